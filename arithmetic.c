@@ -527,8 +527,12 @@ int range_encode_symbol(range_coder *c,unsigned int frequencies[],int alphabet_s
   if (c->errors) return -1;
   range_check(c,__LINE__);
 
-  assert(symbol>=0);
-  assert(symbol<alphabet_size);
+  if (symbol<0||symbol>=alphabet_size) {
+    // The model has no frequency for this symbol, so it cannot be coded.
+    // Fail the coder rather than the process, as range_calc_new_range() does.
+    c->errors++;
+    return -1;
+  }
 
   unsigned int p_low=0;
   if (symbol>0) p_low=frequencies[symbol-1];
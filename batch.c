@@ -0,0 +1,371 @@
+/*
+  Bulk compression of records.
+
+  "smac recipe compress-batch" compresses every record in one input file,
+  which is either a series of stripped records separated by blank lines, or
+  CSV whose first row names the fields, one of which must be formid.  Empty
+  and ~ cells of a CSV row are absent fields.  Records of any number of forms
+  may be mixed.
+
+  The output is one frame per record, in input order: a two byte big-endian
+  length followed by the succinct data.  A record that cannot be compressed
+  gets a frame of length zero, so that frames and records still correspond.
+
+  Each recipe (and its field model) is read once, and records are then
+  compressed by a pool of threads, each with its own clone of the statistics
+  handle.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+
+#define BATCH_MAX_THREADS 64
+#define BATCH_MAX_FORMS 256
+
+struct batch_record {
+  char *text;          // stripped record
+  int text_len;
+  int text_owned;      // text was built from a CSV row, and must be freed
+  struct recipe *recipe;
+  unsigned char *out;  // succinct data, or NULL if compression failed
+  int out_len;
+};
+
+struct batch_state {
+  char *recipe_dir;
+  int out_size;
+
+  struct batch_record *records;
+  int count;
+  int size;
+
+  char *formids[BATCH_MAX_FORMS];
+  struct recipe *recipes[BATCH_MAX_FORMS];
+  int form_count;
+
+  pthread_mutex_t lock;
+  int next;            // next record to compress
+  int failures;
+};
+
+struct batch_worker {
+  struct batch_state *state;
+  stats_handle *h;
+  pthread_t thread;
+};
+
+// The recipe for a form, reading it the first time it is needed
+static struct recipe *batch_recipe(struct batch_state *s,const char *formid,
+				   int formid_len)
+{
+  int i;
+  for(i=0;i<s->form_count;i++)
+    if (!strncmp(s->formids[i],formid,formid_len)&&!s->formids[i][formid_len])
+      return s->recipes[i];
+  if (s->form_count>=BATCH_MAX_FORMS) {
+    fprintf(stderr,"Too many forms in batch (max=%d)\n",BATCH_MAX_FORMS);
+    return NULL;
+  }
+  char recipe_file[1024];
+  snprintf(recipe_file,1024,"%s/%.*s.recipe",s->recipe_dir,formid_len,formid);
+  struct recipe *recipe=recipe_read_from_file(recipe_file);
+  if (!recipe)
+    fprintf(stderr,"Could not read recipe '%s': %s",recipe_file,recipe_error);
+  // Remember failures too, so that each recipe is only tried once
+  s->formids[s->form_count]=strndup(formid,formid_len);
+  s->recipes[s->form_count++]=recipe;
+  return recipe;
+}
+
+static int batch_add(struct batch_state *s,char *text,int text_len,int owned,
+		     struct recipe *recipe)
+{
+  if (s->count>=s->size) {
+    int size=s->size?s->size*2:1024;
+    struct batch_record *records=realloc(s->records,size*sizeof(*records));
+    if (!records) {
+      snprintf(recipe_error,1024,"Could not grow list of batch records.\n");
+      return -1;
+    }
+    s->records=records;
+    s->size=size;
+  }
+  struct batch_record *r=&s->records[s->count++];
+  r->text=text;
+  r->text_len=text_len;
+  r->text_owned=owned;
+  r->recipe=recipe;
+  r->out=NULL;
+  r->out_len=0;
+  return 0;
+}
+
+static int batch_add_stripped(struct batch_state *s,char *text,int len)
+{
+  int i;
+  // formid= at the start of a line identifies the recipe to use
+  for(i=0;i<len;i++) {
+    if ((i==0||text[i-1]=='\n')&&!strncmp(&text[i],"formid=",7)) {
+      int e;
+      for(e=i+7;e<len&&text[e]!='\n'&&text[e]!='\r';e++) continue;
+      return batch_add(s,text,len,0,batch_recipe(s,&text[i+7],e-i-7));
+    }
+  }
+  fprintf(stderr,"Batch record %d has no formid field\n",s->count+1);
+  return batch_add(s,text,len,0,NULL);
+}
+
+// Split a CSV line into cells, in place.  Quoted cells may contain commas
+// and "" for a quote.
+static int batch_csv_cells(char *line,int len,char **cells,int max_cells)
+{
+  int count=0,i=0;
+  while(count<max_cells) {
+    int o=i;
+    cells[count++]=&line[o];
+    if (i<len&&line[i]=='"') {
+      for(i++;i<len;i++) {
+	if (line[i]=='"') {
+	  if (i+1<len&&line[i+1]=='"') i++;
+	  else { i++; break; }
+	}
+	line[o++]=line[i];
+      }
+      while(i<len&&line[i]!=',') i++;
+    } else
+      for(;i<len&&line[i]!=',';i++) line[o++]=line[i];
+    line[o]=0;
+    if (i>=len) break;
+    i++;
+  }
+  return count;
+}
+
+static int batch_read_csv(struct batch_state *s,char *in,int in_len)
+{
+  char *names[1024];
+  int name_count=-1;
+  int formid_column=-1;
+  int i,start=0;
+
+  for(i=0;i<=in_len;i++) {
+    if (i<in_len&&in[i]!='\n') continue;
+    int len=i-start;
+    if (len>0&&in[start+len-1]=='\r') len--;
+    char *line=&in[start];
+    start=i+1;
+    if (!len) continue;
+    line[len]=0;
+    if (name_count<0) {
+      name_count=batch_csv_cells(line,len,names,1024);
+      int c;
+      for(c=0;c<name_count;c++)
+	if (!strcasecmp(names[c],"formid")) formid_column=c;
+      if (formid_column<0) {
+	snprintf(recipe_error,1024,"CSV header row has no formid column.\n");
+	return -1;
+      }
+      continue;
+    }
+    char *cells[1024];
+    int cell_count=batch_csv_cells(line,len,cells,name_count);
+    int size=0,c;
+    for(c=0;c<cell_count;c++) size+=strlen(names[c])+strlen(cells[c])+2;
+    char *text=malloc(size+1);
+    if (!text) {
+      snprintf(recipe_error,1024,"Could not allocate batch record.\n");
+      return -1;
+    }
+    int n=0;
+    for(c=0;c<cell_count;c++)
+      if (cells[c][0]&&strcmp(cells[c],"~"))
+	n+=sprintf(&text[n],"%s=%s\n",names[c],cells[c]);
+    struct recipe *recipe=NULL;
+    if (formid_column<cell_count&&cells[formid_column][0])
+      recipe=batch_recipe(s,cells[formid_column],strlen(cells[formid_column]));
+    else
+      fprintf(stderr,"Batch record %d has no formid\n",s->count+1);
+    if (batch_add(s,text,n,1,recipe)) { free(text); return -1; }
+  }
+  return 0;
+}
+
+static int batch_read_stripped(struct batch_state *s,char *in,int in_len)
+{
+  int i,start=0,line_start=0,blank=1;
+  for(i=0;i<=in_len;i++) {
+    if (i<in_len&&in[i]!='\n') {
+      if (in[i]!='\r') blank=0;
+      continue;
+    }
+    // A blank line, or the end of the input, ends the record
+    if (blank||i==in_len) {
+      int end=blank?line_start:i;
+      if (end>start&&batch_add_stripped(s,&in[start],end-start)) return -1;
+      start=i+1;
+    }
+    line_start=i+1;
+    blank=1;
+  }
+  return 0;
+}
+
+static void *batch_worker(void *context)
+{
+  struct batch_worker *w=context;
+  struct batch_state *s=w->state;
+
+  while(1) {
+    pthread_mutex_lock(&s->lock);
+    int i=s->next++;
+    pthread_mutex_unlock(&s->lock);
+    if (i>=s->count) break;
+
+    struct batch_record *r=&s->records[i];
+    if (!r->recipe) {
+      pthread_mutex_lock(&s->lock);
+      s->failures++;
+      pthread_mutex_unlock(&s->lock);
+      continue;
+    }
+    unsigned char out[1024];
+    int len=recipe_compress(w->h,r->recipe,r->text,r->text_len,out,s->out_size);
+    if (len>0) r->out=malloc(len);
+    if (len<=0||!r->out) {
+      fprintf(stderr,"Could not compress batch record %d: %s",i+1,recipe_error);
+      pthread_mutex_lock(&s->lock);
+      s->failures++;
+      pthread_mutex_unlock(&s->lock);
+      continue;
+    }
+    bcopy(out,r->out,len);
+    r->out_len=len;
+  }
+  return NULL;
+}
+
+static void batch_free(struct batch_state *s)
+{
+  int i;
+  for(i=0;i<s->count;i++) {
+    if (s->records[i].text_owned) free(s->records[i].text);
+    if (s->records[i].out) free(s->records[i].out);
+  }
+  free(s->records);
+  for(i=0;i<s->form_count;i++) {
+    free(s->formids[i]);
+    if (s->recipes[i]) recipe_free(s->recipes[i]);
+  }
+  pthread_mutex_destroy(&s->lock);
+}
+
+int recipe_compress_batch(stats_handle *h,char *recipe_dir,char *input_file,
+			  char *output_file,int threads,int out_size)
+{
+  struct timeval start,end;
+  gettimeofday(&start,NULL);
+
+  struct stat st;
+  if (stat(input_file,&st)) {
+    snprintf(recipe_error,1024,"Could not stat batch input '%s'\n",input_file);
+    return -1;
+  }
+  char *in=malloc(st.st_size+1);
+  if (!in) {
+    snprintf(recipe_error,1024,"Could not allocate %lld bytes for batch input\n",
+	     (long long)st.st_size);
+    return -1;
+  }
+  int in_len=recipe_load_file(input_file,in,st.st_size+1);
+  if (in_len<0) { free(in); return -1; }
+  in[in_len]=0;
+
+  struct batch_state s;
+  bzero(&s,sizeof(s));
+  s.recipe_dir=recipe_dir;
+  s.out_size=out_size>0&&out_size<1024?out_size:1024;
+  pthread_mutex_init(&s.lock,NULL);
+
+  // Stripped records have name=value on their first line; CSV does not
+  int i;
+  for(i=0;i<in_len&&in[i]<=' ';i++) continue;
+  int stripped=0;
+  for(;i<in_len&&in[i]!='\n'&&in[i]!=',';i++)
+    if (in[i]=='=') { stripped=1; break; }
+  if ((stripped?batch_read_stripped(&s,in,in_len)
+       :batch_read_csv(&s,in,in_len))) {
+    batch_free(&s); free(in);
+    return -1;
+  }
+  fprintf(stderr,"Read %d %s records of %d forms from '%s'\n",
+	  s.count,stripped?"stripped":"CSV",s.form_count,input_file);
+
+  if (threads<1) threads=sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads<1) threads=1;
+  if (threads>BATCH_MAX_THREADS) threads=BATCH_MAX_THREADS;
+  if (threads>s.count) threads=s.count?s.count:1;
+
+  struct batch_worker workers[BATCH_MAX_THREADS];
+  int started=0;
+  for(i=0;i<threads;i++) {
+    workers[i].state=&s;
+    workers[i].h=stats_handle_clone(h);
+    if (!workers[i].h) break;
+    if (pthread_create(&workers[i].thread,NULL,batch_worker,&workers[i])) {
+      stats_handle_free(workers[i].h);
+      break;
+    }
+    started++;
+  }
+  if (!started) {
+    // Do it all ourselves
+    workers[0].state=&s;
+    workers[0].h=h;
+    batch_worker(&workers[0]);
+  }
+  for(i=0;i<started;i++) {
+    pthread_join(workers[i].thread,NULL);
+    stats_handle_free(workers[i].h);
+  }
+
+  FILE *f=fopen(output_file,"w");
+  if (!f) {
+    snprintf(recipe_error,1024,"Could not create batch output '%s'\n",output_file);
+    batch_free(&s); free(in);
+    return -1;
+  }
+  long long bytes=0;
+  for(i=0;i<s.count;i++) {
+    struct batch_record *r=&s.records[i];
+    fputc(r->out_len>>8,f);
+    fputc(r->out_len&0xff,f);
+    if (r->out_len) fwrite(r->out,r->out_len,1,f);
+    bytes+=r->out_len;
+  }
+  if (fclose(f)) {
+    snprintf(recipe_error,1024,"Could not write batch output '%s'\n",output_file);
+    batch_free(&s); free(in);
+    return -1;
+  }
+
+  gettimeofday(&end,NULL);
+  double seconds=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1000000.0;
+  fprintf(stderr,"Compressed %d records (%d failed) into %lld bytes in %.2f s using %d threads\n",
+	  s.count-s.failures,s.failures,bytes,seconds,started?started:1);
+  int failures=s.failures;
+  batch_free(&s); free(in);
+  return failures?1:0;
+}
@@ -0,0 +1,154 @@
+/*
+  Round trip checks for record containers.
+
+  Records are packed and unpacked directly, and sent through
+  encryptAndFragmentRecords(), reassembly and decryption, to check that they
+  come back as they went, that a single record is still sent bare, and that
+  a message that only looks like a container is delivered whole.
+
+  Usage: containertest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "crypto_box.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "reassembly.h"
+#include "crypto.h"
+
+#define RECORD_COUNT 4
+#define MTU 160
+
+int failures=0;
+
+void check(int ok,const char *what)
+{
+  if (!ok) {
+    fprintf(stderr,"FAIL: %s\n",what);
+    failures++;
+  }
+}
+
+unsigned char record_data[RECORD_COUNT][2000];
+unsigned char *records[RECORD_COUNT];
+int lengths[RECORD_COUNT]={1,57,300,2000};
+
+// Whether the unpacked records are the first count of records[]
+int same_records(unsigned char **got,int *got_lengths,int got_count,int count)
+{
+  int i;
+  if (got_count!=count) return 0;
+  for(i=0;i<count;i++)
+    if (got_lengths[i]!=lengths[i]||memcmp(got[i],records[i],lengths[i]))
+      return 0;
+  return 1;
+}
+
+void check_pack()
+{
+  unsigned char container[16384];
+  unsigned char *got[RECORD_COUNT+1];
+  int got_lengths[RECORD_COUNT+1];
+
+  int len=record_container_pack(records,lengths,RECORD_COUNT,
+				container,sizeof(container));
+  check(len==RECORD_CONTAINER_MAGIC_BYTES+RECORD_COUNT*2+1+57+300+2000,
+	"container is the magic bytes and length-prefixed records");
+  int count=record_container_unpack(container,len,got,got_lengths,RECORD_COUNT+1);
+  check(same_records(got,got_lengths,count,RECORD_COUNT),
+	"records unpack as they were packed");
+  check(record_container_unpack(container,len,got,got_lengths,RECORD_COUNT-1)==-1,
+	"too many records are refused");
+
+  check(record_container_pack(records,lengths,RECORD_COUNT,container,len-1)==-1,
+	"container too big for the buffer is refused");
+  int empty=0;
+  check(record_container_pack(records,&empty,1,container,sizeof(container))==-1,
+	"empty record is refused");
+
+  // A message that starts with the magic bytes but is cut short is one record
+  count=record_container_unpack(container,len-1,got,got_lengths,RECORD_COUNT+1);
+  check(count==1&&got[0]==container&&got_lengths[0]==len-1,
+	"truncated container is a single record");
+  unsigned char lookalike[]=RECORD_CONTAINER_MAGIC "\x00\x00 not a container";
+  count=record_container_unpack(lookalike,sizeof(lookalike)-1,got,got_lengths,
+				RECORD_COUNT+1);
+  check(count==1&&got_lengths[0]==sizeof(lookalike)-1,
+	"record that starts with the magic bytes is a single record");
+}
+
+// Send the first count records, and unpack what arrives
+void check_send(char *pkhex,unsigned char *sk,int count,int parity)
+{
+  char *fragments[MAX_FRAGMENTS];
+  int fragment_count=0;
+  char what[1024];
+  int i;
+
+  snprintf(what,sizeof(what),"%d records with %d parity fragments",count,parity);
+  if (encryptAndFragmentRecords(records,lengths,count,fragments,&fragment_count,
+				MTU,pkhex,parity,FRAGMENT_ENCODING_BASE64,0)) {
+    check(0,what);
+    return;
+  }
+  struct reassembly *r=reassembly_open(NULL,0);
+  struct fragment_set *f=NULL;
+  int complete=0;
+  // Lose the first fragment, if there is parity to make up for it
+  for(i=parity?1:0;i<fragment_count;i++)
+    if (!complete) complete=reassembly_add(r,fragments[i],time(0),&f);
+  for(i=0;i<fragment_count;i++) free(fragments[i]);
+
+  unsigned char message[32768];
+  int len=0;
+  if (complete!=1||reassembleAndDecryptBuffer(f,sk,message,&len)) {
+    check(0,what);
+    reassembly_close(r);
+    return;
+  }
+  reassembly_close(r);
+
+  if (count==1)
+    check(len==lengths[0]&&!memcmp(message,records[0],len),
+	  "single record is sent bare");
+  unsigned char *got[RECORD_COUNT];
+  int got_lengths[RECORD_COUNT];
+  int got_count=record_container_unpack(message,len,got,got_lengths,RECORD_COUNT);
+  check(same_records(got,got_lengths,got_count,count),what);
+}
+
+int main(int argc,char **argv)
+{
+  int i,j;
+  srandom(1);
+  for(i=0;i<RECORD_COUNT;i++) {
+    records[i]=record_data[i];
+    for(j=0;j<lengths[i];j++) records[i][j]=random();
+  }
+
+  check_pack();
+
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  char pkhex[crypto_box_PUBLICKEYBYTES*2+1];
+  bcopy(private_key_from_passphrase("containertest"),sk,crypto_box_SECRETKEYBYTES);
+  crypto_scalarmult_curve25519_base(pk,sk);
+  for(i=0;i<crypto_box_PUBLICKEYBYTES;i++) sprintf(&pkhex[i*2],"%02x",pk[i]);
+
+  for(i=1;i<=RECORD_COUNT;i++) {
+    check_send(pkhex,sk,i,0);
+    check_send(pkhex,sk,i,2);
+  }
+
+  if (failures) {
+    fprintf(stderr,"%d record container checks failed\n",failures);
+    return 1;
+  }
+  printf("Record container checks passed.\n");
+  return 0;
+}
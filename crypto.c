@@ -2,13 +2,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <alloca.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include "md5.h"
 #include "crypto_box.h"
 #include "randombytes.h"
+#include "reassembly.h"
+#include "crypto.h"
+#include "fec.h"
+#include "gsm7.h"
 
 #ifdef ANDROID
 #include <android/log.h>
@@ -19,12 +28,6 @@
 #endif
 #define CHECKPOINT() LOGI("checkpoint: %s:%d",__FILE__,__LINE__);
 
-#define MAX_FRAGMENTS 64
-struct fragment_set {
-  int frag_count;
-  char *prefix;
-  char *pieces[MAX_FRAGMENTS];
-};
 
 int crypto_scalarmult_curve25519_ref_base(unsigned char *q,const unsigned char *n);
 
@@ -89,6 +92,102 @@ int dump_bytes(char *m,unsigned char *b,int n)
   return 0;
 }
 
+/*
+  Each message is encrypted with a fresh ephemeral keypair, whose public key
+  costs a scalar multiplication to compute.  Once crypto_keypair_pool_start()
+  has been called, a background thread keeps a pool of keypairs ready, so
+  that encrypting a message only costs the multiplication by the recipient's
+  public key.  Keypairs are used once and then wiped.
+*/
+#define CRYPTO_KEYPAIR_POOL_SIZE 8
+
+struct crypto_keypair {
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+};
+
+static struct crypto_keypair keypair_pool[CRYPTO_KEYPAIR_POOL_SIZE];
+static int keypair_pool_count=0;
+static int keypair_pool_running=0;
+static pthread_t keypair_pool_thread;
+static pthread_mutex_t keypair_pool_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keypair_pool_wanted=PTHREAD_COND_INITIALIZER;
+
+static void *keypair_pool_fill(void *context)
+{
+  struct crypto_keypair k;
+  // Refilling the pool must not slow down the thread encrypting a message
+  // (on Linux, priority is per thread)
+  setpriority(PRIO_PROCESS,syscall(SYS_gettid),10);
+  pthread_mutex_lock(&keypair_pool_lock);
+  while(keypair_pool_running) {
+    if (keypair_pool_count>=CRYPTO_KEYPAIR_POOL_SIZE) {
+      pthread_cond_wait(&keypair_pool_wanted,&keypair_pool_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&keypair_pool_lock);
+    crypto_box_keypair(k.pk,k.sk);
+    pthread_mutex_lock(&keypair_pool_lock);
+    if (keypair_pool_count<CRYPTO_KEYPAIR_POOL_SIZE)
+      keypair_pool[keypair_pool_count++]=k;
+  }
+  pthread_mutex_unlock(&keypair_pool_lock);
+  bzero(&k,sizeof(k));
+  return NULL;
+}
+
+int crypto_keypair_pool_start()
+{
+  unsigned char nothing[1];
+  // Open /dev/urandom before there is a second thread to race to do so
+  randombytes(nothing,0);
+
+  pthread_mutex_lock(&keypair_pool_lock);
+  if (!keypair_pool_running) {
+    keypair_pool_running=1;
+    if (pthread_create(&keypair_pool_thread,NULL,keypair_pool_fill,NULL)) {
+      keypair_pool_running=0;
+      pthread_mutex_unlock(&keypair_pool_lock);
+      LOGI("Could not start keypair pool thread");
+      return -1;
+    }
+  }
+  pthread_mutex_unlock(&keypair_pool_lock);
+  return 0;
+}
+
+void crypto_keypair_pool_stop()
+{
+  pthread_mutex_lock(&keypair_pool_lock);
+  if (!keypair_pool_running) {
+    pthread_mutex_unlock(&keypair_pool_lock);
+    return;
+  }
+  keypair_pool_running=0;
+  pthread_cond_signal(&keypair_pool_wanted);
+  pthread_mutex_unlock(&keypair_pool_lock);
+  pthread_join(keypair_pool_thread,NULL);
+  bzero(keypair_pool,sizeof(keypair_pool));
+  keypair_pool_count=0;
+}
+
+// An unused ephemeral keypair, from the pool if there is one ready
+static void crypto_keypair_take(unsigned char *pk,unsigned char *sk)
+{
+  pthread_mutex_lock(&keypair_pool_lock);
+  if (keypair_pool_count>0) {
+    struct crypto_keypair *k=&keypair_pool[--keypair_pool_count];
+    bcopy(k->pk,pk,crypto_box_PUBLICKEYBYTES);
+    bcopy(k->sk,sk,crypto_box_SECRETKEYBYTES);
+    bzero(k,sizeof(*k));
+    pthread_cond_signal(&keypair_pool_wanted);
+    pthread_mutex_unlock(&keypair_pool_lock);
+    return;
+  }
+  pthread_mutex_unlock(&keypair_pool_lock);
+  crypto_box_keypair(pk,sk);
+}
+
 /* Encrypt a message */
 int encryptMessage(unsigned char *public_key,unsigned char *in, int in_len,
 		   unsigned char *out,int *out_len, unsigned char *nonce,
@@ -101,7 +200,7 @@ int encryptMessage(unsigned char *public_key,unsigned char *in, int in_len,
   unsigned char pk[crypto_box_PUBLICKEYBYTES];
   unsigned char sk[crypto_box_SECRETKEYBYTES];
   if (!debug)
-    crypto_box_keypair(pk,sk);
+    crypto_keypair_take(pk,sk);
   else {
     // In debug mode, use a secret key of all zeroes
     bzero(sk,crypto_box_SECRETKEYBYTES);
@@ -139,6 +238,9 @@ int encryptMessage(unsigned char *public_key,unsigned char *in, int in_len,
     exit(-1);
   }
 
+#ifdef CRYPTO_SELF_CHECK
+  // Check that the message can be opened again.  This costs as much as
+  // encrypting it, so is only compiled in when debugging.
   {
     unsigned char temp[32768];
     int clen=in_len+crypto_box_ZEROBYTES;
@@ -146,6 +248,8 @@ int encryptMessage(unsigned char *public_key,unsigned char *in, int in_len,
 				 nonce,pk,sk);
     printf("open result = %d, clen=%d\n",result,clen);    
   }
+#endif
+  bzero(sk,crypto_box_SECRETKEYBYTES);
   
   // This leaves crypto_box_ZEROBYTES of zeroes at the start of the message.
   // This is a waste.  We will stuff half of our public key in there, and then the
@@ -232,9 +336,82 @@ int base64_append(char *out,int *out_offset,unsigned char *bytes,int count)
   return 0;
 }
   
-int encryptAndFragmentBuffer(unsigned char *in_buffer,int in_len,
-			     char *fragments[MAX_FRAGMENTS],int *fragment_count,
-			     int mtu,char *publickeyhex,int debug)
+/* Work out how many bytes per fragment:
+
+   Assumes that: 
+   1. body gets base64 encoded.
+   2. Nonce is 6 bytes (48 bits), and so takes 8 characters to encode.
+   3. Fragment number is expressed using two leading characters: 0-9a-zA-Z = 
+      current fragment number, followed by 2nd character which indicates the max
+      fragment number.  Thus we can have 62 fragments.
+*/
+int fragment_bytes_per_fragment(int mtu)
+{
+  int overhead=2+(48/6);
+  return (mtu-overhead)*6/8;
+}
+
+/* The same for a fragment of mtu characters in the given encoding.  In
+   FRAGMENT_ENCODING_GSM7, the header is followed by FRAGMENT_GSM7_MARKER
+   and then the data. */
+int fragment_encoded_bytes_per_fragment(int mtu,int encoding)
+{
+  if (encoding==FRAGMENT_ENCODING_GSM7) {
+    int overhead=2+(48/6)+1;
+    return mtu>overhead?gsm7_bytes_in_chars(mtu-overhead):0;
+  }
+  return fragment_bytes_per_fragment(mtu);
+}
+
+// FRAGMENT_ENCODING_BASE64 or FRAGMENT_ENCODING_GSM7 by name, or -1
+int fragment_encoding_by_name(char *name)
+{
+  if (!strcasecmp(name,"base64")) return FRAGMENT_ENCODING_BASE64;
+  if (!strcasecmp(name,"gsm7")) return FRAGMENT_ENCODING_GSM7;
+  return -1;
+}
+
+static int fragment_append(char *out,int *out_offset,unsigned char *bytes,
+			   int count,int encoding)
+{
+  if (encoding==FRAGMENT_ENCODING_GSM7)
+    return gsm7_append(out,out_offset,bytes,count);
+  return base64_append(out,out_offset,bytes,count);
+}
+
+/* Largest succinct data record that encryptAndFragmentBufferFEC() will fit
+   in fragment_count fragments of mtu characters in the given encoding, of
+   which parity are parity fragments. */
+int fragment_payload_bytes(int mtu,int fragment_count,int parity,int encoding)
+{
+  int data_count=fragment_count-parity;
+  if (parity<0) return 0;
+  if (data_count>62) data_count=62;
+  if (parity&&data_count+parity>FEC_MAX_SHARDS) data_count=FEC_MAX_SHARDS-parity;
+  int bytes_per_fragment=fragment_encoded_bytes_per_fragment(mtu,encoding);
+  // Each data fragment gives up room for the length carried by the parity
+  if (parity>0) bytes_per_fragment-=FEC_LENGTH_BYTES;
+  if (bytes_per_fragment<1||data_count<1) return 0;
+  int bytes=bytes_per_fragment*data_count;
+  // encryptMessage() adds the public key and authenticator
+  bytes-=crypto_box_PUBLICKEYBYTES+(crypto_box_ZEROBYTES-crypto_box_BOXZEROBYTES);
+  return bytes>0?bytes:0;
+}
+
+/*
+  Encrypt a message and cut it into fragments of at most mtu characters.  If
+  parity is more than zero, that many parity fragments (see fec.h) follow the
+  data fragments, so that the message can be rebuilt from any of them as
+  many as there are data fragments.  The data fragments of such a message
+  then carry two bytes less each, so that every fragment holds one shard,
+  and the parity fragments start with the length of the box.  encoding is
+  FRAGMENT_ENCODING_BASE64, or FRAGMENT_ENCODING_GSM7 for denser fragments
+  that are only sent by SMS.
+*/
+int encryptAndFragmentBufferFEC(unsigned char *in_buffer,int in_len,
+				char *fragments[MAX_FRAGMENTS],int *fragment_count,
+				int mtu,char *publickeyhex,int parity,int encoding,
+				int debug)
 {
   unsigned char nonce[crypto_box_NONCEBYTES];
   int nonce_len=6;
@@ -256,21 +433,13 @@ int encryptAndFragmentBuffer(unsigned char *in_buffer,int in_len,
   encryptMessage(pk,in_buffer,in_len,
 		 out_buffer,&out_len,nonce,nonce_len, debug);
 
-  /* Work out how many bytes per fragment:
-
-     Assumes that: 
-     1. body gets base64 encoded.
-     2. Nonce is 6 bytes (48 bits), and so takes 8 characters to encode.
-     3. Fragment number is expressed using two leading characters: 0-9a-zA-Z = 
-        current fragment number, followed by 2nd character which indicates the max
-	fragment number.  Thus we can have 62 fragments.
-  */
-  int overhead=2+(48/6);
-  int bytes_per_fragment=(mtu-overhead)*6/8;
+  int bytes_per_fragment=fragment_encoded_bytes_per_fragment(mtu,encoding);
+  if (parity>0) bytes_per_fragment-=FEC_LENGTH_BYTES;
   assert(bytes_per_fragment>0);
   int frag_count=out_len/bytes_per_fragment;
   if (out_len%bytes_per_fragment) frag_count++;
-  assert(frag_count<=62);
+  if (frag_count>62) return -1;
+  if (parity<0||frag_count+parity>FEC_MAX_SHARDS) return -1;
 
   int frag_number=0;
   for(int i=0;i<out_len;i+=bytes_per_fragment)
@@ -280,44 +449,169 @@ int encryptAndFragmentBuffer(unsigned char *in_buffer,int in_len,
       int bytes=bytes_per_fragment;
       if (bytes>(out_len-i)) bytes=out_len-i;
 
-      char fragment[mtu+1];
+      // Characters outside ASCII take two bytes
+      char fragment[2*mtu+1];
       int offset=0;
 
       fragment[offset++]=num_to_char(*fragment_count);
       fragment[offset++]=num_to_char(frag_count-1);
       base64_append(fragment,&offset,nonce,6);
-      base64_append(fragment,&offset,&out_buffer[i],bytes);
+      if (encoding==FRAGMENT_ENCODING_GSM7) fragment[offset++]=FRAGMENT_GSM7_MARKER;
+      fragment_append(fragment,&offset,&out_buffer[i],bytes,encoding);
 
       fragment[offset]=0;
       
       fragments[(*fragment_count)++]=strdup(fragment);
     }
+
+  if (parity>0) {
+    // The last data shard is zero padded
+    bzero(&out_buffer[out_len],frag_count*bytes_per_fragment-out_len);
+    unsigned char shard[FEC_LENGTH_BYTES+bytes_per_fragment];
+    shard[0]=out_len>>8; shard[1]=out_len;
+    for(int j=0;j<parity;j++) {
+      if ((*fragment_count)>=MAX_FRAGMENTS) return -1;
+      fec_parity(out_buffer,frag_count,bytes_per_fragment,j,
+		 &shard[FEC_LENGTH_BYTES]);
+
+      char fragment[2*mtu+1];
+      int offset=0;
+
+      fragment[offset++]=num_to_char(frag_count+j);
+      fragment[offset++]=num_to_char(frag_count-1);
+      base64_append(fragment,&offset,nonce,6);
+      if (encoding==FRAGMENT_ENCODING_GSM7) fragment[offset++]=FRAGMENT_GSM7_MARKER;
+      fragment_append(fragment,&offset,shard,sizeof(shard),encoding);
+
+      fragment[offset]=0;
+
+      fragments[(*fragment_count)++]=strdup(fragment);
+    }
+  }
   
   return 0;
 }
 
-int encryptAndFragment(char *filename,int mtu,char *outputdir,char *publickeyhex,
-		       int debug)
+int encryptAndFragmentBuffer(unsigned char *in_buffer,int in_len,
+			     char *fragments[MAX_FRAGMENTS],int *fragment_count,
+			     int mtu,char *publickeyhex,int debug)
 {
-  /* Read a file, encrypt it, break it into fragments and write them into the output
-     directory. */
+  return encryptAndFragmentBufferFEC(in_buffer,in_len,fragments,fragment_count,
+				     mtu,publickeyhex,0,FRAGMENT_ENCODING_BASE64,
+				     debug);
+}
 
-  unsigned char in_buffer[16384];
-  FILE *f=fopen(filename,"r");
-  assert(f);
-  int r=fread(in_buffer,1,16384,f);
-  assert(r>0);
-  if (r>=16384) {
-    fprintf(stderr,"File must be <16KB\n");
+/*
+  Records queued on a device can be sent as one message, so that the key,
+  authenticator and fragment headers are paid for once.  The plaintext of
+  such a message is RECORD_CONTAINER_MAGIC, then each record preceded by its
+  length in two bytes, big-endian.  Returns the length of the container, or
+  -1 if it would not fit in out_size bytes.
+*/
+int record_container_pack(unsigned char **records,int *lengths,int count,
+			  unsigned char *out,int out_size)
+{
+  int offset=RECORD_CONTAINER_MAGIC_BYTES;
+  if (offset>out_size) return -1;
+  bcopy(RECORD_CONTAINER_MAGIC,out,RECORD_CONTAINER_MAGIC_BYTES);
+  for(int i=0;i<count;i++) {
+    if (lengths[i]<1||lengths[i]>0xffff) return -1;
+    if (offset+2+lengths[i]>out_size) return -1;
+    out[offset++]=lengths[i]>>8;
+    out[offset++]=lengths[i];
+    bcopy(records[i],&out[offset],lengths[i]);
+    offset+=lengths[i];
+  }
+  return offset;
+}
+
+/*
+  Split a decrypted message into its records, pointing into message.  A
+  message that is not a well-formed container is a single record, so that
+  a record that happens to start with the magic bytes is still delivered.
+  Returns the number of records, or -1 if there are more than max_records.
+*/
+int record_container_unpack(unsigned char *message,int len,
+			    unsigned char **records,int *lengths,int max_records)
+{
+  int count=0,offset=RECORD_CONTAINER_MAGIC_BYTES;
+  if (len>offset&&!memcmp(message,RECORD_CONTAINER_MAGIC,offset)) {
+    while(offset+2<len) {
+      int length=(message[offset]<<8)|message[offset+1];
+      if (length<1||offset+2+length>len) break;
+      if (count>=max_records) return -1;
+      records[count]=&message[offset+2];
+      lengths[count++]=length;
+      offset+=2+length;
+    }
+    if (offset==len) return count;
+  }
+  if (max_records<1) return -1;
+  records[0]=message;
+  lengths[0]=len;
+  return 1;
+}
+
+/*
+  Encrypt count records as one message and fragment it, as for
+  encryptAndFragmentBufferFEC().  A single record is sent as it is.
+*/
+int encryptAndFragmentRecords(unsigned char **records,int *lengths,int count,
+			      char *fragments[MAX_FRAGMENTS],int *fragment_count,
+			      int mtu,char *publickeyhex,int parity,int encoding,
+			      int debug)
+{
+  if (count==1)
+    return encryptAndFragmentBufferFEC(records[0],lengths[0],fragments,
+				       fragment_count,mtu,publickeyhex,parity,
+				       encoding,debug);
+  unsigned char container[16384];
+  int len=record_container_pack(records,lengths,count,
+				container,sizeof(container));
+  if (len<0) return -1;
+  return encryptAndFragmentBufferFEC(container,len,fragments,fragment_count,
+				     mtu,publickeyhex,parity,encoding,debug);
+}
+
+/*
+  Read the records in the files, encrypt them as one message, break it into
+  fragments and write them into the output directory.
+*/
+int encryptAndFragmentFiles(char **filenames,int count,int mtu,char *outputdir,
+			    char *publickeyhex,int parity,int encoding,int debug)
+{
+  unsigned char *records[count];
+  int lengths[count];
+  unsigned char *in_buffer=alloca(16384);
+  int offset=0;
+
+  for(int j=0;j<count;j++) {
+    FILE *f=fopen(filenames[j],"r");
+    if (!f) {
+      fprintf(stderr,"Could not read '%s'\n",filenames[j]);
+      return -1;
+    }
+    int r=fread(&in_buffer[offset],1,16384-offset,f);
+    fclose(f);
+    if (r<1||offset+r>=16384) {
+      fprintf(stderr,"File '%s' is empty, or the files exceed 16KB\n",
+	      filenames[j]);
+      return -1;
+    }
+    records[j]=&in_buffer[offset];
+    lengths[j]=r;
+    offset+=r;
   }
-  fclose(f);
-  in_buffer[r]=0;
 
   char *fragments[MAX_FRAGMENTS];
   int fragment_count=0;
   
-  encryptAndFragmentBuffer(in_buffer,r,fragments,&fragment_count,
-			   mtu,publickeyhex, debug);
+  if (encryptAndFragmentRecords(records,lengths,count,fragments,&fragment_count,
+				mtu,publickeyhex,parity,encoding,debug)) {
+    fprintf(stderr,"Could not fragment %d records with %d parity fragments.\n",
+	    count,parity);
+    return -1;
+  }
 
   if (fragment_count<1) return 0;
   
@@ -331,10 +625,18 @@ int encryptAndFragment(char *filename,int mtu,char *outputdir,char *publickeyhex
       fprintf(f,"%s",fragments[j]);
       fclose(f);
     }
+    free(fragments[j]);
   }
   return fragment_count;
 }
 
+int encryptAndFragment(char *filename,int mtu,char *outputdir,char *publickeyhex,
+		       int parity,int encoding,int debug)
+{
+  return encryptAndFragmentFiles(&filename,1,mtu,outputdir,publickeyhex,
+				 parity,encoding,debug);
+}
+
 int base64_extract(char *in,unsigned char *out,int *out_len)
 {
   int v[4];
@@ -364,20 +666,104 @@ int base64_extract(char *in,unsigned char *out,int *out_len)
   return 0;
 }
 
-int reassembleAndDecrypt(struct fragment_set *f,char *outputdir,
-			 unsigned char *sk, unsigned char *pk)
+// Append the data of a fragment, in whichever encoding it uses, to out
+static int fragment_extract(char *fragment,unsigned char *out,int *out_len)
 {
-  unsigned char buffer[32768];
+  if (fragment[10]==FRAGMENT_GSM7_MARKER)
+    return gsm7_extract(&fragment[11],out,out_len);
+  return base64_extract(&fragment[10],out,out_len);
+}
+
+/*
+  Rebuild the box of a set that is missing data fragments from its parity
+  fragments.  Every fragment holds one shard, the last data shard short of
+  its zero padding, and the parity shards follow the length of the box.
+*/
+static int reassembleParity(struct fragment_set *f,unsigned char *box,
+			    int *box_len)
+{
+  int data_count=f->frag_count+1;
+  unsigned char *shards[FEC_MAX_SHARDS];
+  int lengths[FEC_MAX_SHARDS];
+  int shard_size=-1,total=-1,longest=0;
+
+  for(int i=0;i<f->slots;i++)
+    if (f->pieces[i]&&strlen(f->pieces[i])>longest)
+      longest=strlen(f->pieces[i]);
+  // No encoding has more than one byte per character
+  int stride=longest+4;
+  unsigned char *decoded=calloc(FEC_MAX_SHARDS,stride);
+  if (!decoded) return -1;
+
+  for(int i=0;i<FEC_MAX_SHARDS;i++) {
+    shards[i]=NULL;
+    lengths[i]=0;
+    if (i>=f->slots||!f->pieces[i]) continue;
+    printf("  fragment '%s'\n",f->pieces[i]);
+    if (fragment_extract(f->pieces[i],&decoded[i*stride],&lengths[i])) {
+      printf("Fragment of %s is malformed -- ignoring.\n",f->prefix);
+      free(decoded);
+      return -1;
+    }
+    if (i<data_count) { shards[i]=&decoded[i*stride]; continue; }
+    if (lengths[i]<=FEC_LENGTH_BYTES) continue;
+    int length=(decoded[i*stride]<<8)|decoded[i*stride+1];
+    if ((shard_size!=-1&&shard_size!=lengths[i]-FEC_LENGTH_BYTES)
+	||(total!=-1&&total!=length)) {
+      printf("Parity fragments of %s disagree -- ignoring.\n",f->prefix);
+      free(decoded);
+      return -1;
+    }
+    shard_size=lengths[i]-FEC_LENGTH_BYTES;
+    total=length;
+    shards[i]=&decoded[i*stride+FEC_LENGTH_BYTES];
+  }
+
+  int malformed=shard_size<1||data_count*shard_size>32768
+    ||total>data_count*shard_size||total<=(data_count-1)*shard_size;
+  for(int i=0;i<data_count&&!malformed;i++)
+    if (shards[i]&&lengths[i]!=(i<data_count-1?shard_size:
+				total-(data_count-1)*shard_size))
+      malformed=1;
+  if (malformed) {
+    printf("Fragments of %s do not fit its parity fragments -- ignoring.\n",
+	   f->prefix);
+    free(decoded);
+    return -1;
+  }
+
+  printf("Rebuilding %s from parity fragments.\n",f->prefix);
+  int r=fec_reconstruct(shards,data_count,shard_size,box);
+  free(decoded);
+  if (r) return -1;
+  *box_len=total;
+  return 0;
+}
+
+/*
+  Join the fragments of a complete set into a box for crypto_box_open(), of
+  *box_len bytes, and extract its nonce and the sender's public key.  box
+  must hold 32768 bytes.
+*/
+static int reassembleBox(struct fragment_set *f,unsigned char *box,int *box_len,
+			 unsigned char *nonce,unsigned char *msg_pk)
+{
+  unsigned char *buffer=box;
   bzero(buffer,32768);
   int offset=0;
   
   printf("Reassembling %s\n",f->prefix);
-  for(int i=0;i<=f->frag_count;i++) {
-    base64_extract(&f->pieces[i][10],buffer,&offset);
-    printf("  fragment '%s'\n",f->pieces[i]);
-  }
+  unsigned long long data=f->frag_count==63?~0ULL:(1ULL<<(f->frag_count+1))-1;
+  if ((f->received&data)==data) {
+    for(int i=0;i<=f->frag_count;i++) {
+      printf("  fragment '%s'\n",f->pieces[i]);
+      if (fragment_extract(f->pieces[i],buffer,&offset)) {
+	printf("Fragment of %s is malformed -- ignoring.\n",f->prefix);
+	return -1;
+      }
+    }
+  } else if (reassembleParity(f,buffer,&offset)) return -1;
 
-  unsigned char nonce[crypto_box_NONCEBYTES];
   int nonce_len=0;
   base64_extract(f->prefix,nonce,&nonce_len);
   int o=0;
@@ -393,8 +779,6 @@ int reassembleAndDecrypt(struct fragment_set *f,char *outputdir,
       return -1;
     }
   
-  unsigned char msg_pk[crypto_box_PUBLICKEYBYTES];
-
   /*
     Encrypted message consists of:
     1. crypto_box_BOXZEROBYTES of message public key.
@@ -415,6 +799,22 @@ int reassembleAndDecrypt(struct fragment_set *f,char *outputdir,
   offset-=crypto_box_ZEROBYTES-crypto_box_BOXZEROBYTES;
   bcopy(&buffer[offset],
 	&msg_pk[crypto_box_BOXZEROBYTES],crypto_box_ZEROBYTES-crypto_box_BOXZEROBYTES);
+  *box_len=offset;
+  return 0;
+}
+
+/*
+  Join the fragments of a complete set and decrypt the message.  The
+  plaintext is written to out, which must hold 32768 bytes.
+*/
+int reassembleAndDecryptBuffer(struct fragment_set *f,unsigned char *sk,
+			       unsigned char *out,int *out_len)
+{
+  unsigned char buffer[32768];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  unsigned char msg_pk[crypto_box_PUBLICKEYBYTES];
+  int offset=0;
+  if (reassembleBox(f,buffer,&offset,nonce,msg_pk)) return -1;
   
   unsigned char enclaire[32768];
   bzero(enclaire,32768);  
@@ -427,27 +827,278 @@ int reassembleAndDecrypt(struct fragment_set *f,char *outputdir,
   }
   printf("Decrypted %s\n",f->prefix);
 
-  char filename[1024];
-  snprintf(filename,1024,"%s/%s.out",outputdir,f->prefix);
-  FILE *of=fopen(filename,"w");
-  if (!of) {
-    printf("failed to open %s for writing\n",filename);
-    return -1;
+  *out_len=offset-crypto_box_ZEROBYTES;
+  bcopy(&enclaire[crypto_box_ZEROBYTES],out,*out_len);
+  return 0;
+}
+
+/*
+  Every message is boxed with its own ephemeral key, so opening one costs a
+  scalar multiplication that cannot be shared with any other.  Batches of
+  boxes are instead opened on a pool of threads, one per CPU besides the
+  caller, started when the first batch arrives.  Only one batch is open at a
+  time; the caller works on it too, and returns once it is finished.
+*/
+#define CRYPTO_BOX_POOL_MAX_THREADS 16
+
+static int box_pool_threads=-1;
+static pthread_mutex_t box_pool_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t box_pool_batch_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t box_pool_work=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t box_pool_done=PTHREAD_COND_INITIALIZER;
+static struct crypto_box_open_job *box_pool_jobs=NULL;
+static int box_pool_count=0;
+static int box_pool_next=0;
+static int box_pool_finished=0;
+static const unsigned char *box_pool_sk=NULL;
+
+// Open boxes of the current batch until none are left.  Called with the lock held.
+static void box_pool_open_some()
+{
+  while(box_pool_next<box_pool_count) {
+    struct crypto_box_open_job *j=&box_pool_jobs[box_pool_next++];
+    const unsigned char *sk=box_pool_sk;
+    pthread_mutex_unlock(&box_pool_lock);
+    j->result=crypto_box_open(j->m,j->c,j->clen,j->n,j->pk,sk);
+    pthread_mutex_lock(&box_pool_lock);
+    if (++box_pool_finished==box_pool_count)
+      pthread_cond_signal(&box_pool_done);
   }
-  enclaire[offset]=0;
-  int n=fwrite(&enclaire[crypto_box_ZEROBYTES],offset-crypto_box_ZEROBYTES,1,of);
-  fclose(of);
-  if (n!=1) {
-    printf("failed to write data into %s\n",filename);
+}
+
+static void *box_pool_worker(void *context)
+{
+  pthread_mutex_lock(&box_pool_lock);
+  while(1) {
+    if (box_pool_next<box_pool_count) box_pool_open_some();
+    else pthread_cond_wait(&box_pool_work,&box_pool_lock);
   }
-  
+  return NULL;
+}
+
+static void box_pool_start()
+{
+  int cpus=sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus>CRYPTO_BOX_POOL_MAX_THREADS+1) cpus=CRYPTO_BOX_POOL_MAX_THREADS+1;
+  box_pool_threads=0;
+  for(int i=1;i<cpus;i++) {
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,box_pool_worker,NULL)) break;
+    pthread_detach(thread);
+    box_pool_threads++;
+  }
+}
+
+/*
+  Open count boxes, all sealed to the secret key sk, setting the result of
+  each job.  Returns the number that could not be opened.
+*/
+int crypto_box_open_batch(struct crypto_box_open_job *jobs,int count,
+			  const unsigned char *sk)
+{
+  int i,failures=0;
+
+  pthread_mutex_lock(&box_pool_batch_lock);
+  if (box_pool_threads<0) box_pool_start();
+  if (count<2||!box_pool_threads) {
+    for(i=0;i<count;i++)
+      jobs[i].result=crypto_box_open(jobs[i].m,jobs[i].c,jobs[i].clen,
+				     jobs[i].n,jobs[i].pk,sk);
+  } else {
+    pthread_mutex_lock(&box_pool_lock);
+    box_pool_jobs=jobs;
+    box_pool_sk=sk;
+    box_pool_next=0;
+    box_pool_finished=0;
+    box_pool_count=count;
+    pthread_cond_broadcast(&box_pool_work);
+    box_pool_open_some();
+    while(box_pool_finished<count)
+      pthread_cond_wait(&box_pool_done,&box_pool_lock);
+    box_pool_jobs=NULL;
+    box_pool_sk=NULL;
+    box_pool_count=0;
+    box_pool_next=0;
+    pthread_mutex_unlock(&box_pool_lock);
+  }
+  pthread_mutex_unlock(&box_pool_batch_lock);
+
+  for(i=0;i<count;i++) if (jobs[i].result) failures++;
+  return failures;
+}
+
+// Fragments received by this process, journalled if a journal has been opened
+static struct reassembly *fragment_reassembly=NULL;
+
+/*
+  Keep partial fragment sets in journal_file, so that they survive restarts.
+  Sets already in it are restored.
+*/
+int fragment_reassembly_open(char *journal_file)
+{
+  struct reassembly *r=reassembly_open(journal_file,REASSEMBLY_DEFAULT_EXPIRY);
+  if (!r) return -1;
+  if (fragment_reassembly) reassembly_close(fragment_reassembly);
+  fragment_reassembly=r;
   return 0;
 }
 
+static struct reassembly *fragment_engine()
+{
+  if (!fragment_reassembly)
+    fragment_reassembly=reassembly_open(NULL,REASSEMBLY_DEFAULT_EXPIRY);
+  return fragment_reassembly;
+}
+
+// Number of messages of which some but not all fragments have been received
+int fragment_pending_sets()
+{
+  return fragment_reassembly?reassembly_pending(fragment_reassembly):0;
+}
+
+/*
+  Whether the fragment in the file of this name need not be read again: 1 if
+  it is held, 2 if its message has been delivered already.
+*/
+int fragment_known(char *name)
+{
+  return fragment_reassembly?reassembly_known(fragment_reassembly,name):0;
+}
+
+// Complete sets waiting for fragment_flush()
+struct fragment_queued {
+  struct fragment_set *set;
+  long long tag;
+};
+static struct fragment_queued *fragment_queue_sets=NULL;
+static int fragment_queue_count=0;
+static int fragment_queue_size=0;
+
+/*
+  Add a received fragment to the set of fragments of its message.  A set that
+  this completes is queued to be decrypted by fragment_flush(), along with
+  tag.  Returns 1 if a set was queued, 0 if more fragments are needed, or -1
+  if the fragment is malformed.
+*/
+int fragment_queue(char *fragment,long long tag)
+{
+  struct reassembly *r=fragment_engine();
+  if (!r) return -1;
+  struct fragment_set *f=NULL;
+  int complete=reassembly_add(r,fragment,time(0),&f);
+  if (complete<1) return complete;
+
+  // A duplicate of a fragment of a set that is already queued
+  for(int i=0;i<fragment_queue_count;i++)
+    if (fragment_queue_sets[i].set==f) return 0;
+  if (fragment_queue_count>=fragment_queue_size) {
+    int size=fragment_queue_size?fragment_queue_size*2:FRAGMENT_BATCH_SIZE;
+    struct fragment_queued *q=realloc(fragment_queue_sets,size*sizeof(*q));
+    if (!q) return -1;
+    fragment_queue_sets=q;
+    fragment_queue_size=size;
+  }
+  fragment_queue_sets[fragment_queue_count].set=f;
+  fragment_queue_sets[fragment_queue_count].tag=tag;
+  fragment_queue_count++;
+  return 1;
+}
+
+// Number of complete sets waiting for fragment_flush()
+int fragment_queued()
+{
+  return fragment_queue_count;
+}
+
+/*
+  Reassemble and decrypt up to FRAGMENT_BATCH_SIZE queued sets together, pass
+  each message to deliver, and forget their fragments.  Returns the number of
+  messages delivered.
+*/
+int fragment_flush(unsigned char *sk,fragment_deliver deliver,void *context)
+{
+  struct reassembly *r=fragment_engine();
+  int count=fragment_queue_count;
+  if (!r||!count) return 0;
+  if (count>FRAGMENT_BATCH_SIZE) count=FRAGMENT_BATCH_SIZE;
+
+  struct fragment_box {
+    unsigned char box[32768];
+    unsigned char clear[32768];
+    unsigned char nonce[crypto_box_NONCEBYTES];
+    unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  } *boxes=malloc(count*sizeof(struct fragment_box));
+  struct crypto_box_open_job jobs[FRAGMENT_BATCH_SIZE];
+  int usable[FRAGMENT_BATCH_SIZE];
+  int i,n=0;
+  if (!boxes) return 0;
+
+  for(i=0;i<count;i++) {
+    int len=0;
+    struct fragment_box *b=&boxes[i];
+    usable[i]=!reassembleBox(fragment_queue_sets[i].set,b->box,&len,b->nonce,b->pk);
+    if (!usable[i]) continue;
+    jobs[n].m=b->clear;
+    jobs[n].c=b->box;
+    jobs[n].clen=len;
+    jobs[n].n=b->nonce;
+    jobs[n].pk=b->pk;
+    n++;
+  }
+  crypto_box_open_batch(jobs,n,sk);
 
-#define MAX_FRAGSETS 65536
-struct fragment_set *fragments[MAX_FRAGSETS];
-int fragset_count=0;
+  time_t now=time(0);
+  for(i=0,n=0;i<count;i++) {
+    struct fragment_set *f=fragment_queue_sets[i].set;
+    int len=-1;
+    if (usable[i]) {
+      if (jobs[n].result)
+	printf("decryption of %s failed (crypto box returned = %d)\n",
+	       f->prefix,jobs[n].result);
+      else {
+	printf("Decrypted %s\n",f->prefix);
+	len=jobs[n].clen-crypto_box_ZEROBYTES;
+      }
+      n++;
+    }
+    deliver(context,f->prefix,f->frag_count,fragment_queue_sets[i].tag,
+	    len<0?NULL:&boxes[i].clear[crypto_box_ZEROBYTES],len);
+    reassembly_complete(r,f,now);
+  }
+
+  fragment_queue_count-=count;
+  memmove(&fragment_queue_sets[0],&fragment_queue_sets[count],
+	  fragment_queue_count*sizeof(struct fragment_queued));
+  free(boxes);
+  return count;
+}
+
+// Write each message decrypted by defragmentAndDecrypt() to <outputdir>/<prefix>.out
+static void defragment_write(void *context,char *prefix,int frag_count,
+			     long long tag,unsigned char *message,int len)
+{
+  char *outputdir=context;
+  char filename[1024];
+  if (len<0) return;
+  // Each record of a message that holds several (of at least three bytes
+  // each) gets its own file
+  int max_records=len/3+1;
+  unsigned char *records[max_records];
+  int lengths[max_records];
+  int count=record_container_unpack(message,len,records,lengths,max_records);
+  for(int i=0;i<count;i++) {
+    if (count==1) snprintf(filename,1024,"%s/%s.out",outputdir,prefix);
+    else snprintf(filename,1024,"%s/%s-%d.out",outputdir,prefix,i);
+    FILE *of=fopen(filename,"w");
+    if (!of) {
+      printf("failed to open %s for writing\n",filename);
+      return;
+    }
+    if (fwrite(records[i],lengths[i],1,of)!=1)
+      printf("failed to write data into %s\n",filename);
+    fclose(of);
+  }
+}
 
 int defragmentAndDecrypt(char *inputdir,char *outputdir,char *privatekeypassphrase)
 {
@@ -462,16 +1113,17 @@ int defragmentAndDecrypt(char *inputdir,char *outputdir,char *privatekeypassphra
   // Iterate through the input directory, building lists of message fragments, and
   // then reassembling and decrypting them when we find the whole set.  It's really
   // a bit like collecting Paddle-Pop(tm) Lick-a-prize(tm) sticks.
+  // Remember what has been collected, so that fragments already used need
+  // not be read again next time
+  char journal[1024];
+  snprintf(journal,1024,"%s/reassembly.journal",outputdir);
+  if (fragment_reassembly_open(journal)) return -1;
+
   DIR *d=opendir(inputdir);
   if (!d) return -1;
   struct dirent *de=NULL;
   while ((de=readdir(d))!=NULL) {
-    char this_prefix[16];
-    if (strlen(de->d_name)>=10) {
-      for(int i=0;i<8;i++) this_prefix[i]=de->d_name[2+i];
-      int frag_num=char_to_num(de->d_name[0]);
-      int frag_count=char_to_num(de->d_name[1]);
-
+    if (strlen(de->d_name)>=10&&!fragment_known(de->d_name)) {
       char message[32768];
       char filename[1024];
       snprintf(filename,1024,"%s/%s",inputdir,de->d_name);
@@ -481,50 +1133,14 @@ int defragmentAndDecrypt(char *inputdir,char *outputdir,char *privatekeypassphra
       fclose(f);
       if (r<0) r=0; if (r>32767) r=32767;
       message[r]=0;
-      
-      printf("Found fragment #%d/%d of %s\n",frag_num,frag_count,this_prefix);
-      int i;
-      for(i=0;i<fragset_count;i++) {
-	if (!strcmp(fragments[i]->prefix,this_prefix)) break;
-      }
-      if (i==fragset_count) {
-	// Need a new fragset.
 
-	// No space, so ignore
-	if (fragset_count==MAX_FRAGSETS) continue;
-
-	fragments[i]=calloc(sizeof(struct fragment_set),1);
-	assert(fragments[i]);
-
-	fragments[i]->prefix=strdup(this_prefix);
-
-	fragset_count++;
-      }
-
-      fragments[i]->frag_count=frag_count;
-      if (fragments[i]->pieces[frag_num]) free(fragments[i]->pieces[frag_num]);
-      fragments[i]->pieces[frag_num]=strdup(message);
-      assert(fragments[i]->pieces[frag_num]);
-
-      int j;
-      for(j=0;j<=frag_count;j++) if (!fragments[i]->pieces[j]) break;
-      if (j==frag_count+1) {
-	// Have whole message -- reassemble, decrypt and delete
-	reassembleAndDecrypt(fragments[i],outputdir,sk,pk);
-
-	// free fragment and adjust list
-	for(int j=0;j<fragments[i]->frag_count;j++) {
-	  if (fragments[i]->pieces[j]) free(fragments[i]->pieces[j]);
-	}
-	free(fragments[i]);
-	fragments[i]=fragments[fragset_count-1];
-	fragments[fragset_count-1]=NULL;
-	fragset_count--;
-      }
-	
+      fragment_queue(message,0);
+      if (fragment_queued()>=FRAGMENT_BATCH_SIZE)
+	fragment_flush(sk,defragment_write,outputdir);
     }
     
   }
+  while(fragment_queued()) fragment_flush(sk,defragment_write,outputdir);
 
   closedir(d);
   
@@ -0,0 +1,77 @@
+/*
+  Encryption, fragmentation and reassembly of succinct data messages.
+*/
+
+/*
+  One box for crypto_box_open_batch().  As for crypto_box_open(), c starts
+  with crypto_box_BOXZEROBYTES zero bytes, and m receives clen bytes, the
+  first crypto_box_ZEROBYTES of which are zero.
+*/
+struct crypto_box_open_job {
+  unsigned char *m;
+  const unsigned char *c;
+  unsigned long long clen;
+  const unsigned char *n;
+  const unsigned char *pk;
+  int result;                   // as returned by crypto_box_open()
+};
+
+int crypto_box_open_batch(struct crypto_box_open_job *jobs,int count,
+			  const unsigned char *sk);
+
+// Complete messages decrypted together by fragment_flush()
+#define FRAGMENT_BATCH_SIZE 64
+
+/*
+  Called by fragment_flush() for each message, with len -1 if it could not be
+  decrypted.  tag is whatever was passed to fragment_queue() with the
+  fragment that completed the message.
+*/
+typedef void (*fragment_deliver)(void *context,char *prefix,int frag_count,
+				 long long tag,unsigned char *message,int len);
+
+/*
+  Marks a message that holds several records, each preceded by its length
+  (see record_container_pack()).
+*/
+#define RECORD_CONTAINER_MAGIC "\xffSDR"
+#define RECORD_CONTAINER_MAGIC_BYTES 4
+
+int record_container_pack(unsigned char **records,int *lengths,int count,
+			  unsigned char *out,int out_size);
+int record_container_unpack(unsigned char *message,int len,
+			    unsigned char **records,int *lengths,int max_records);
+
+// MAX_FRAGMENTS, the most fragments of one message, is in reassembly.h
+
+// How the data of a fragment is written (see gsm7.h)
+#define FRAGMENT_ENCODING_BASE64 0
+#define FRAGMENT_ENCODING_GSM7 1
+// Follows the header of a fragment in FRAGMENT_ENCODING_GSM7, where base64
+// data never has it
+#define FRAGMENT_GSM7_MARKER '!'
+
+int fragment_encoding_by_name(char *name);
+int fragment_encoded_bytes_per_fragment(int mtu,int encoding);
+int fragment_payload_bytes(int mtu,int fragment_count,int parity,int encoding);
+int encryptAndFragmentBufferFEC(unsigned char *in_buffer,int in_len,
+				char *fragments[MAX_FRAGMENTS],int *fragment_count,
+				int mtu,char *publickeyhex,int parity,int encoding,
+				int debug);
+int encryptAndFragmentRecords(unsigned char **records,int *lengths,int count,
+			      char *fragments[MAX_FRAGMENTS],int *fragment_count,
+			      int mtu,char *publickeyhex,int parity,int encoding,
+			      int debug);
+int crypto_keypair_pool_start();
+unsigned char *private_key_from_passphrase(char *passphrase);
+int num_to_char(int n);
+int char_to_num(int c);
+int fragment_reassembly_open(char *journal_file);
+int fragment_pending_sets();
+int fragment_known(char *name);
+int fragment_queue(char *fragment,long long tag);
+int fragment_queued();
+int fragment_flush(unsigned char *sk,fragment_deliver deliver,void *context);
+struct fragment_set;
+int reassembleAndDecryptBuffer(struct fragment_set *f,unsigned char *sk,
+			       unsigned char *out,int *out_len);
@@ -0,0 +1,280 @@
+/*
+  Known-answer checks and a microbenchmark for the NaCl primitives.
+
+  Both the reference and the fast implementations of curve25519 and
+  poly1305 are linked in, so each can be checked against published test
+  vectors and against the other on random inputs, and then timed.  salsa20
+  has only the reference implementation, which is checked and timed once.
+  crypto_box_open is timed with whichever implementations this build
+  selected (see NACL in the Makefile).
+
+  Usage: cryptobench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "crypto_box.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "crypto_onetimeauth_poly1305.h"
+#include "crypto_stream_salsa20.h"
+#include "randombytes.h"
+
+void randombytes(unsigned char *buf,unsigned long long len)
+{
+  static int urandomfd = -1;
+  if (urandomfd == -1) urandomfd = open("/dev/urandom",O_RDONLY);
+  while (len>0) {
+    int r=read(urandomfd,buf,len>1048576?1048576:len);
+    if (r<1) { perror("read(/dev/urandom)"); exit(-1); }
+    buf+=r; len-=r;
+  }
+}
+
+typedef int (*scalarmult_fn)(unsigned char *,const unsigned char *,
+			     const unsigned char *);
+typedef int (*scalarmult_base_fn)(unsigned char *,const unsigned char *);
+typedef int (*onetimeauth_fn)(unsigned char *,const unsigned char *,
+			      unsigned long long,const unsigned char *);
+
+struct backend {
+  char *name;
+  scalarmult_fn scalarmult;
+  scalarmult_base_fn scalarmult_base;
+  onetimeauth_fn onetimeauth;
+};
+
+struct backend backends[]={
+  {"ref",
+   crypto_scalarmult_curve25519_ref,crypto_scalarmult_curve25519_ref_base,
+   crypto_onetimeauth_poly1305_ref},
+#ifdef __SIZEOF_INT128__
+  {"fast",
+   crypto_scalarmult_curve25519_donna_c64,
+   crypto_scalarmult_curve25519_donna_c64_base,
+   crypto_onetimeauth_poly1305_donna},
+#else
+  {"fast",
+   crypto_scalarmult_curve25519_ref,crypto_scalarmult_curve25519_ref_base,
+   crypto_onetimeauth_poly1305_ref},
+#endif
+  {NULL}
+};
+
+int failures=0;
+
+int hex_decode(const char *hex,unsigned char *out)
+{
+  int n=0;
+  while(hex[0]&&hex[1]) {
+    unsigned int v;
+    if (sscanf(hex,"%2x",&v)!=1) break;
+    out[n++]=v; hex+=2;
+  }
+  return n;
+}
+
+void check(const char *backend,const char *what,
+	   const unsigned char *got,const char *expected_hex)
+{
+  unsigned char expected[64];
+  int len=hex_decode(expected_hex,expected);
+  if (memcmp(got,expected,len)) {
+    int i;
+    fprintf(stderr,"FAIL: %s %s\n  got      ",backend,what);
+    for(i=0;i<len;i++) fprintf(stderr,"%02x",got[i]);
+    fprintf(stderr,"\n  expected %s\n",expected_hex);
+    failures++;
+  }
+}
+
+void known_answers(struct backend *b)
+{
+  unsigned char scalar[32],point[32],out[32],key[32];
+  const char *message="Cryptographic Forum Research Group";
+
+  // RFC 7748 section 5.2, first vector
+  hex_decode("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+	     scalar);
+  hex_decode("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+	     point);
+  b->scalarmult(out,scalar,point);
+  check(b->name,"curve25519 RFC 7748 5.2",out,
+	"c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+
+  // RFC 7748 section 6.1 (also the NaCl box test keys)
+  hex_decode("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+	     scalar);
+  b->scalarmult_base(out,scalar);
+  check(b->name,"curve25519 alice public key",out,
+	"8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+  hex_decode("de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f",
+	     point);
+  b->scalarmult(out,scalar,point);
+  check(b->name,"curve25519 shared secret",out,
+	"4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+
+  // RFC 8439 section 2.5.2
+  hex_decode("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b",
+	     key);
+  b->onetimeauth(out,(const unsigned char *)message,strlen(message),key);
+  check(b->name,"poly1305 RFC 8439 2.5.2",out,
+	"a8061dc1305136c6c22b8baf0c0127a9");
+}
+
+void salsa20_known_answer()
+{
+  unsigned char out[64],key[32],nonce[8];
+
+  // Salsa20 with an all-zero key and nonce
+  bzero(key,32); bzero(nonce,8); bzero(out,64);
+  crypto_stream_salsa20_xor(out,out,64,nonce,key);
+  check("ref","salsa20 zero key",out,
+	"9a97f65b9b4c721b960a672145fca8d4e32e67f9111ea979ce9c4826806aeee6"
+	"3de9c0da2bd7f91ebcb2639bf989c6251b29bf38d39a9bdce7c55f4b2ac12a39");
+}
+
+// Compare each fast primitive with the reference one on random inputs
+void differential(struct backend *ref,struct backend *fast,int count)
+{
+  unsigned char a[32],b[32],c[32],d[32];
+  unsigned char key[32];
+  unsigned char m[1024];
+  int i;
+
+  for(i=0;i<count;i++) {
+    int len;
+
+    randombytes(a,32); randombytes(b,32);
+    // Both implementations take the top bit of the point as 2^255
+    if (i&1) b[31]|=0x80; else b[31]&=0x7f;
+    ref->scalarmult(c,a,b);
+    fast->scalarmult(d,a,b);
+    if (memcmp(c,d,32)) {
+      fprintf(stderr,"FAIL: curve25519 differs from reference (case %d)\n",i);
+      failures++; return;
+    }
+
+    len=random()%sizeof(m);
+    randombytes(key,32); randombytes(m,len);
+    ref->onetimeauth(c,m,len,key);
+    fast->onetimeauth(d,m,len,key);
+    if (memcmp(c,d,16)) {
+      fprintf(stderr,"FAIL: poly1305 differs from reference (length %d)\n",len);
+      failures++; return;
+    }
+  }
+}
+
+long long gettime_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+void report(const char *what,const char *backend,int iterations,long long us)
+{
+  if (us<1) us=1;
+  printf("  %-28s %-5s %10.2f us/op %12.0f op/s\n",
+	 what,backend,us*1.0/iterations,iterations*1000000.0/us);
+}
+
+void benchmark(struct backend *b,int iterations)
+{
+  unsigned char sk[32],pk[32],out[32],key[32];
+  unsigned char m[256];
+  long long start;
+  int i;
+
+  randombytes(sk,32); randombytes(pk,32); randombytes(key,32);
+  randombytes(m,sizeof(m));
+
+  start=gettime_us();
+  for(i=0;i<iterations;i++) b->scalarmult(out,sk,pk);
+  report("curve25519 scalarmult",b->name,iterations,gettime_us()-start);
+
+  start=gettime_us();
+  for(i=0;i<iterations*100;i++) b->onetimeauth(out,m,sizeof(m),key);
+  report("poly1305, 256 bytes",b->name,iterations*100,gettime_us()-start);
+}
+
+void benchmark_salsa20(int iterations)
+{
+  unsigned char key[32],nonce[8];
+  unsigned char m[256];
+  long long start;
+  int i;
+
+  randombytes(key,32); randombytes(nonce,8); randombytes(m,sizeof(m));
+
+  start=gettime_us();
+  for(i=0;i<iterations*100;i++)
+    crypto_stream_salsa20_xor(m,m,sizeof(m),nonce,key);
+  report("salsa20 xor, 256 bytes","ref",iterations*100,gettime_us()-start);
+}
+
+void benchmark_box_open(int iterations)
+{
+  unsigned char pk[crypto_box_PUBLICKEYBYTES],sk[crypto_box_SECRETKEYBYTES];
+  unsigned char epk[crypto_box_PUBLICKEYBYTES],esk[crypto_box_SECRETKEYBYTES];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  unsigned char m[crypto_box_ZEROBYTES+200],c[crypto_box_ZEROBYTES+200];
+  unsigned char p[crypto_box_ZEROBYTES+200];
+  long long start;
+  int i;
+
+  crypto_box_keypair(pk,sk);
+  crypto_box_keypair(epk,esk);
+  randombytes(nonce,sizeof(nonce));
+  bzero(m,crypto_box_ZEROBYTES);
+  randombytes(m+crypto_box_ZEROBYTES,200);
+  crypto_box(c,m,sizeof(m),nonce,pk,esk);
+
+  start=gettime_us();
+  for(i=0;i<iterations;i++)
+    if (crypto_box_open(p,c,sizeof(c),nonce,epk,sk)) {
+      fprintf(stderr,"FAIL: crypto_box_open rejected a valid box\n");
+      failures++; return;
+    }
+  report("crypto_box_open, 200 bytes",
+	 strstr(crypto_scalarmult_curve25519_IMPLEMENTATION,"ref")?"ref":"fast",
+	 iterations,gettime_us()-start);
+  if (memcmp(p+crypto_box_ZEROBYTES,m+crypto_box_ZEROBYTES,200)) {
+    fprintf(stderr,"FAIL: crypto_box_open did not recover the message\n");
+    failures++;
+  }
+}
+
+int main(int argc,char **argv)
+{
+  int iterations=2000;
+  int i;
+
+  if (argc>1) iterations=atoi(argv[1]);
+  if (iterations<1) iterations=1;
+
+  for(i=0;backends[i].name;i++) known_answers(&backends[i]);
+  salsa20_known_answer();
+  differential(&backends[0],&backends[1],1000);
+  if (failures) {
+    fprintf(stderr,"%d known-answer or cross-check failures\n",failures);
+    return 1;
+  }
+  printf("Known-answer and cross-checks passed.\n");
+  printf("crypto_box uses %s, %s, %s\n",
+	 crypto_scalarmult_curve25519_IMPLEMENTATION,
+	 crypto_onetimeauth_poly1305_IMPLEMENTATION,
+	 crypto_stream_salsa20_IMPLEMENTATION);
+
+  for(i=0;backends[i].name;i++) benchmark(&backends[i],iterations);
+  benchmark_salsa20(iterations);
+  benchmark_box_open(iterations);
+
+  return failures?1:0;
+}
@@ -0,0 +1,447 @@
+/*
+  Date and time field codecs for succinct data recipes.
+
+  Parsing and formatting are done by hand, and conversions between calendar
+  dates and day numbers use Howard Hinnant's days_from_civil() arithmetic, so
+  that encoding and decoding never consult the host's timezone or locale, and
+  a record decodes to the same text on every machine.
+
+  TIMEDATE, MAGPITIMEDATE and DATE fields may give an epoch window as the
+  minimum and maximum years in their recipe line, e.g.
+
+  startrecordtime:timestamp:2015:2030:0
+
+  Values are then coded relative to the start of the window, which takes fewer
+  bits than the full range.  Fields with minimum and maximum both zero (or
+  otherwise not increasing) are coded as they always have been.
+
+  (C) Copyright Paul Gardner-Stephen, 2016.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "datetime.h"
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+long long datetime_days_from_civil(int year,int month,int day)
+{
+  year-=month<=2;
+  long long era=(year>=0?year:year-399)/400;
+  unsigned int yoe=(unsigned int)(year-era*400);
+  unsigned int doy=(153*(month+(month>2?-3:9))+2)/5+day-1;
+  unsigned int doe=yoe*365+yoe/4-yoe/100+doy;
+  return era*146097+(long long)doe-719468;
+}
+
+void datetime_civil_from_days(long long days,int *year,int *month,int *day)
+{
+  days+=719468;
+  long long era=(days>=0?days:days-146096)/146097;
+  unsigned int doe=(unsigned int)(days-era*146097);
+  unsigned int yoe=(doe-doe/1460+doe/36524-doe/146096)/365;
+  unsigned int doy=doe-(365*yoe+yoe/4-yoe/100);
+  unsigned int mp=(5*doy+2)/153;
+  *day=doy-(153*mp+2)/5+1;
+  *month=mp<10?mp+3:mp-9;
+  *year=yoe+era*400+(*month<=2);
+}
+
+int datetime_days_in_month(int year,int month)
+{
+  static const int days[12]={31,28,31,30,31,30,31,31,30,31,30,31};
+  if (month<1||month>12) return 0;
+  if (month==2&&(year%4==0&&(year%100!=0||year%400==0))) return 29;
+  return days[month-1];
+}
+
+long long datetime_to_epoch(struct datetime *dt)
+{
+  return datetime_days_from_civil(dt->year,dt->month,dt->day)*86400LL
+    +dt->hour*3600+dt->minute*60+dt->second-dt->offset;
+}
+
+void datetime_from_epoch(long long t,struct datetime *dt)
+{
+  long long days=t/86400;
+  int seconds=t%86400;
+  if (seconds<0) { seconds+=86400; days--; }
+  datetime_civil_from_days(days,&dt->year,&dt->month,&dt->day);
+  dt->hour=seconds/3600;
+  dt->minute=(seconds/60)%60;
+  dt->second=seconds%60;
+  dt->offset=0;
+}
+
+// Read an unsigned number of 1 to max_digits digits.
+static int parse_number(const char **s,int max_digits,int *v)
+{
+  int n=0;
+  *v=0;
+  while(n<max_digits&&(**s)>='0'&&(**s)<='9') {
+    *v=(*v)*10+(**s)-'0';
+    (*s)++; n++;
+  }
+  return n?0:-1;
+}
+
+static int parse_char(const char **s,char c)
+{
+  if (**s!=c) return -1;
+  (*s)++;
+  return 0;
+}
+
+static const char *skip_spaces(const char *s)
+{
+  while(*s==' '||*s=='\t') s++;
+  return s;
+}
+
+/*
+  Parse hh:mm[:ss[.fff]] into dt, and return a pointer to what follows.
+*/
+static const char *parse_time(const char *s,struct datetime *dt)
+{
+  if (parse_number(&s,2,&dt->hour)||parse_char(&s,':')
+      ||parse_number(&s,2,&dt->minute)) return NULL;
+  dt->second=0;
+  if (*s==':') {
+    s++;
+    if (parse_number(&s,2,&dt->second)) return NULL;
+    if (*s=='.'||*s==',') {
+      // Fractions of a second are not kept
+      int fraction;
+      s++;
+      if (parse_number(&s,9,&fraction)) return NULL;
+    }
+  }
+  return s;
+}
+
+/*
+  Parse an ISO-8601 date and time, as ODK Collect writes them:
+  YYYY-MM-DDThh:mm[:ss[.fff]][Z|+hh:mm|-hh:mm|+hhmm|-hhmm|+hh|-hh]
+  A space may separate the date and time instead of T.
+*/
+int datetime_parse_iso8601(const char *s,struct datetime *dt)
+{
+  s=skip_spaces(s);
+  dt->offset=0;
+  if (parse_number(&s,4,&dt->year)||parse_char(&s,'-')
+      ||parse_number(&s,2,&dt->month)||parse_char(&s,'-')
+      ||parse_number(&s,2,&dt->day)) return -1;
+  if (*s!='T'&&*s!='t'&&*s!=' ') return -1;
+  s++;
+  if (!(s=parse_time(s,dt))) return -1;
+  if (*s=='Z'||*s=='z') s++;
+  else if (*s=='+'||*s=='-') {
+    int sign=(*s=='-')?-1:1;
+    int tzh=0,tzm=0;
+    s++;
+    if (parse_number(&s,2,&tzh)) return -1;
+    if (*s==':') s++;
+    if (*s>='0'&&*s<='9') if (parse_number(&s,2,&tzm)) return -1;
+    if (tzh>14||tzm>59) return -1;
+    dt->offset=sign*(tzh*3600+tzm*60);
+  }
+  if (*skip_spaces(s)) return -1;
+  if (dt->month<1||dt->month>12||dt->day<1
+      ||dt->day>datetime_days_in_month(dt->year,dt->month)) return -1;
+  if (dt->hour>24||dt->minute>59||dt->second>61) return -1;
+  return 0;
+}
+
+// Parse a Magpi time stamp: YYYY-MM-DD hh:mm:ss
+int datetime_parse_magpi(const char *s,struct datetime *dt)
+{
+  s=skip_spaces(s);
+  dt->offset=0;
+  if (parse_number(&s,4,&dt->year)||parse_char(&s,'-')
+      ||parse_number(&s,2,&dt->month)||parse_char(&s,'-')
+      ||parse_number(&s,2,&dt->day)) return -1;
+  s=skip_spaces(s);
+  if (parse_number(&s,2,&dt->hour)||parse_char(&s,':')
+      ||parse_number(&s,2,&dt->minute)||parse_char(&s,':')
+      ||parse_number(&s,2,&dt->second)) return -1;
+
+  // Validate fields
+  if (dt->month<1||dt->month>12) return -1;
+  if (dt->day<1||dt->day>31) return -1;
+  if (dt->hour>24) return -1;
+  if (dt->minute>59) return -1;
+  if (dt->second>61) return -1;
+  return 0;
+}
+
+/*
+  ODK does YYYY/MM/DD
+  Magpi does DD-MM-YYYY
+  The different delimiter allows us to discern between the two.
+*/
+int datetime_parse_date(const char *s,int *year,int *month,int *day)
+{
+  int a,b,c;
+  char delimiter;
+  s=skip_spaces(s);
+  if (parse_number(&s,4,&a)) return -1;
+  delimiter=*s;
+  if ((delimiter!='/'&&delimiter!='-')||parse_char(&s,delimiter)
+      ||parse_number(&s,2,&b)||parse_char(&s,delimiter)
+      ||parse_number(&s,4,&c)) return -1;
+  if (delimiter=='/') { *year=a; *month=b; *day=c; }
+  else { *day=a; *month=b; *year=c; }
+
+  // XXX Not as efficient as it could be (assumes all months have 31 days)
+  if (*year<1||*year>9999||*month<1||*month>12||*day<1||*day>31) return -1;
+  return 0;
+}
+
+// Parse hh:mm[:ss[.fff]] (or the older hh:mm.ss) into seconds since midnight.
+int datetime_parse_timeofday(const char *s,int *seconds)
+{
+  struct datetime dt;
+  s=skip_spaces(s);
+  const char *p=s;
+  if (parse_number(&p,2,&dt.hour)||parse_char(&p,':')
+      ||parse_number(&p,2,&dt.minute)) return -1;
+  if (*p=='.') {
+    p++;
+    if (parse_number(&p,2,&dt.second)) return -1;
+  } else if (!parse_time(s,&dt)) return -1;
+  // XXX - We don't support leap seconds
+  if (dt.hour>23||dt.minute>59||dt.second>59) return -1;
+  *seconds=dt.hour*3600+dt.minute*60+dt.second;
+  return 0;
+}
+
+static char *format_number(char *out,int v,int width)
+{
+  int i;
+  if (v<0) v=0;
+  for(i=width-1;i>=0;i--) { out[i]='0'+v%10; v/=10; }
+  return out+width;
+}
+
+// Format as yyyy-mm-ddThh:mm:ss+hh:mm
+int datetime_format_iso8601(char *out,struct datetime *dt)
+{
+  char *p=out;
+  int offset=dt->offset;
+  p=format_number(p,dt->year,4); *p++='-';
+  p=format_number(p,dt->month,2); *p++='-';
+  p=format_number(p,dt->day,2); *p++='T';
+  p=format_number(p,dt->hour,2); *p++=':';
+  p=format_number(p,dt->minute,2); *p++=':';
+  p=format_number(p,dt->second,2);
+  *p++=offset<0?'-':'+';
+  if (offset<0) offset=-offset;
+  p=format_number(p,offset/3600,2); *p++=':';
+  p=format_number(p,(offset/60)%60,2);
+  *p=0;
+  return p-out;
+}
+
+// Format as yyyy-mm-dd hh:mm:ss
+int datetime_format_magpi(char *out,struct datetime *dt)
+{
+  char *p=out;
+  p=format_number(p,dt->year,4); *p++='-';
+  p=format_number(p,dt->month,2); *p++='-';
+  p=format_number(p,dt->day,2); *p++=' ';
+  p=format_number(p,dt->hour,2); *p++=':';
+  p=format_number(p,dt->minute,2); *p++=':';
+  p=format_number(p,dt->second,2);
+  *p=0;
+  return p-out;
+}
+
+/*
+  First day and number of days of a field's epoch window, if it has one.
+*/
+static int datetime_window(struct field *field,long long *first_day,
+			   long long *days)
+{
+  if (field->maximum<=field->minimum) return 0;
+  *first_day=datetime_days_from_civil(field->minimum,1,1);
+  *days=datetime_days_from_civil(field->maximum+1,1,1)-*first_day;
+  return 1;
+}
+
+// Largest value of a TIMEOFDAY or DATE field at the given precision, and the
+// number of bits it is shifted down by.
+static int datetime_range(int full_precision,int full_maximum,int precision,
+			  int *maximum,int *shift)
+{
+  if (precision==0||precision>full_precision) precision=full_precision;
+  *shift=full_precision-precision;
+  *maximum=full_maximum>>*shift;
+  // make sure that a shifted value cannot = maximum
+  if (*shift) *maximum+=1;
+  return 0;
+}
+
+int datetime_encode_field(range_coder *c,struct field *field,const char *value)
+{
+  struct datetime dt;
+  long long first_day,days;
+  int maximum,shift;
+
+  switch(field->type) {
+  case FIELDTYPE_TIMEOFDAY:
+    {
+      int seconds;
+      if (datetime_parse_timeofday(value,&seconds)) return -1;
+      // 2^16 < 24*60*60 < 2^17
+      datetime_range(17,24*60*60,field->precision,&maximum,&shift);
+      return range_encode_equiprobable(c,maximum+1,seconds>>shift);
+    }
+  case FIELDTYPE_TIMEDATE:
+    {
+      if (datetime_parse_iso8601(value,&dt)) return -1;
+      long long t=datetime_to_epoch(&dt);
+      long long span=0x80000000LL;
+      if (datetime_window(field,&first_day,&days)) {
+	t-=first_day*86400;
+	span=days*86400;
+      }
+      if (t<0||t>=span) {
+	fprintf(stderr,"TIMEDATE: '%s' is outside the range of field '%s'\n",
+		value,field->name);
+	return -1;
+      }
+      // SMAC has a bug with encoding large ranges, so break into smaller pieces
+      range_encode_equiprobable(c,((span-1)>>16)+1,t>>16);
+      return range_encode_equiprobable(c,0x10000,t&0xffff);
+    }
+  case FIELDTYPE_MAGPITIMEDATE:
+    {
+      if (datetime_parse_magpi(value,&dt)) return -1;
+      // Encode each field: requires about 40 bits, but safely encodes all values
+      // without risk of timezone munging on Android
+      if (datetime_window(field,&first_day,&days)) {
+	if (dt.year<field->minimum||dt.year>field->maximum) return -1;
+	range_encode_equiprobable(c,field->maximum-field->minimum+1,
+				  dt.year-field->minimum);
+      } else {
+	if (dt.year>9999) return -1;
+	range_encode_equiprobable(c,10000,dt.year);
+      }
+      range_encode_equiprobable(c,12,dt.month-1);
+      range_encode_equiprobable(c,31,dt.day-1);
+      range_encode_equiprobable(c,25,dt.hour);
+      range_encode_equiprobable(c,60,dt.minute);
+      return range_encode_equiprobable(c,62,dt.second);
+    }
+  case FIELDTYPE_DATE:
+    {
+      int y,m,d;
+      if (datetime_parse_date(value,&y,&m,&d)) {
+	fprintf(stderr,"Invalid date value '%s'\n",value);
+	return -1;
+      }
+      if (datetime_window(field,&first_day,&days)) {
+	long long n=datetime_days_from_civil(y,m,d)-first_day;
+	if (d>datetime_days_in_month(y,m)||n<0||n>=days) {
+	  fprintf(stderr,"Date '%s' is outside the range of field '%s'\n",
+		  value,field->name);
+	  return -1;
+	}
+	return recipe_encode_value(c,field,days,n);
+      }
+      // 2^21 < 10000*372 < 2^22
+      datetime_range(22,10000*372,field->precision,&maximum,&shift);
+      return recipe_encode_value(c,field,maximum+1,
+				 (y*372+(m-1)*31+(d-1))>>shift);
+    }
+  }
+  return -1;
+}
+
+int datetime_decode_field(range_coder *c,struct field *field,
+			  char *value,int value_size)
+{
+  struct datetime dt;
+  long long first_day,days;
+  int maximum,shift;
+
+  if (value_size<32) return -1;
+
+  switch(field->type) {
+  case FIELDTYPE_TIMEOFDAY:
+    {
+      datetime_range(17,24*60*60,field->precision,&maximum,&shift);
+      int seconds=range_decode_equiprobable(c,maximum+1)<<shift;
+      char *p=value;
+      p=format_number(p,seconds/3600,2); *p++=':';
+      p=format_number(p,(seconds/60)%60,2); *p++=':';
+      p=format_number(p,seconds%60,2);
+      *p=0;
+      return 0;
+    }
+  case FIELDTYPE_TIMEDATE:
+    // time is 32-bit seconds since 1970, or since the start of the window.
+    {
+      long long span=0x80000000LL;
+      long long start=0;
+      if (datetime_window(field,&first_day,&days)) {
+	start=first_day*86400;
+	span=days*86400;
+      }
+      long long t=(long long)range_decode_equiprobable(c,((span-1)>>16)+1)<<16;
+      t|=range_decode_equiprobable(c,0x10000);
+      datetime_from_epoch(start+t,&dt);
+      datetime_format_iso8601(value,&dt);
+      return 0;
+    }
+  case FIELDTYPE_MAGPITIMEDATE:
+    // time encodes each field precisely, allowing years 0 - 9999
+    {
+      if (datetime_window(field,&first_day,&days))
+	dt.year=field->minimum
+	  +range_decode_equiprobable(c,field->maximum-field->minimum+1);
+      else
+	dt.year=range_decode_equiprobable(c,10000);
+      dt.month=range_decode_equiprobable(c,12)+1;
+      dt.day=range_decode_equiprobable(c,31)+1;
+      dt.hour=range_decode_equiprobable(c,25);
+      dt.minute=range_decode_equiprobable(c,60);
+      dt.second=range_decode_equiprobable(c,62);
+      datetime_format_magpi(value,&dt);
+      return 0;
+    }
+  case FIELDTYPE_DATE:
+    {
+      int y,m,d;
+      if (datetime_window(field,&first_day,&days)) {
+	long long n=recipe_decode_value(c,field,days);
+	datetime_civil_from_days(first_day+n,&y,&m,&d);
+      } else {
+	// Date encoded using:
+	// normalised_value=y*372+(m-1)*31+(d-1);
+	datetime_range(22,10000*372,field->precision,&maximum,&shift);
+	int normalised_value=recipe_decode_value(c,field,maximum+1)<<shift;
+	y=normalised_value/372;
+	int day_of_year=normalised_value-(y*372);
+	m=day_of_year/31+1;
+	d=day_of_year%31+1;
+      }
+      // American date format for Magpi
+      char *p=value;
+      p=format_number(p,m,2); *p++='-';
+      p=format_number(p,d,2); *p++='-';
+      p=format_number(p,y,4);
+      *p=0;
+      return 0;
+    }
+  }
+  return -1;
+}
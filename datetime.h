@@ -0,0 +1,35 @@
+/*
+  Date and time parsing, formatting and field coding for succinct data.
+
+  All conversions are pure arithmetic on the proleptic Gregorian calendar, so
+  they neither allocate nor depend on the locale or timezone of the host.
+*/
+
+struct datetime {
+  int year;
+  int month;  // 1 - 12
+  int day;    // 1 - 31
+  int hour;
+  int minute;
+  int second;
+  int offset; // seconds east of UTC
+};
+
+long long datetime_days_from_civil(int year,int month,int day);
+void datetime_civil_from_days(long long days,int *year,int *month,int *day);
+int datetime_days_in_month(int year,int month);
+
+long long datetime_to_epoch(struct datetime *dt);
+void datetime_from_epoch(long long t,struct datetime *dt);
+
+int datetime_parse_iso8601(const char *s,struct datetime *dt);
+int datetime_parse_magpi(const char *s,struct datetime *dt);
+int datetime_parse_date(const char *s,int *year,int *month,int *day);
+int datetime_parse_timeofday(const char *s,int *seconds);
+
+int datetime_format_iso8601(char *out,struct datetime *dt);
+int datetime_format_magpi(char *out,struct datetime *dt);
+
+int datetime_encode_field(range_coder *c,struct field *field,const char *value);
+int datetime_decode_field(range_coder *c,struct field *field,
+			  char *value,int value_size);
@@ -1,8 +1,14 @@
 #include <stdio.h>
 #include <strings.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "charset.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "recipe.h"
+
 /*
   Re-constitute a form to XML (or other format) by reading a template of the output
   format and substituting the values in.
@@ -85,8 +91,147 @@ int stripped2xml(char *stripped,int stripped_len,char *template,int template_len
   return xml_ofs;
 }
 
-int xml2stripped(const char *form_name, const char *xml,int xml_len,
-		 char *stripped,int stripped_size)
+/*
+  Compile a template once into a list of segments, each being a span of literal
+  text followed by an optional field slot.  Slots are resolved to recipe field
+  indices here, so that rendering a record is just a sequence of memcpy()s.
+  Semantics match stripped2xml(): $FIELD$ is replaced by the value of FIELD,
+  and slots that name no recipe field produce no output.
+*/
+struct compiled_template *template_compile(struct recipe *recipe,
+					   char *template,int template_len)
+{
+  struct compiled_template *t=calloc(sizeof(struct compiled_template),1);
+  if (!t) return NULL;
+  t->text=malloc(template_len+1);
+  if (!t->text) { free(t); return NULL; }
+  bcopy(template,t->text,template_len);
+  t->text[template_len]=0;
+  t->text_len=template_len;
+
+  int segments_allocated=0;
+  int literal_start=0;
+  int i=0;
+  while(i<=template_len) {
+    int field=-1;
+    int literal_end=i;
+    if (i<template_len) {
+      if (template[i]!='$') { i++; continue; }
+      // Find end of slot name.  Unterminated slots are dropped.
+      int j;
+      for(j=i+1;j<template_len&&template[j]!='$';j++) continue;
+      if (j<template_len) {
+	int name_len=j-(i+1);
+	if (name_len>1023) name_len=1023;
+	for(field=0;field<recipe->field_count;field++)
+	  if (strlen(recipe->fields[field].name)==name_len
+	      &&!strncasecmp(recipe->fields[field].name,&template[i+1],name_len))
+	    break;
+	if (field==recipe->field_count) field=-1;
+      }
+      i=j+1;
+    } else i++;
+
+    if (t->segment_count>=segments_allocated) {
+      segments_allocated=segments_allocated?segments_allocated*2:64;
+      struct template_segment *s=realloc(t->segments,
+					 segments_allocated*sizeof(struct template_segment));
+      if (!s) { template_free(t); return NULL; }
+      t->segments=s;
+    }
+    t->segments[t->segment_count].offset=literal_start;
+    t->segments[t->segment_count].length=literal_end-literal_start;
+    t->segments[t->segment_count].field=field;
+    t->segment_count++;
+    literal_start=i;
+  }
+  return t;
+}
+
+void template_free(struct compiled_template *t)
+{
+  if (!t) return;
+  if (t->text) free(t->text);
+  if (t->segments) free(t->segments);
+  free(t);
+}
+
+static int template_append(char **out,int *out_len,int *out_size,
+			   char *bytes,int count)
+{
+  if ((*out_len)+count+1>(*out_size)) {
+    int size=(*out_size)?(*out_size):65536;
+    while((*out_len)+count+1>size) size*=2;
+    char *n=realloc(*out,size);
+    if (!n) return -1;
+    *out=n; *out_size=size;
+  }
+  bcopy(bytes,&(*out)[*out_len],count);
+  (*out_len)+=count;
+  (*out)[*out_len]=0;
+  return 0;
+}
+
+/*
+  Render a stripped record through a compiled template into *out, which is
+  grown with realloc() as required.  Returns the number of bytes rendered.
+  Decompressed records list the fields in recipe order, so each key is
+  first checked against the field following the previous one.
+*/
+int template_render(struct compiled_template *t,struct recipe *recipe,
+		    char *stripped,int stripped_len,
+		    char **out,int *out_size)
+{
+  char *values[recipe->field_count];
+  int value_lengths[recipe->field_count];
+  int i,f;
+  int next_field=0;
+
+  for(f=0;f<recipe->field_count;f++) values[f]=NULL;
+
+  for(i=0;i<stripped_len;) {
+    int key_start=i;
+    while(i<stripped_len&&stripped[i]>=' '&&stripped[i]!='=') i++;
+    int key_len=i-key_start;
+    if (i>=stripped_len||stripped[i]!='=') { i++; continue; }
+    int value_start=++i;
+    while(i<stripped_len&&stripped[i]>=' ') i++;
+    int value_len=i-value_start;
+    if (key_len>1000||value_len>1000) return -1;
+
+    if (i==stripped_len) break; // value without line ending is ignored
+    f=recipe_field_lookup(recipe,&stripped[key_start],key_len,next_field);
+    if (f>=0) {
+      // First occurrence of a key wins, as in stripped2xml()
+      if (!values[f]) {
+	values[f]=&stripped[value_start];
+	value_lengths[f]=value_len;
+      }
+      next_field=f+1;
+    }
+  }
+
+  int out_len=0;
+  for(i=0;i<t->segment_count;i++) {
+    struct template_segment *s=&t->segments[i];
+    if (template_append(out,&out_len,out_size,&t->text[s->offset],s->length))
+      return -1;
+    if (s->field>=0&&values[s->field])
+      if (template_append(out,&out_len,out_size,
+			  values[s->field],value_lengths[s->field]))
+	return -1;
+  }
+  return out_len;
+}
+
+/*
+  Scan a form instance, calling pair() for each field value in document order.
+  Magpi's empty field marker (~) is skipped.  Sub-form boundaries are reported
+  as a key of "{" or "}" with a NULL value.  A non-zero return from pair() stops
+  the scan, and is returned to the caller.
+*/
+int xml_scan_instance(const char *form_name, const char *xml,int xml_len,
+		      xml_pair_callback pair,void *context)
 {
 
   char tag[1024];
@@ -102,7 +247,6 @@ int xml2stripped(const char *form_name, const char *xml,int xml_len,
   int state=0;
 
   int xmlofs=0;
-  int stripped_ofs=0;
 
   char exit_tag[1024]="";
   
@@ -119,8 +263,8 @@ int xml2stripped(const char *form_name, const char *xml,int xml_len,
 	if ((value[0]=='~')&&(val_len==1)) {
 	  // nothing to do
 	} else {
-	  int b=snprintf(&stripped[stripped_ofs],stripped_size-stripped_ofs,"%s=%s\n",tag,value);
-	  if (b>0) stripped_ofs+=b;
+	  int r=pair(context,tag,value);
+	  if (r) return r;
 	}
 	val_len=0;
       }
@@ -145,14 +289,14 @@ int xml2stripped(const char *form_name, const char *xml,int xml_len,
 	  if (!strncasecmp("dd:subform ",tag,strlen("dd:subform"))) {
 	      // Beginning of sub form
 	      interesting_tag=0;
-	      int b=snprintf(&stripped[stripped_ofs],stripped_size-stripped_ofs,"{\n");
-	      if (b>0) stripped_ofs+=b;
+	      int r=pair(context,"{",NULL);
+	      if (r) return r;
 	    }
 	  if (!strncasecmp("/dd:subform ",tag,strlen("/dd:subform"))) {
 	      // End of sub form
 	      interesting_tag=0;
-	      int b=snprintf(&stripped[stripped_ofs],stripped_size-stripped_ofs,"}\n");
-	      if (b>0) stripped_ofs+=b;
+	      int r=pair(context,"}",NULL);
+	      if (r) return r;
 	    }
 	  if (!strncasecmp("form",tag,strlen("form")))
 	    {
@@ -180,8 +324,10 @@ int xml2stripped(const char *form_name, const char *xml,int xml_len,
 	      // the recipe that corresponds to a record.
 	      fprintf(stderr,"ODK form name is %s.%s\n",
 		      name_part,version_part);
-	      int b=snprintf(&stripped[stripped_ofs],stripped_size-stripped_ofs,"formid=%s.%s\n",name_part,version_part);
-	      if (b>0) stripped_ofs+=b;
+	      char formid[2048];
+	      snprintf(formid,sizeof(formid),"%s.%s",name_part,version_part);
+	      int e=pair(context,"formid",formid);
+	      if (e) return e;
 	      in_instance++;
 	    }
 
@@ -220,5 +366,36 @@ int xml2stripped(const char *form_name, const char *xml,int xml_len,
     }
     c= xml[xmlofs++];
   }
-  return stripped_ofs;  
+  return 0;
+}
+
+struct stripped_output {
+  char *stripped;
+  int stripped_ofs;
+  int stripped_size;
+};
+
+static int stripped_append_pair(void *context,const char *key,const char *value)
+{
+  struct stripped_output *o=context;
+  int b;
+  if (value)
+    b=snprintf(&o->stripped[o->stripped_ofs],o->stripped_size-o->stripped_ofs,
+	       "%s=%s\n",key,value);
+  else
+    b=snprintf(&o->stripped[o->stripped_ofs],o->stripped_size-o->stripped_ofs,
+	       "%s\n",key);
+  if (b>0&&o->stripped_ofs+b<o->stripped_size) o->stripped_ofs+=b;
+  return 0;
+}
+
+int xml2stripped(const char *form_name, const char *xml,int xml_len,
+		 char *stripped,int stripped_size)
+{
+  struct stripped_output o;
+  o.stripped=stripped;
+  o.stripped_ofs=0;
+  o.stripped_size=stripped_size;
+  xml_scan_instance(form_name,xml,xml_len,stripped_append_pair,&o);
+  return o.stripped_ofs;
 }
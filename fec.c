@@ -0,0 +1,153 @@
+/*
+  Forward error correction over the fragments of a message: a systematic
+  Reed-Solomon code over GF(2^8), built from a Cauchy matrix.  See fec.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "fec.h"
+
+// x^8 + x^4 + x^3 + x^2 + 1
+#define FEC_POLYNOMIAL 0x11d
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static pthread_once_t gf_once=PTHREAD_ONCE_INIT;
+
+static void gf_init()
+{
+  int i,x=1;
+  for(i=0;i<255;i++) {
+    gf_exp[i]=x;
+    gf_log[x]=i;
+    x<<=1;
+    if (x&0x100) x^=FEC_POLYNOMIAL;
+  }
+  for(i=255;i<512;i++) gf_exp[i]=gf_exp[i-255];
+}
+
+static inline unsigned char gf_mul(unsigned char a,unsigned char b)
+{
+  if (!a||!b) return 0;
+  return gf_exp[gf_log[a]+gf_log[b]];
+}
+
+static inline unsigned char gf_inv(unsigned char a)
+{
+  return gf_exp[255-gf_log[a]];
+}
+
+// Weight of data shard i in parity shard j: 1/(x_j + y_i), x_j=data_count+j, y_i=i
+static unsigned char fec_coefficient(int data_count,int parity_index,int i)
+{
+  return gf_inv((data_count+parity_index)^i);
+}
+
+// out ^= c*in, for len bytes
+static void gf_mul_add(unsigned char *out,const unsigned char *in,
+		       unsigned char c,int len)
+{
+  unsigned char table[256];
+  int i;
+  if (!c) return;
+  for(i=0;i<256;i++) table[i]=gf_mul(c,i);
+  for(i=0;i<len;i++) out[i]^=table[in[i]];
+}
+
+/*
+  Compute parity shard parity_index (counting from 0) of data, which is
+  data_count shards of shard_size bytes, into parity.
+*/
+int fec_parity(const unsigned char *data,int data_count,int shard_size,
+	       int parity_index,unsigned char *parity)
+{
+  int i;
+  if (data_count<1||parity_index<0
+      ||data_count+parity_index>=FEC_MAX_SHARDS) return -1;
+  pthread_once(&gf_once,gf_init);
+  bzero(parity,shard_size);
+  for(i=0;i<data_count;i++)
+    gf_mul_add(parity,&data[i*shard_size],
+	       fec_coefficient(data_count,parity_index,i),shard_size);
+  return 0;
+}
+
+/*
+  Rebuild the data_count data shards into out (data_count*shard_size bytes)
+  from the shards received, indexed by shard number, with NULL for those
+  missing.  Returns -1 if fewer than data_count shards were received.
+*/
+int fec_reconstruct(unsigned char *shards[FEC_MAX_SHARDS],int data_count,
+		    int shard_size,unsigned char *out)
+{
+  int missing[FEC_MAX_SHARDS],parity[FEC_MAX_SHARDS];
+  int m=0,p=0;
+  int i,j,k;
+
+  if (data_count<1||data_count>FEC_MAX_SHARDS) return -1;
+  for(i=0;i<data_count;i++)
+    if (shards[i]) bcopy(shards[i],&out[i*shard_size],shard_size);
+    else missing[m++]=i;
+  if (!m) return 0;
+  for(i=data_count;i<FEC_MAX_SHARDS&&p<m;i++)
+    if (shards[i]) parity[p++]=i-data_count;
+  if (p<m) return -1;
+  pthread_once(&gf_once,gf_init);
+
+  /*
+    Each parity shard, less the contribution of the data shards we have, is
+    a combination of the missing ones: r = A d, with A the m x m submatrix of
+    the Cauchy matrix for the parity shards used and the missing data shards.
+  */
+  unsigned char a[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+  unsigned char inverse[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+  unsigned char *r=malloc(m*shard_size);
+  if (!r) return -1;
+  for(j=0;j<m;j++) {
+    bcopy(shards[data_count+parity[j]],&r[j*shard_size],shard_size);
+    for(i=0;i<data_count;i++)
+      if (shards[i])
+	gf_mul_add(&r[j*shard_size],&out[i*shard_size],
+		   fec_coefficient(data_count,parity[j],i),shard_size);
+    for(k=0;k<m;k++) {
+      a[j][k]=fec_coefficient(data_count,parity[j],missing[k]);
+      inverse[j][k]=(j==k);
+    }
+  }
+
+  // Gauss-Jordan elimination.  A is a Cauchy matrix, so never singular.
+  for(k=0;k<m;k++) {
+    for(j=k;j<m&&!a[j][k];j++) continue;
+    if (j==m) { free(r); return -1; }
+    if (j!=k)
+      for(i=0;i<m;i++) {
+	unsigned char t=a[j][i]; a[j][i]=a[k][i]; a[k][i]=t;
+	t=inverse[j][i]; inverse[j][i]=inverse[k][i]; inverse[k][i]=t;
+      }
+    unsigned char scale=gf_inv(a[k][k]);
+    for(i=0;i<m;i++) {
+      a[k][i]=gf_mul(a[k][i],scale);
+      inverse[k][i]=gf_mul(inverse[k][i],scale);
+    }
+    for(j=0;j<m;j++)
+      if (j!=k&&a[j][k]) {
+	unsigned char c=a[j][k];
+	for(i=0;i<m;i++) {
+	  a[j][i]^=gf_mul(c,a[k][i]);
+	  inverse[j][i]^=gf_mul(c,inverse[k][i]);
+	}
+      }
+  }
+
+  for(k=0;k<m;k++) {
+    unsigned char *d=&out[missing[k]*shard_size];
+    bzero(d,shard_size);
+    for(j=0;j<m;j++) gf_mul_add(d,&r[j*shard_size],inverse[k][j],shard_size);
+  }
+  free(r);
+  return 0;
+}
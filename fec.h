@@ -0,0 +1,22 @@
+/*
+  Forward error correction over the fragments of a message.
+
+  The message is cut into data_count shards of shard_size bytes (the last
+  zero padded), and parity shard j is the sum over GF(2^8) of the data shards
+  weighted by row j of a Cauchy matrix.  Every square submatrix of a Cauchy
+  matrix is invertible, so any data_count of the data and parity shards are
+  enough to rebuild the message, however many parity shards were sent.
+  Shards are numbered as fragments are: data shards from 0, then parity
+  shards from data_count.  Any number of parity shards can be computed
+  without the others, and any subset of them sent.
+*/
+
+#define FEC_MAX_SHARDS 64
+
+// Parity fragments carry the length of the box, big-endian, before the shard
+#define FEC_LENGTH_BYTES 2
+
+int fec_parity(const unsigned char *data,int data_count,int shard_size,
+	       int parity_index,unsigned char *parity);
+int fec_reconstruct(unsigned char *shards[FEC_MAX_SHARDS],int data_count,
+		    int shard_size,unsigned char *out);
@@ -0,0 +1,209 @@
+/*
+  Erasure recovery checks for the parity fragments of fec.c.
+
+  Shards are rebuilt from every way of losing as many of them as there are
+  parity shards, and whole messages are encrypted, fragmented, and then
+  decrypted after fragments are dropped, in both fragment encodings.
+  Losing one fragment more than there is parity for must leave the message
+  incomplete.  The largest message fragment_payload_bytes() allows must fit
+  in the fragments it was asked about, and no more.
+
+  Usage: fectest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "crypto_box.h"
+#include "crypto_scalarmult_curve25519.h"
+#include "fec.h"
+#include "reassembly.h"
+#include "crypto.h"
+
+#define SHARD_SIZE 37
+#define MESSAGE_BYTES 700
+#define MTU 160
+
+int failures=0;
+
+void check(int ok,const char *what)
+{
+  if (!ok) {
+    fprintf(stderr,"FAIL: %s\n",what);
+    failures++;
+  }
+}
+
+/*
+  Rebuild data_count shards with parity_count parity shards, for every set
+  of lost shards, data or parity, of up to one more than there is parity
+  for.
+*/
+void check_shards(int data_count,int parity_count)
+{
+  int total=data_count+parity_count;
+  unsigned char *data=malloc(total*SHARD_SIZE);
+  unsigned char *out=malloc(data_count*SHARD_SIZE);
+  int i,lost;
+  char what[1024];
+
+  for(i=0;i<data_count*SHARD_SIZE;i++) data[i]=random();
+  for(i=0;i<parity_count;i++)
+    check(!fec_parity(data,data_count,SHARD_SIZE,i,
+		      &data[(data_count+i)*SHARD_SIZE]),"parity is computed");
+
+  // Each set of lost shards is a bitmap, so keep the shard counts small
+  for(lost=0;lost<(1<<total);lost++) {
+    unsigned char *shards[FEC_MAX_SHARDS];
+    int count=__builtin_popcount(lost);
+    if (count>parity_count+1) continue;
+    bzero(shards,sizeof(shards));
+    for(i=0;i<total;i++)
+      if (!(lost&(1<<i))) shards[i]=&data[i*SHARD_SIZE];
+    bzero(out,data_count*SHARD_SIZE);
+    int r=fec_reconstruct(shards,data_count,SHARD_SIZE,out);
+    if (count<=parity_count) {
+      snprintf(what,sizeof(what),"%d+%d shards rebuilt without 0x%x",
+	       data_count,parity_count,lost);
+      check(!r&&!memcmp(out,data,data_count*SHARD_SIZE),what);
+    } else {
+      snprintf(what,sizeof(what),"%d+%d shards not rebuilt without 0x%x",
+	       data_count,parity_count,lost);
+      check(r==-1,what);
+    }
+  }
+  free(data);
+  free(out);
+}
+
+/*
+  Send a message with parity fragments, lose those in lost (a bitmap of
+  fragment numbers), and deliver the rest.  Returns 1 if the message was
+  recovered intact, 0 if it was incomplete, or -1 if it was recovered wrong.
+*/
+int deliver(unsigned char *message,int len,char *pkhex,unsigned char *sk,
+	    int parity,int encoding,unsigned long long lost,int *fragment_count)
+{
+  char *fragments[MAX_FRAGMENTS];
+  *fragment_count=0;
+  if (encryptAndFragmentBufferFEC(message,len,fragments,fragment_count,MTU,
+				  pkhex,parity,encoding,0)) {
+    check(0,"message is fragmented");
+    return -1;
+  }
+
+  struct reassembly *r=reassembly_open(NULL,0);
+  struct fragment_set *f=NULL;
+  int complete=0,i;
+  for(i=0;i<*fragment_count;i++) {
+    if (!(lost&(1ULL<<i))&&!complete)
+      complete=reassembly_add(r,fragments[i],time(0),&f);
+    free(fragments[i]);
+  }
+
+  int result=0;
+  if (complete==1) {
+    unsigned char out[32768];
+    int out_len=0;
+    result=-1;
+    if (!reassembleAndDecryptBuffer(f,sk,out,&out_len)
+	&&out_len==len&&!memcmp(out,message,len)) result=1;
+  }
+  reassembly_close(r);
+  return result;
+}
+
+void check_messages(char *pkhex,unsigned char *sk,int parity,int encoding)
+{
+  unsigned char message[MESSAGE_BYTES];
+  char what[1024];
+  int i,count;
+  for(i=0;i<MESSAGE_BYTES;i++) message[i]=random();
+
+  // Find how many fragments the message takes
+  check(deliver(message,MESSAGE_BYTES,pkhex,sk,parity,encoding,0,&count)==1,
+	"message is delivered without loss");
+  int data_count=count-parity;
+
+  // Lose the first data fragments, the last ones, or a spread of them
+  unsigned long long patterns[3]={0,0,0};
+  for(i=0;i<parity;i++) {
+    patterns[0]|=1ULL<<i;
+    patterns[1]|=1ULL<<(count-1-i);
+    patterns[2]|=1ULL<<(i*data_count/parity);
+  }
+  for(i=0;i<3;i++) {
+    snprintf(what,sizeof(what),"%s message of %d+%d fragments recovered without 0x%llx",
+	     encoding==FRAGMENT_ENCODING_GSM7?"gsm7":"base64",
+	     data_count,parity,patterns[i]);
+    check(deliver(message,MESSAGE_BYTES,pkhex,sk,parity,encoding,
+		  patterns[i],&count)==1,what);
+  }
+  // One fragment too many
+  unsigned long long lost=patterns[0]|(1ULL<<parity);
+  snprintf(what,sizeof(what),"message of %d+%d fragments incomplete without 0x%llx",
+	   data_count,parity,lost);
+  check(deliver(message,MESSAGE_BYTES,pkhex,sk,parity,encoding,lost,&count)==0,
+	what);
+}
+
+// The number of fragments a message of len bytes is sent in
+int fragments_for(int len,char *pkhex,int parity,int encoding)
+{
+  unsigned char message[32768];
+  char *fragments[MAX_FRAGMENTS];
+  int count=0,i;
+  bzero(message,len);
+  if (encryptAndFragmentBufferFEC(message,len,fragments,&count,MTU,pkhex,
+				  parity,encoding,0)) return -1;
+  for(i=0;i<count;i++) free(fragments[i]);
+  return count;
+}
+
+void check_budget(char *pkhex,int parity,int encoding)
+{
+  char what[1024];
+  int count;
+  for(count=parity+1;count<=parity+8;count++) {
+    int len=fragment_payload_bytes(MTU,count,parity,encoding);
+    snprintf(what,sizeof(what),"%s budget of %d fragments with %d parity is exact",
+	     encoding==FRAGMENT_ENCODING_GSM7?"gsm7":"base64",count,parity);
+    check(len>0&&fragments_for(len,pkhex,parity,encoding)==count
+	  &&fragments_for(len+1,pkhex,parity,encoding)==count+1,what);
+  }
+}
+
+int main(int argc,char **argv)
+{
+  int d,p;
+  srandom(1);
+  for(d=1;d<=6;d++)
+    for(p=1;p<=4;p++) check_shards(d,p);
+
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+  unsigned char pk[crypto_box_PUBLICKEYBYTES];
+  char pkhex[crypto_box_PUBLICKEYBYTES*2+1];
+  bcopy(private_key_from_passphrase("fectest"),sk,crypto_box_SECRETKEYBYTES);
+  crypto_scalarmult_curve25519_base(pk,sk);
+  for(d=0;d<crypto_box_PUBLICKEYBYTES;d++) sprintf(&pkhex[d*2],"%02x",pk[d]);
+
+  for(p=1;p<=3;p++) {
+    check_messages(pkhex,sk,p,FRAGMENT_ENCODING_BASE64);
+    check_messages(pkhex,sk,p,FRAGMENT_ENCODING_GSM7);
+  }
+  for(p=0;p<=3;p++) {
+    check_budget(pkhex,p,FRAGMENT_ENCODING_BASE64);
+    check_budget(pkhex,p,FRAGMENT_ENCODING_GSM7);
+  }
+
+  if (failures) {
+    fprintf(stderr,"%d erasure recovery checks failed\n",failures);
+    return 1;
+  }
+  printf("Erasure recovery checks passed.\n");
+  return 0;
+}
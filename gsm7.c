@@ -0,0 +1,146 @@
+/*
+  Dense text encoding of fragment data for SMS, in the GSM 03.38 default
+  alphabet.  See gsm7.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "gsm7.h"
+
+/*
+  The basic alphabet in GSM order, as Unicode, with 0 for the characters
+  left out: line feed (0x0a), carriage return (0x0d), escape (0x1b) and
+  space (0x20).  Digit values are positions in what remains.
+*/
+static const unsigned short gsm7_alphabet[128]={
+  '@',0xa3,'$',0xa5,0xe8,0xe9,0xf9,0xec,0xf2,0xc7,0,0xd8,0xf8,0,0xc5,0xe5,
+  0x394,'_',0x3a6,0x393,0x39b,0x3a9,0x3a0,0x3a8,0x3a3,0x398,0x39e,0,0xc6,0xe6,0xdf,0xc9,
+  0,'!','"','#',0xa4,'%','&','\'','(',')','*','+',',','-','.','/',
+  '0','1','2','3','4','5','6','7','8','9',':',';','<','=','>','?',
+  0xa1,'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O',
+  'P','Q','R','S','T','U','V','W','X','Y','Z',0xc4,0xd6,0xd1,0xdc,0xa7,
+  0xbf,'a','b','c','d','e','f','g','h','i','j','k','l','m','n','o',
+  'p','q','r','s','t','u','v','w','x','y','z',0xe4,0xf6,0xf1,0xfc,0xe0
+};
+
+// Every character of the alphabet is below U+0400
+#define GSM7_MAX_CODE_POINT 0x400
+
+// Smallest number of digits that can hold each number of bytes of a block
+static const int gsm7_block_chars[GSM7_BLOCK_BYTES+1]={
+  0,2,3,4,5,6,7,9,10,11,12,13,14,15
+};
+
+static unsigned short gsm7_digits[GSM7_RADIX];
+static signed char gsm7_values[GSM7_MAX_CODE_POINT];
+static pthread_once_t gsm7_once=PTHREAD_ONCE_INIT;
+
+static void gsm7_init()
+{
+  int i,d=0;
+  memset(gsm7_values,-1,sizeof(gsm7_values));
+  for(i=0;i<128;i++)
+    if (gsm7_alphabet[i]) {
+      gsm7_digits[d]=gsm7_alphabet[i];
+      gsm7_values[gsm7_alphabet[i]]=d++;
+    }
+}
+
+static void gsm7_put(char *out,int *out_offset,unsigned short c)
+{
+  if (c<0x80) out[(*out_offset)++]=c;
+  else {
+    out[(*out_offset)++]=0xc0|(c>>6);
+    out[(*out_offset)++]=0x80|(c&0x3f);
+  }
+}
+
+// Read one character, returning its digit value, or -1 if it is not one
+static int gsm7_get(const unsigned char **in)
+{
+  const unsigned char *s=*in;
+  int c;
+  if (s[0]<0x80) { c=s[0]; *in=s+1; }
+  else if ((s[0]&0xe0)==0xc0&&(s[1]&0xc0)==0x80) {
+    c=((s[0]&0x1f)<<6)|(s[1]&0x3f);
+    *in=s+2;
+  } else return -1;
+  return c<GSM7_MAX_CODE_POINT?gsm7_values[c]:-1;
+}
+
+/*
+  Append count bytes to out at *out_offset, as for base64_append().  out
+  needs room for two bytes per character.
+*/
+int gsm7_append(char *out,int *out_offset,unsigned char *bytes,int count)
+{
+  pthread_once(&gsm7_once,gsm7_init);
+  int i;
+  for(i=0;i<count;i+=GSM7_BLOCK_BYTES) {
+    int n=count-i<GSM7_BLOCK_BYTES?count-i:GSM7_BLOCK_BYTES;
+    int chars=gsm7_block_chars[n];
+    unsigned char block[GSM7_BLOCK_BYTES];
+    int digits[GSM7_BLOCK_CHARS];
+    int j,k;
+    bcopy(&bytes[i],block,n);
+    // Long division of the block, taken as a big-endian number, by the radix
+    for(k=chars-1;k>=0;k--) {
+      int remainder=0;
+      for(j=0;j<n;j++) {
+	int v=(remainder<<8)|block[j];
+	block[j]=v/GSM7_RADIX;
+	remainder=v%GSM7_RADIX;
+      }
+      digits[k]=remainder;
+    }
+    for(k=0;k<chars;k++) gsm7_put(out,out_offset,gsm7_digits[digits[k]]);
+  }
+  return 0;
+}
+
+/*
+  Append the bytes encoded in the string in to out at *out_len.  Returns -1
+  if in holds anything but characters of the alphabet, or a short block that
+  no number of bytes encodes to.
+*/
+int gsm7_extract(char *in,unsigned char *out,int *out_len)
+{
+  pthread_once(&gsm7_once,gsm7_init);
+  const unsigned char *s=(const unsigned char *)in;
+  while(*s) {
+    int digits[GSM7_BLOCK_CHARS];
+    int chars=0,n,j,k;
+    while(*s&&chars<GSM7_BLOCK_CHARS) {
+      digits[chars]=gsm7_get(&s);
+      if (digits[chars++]<0) return -1;
+    }
+    for(n=GSM7_BLOCK_BYTES;n>0&&gsm7_block_chars[n]!=chars;n--) continue;
+    if (!n) return -1;
+    unsigned char *block=&out[*out_len];
+    bzero(block,n);
+    for(k=0;k<chars;k++) {
+      int carry=digits[k];
+      for(j=n-1;j>=0;j--) {
+	int v=block[j]*GSM7_RADIX+carry;
+	block[j]=v&0xff;
+	carry=v>>8;
+      }
+      if (carry) return -1;
+    }
+    (*out_len)+=n;
+  }
+  return 0;
+}
+
+// The number of bytes that chars characters can hold
+int gsm7_bytes_in_chars(int chars)
+{
+  int bytes=chars/GSM7_BLOCK_CHARS*GSM7_BLOCK_BYTES;
+  int n=GSM7_BLOCK_BYTES;
+  while(n>0&&gsm7_block_chars[n]>chars%GSM7_BLOCK_CHARS) n--;
+  return bytes+n;
+}
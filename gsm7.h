@@ -0,0 +1,22 @@
+/*
+  Dense text encoding of fragment data for SMS.
+
+  An SMS carries 160 characters of the GSM 03.38 default alphabet, at seven
+  bits each, where base64 uses only six.  Leaving out the escape character,
+  and line feed, carriage return and space (which do not survive every path
+  a fragment takes), leaves 124 characters of the basic alphabet.  Blocks of
+  13 bytes are written as 15 base-124 digits, and a short last block of n
+  bytes takes the fewest digits that can hold it, so that every byte count
+  has its own digit count.  That is 6.93 bits per character.
+
+  Characters outside ASCII are written as UTF-8, so a fragment of mtu
+  characters may take up to twice as many bytes.
+*/
+
+#define GSM7_RADIX 124
+#define GSM7_BLOCK_BYTES 13
+#define GSM7_BLOCK_CHARS 15
+
+int gsm7_append(char *out,int *out_offset,unsigned char *bytes,int count);
+int gsm7_extract(char *in,unsigned char *out,int *out_len);
+int gsm7_bytes_in_chars(int chars);
@@ -0,0 +1,455 @@
+/*
+  Continuous ingestion of succinct data fragments.
+
+  Rather than running "smac recipe decrypt" and "smac recipe decompress" over
+  whole directories from cron, "smac recipe ingest" watches an inbox
+  directory with inotify, and pushes each fragment through reassembly,
+  decryption and decompression into the record store as soon as its set is
+  complete.  Messages completed by the same read of the event queue are
+  decrypted together, spread over all of the CPUs.  The private key, the
+  stats.dat tree and the recipes (with their compiled templates and record
+  stores) stay resident for the life of the process.
+
+  Fragment files are left in the inbox until their message has been
+  delivered, when the files that were read for it are removed, and parity
+  fragments that arrive after that are removed too.  Partial sets are also kept in <output>/reassembly.journal, so
+  after a restart only fragment files that are not already in the journal
+  are read.  Messages that cannot be decompressed are kept in
+  <output>/failed.
+
+  The time spent in each stage, and the depth of the queues feeding them, are
+  written to <output>/ingest.stats every INGEST_REPORT_INTERVAL seconds, on
+  SIGUSR1, and on exit.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "reassembly.h"
+#include "crypto.h"
+
+#define INGEST_REPORT_INTERVAL 60
+#define INGEST_FILE_BUCKETS 4096
+
+#define INGEST_STAGE_READ 0
+#define INGEST_STAGE_DECRYPT 1
+#define INGEST_STAGE_DECOMPRESS 2
+#define INGEST_STAGE_DELIVERY 3 // from arrival of the last fragment to stored
+#define INGEST_STAGES 4
+
+struct ingest_stage {
+  char *name;
+  long long count;
+  long long total_us;
+  long long max_us;
+};
+
+// The inbox files holding the fragments of a message not yet delivered
+struct ingest_files {
+  char prefix[16];
+  char **names;
+  int count;
+  time_t last_added;
+  struct ingest_files *next;   // in hash bucket
+};
+
+struct ingest_state {
+  stats_handle *h;
+  char *recipe_dir;
+  char *inbox;
+  char *output_dir;
+  unsigned char *sk;
+
+  struct ingest_stage stages[INGEST_STAGES];
+  long long fragments;
+  long long messages;
+  long long failures;
+  int event_backlog;     // events returned by the last read of the inotify queue
+  int max_event_backlog;
+  long long deliver_us;  // spent delivering messages during the current flush
+  time_t started;
+  struct ingest_files *files[INGEST_FILE_BUCKETS];
+};
+
+static volatile sig_atomic_t ingest_stop=0;
+static volatile sig_atomic_t ingest_report=0;
+
+static void ingest_signal(int sig)
+{
+  if (sig==SIGUSR1) ingest_report=1; else ingest_stop=1;
+}
+
+static long long ingest_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_usec+tv.tv_sec*1000000LL;
+}
+
+static void ingest_account(struct ingest_state *s,int stage,long long us)
+{
+  if (us<0) us=0;
+  s->stages[stage].count++;
+  s->stages[stage].total_us+=us;
+  if (us>s->stages[stage].max_us) s->stages[stage].max_us=us;
+}
+
+static int ingest_write_stats(struct ingest_state *s)
+{
+  char filename[1024],temp[1024+5];
+  snprintf(filename,1024,"%s/ingest.stats",s->output_dir);
+  snprintf(temp,sizeof(temp),"%s.tmp",filename);
+  FILE *f=fopen(temp,"w");
+  if (!f) return -1;
+  fprintf(f,"uptime %lld s\n",(long long)(time(0)-s->started));
+  fprintf(f,"fragments %lld\n",s->fragments);
+  fprintf(f,"messages %lld\n",s->messages);
+  fprintf(f,"failures %lld\n",s->failures);
+  fprintf(f,"pending-sets %d\n",fragment_pending_sets());
+  fprintf(f,"event-backlog %d (max %d)\n",s->event_backlog,s->max_event_backlog);
+  fprintf(f,"%-12s %10s %12s %12s\n","stage","count","mean-us","max-us");
+  int i;
+  for(i=0;i<INGEST_STAGES;i++) {
+    struct ingest_stage *st=&s->stages[i];
+    fprintf(f,"%-12s %10lld %12lld %12lld\n",st->name,st->count,
+	    st->count?st->total_us/st->count:0,st->max_us);
+  }
+  fclose(f);
+  return rename(temp,filename);
+}
+
+static struct ingest_files **ingest_files_find(struct ingest_state *s,
+					       const char *prefix)
+{
+  unsigned int h=2166136261U;
+  const char *p;
+  for(p=prefix;*p;p++) h=(h^(unsigned char)*p)*16777619U;
+  struct ingest_files **f=&s->files[h%INGEST_FILE_BUCKETS];
+  while(*f&&strcmp((*f)->prefix,prefix)) f=&(*f)->next;
+  return f;
+}
+
+static void ingest_files_free(struct ingest_files *f)
+{
+  int i;
+  for(i=0;i<f->count;i++) free(f->names[i]);
+  free(f->names);
+  free(f);
+}
+
+// Remember that the inbox file name holds a fragment of message prefix
+static void ingest_add_file(struct ingest_state *s,const char *prefix,char *name)
+{
+  struct ingest_files **p=ingest_files_find(s,prefix);
+  struct ingest_files *f=*p;
+  int i;
+  if (!f) {
+    f=calloc(sizeof(struct ingest_files),1);
+    if (!f) return;
+    snprintf(f->prefix,sizeof(f->prefix),"%s",prefix);
+    *p=f;
+  }
+  f->last_added=time(0);
+  // The same file may be reported more than once
+  for(i=0;i<f->count;i++) if (!strcmp(f->names[i],name)) return;
+  char **names=realloc(f->names,(f->count+1)*sizeof(char *));
+  if (!names) return;
+  f->names=names;
+  if ((f->names[f->count]=strdup(name))) f->count++;
+}
+
+// Remove the fragment files of a delivered message from the inbox
+static void ingest_remove_fragments(struct ingest_state *s,char *prefix)
+{
+  char filename[1024];
+  struct ingest_files **p=ingest_files_find(s,prefix);
+  struct ingest_files *f=*p;
+  int i;
+  if (!f) return;
+  for(i=0;i<f->count;i++) {
+    snprintf(filename,1024,"%s/%s",s->inbox,f->names[i]);
+    unlink(filename);
+  }
+  *p=f->next;
+  ingest_files_free(f);
+}
+
+/*
+  Forget the files of messages that have not grown for longer than
+  reassembly keeps them, and so have expired.  Their files stay in the inbox.
+*/
+static void ingest_forget_files(struct ingest_state *s,time_t now)
+{
+  int b;
+  for(b=0;b<INGEST_FILE_BUCKETS;b++) {
+    struct ingest_files **p=&s->files[b];
+    while(*p) {
+      struct ingest_files *f=*p;
+      if (now-f->last_added>REASSEMBLY_DEFAULT_EXPIRY) {
+	*p=f->next;
+	ingest_files_free(f);
+      } else p=&f->next;
+    }
+  }
+}
+
+// Keep a message that could not be decompressed, so that it is not lost
+static void ingest_keep_failed(struct ingest_state *s,char *prefix,
+			       unsigned char *message,int len)
+{
+  char filename[1024];
+  snprintf(filename,1024,"%s/failed",s->output_dir);
+  mkdir(filename,0777);
+  snprintf(filename,1024,"%s/failed/%s.out",s->output_dir,prefix);
+  FILE *f=fopen(filename,"w");
+  if (!f) return;
+  if (fwrite(message,len,1,f)!=1)
+    fprintf(stderr,"Could not write failed message to '%s'\n",filename);
+  fclose(f);
+}
+
+static int ingest_fragment_file(struct ingest_state *s,char *name)
+{
+  if (name[0]=='.'||strlen(name)<10) return 0;
+  long long start=ingest_time_us();
+  char filename[1024];
+  snprintf(filename,1024,"%s/%s",s->inbox,name);
+  // Already journalled, or part of a message already delivered, such as
+  // a parity fragment that was not needed
+  char prefix[16];
+  switch(fragment_known(name)) {
+  case 2: unlink(filename); return 0;
+  case 1:
+    // Read before a restart, and held in the journal by the name's prefix
+    snprintf(prefix,sizeof(prefix),"%.8s",&name[2]);
+    ingest_add_file(s,prefix,name);
+    return 0;
+  }
+
+  struct stat st;
+  if (stat(filename,&st)||!S_ISREG(st.st_mode)) return 0;
+  FILE *f=fopen(filename,"r");
+  if (!f) return 0;
+  char fragment[32768];
+  int r=fread(fragment,1,sizeof(fragment)-1,f);
+  fclose(f);
+  if (r<0) r=0;
+  fragment[r]=0;
+  // Ignore trailing white space left by whatever delivered the fragment
+  while(r>0&&(unsigned char)fragment[r-1]<=' ') fragment[--r]=0;
+  // The file name need not be the fragment's header, so look again
+  if (fragment_known(fragment)==2) { unlink(filename); return 0; }
+  s->fragments++;
+  long long arrived=st.st_mtim.tv_sec*1000000LL+st.st_mtim.tv_nsec/1000;
+  long long now=ingest_time_us();
+  ingest_account(s,INGEST_STAGE_READ,now-start);
+
+  int queued=fragment_queue(fragment,arrived);
+  if (queued<0) {
+    fprintf(stderr,"Could not use fragment '%s'\n",name);
+    s->failures++;
+  } else {
+    // The message is known by the prefix in the fragment, whatever the
+    // file is called
+    snprintf(prefix,sizeof(prefix),"%.8s",&fragment[2]);
+    ingest_add_file(s,prefix,name);
+  }
+  return queued;
+}
+
+// Decompress and store a message decrypted by fragment_flush()
+static void ingest_deliver(void *context,char *prefix,int frag_count,
+			   long long arrived,unsigned char *message,int len)
+{
+  struct ingest_state *s=context;
+  if (len<0) {
+    // The fragments stay in the inbox, as for a malformed fragment
+    fprintf(stderr,"Could not decrypt message %s\n",prefix);
+    s->failures++;
+    return;
+  }
+  long long start=ingest_time_us();
+  // A message may hold several records, of at least three bytes each
+  int max_records=len/3+1;
+  unsigned char *records[max_records];
+  int lengths[max_records];
+  int count=record_container_unpack(message,len,records,lengths,max_records);
+  int i;
+  for(i=0;i<count;i++) {
+    char name[64];
+    if (count==1) snprintf(name,64,"%s",prefix);
+    else snprintf(name,64,"%s-%d",prefix,i);
+    if (recipe_decompress_message(s->h,s->recipe_dir,records[i],lengths[i],
+				  s->output_dir,name)<0) {
+      fprintf(stderr,"Could not decompress message %s: %s",name,recipe_error);
+      ingest_keep_failed(s,name,records[i],lengths[i]);
+      s->failures++;
+    } else
+      s->messages++;
+  }
+  long long now=ingest_time_us();
+  ingest_account(s,INGEST_STAGE_DECOMPRESS,now-start);
+  ingest_account(s,INGEST_STAGE_DELIVERY,now-arrived);
+  s->deliver_us+=now-start;
+
+  ingest_remove_fragments(s,prefix);
+}
+
+/*
+  Decrypt the messages completed so far, a batch at a time, so that they are
+  spread over all of the CPUs.  Each message is charged an equal share of the
+  time its batch took to decrypt.
+*/
+static void ingest_flush(struct ingest_state *s)
+{
+  while(fragment_queued()) {
+    long long start=ingest_time_us();
+    s->deliver_us=0;
+    int count=fragment_flush(s->sk,ingest_deliver,s);
+    if (count<1) break;
+    long long decrypt_us=ingest_time_us()-start-s->deliver_us;
+    int i;
+    for(i=0;i<count;i++) ingest_account(s,INGEST_STAGE_DECRYPT,decrypt_us/count);
+  }
+}
+
+int ingest_run(stats_handle *h,char *recipe_dir,char *inbox,char *output_dir,
+	       char *passphrase)
+{
+  struct ingest_state s;
+  bzero(&s,sizeof(s));
+  s.h=h;
+  s.recipe_dir=recipe_dir;
+  s.inbox=inbox;
+  s.output_dir=output_dir;
+  s.started=time(0);
+  s.stages[INGEST_STAGE_READ].name="read";
+  s.stages[INGEST_STAGE_DECRYPT].name="decrypt";
+  s.stages[INGEST_STAGE_DECOMPRESS].name="decompress";
+  s.stages[INGEST_STAGE_DELIVERY].name="delivery";
+
+  s.sk=private_key_from_passphrase(passphrase);
+  if (!s.sk) {
+    fprintf(stderr,"Failed to read passphrase\n");
+    return -1;
+  }
+  mkdir(output_dir,0777);
+  char journal[1024];
+  snprintf(journal,1024,"%s/reassembly.journal",output_dir);
+  if (fragment_reassembly_open(journal)) {
+    fprintf(stderr,"Could not open reassembly journal '%s'\n",journal);
+    return -1;
+  }
+
+  int fd=inotify_init();
+  if (fd<0||inotify_add_watch(fd,inbox,IN_CLOSE_WRITE|IN_MOVED_TO)<0) {
+    perror("Could not watch inbox directory");
+    if (fd>=0) close(fd);
+    return -1;
+  }
+
+  signal(SIGINT,ingest_signal);
+  signal(SIGTERM,ingest_signal);
+  signal(SIGUSR1,ingest_signal);
+
+  // Fragments that arrived while we were not running.  Anything arriving
+  // from now on will also be reported by inotify, but reading a fragment
+  // twice is harmless.
+  DIR *d=opendir(inbox);
+  if (d) {
+    struct dirent *de;
+    while((de=readdir(d))) {
+      ingest_fragment_file(&s,de->d_name);
+      if (fragment_queued()>=FRAGMENT_BATCH_SIZE) ingest_flush(&s);
+    }
+    closedir(d);
+  }
+  ingest_flush(&s);
+  fprintf(stderr,"Watching '%s' for fragments\n",inbox);
+
+  time_t last_report=time(0);
+  char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while(!ingest_stop) {
+    struct pollfd p;
+    p.fd=fd;
+    p.events=POLLIN;
+    int n=poll(&p,1,1000);
+    if (n<0&&errno!=EINTR) {
+      perror("poll");
+      break;
+    }
+    if (n>0) {
+      int len=read(fd,events,sizeof(events));
+      if (len<0&&errno!=EINTR) {
+	perror("read");
+	break;
+      }
+      int count=0;
+      int i;
+      for(i=0;i<len;) {
+	struct inotify_event *e=(struct inotify_event *)&events[i];
+	i+=sizeof(struct inotify_event)+e->len;
+	count++;
+      }
+      s.event_backlog=count;
+      if (count>s.max_event_backlog) s.max_event_backlog=count;
+      for(i=0;i<len;) {
+	struct inotify_event *e=(struct inotify_event *)&events[i];
+	i+=sizeof(struct inotify_event)+e->len;
+	if (e->mask&IN_Q_OVERFLOW) {
+	  // Events were lost, so look at everything in the inbox again
+	  fprintf(stderr,"inotify queue overflowed: rescanning inbox\n");
+	  d=opendir(inbox);
+	  if (d) {
+	    struct dirent *de;
+	    while((de=readdir(d))) {
+	      ingest_fragment_file(&s,de->d_name);
+	      if (fragment_queued()>=FRAGMENT_BATCH_SIZE) ingest_flush(&s);
+	    }
+	    closedir(d);
+	  }
+	} else if (e->len)
+	  ingest_fragment_file(&s,e->name);
+	if (fragment_queued()>=FRAGMENT_BATCH_SIZE) ingest_flush(&s);
+      }
+      // Messages completed by this read of the event queue
+      ingest_flush(&s);
+    }
+    if (ingest_report||time(0)-last_report>=INGEST_REPORT_INTERVAL) {
+      ingest_forget_files(&s,time(0));
+      ingest_write_stats(&s);
+      ingest_report=0;
+      last_report=time(0);
+    }
+  }
+
+  ingest_write_stats(&s);
+  close(fd);
+  int b;
+  for(b=0;b<INGEST_FILE_BUCKETS;b++)
+    while(s.files[b]) {
+      struct ingest_files *f=s.files[b];
+      s.files[b]=f->next;
+      ingest_files_free(f);
+    }
+  fprintf(stderr,"Ingested %lld messages from %lld fragments (%lld failures)\n",
+	  s.messages,s.fragments,s.failures);
+  return 0;
+}
@@ -0,0 +1,318 @@
+/*
+  Location field codecs for succinct data recipes.
+
+  A LATLONG field with nothing after its precision is coded against the whole
+  globe, with a precision of 16 (whole degrees) or 34 (~1m) bits, as it always
+  has been.  Deployments that only ever see one country can instead give a
+  bounding box after the precision, e.g.
+
+  gps:geopoint:0:0:20:box=-44.0,112.5,-10.0,154.0
+
+  as south, west, north and east edges in degrees.  West may be greater than
+  east for a box spanning the antimeridian.  A location that is usually close
+  to another one in the same record can be coded as an offset from it, e.g.
+
+  household:geopoint:0:0:16:near=gps,0.05
+
+  which codes household within 0.05 degrees either side of gps (which must be
+  an earlier location field in the same repeat group).  Both may be given,
+  separated by a semicolon, in which case values outside the window are coded
+  against the box.
+
+  In these forms the precision is the number of bits for each coordinate
+  within the box or window, and so the resolution is its size divided by
+  2^precision.  A flag, heavily skewed towards "inside", precedes each value so
+  that stray locations are still coded, against the whole globe.  A near field
+  whose reference is absent is coded against its box, or the globe.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "latlong.h"
+
+// ~1m resolution when coding against the whole globe
+#define LATLONG_GLOBE_SCALE 112000
+
+struct latlong_area {
+  double south;
+  double west;
+  double height;
+  double width;
+};
+
+static unsigned int latlong_inside_frequency=LATLONG_INSIDE_FREQUENCY;
+
+static int latlong_parse(const char *value,double *lat,double *lon)
+{
+  // Allow space or comma between LAT and LONG
+  if ((sscanf(value,"%lf %lf",lat,lon)!=2)
+      &&(sscanf(value,"%lf,%lf",lat,lon)!=2))
+    return -1;
+  if (*lat<-90||*lat>90||*lon<-180||*lon>180) return -1;
+  return 0;
+}
+
+int latlong_parse_options(struct field *field,char *options,
+			  char *reference,int reference_size)
+{
+  char option[1024];
+  int o=0,i;
+
+  reference[0]=0;
+  for(i=0;i<=strlen(options);i++) {
+    if (options[i]!=';'&&options[i]!=0) {
+      if (o<1000) option[o++]=options[i];
+      continue;
+    }
+    option[o]=0; o=0;
+    if (!option[0]) continue;
+    double s,w,n,e;
+    char name[1024];
+    if (sscanf(option,"box=%lf,%lf,%lf,%lf",&s,&w,&n,&e)==4) {
+      if (s<-90||n>90||s>=n||w<-180||w>180||e<-180||e>180||w==e) {
+	snprintf(recipe_error,1024,"LATLONG field '%.480s' has an invalid box '%.480s'.\n",
+		 field->name,option);
+	return -1;
+      }
+      field->latlong_box=1;
+      field->latlong_bounds[0]=s;
+      field->latlong_bounds[1]=w;
+      field->latlong_bounds[2]=n;
+      field->latlong_bounds[3]=e;
+    } else if (sscanf(option,"near=%[^,],%lf",name,&w)==2) {
+      if (w<=0||w>90) {
+	snprintf(recipe_error,1024,"LATLONG field '%s' has an invalid window of %f degrees.\n",
+		 field->name,w);
+	return -1;
+      }
+      snprintf(reference,reference_size,"%s",name);
+      field->latlong_window=w;
+    } else {
+      snprintf(recipe_error,1024,"LATLONG field '%.480s' has unknown option '%.480s'.\n",
+	       field->name,option);
+      return -1;
+    }
+  }
+  if (field->precision<1||field->precision>LATLONG_MAXIMUM_BITS) {
+    snprintf(recipe_error,1024,"LATLONG field '%s' with a box or reference must have a precision of 1 to %d bits.\n",
+	     field->name,LATLONG_MAXIMUM_BITS);
+    return -1;
+  }
+  return 0;
+}
+
+static void latlong_box_area(struct field *field,struct latlong_area *a)
+{
+  a->south=field->latlong_bounds[0];
+  a->west=field->latlong_bounds[1];
+  a->height=field->latlong_bounds[2]-field->latlong_bounds[0];
+  a->width=field->latlong_bounds[3]-field->latlong_bounds[1];
+  if (a->width<0) a->width+=360;
+}
+
+static void latlong_window_area(struct field *field,double lat,double lon,
+				struct latlong_area *a)
+{
+  a->south=lat-field->latlong_window;
+  a->west=lon-field->latlong_window;
+  a->height=2*field->latlong_window;
+  a->width=2*field->latlong_window;
+}
+
+// Enough decimal places to show a step of the given size
+static int latlong_decimals(double step)
+{
+  int d=0;
+  double unit=1;
+  while(d<10&&unit>step/2) { unit/=10; d++; }
+  return d;
+}
+
+static int latlong_format_area(struct latlong_area *a,int bits,
+			       int nlat,int nlon,char *out,int out_size)
+{
+  double steps=(1<<bits)-1;
+  double lat=a->south+nlat*a->height/steps;
+  double lon=a->west+nlon*a->width/steps;
+  if (lon>180) lon-=360;
+  if (lon<-180) lon+=360;
+  return snprintf(out,out_size,"%.*f %.*f",
+		  latlong_decimals(a->height/steps),lat,
+		  latlong_decimals(a->width/steps),lon);
+}
+
+// Quantise a location within an area, returning 0 if it lies outside it
+static int latlong_quantise(struct latlong_area *a,int bits,double lat,double lon,
+			    int *nlat,int *nlon)
+{
+  double steps=(1<<bits)-1;
+  double dlat=lat-a->south;
+  double dlon=fmod(lon-a->west+720,360);
+  if (dlat<0||dlat>a->height||dlon>a->width) return 0;
+  *nlat=lround(dlat/a->height*steps);
+  *nlon=lround(dlon/a->width*steps);
+  return 1;
+}
+
+static int latlong_encode_area(range_coder *c,struct latlong_area *a,int bits,
+			       double lat,double lon,char *decoded,int decoded_size)
+{
+  int nlat,nlon;
+  if (!latlong_quantise(a,bits,lat,lon,&nlat,&nlon)) {
+    range_encode_symbol(c,&latlong_inside_frequency,2,1);
+    return 0;
+  }
+  range_encode_symbol(c,&latlong_inside_frequency,2,0);
+  range_encode_equiprobable(c,1<<bits,nlat);
+  range_encode_equiprobable(c,1<<bits,nlon);
+  if (decoded) latlong_format_area(a,bits,nlat,nlon,decoded,decoded_size);
+  return 1;
+}
+
+static int latlong_decode_area(range_coder *c,struct latlong_area *a,int bits,
+			       char *value,int value_size)
+{
+  if (range_decode_symbol(c,&latlong_inside_frequency,2)) return 0;
+  int nlat=range_decode_equiprobable(c,1<<bits);
+  int nlon=range_decode_equiprobable(c,1<<bits);
+  latlong_format_area(a,bits,nlat,nlon,value,value_size);
+  return 1;
+}
+
+static int latlong_encode_globe(range_coder *c,double lat,double lon,
+				char *decoded,int decoded_size)
+{
+  int ilat=lround(lat*LATLONG_GLOBE_SCALE)+90*LATLONG_GLOBE_SCALE;
+  int ilon=lround(lon*LATLONG_GLOBE_SCALE)+180*LATLONG_GLOBE_SCALE;
+  range_encode_equiprobable(c,182*LATLONG_GLOBE_SCALE,ilat);
+  range_encode_equiprobable(c,361*LATLONG_GLOBE_SCALE,ilon);
+  if (decoded)
+    snprintf(decoded,decoded_size,"%.5f %.5f",
+	     (ilat-90*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE,
+	     (ilon-180*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE);
+  return 0;
+}
+
+static int latlong_decode_globe(range_coder *c,char *value,int value_size)
+{
+  int ilat=range_decode_equiprobable(c,182*LATLONG_GLOBE_SCALE);
+  int ilon=range_decode_equiprobable(c,361*LATLONG_GLOBE_SCALE);
+  snprintf(value,value_size,"%.5f %.5f",
+	   (ilat-90*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE,
+	   (ilon-180*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE);
+  return 0;
+}
+
+// Whole-globe coding of fields without a box or reference
+static int latlong_encode_legacy(range_coder *c,struct field *field,
+				 const char *value,char *decoded,int decoded_size)
+{
+  float lat,lon;
+  int ilat,ilon;
+  if ((sscanf(value,"%f %f",&lat,&lon)!=2)
+      &&(sscanf(value,"%f,%f",&lat,&lon)!=2))
+    return -1;
+  if (lat<-90||lat>90||lon<-180||lon>180) return -1;
+  if (field->precision==16) {
+    // gradicule resolution
+    ilat=lroundf(lat)+90; // range now 0..181 (for -90 to +90, inclusive)
+    ilon=lroundf(lon)+180; // range now 0..360 (for -180 to +180, inclusive)
+    range_encode_equiprobable(c,182,ilat);
+    range_encode_equiprobable(c,361,ilon);
+    if (decoded)
+      snprintf(decoded,decoded_size,"%.5f %.5f",(double)(ilat-90),(double)(ilon-180));
+    return 0;
+  } else if (field->precision==0||field->precision==34) {
+    // ~1m resolution
+    ilat=lroundf(lat*LATLONG_GLOBE_SCALE)+90*LATLONG_GLOBE_SCALE;
+    ilon=lroundf(lon*LATLONG_GLOBE_SCALE)+180*LATLONG_GLOBE_SCALE;
+    range_encode_equiprobable(c,182*LATLONG_GLOBE_SCALE,ilat);
+    range_encode_equiprobable(c,361*LATLONG_GLOBE_SCALE,ilon);
+    if (decoded)
+      snprintf(decoded,decoded_size,"%.5f %.5f",
+	       (ilat-90*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE,
+	       (ilon-180*LATLONG_GLOBE_SCALE)/(double)LATLONG_GLOBE_SCALE);
+    return 0;
+  }
+  snprintf(recipe_error,1024,"Illegal LATLONG precision of %d bits.  Should be 16 or 34.\n",
+	   field->precision);
+  return -1;
+}
+
+static int latlong_decode_legacy(range_coder *c,struct field *field,
+				 char *value,int value_size)
+{
+  int ilat,ilon;
+  switch(field->precision) {
+  case 0: case 34:
+    return latlong_decode_globe(c,value,value_size);
+  case 16:
+    ilat=range_decode_equiprobable(c,182); ilat-=90;
+    ilon=range_decode_equiprobable(c,361); ilon-=180;
+    snprintf(value,value_size,"%.5f %.5f",(double)ilat,(double)ilon);
+    return 0;
+  default:
+    snprintf(recipe_error,1024,"Illegal LATLONG precision of %d bits.  Should be 16 or 34.\n",
+	     field->precision);
+    return -1;
+  }
+}
+
+/*
+  Code a location.  reference is the decoded value of the field's reference
+  location in this record, or NULL if it is absent.  If decoded is not NULL, it
+  receives the text that the decoder will produce for this value, so that
+  later fields can be coded relative to it.
+*/
+int latlong_encode_field(range_coder *c,struct field *field,const char *value,
+			 const char *reference,char *decoded,int decoded_size)
+{
+  if (!field->latlong_box&&field->latlong_reference<0)
+    return latlong_encode_legacy(c,field,value,decoded,decoded_size);
+
+  double lat,lon,rlat,rlon;
+  struct latlong_area a;
+  if (latlong_parse(value,&lat,&lon)) return -1;
+  if (field->latlong_reference>=0&&reference
+      &&!latlong_parse(reference,&rlat,&rlon)) {
+    latlong_window_area(field,rlat,rlon,&a);
+    if (latlong_encode_area(c,&a,field->precision,lat,lon,decoded,decoded_size))
+      return 0;
+  }
+  if (field->latlong_box) {
+    latlong_box_area(field,&a);
+    if (latlong_encode_area(c,&a,field->precision,lat,lon,decoded,decoded_size))
+      return 0;
+  }
+  return latlong_encode_globe(c,lat,lon,decoded,decoded_size);
+}
+
+int latlong_decode_field(range_coder *c,struct field *field,
+			 const char *reference,char *value,int value_size)
+{
+  if (!field->latlong_box&&field->latlong_reference<0)
+    return latlong_decode_legacy(c,field,value,value_size);
+
+  double rlat,rlon;
+  struct latlong_area a;
+  if (field->latlong_reference>=0&&reference
+      &&!latlong_parse(reference,&rlat,&rlon)) {
+    latlong_window_area(field,rlat,rlon,&a);
+    if (latlong_decode_area(c,&a,field->precision,value,value_size)) return 0;
+  }
+  if (field->latlong_box) {
+    latlong_box_area(field,&a);
+    if (latlong_decode_area(c,&a,field->precision,value,value_size)) return 0;
+  }
+  return latlong_decode_globe(c,value,value_size);
+}
@@ -0,0 +1,20 @@
+/*
+  Location field coding for succinct data.
+
+  LATLONG fields are normally coded against the whole globe.  A recipe may
+  instead give a bounding box and/or an earlier location field of the same
+  record, in which case the precision of the field is the number of bits used
+  for each coordinate within that area.
+*/
+
+// Probability (out of 0xffffff) that a value lies within its box or window
+#define LATLONG_INSIDE_FREQUENCY 0xfc0000
+
+#define LATLONG_MAXIMUM_BITS 30
+
+int latlong_parse_options(struct field *field,char *options,
+			  char *reference,int reference_size);
+int latlong_encode_field(range_coder *c,struct field *field,const char *value,
+			 const char *reference,char *decoded,int decoded_size);
+int latlong_decode_field(range_coder *c,struct field *field,
+			 const char *reference,char *value,int value_size);
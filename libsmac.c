@@ -0,0 +1,233 @@
+/*
+  The exported interface of libsmac.  See libsmac.h.
+
+  Everything here is a thin layer over the functions that the smac command
+  uses, so that programs can compress in-process with a model they keep
+  loaded, rather than running smac for each message.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "crypto_box.h"
+#include "reassembly.h"
+#include "crypto.h"
+#include "session.h"
+#include "libsmac.h"
+
+#if SMAC_MAX_FRAGMENTS!=MAX_FRAGMENTS
+#error SMAC_MAX_FRAGMENTS must match MAX_FRAGMENTS
+#endif
+#if SMAC_ENCODING_BASE64!=FRAGMENT_ENCODING_BASE64||SMAC_ENCODING_GSM7!=FRAGMENT_ENCODING_GSM7
+#error SMAC_ENCODING_* must match FRAGMENT_ENCODING_*
+#endif
+#if SMAC_FINGERPRINT_BYTES!=STATS_FINGERPRINT_BYTES
+#error SMAC_FINGERPRINT_BYTES must match STATS_FINGERPRINT_BYTES
+#endif
+
+struct smac_defragmenter {
+  struct reassembly *r;
+  unsigned char sk[crypto_box_SECRETKEYBYTES];
+};
+
+int smac_api_version(void)
+{
+  return SMAC_API_VERSION;
+}
+
+const char *smac_error(void)
+{
+  return recipe_error;
+}
+
+smac_model *smac_model_open(const char *stats_file)
+{
+  return session_open((char *)stats_file);
+}
+
+void smac_model_close(smac_model *m)
+{
+  session_close(m);
+}
+
+int smac_model_fingerprint(smac_model *m,
+			   unsigned char fingerprint[SMAC_FINGERPRINT_BYTES])
+{
+  // Most programs never ask, so the file is only hashed the first time
+  pthread_mutex_lock(&m->lock);
+  int r=stats_fingerprint(m->h);
+  pthread_mutex_unlock(&m->lock);
+  if (r) {
+    snprintf(recipe_error,1024,"Could not fingerprint model\n");
+    return -1;
+  }
+  bcopy(m->h->fingerprint,fingerprint,SMAC_FINGERPRINT_BYTES);
+  return 0;
+}
+
+int smac_compress(smac_model *m,const char *text,int text_len,
+		  unsigned char *out,int out_size)
+{
+  if (text_len>1024) {
+    snprintf(recipe_error,1024,"Messages must be no more than 1024 bytes.\n");
+    return -1;
+  }
+  range_coder *c=range_new_coder(2048);
+  if (!c) {
+    snprintf(recipe_error,1024,"Out of memory compressing message.\n");
+    return -1;
+  }
+  pthread_mutex_lock(&m->lock);
+  int r=stats3_compress_bits(c,(unsigned char *)text,text_len,m->h,NULL);
+  pthread_mutex_unlock(&m->lock);
+  int len=(c->bits_used+7)>>3;
+  if (r) {
+    snprintf(recipe_error,1024,"Could not compress message.\n");
+    len=-1;
+  } else if (len>out_size) {
+    snprintf(recipe_error,1024,"Compressed message is %d bytes, but only %d fit.\n",
+	     len,out_size);
+    len=-1;
+  } else bcopy(c->bit_stream,out,len);
+  range_coder_free(c);
+  return len;
+}
+
+int smac_decompress(smac_model *m,const unsigned char *in,int in_len,
+		    char *out,int out_size)
+{
+  unsigned char text[1025];
+  int len=0;
+  if (in_len>1024) {
+    snprintf(recipe_error,1024,"Compressed messages are less than 1KB.\n");
+    return -1;
+  }
+  pthread_mutex_lock(&m->lock);
+  int r=stats3_decompress((unsigned char *)in,in_len,text,&len,m->h);
+  pthread_mutex_unlock(&m->lock);
+  if (r) {
+    snprintf(recipe_error,1024,"Could not decompress message.\n");
+    return -1;
+  }
+  if (len>out_size) {
+    snprintf(recipe_error,1024,"Message is %d bytes, but only %d fit.\n",
+	     len,out_size);
+    return -1;
+  }
+  bcopy(text,out,len);
+  return len;
+}
+
+int smac_recipe_compress(smac_model *m,const char *recipe_dir,
+			 const char *record,int record_len,
+			 unsigned char *out,int out_size)
+{
+  return session_compress_record(m,recipe_dir,record,record_len,out,out_size);
+}
+
+int smac_recipe_decompress(smac_model *m,const char *recipe_dir,
+			   const char *reference_dir,
+			   const unsigned char *in,int in_len,
+			   char *out,int out_size)
+{
+  char recipe_name[1024];
+  pthread_mutex_lock(&m->lock);
+  int len=recipe_decompress(m->h,(char *)recipe_dir,(char *)reference_dir,
+			    (unsigned char *)in,in_len,out,out_size,
+			    recipe_name,NULL);
+  pthread_mutex_unlock(&m->lock);
+  return len;
+}
+
+int smac_fragment(const unsigned char *in,int in_len,
+		  const char *publickeyhex,int mtu,int parity,int encoding,
+		  char *fragments[SMAC_MAX_FRAGMENTS],int *fragment_count)
+{
+  if (encryptAndFragmentBufferFEC((unsigned char *)in,in_len,
+				  fragments,fragment_count,mtu,
+				  (char *)publickeyhex,parity,encoding,0)) {
+    snprintf(recipe_error,1024,"Could not fragment %d bytes of data\n",in_len);
+    return -1;
+  }
+  return 0;
+}
+
+int smac_form_fragment(smac_model *m,const char *xml,
+		       const char *specification,int mtu,int parity,
+		       int encoding,char *fragments[SMAC_MAX_FRAGMENTS],
+		       int *fragment_count)
+{
+  return session_xml_to_fragments(m,xml,specification,NULL,NULL,NULL,
+				  mtu,parity,encoding,0,
+				  fragments,fragment_count);
+}
+
+smac_defragmenter *smac_defragmenter_open(const char *passphrase,
+					  const char *journal_file)
+{
+  struct smac_defragmenter *d=calloc(1,sizeof(struct smac_defragmenter));
+  if (!d) {
+    snprintf(recipe_error,1024,"Out of memory opening defragmenter\n");
+    return NULL;
+  }
+  unsigned char *sk=private_key_from_passphrase((char *)passphrase);
+  if (!sk) {
+    snprintf(recipe_error,1024,"Could not read passphrase\n");
+    free(d);
+    return NULL;
+  }
+  bcopy(sk,d->sk,crypto_box_SECRETKEYBYTES);
+  d->r=reassembly_open((char *)journal_file,REASSEMBLY_DEFAULT_EXPIRY);
+  if (!d->r) {
+    snprintf(recipe_error,1024,"Could not open reassembly journal '%s'\n",
+	     journal_file?journal_file:"");
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void smac_defragmenter_close(smac_defragmenter *d)
+{
+  if (!d) return;
+  reassembly_close(d->r);
+  free(d);
+}
+
+int smac_defragment(smac_defragmenter *d,const char *fragment,
+		    unsigned char *out,int out_size)
+{
+  struct fragment_set *f=NULL;
+  time_t now=time(0);
+  int complete=reassembly_add(d->r,fragment,now,&f);
+  if (complete<0) {
+    snprintf(recipe_error,1024,"Malformed fragment\n");
+    return -1;
+  }
+  if (!complete) return 0;
+
+  unsigned char message[32768];
+  int len=0;
+  int r=reassembleAndDecryptBuffer(f,d->sk,message,&len);
+  if (r) snprintf(recipe_error,1024,"Could not decrypt message %s\n",f->prefix);
+  reassembly_complete(d->r,f,now);
+  if (r) return -1;
+  if (len>out_size) {
+    snprintf(recipe_error,1024,"Message is %d bytes, but only %d fit.\n",
+	     len,out_size);
+    return -1;
+  }
+  bcopy(message,out,len);
+  return len;
+}
@@ -0,0 +1,106 @@
+/*
+  libsmac: short message and succinct data compression, for use in-process.
+
+  This is the whole of the interface that libsmac.a and libsmac.so export;
+  everything else in them is internal, and may change from release to
+  release.  SMAC_API_VERSION is raised whenever this interface changes
+  incompatibly, and is the major version of the shared library.
+
+  A model is a loaded stats.dat, along with the recipes of the forms that
+  have been compressed with it.  Calls on one model are serialised, so
+  threads that compress in parallel should each open their own.
+
+  Functions that can fail return -1 (or NULL), and smac_error() then
+  describes what went wrong in the calling thread.
+*/
+
+#ifndef LIBSMAC_H
+#define LIBSMAC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SMAC_API_VERSION 1
+
+#define SMAC_API __attribute__((visibility("default")))
+
+// Most fragments a message can be sent in, data and parity
+#define SMAC_MAX_FRAGMENTS 64
+// How the data of a fragment is written
+#define SMAC_ENCODING_BASE64 0
+#define SMAC_ENCODING_GSM7 1
+// Bytes of the fingerprint that identifies a model
+#define SMAC_FINGERPRINT_BYTES 4
+
+typedef struct smac_session smac_model;
+typedef struct smac_defragmenter smac_defragmenter;
+
+SMAC_API int smac_api_version(void);
+SMAC_API const char *smac_error(void);
+
+SMAC_API smac_model *smac_model_open(const char *stats_file);
+SMAC_API void smac_model_close(smac_model *m);
+SMAC_API int smac_model_fingerprint(smac_model *m,
+				    unsigned char fingerprint[SMAC_FINGERPRINT_BYTES]);
+
+/*
+  Compress a text message of up to 1024 bytes, or decompress one.  Both
+  return the length of the output.
+*/
+SMAC_API int smac_compress(smac_model *m,const char *text,int text_len,
+			   unsigned char *out,int out_size);
+SMAC_API int smac_decompress(smac_model *m,const unsigned char *in,int in_len,
+			     char *out,int out_size);
+
+/*
+  Compress a stripped or XML record to succinct data, with the recipe in
+  recipe_dir that its formid field names, or decompress succinct data to a
+  stripped record.  reference_dir holds the records that others are coded
+  against, and may be NULL if none are.
+*/
+SMAC_API int smac_recipe_compress(smac_model *m,const char *recipe_dir,
+				  const char *record,int record_len,
+				  unsigned char *out,int out_size);
+SMAC_API int smac_recipe_decompress(smac_model *m,const char *recipe_dir,
+				    const char *reference_dir,
+				    const unsigned char *in,int in_len,
+				    char *out,int out_size);
+
+/*
+  Encrypt a message to publickeyhex, and break it into fragments of at most
+  mtu characters, with parity extra fragments from which lost ones can be
+  rebuilt.  Each fragment is a string to be released with free().
+*/
+SMAC_API int smac_fragment(const unsigned char *in,int in_len,
+			   const char *publickeyhex,int mtu,int parity,
+			   int encoding,char *fragments[SMAC_MAX_FRAGMENTS],
+			   int *fragment_count);
+
+/*
+  Compress a form instance with the recipe made from its form specification,
+  then encrypt and fragment it, as smac_fragment() does, for the server that
+  collects the form.
+*/
+SMAC_API int smac_form_fragment(smac_model *m,const char *xml,
+				const char *specification,int mtu,int parity,
+				int encoding,char *fragments[SMAC_MAX_FRAGMENTS],
+				int *fragment_count);
+
+/*
+  Collect fragments until a message is complete, then decrypt it.  If
+  journal_file is not NULL, incomplete messages are kept in it across
+  restarts.  smac_defragment() returns the length of the message that the
+  fragment completes, or 0 if more fragments are needed.
+*/
+SMAC_API smac_defragmenter *smac_defragmenter_open(const char *passphrase,
+						   const char *journal_file);
+SMAC_API void smac_defragmenter_close(smac_defragmenter *d);
+SMAC_API int smac_defragment(smac_defragmenter *d,const char *fragment,
+			     unsigned char *out,int out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
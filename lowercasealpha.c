@@ -43,8 +43,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #undef DEBUG
 
-extern long long total_unicode_millibits;
-extern long long total_unicode_chars;
+long long total_unicode_millibits=0;
+long long total_unicode_chars=0;
 
 int strncmp816(char *s1,unsigned short *s2,int len)
 {
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "packed_stats.h"
 #include "smac.h"
 #include "recipe.h"
+#include "smacd.h"
 
 int processFile(FILE *f,FILE *contentXML,stats_handle *h);
 
@@ -36,16 +37,10 @@ int lines=0;
 double worstPercent=0,bestPercent=100;
 long long total_compressed_bits=0;
 long long total_uncompressed_bits=0;
-long long total_alpha_bits=0;
-long long total_nonalpha_bits=0;
-long long total_case_bits=0;
-long long total_model_bits=0;
 long long total_length_millibits=0;
-long long total_finalisation_bits=0;
-long long total_length_bits=0;
 
-long long total_unicode_millibits=0;
-long long total_unicode_chars=0;
+extern long long total_unicode_millibits;
+extern long long total_unicode_chars;
 
 long long total_messages=0;
 
@@ -90,6 +85,8 @@ int usage()
   fprintf(stderr,
 	  "smac usage:\n"
 	  "  smac recipe <recipe sub-command>\n"
+	  "  smac daemon <socket> <recipe directory> <output directory> [<threads> [<model directory>]]\n"
+	  "  smac daemon-client <socket> <operation> [<file> ...]\n"
 	  "  smac babble\n"
 	  "  smac test <files>\n");
   exit(-1);
@@ -100,6 +97,8 @@ int main(int argc,char *argv[])
   int i;
 
   if (argc<2) usage();
+  // The client needs no model of its own
+  if (!strcasecmp(argv[1],"daemon-client")) return smacd_client_main(argc,argv);
   
   /* Clear statistics */
   for(i=0;i<104;i++) {
@@ -116,9 +115,6 @@ int main(int argc,char *argv[])
   stats_handle *h=stats_new_handle("stats.dat");
 #endif
 
-  // Load complete tree
-  stats_load_tree(h);
-  
   if (!h) {
     char working_dir[1024];
     getcwd(working_dir,1024);
@@ -126,8 +122,12 @@ int main(int argc,char *argv[])
     exit(-1);
   }
 
+  // Load complete tree
+  stats_load_tree(h);
+
   if (argc>1) {
     if (!strcasecmp(argv[1],"recipe")) return recipe_main(argc,argv,h);
+    if (!strcasecmp(argv[1],"daemon")) return smacd_main(argc,argv,h);
   }
   
   /* Preload tree for speed */
@@ -6,6 +6,7 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -13,12 +14,15 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <time.h>
 #include "charset.h"
 #include "visualise.h"
 #include "arithmetic.h"
 #include "packed_stats.h"
 #include "smac.h"
 #include "recipe.h"
+#include "store.h"
+#include "md5.h"
 
 char *htmlTop=""
 "<!DOCTYPE HTML>\n"
@@ -137,33 +141,8 @@ void stripped_free(struct stripped *s)
   return;
 }
 
-struct stripped *parse_stripped(char *filename)
+struct stripped *parse_stripped(char *in,int in_len)
 {
-  char *in;
-  int in_len;
-  int fd=open(filename,O_RDONLY);
-  if (fd<0) return NULL;
-  
-  struct stat stat;
-  if (fstat(fd, &stat) == -1) {
-    fprintf(stderr,"Could not stat file '%s'\n",filename);
-    close(fd); return NULL;
-  }
-
-  if (stat.st_size>65536) {
-    fprintf(stderr,"File '%s' is too long (must be <= %d bytes)\n",
-	     filename,65536);
-    close(fd); return NULL;
-  }
-
-  in=mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (in==MAP_FAILED) {
-    fprintf(stderr,"Could not memory map file '%s'\n",filename);
-    close(fd); return NULL; 
-  }
-  in_len=stat.st_size;
-  close(fd);
-
   struct stripped *s=calloc(sizeof(struct stripped),1);
 
   int l=0;
@@ -176,18 +155,18 @@ struct stripped *parse_stripped(char *filename)
     if (l>1000) { 
       fprintf(stderr,"line:%d:Data line too long.\n",line_number);
       stripped_free(s);
-      munmap(in,stat.st_size);
       return NULL; }
     if ((i==in_len)||(in[i]=='\n')||(in[i]=='\r')) {
       if (s->value_count>1000) {
 	fprintf(stderr,"line:%d:Too many data lines (must be <=1000).\n",line_number);
 	stripped_free(s);
-	munmap(in,stat.st_size);
 	return NULL;
       }
       // Process key=value line
       line[l]=0; 
-      if ((l>0)&&(line[0]!='#')) {
+      if ((l>0)&&(line[0]!='#')
+	  // Repeat group instances are bracketed by lines of { and }
+	  &&strcmp(line,"{")&&strcmp(line,"}")) {
 	if (sscanf(line,"%[^=]=%[^\n]",key,value)==2) {
 	  s->keys[s->value_count]=strdup(key);
 	  s->values[s->value_count]=strdup(value);
@@ -196,7 +175,6 @@ struct stripped *parse_stripped(char *filename)
 	  fprintf(stderr,"line:%d:Malformed data line (%s:%d).\n",line_number,
 		  __FILE__,__LINE__);
 	  stripped_free(s);
-	  munmap(in,stat.st_size);
 	  return NULL;
 	}
       }
@@ -208,9 +186,426 @@ struct stripped *parse_stripped(char *filename)
   return s;
 }
 
+/*
+  Each form has a persistent index in <outputDir>/maps/<form>.index that
+  remembers how far into the record store it has read, and keeps running
+  aggregates for each field.  Each run reads the store from that watermark
+  onwards, and appends the markers of the records it finds to
+  <form>.markers.js, which the map page loads rather than holding the
+  markers itself.  The pages are then written from the index alone, so
+  refreshing them does not depend on how many records there are.
+
+  The store is append-only, so the watermark is simply the segment and offset
+  just past the last record read.  The index also records how long the
+  marker file was when it was saved, so that markers appended by a run that
+  did not get as far as saving the index are cut off, rather than appended
+  again by the next run.
+*/
+#define MAP_INDEX_VERSION 4
+#define MAP_HISTOGRAM_BUCKETS 10
+
+struct map_field_summary {
+  long long count;   // records in which the field is present
+  double minimum;
+  double maximum;
+  double sum;
+  int tally_count;   // histogram buckets, false/true, or enum values + other
+  long long *tally;
+};
+
+struct map_index {
+  struct recipe *recipe;
+  long long records;
+  long long markers;
+  long long marker_bytes; // length of the marker file for these markers
+
+  struct store_position watermark;
+
+  struct map_field_summary *fields;
+};
+
+int map_field_has_histogram(struct field *field)
+{
+  switch(field->type) {
+  case FIELDTYPE_INTEGER: case FIELDTYPE_FIXEDPOINT: case FIELDTYPE_FLOAT:
+    return field->maximum>field->minimum;
+  default:
+    return 0;
+  }
+}
+
+struct map_index *map_index_new(struct recipe *r)
+{
+  struct map_index *idx=calloc(sizeof(struct map_index),1);
+  int i;
+  idx->recipe=r;
+  idx->fields=calloc(sizeof(struct map_field_summary),r->field_count+1);
+  for(i=0;i<r->field_count;i++) {
+    struct field *field=&r->fields[i];
+    switch(field->type) {
+    case FIELDTYPE_BOOLEAN: idx->fields[i].tally_count=2; break;
+    case FIELDTYPE_ENUM: case FIELDTYPE_MULTISELECT:
+      idx->fields[i].tally_count=field->enum_count+1; break;
+    default:
+      if (map_field_has_histogram(field))
+	idx->fields[i].tally_count=MAP_HISTOGRAM_BUCKETS;
+    }
+    if (idx->fields[i].tally_count)
+      idx->fields[i].tally=calloc(sizeof(long long),idx->fields[i].tally_count);
+  }
+  return idx;
+}
+
+/*
+  Hash of everything in the recipe that the aggregates depend on, so that an
+  index is rebuilt if a field changes type, range or values, not just if
+  fields are added or removed.
+*/
+void map_recipe_signature(struct recipe *r,char *hex)
+{
+  MD5_CTX md5;
+  unsigned char hash[16];
+  char buffer[1024];
+  int i,j;
+  MD5_Init(&md5);
+  for(i=0;i<r->field_count;i++) {
+    struct field *field=&r->fields[i];
+    int len=snprintf(buffer,sizeof(buffer),"%.900s:%d:%d:%d:%d:%d\n",
+		     field->name,field->type,field->minimum,field->maximum,
+		     field->precision,field->enum_count);
+    MD5_Update(&md5,buffer,len);
+    for(j=0;j<field->enum_count;j++)
+      MD5_Update(&md5,field->enum_values[j],strlen(field->enum_values[j])+1);
+  }
+  MD5_Final(hash,&md5);
+  for(i=0;i<16;i++) sprintf(&hex[i*2],"%02x",hash[i]);
+}
+
+void map_index_free(struct map_index *idx)
+{
+  int i;
+  if (!idx) return;
+  for(i=0;i<idx->recipe->field_count;i++) free(idx->fields[i].tally);
+  free(idx->fields);
+  free(idx);
+}
+
+/*
+  Read a previously saved index.  Returns NULL if there is none, if it was
+  built from a different recipe, or if it is damaged, in which case the
+  caller starts afresh.
+*/
+struct map_index *map_index_read(struct recipe *r,char *filename)
+{
+  FILE *f=fopen(filename,"r");
+  if (!f) return NULL;
+
+  struct map_index *idx=map_index_new(r);
+  char line[65536];
+  int version=0,field_count=-1,damaged=0;
+  char formhash[13]="";
+  char expected[13];
+  char signature[33]="";
+  char expected_signature[33];
+  int i;
+  for(i=0;i<6;i++) sprintf(&expected[i*2],"%02x",r->formhash[i]);
+  map_recipe_signature(r,expected_signature);
+
+  while(fgets(line,sizeof(line),f)) {
+    int len=strlen(line);
+    while(len>0&&(line[len-1]=='\n'||line[len-1]=='\r')) line[--len]=0;
+
+    long long n;
+    int fieldnumber,tally_count,offset;
+    double minimum,maximum,sum;
+    if (sscanf(line,"smac-map-index:%d",&version)==1) continue;
+    if (sscanf(line,"form:%12[0-9a-f]:%d",formhash,&field_count)==2) continue;
+    if (sscanf(line,"recipe:%32[0-9a-f]",signature)==1) continue;
+    if (sscanf(line,"watermark:%d:%lld",&idx->watermark.segment,
+	       &idx->watermark.offset)==2) continue;
+    if (sscanf(line,"records:%lld",&n)==1) { idx->records=n; continue; }
+    if (sscanf(line,"markers:%lld",&n)==1) { idx->markers=n; continue; }
+    if (sscanf(line,"marker-bytes:%lld",&n)==1) { idx->marker_bytes=n; continue; }
+    if (sscanf(line,"field:%d:%lld:%lf:%lf:%lf:%d:%n",&fieldnumber,&n,
+	       &minimum,&maximum,&sum,&tally_count,&offset)==6) {
+      if (fieldnumber<0||fieldnumber>=r->field_count
+	  ||tally_count!=idx->fields[fieldnumber].tally_count) {
+	damaged=1; break;
+      }
+      struct map_field_summary *fs=&idx->fields[fieldnumber];
+      fs->count=n; fs->minimum=minimum; fs->maximum=maximum; fs->sum=sum;
+      char *p=&line[offset];
+      for(i=0;i<tally_count;i++) {
+	fs->tally[i]=strtoll(p,&p,10);
+	if (*p==',') p++;
+      }
+      continue;
+    }
+  }
+  fclose(f);
+
+  if (damaged||version!=MAP_INDEX_VERSION||field_count!=r->field_count
+      ||strcmp(formhash,expected)||strcmp(signature,expected_signature)) {
+    fprintf(stderr,"Map index '%s' is stale -- rebuilding\n",filename);
+    map_index_free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+int map_index_write(struct map_index *idx,char *filename)
+{
+  char tempname[1024];
+  snprintf(tempname,1024,"%s.tmp",filename);
+  FILE *f=fopen(tempname,"w");
+  if (!f) {
+    fprintf(stderr,"Could not write map index '%s'\n",tempname);
+    return -1;
+  }
+
+  struct recipe *r=idx->recipe;
+  char signature[33];
+  int i,j;
+  map_recipe_signature(r,signature);
+  fprintf(f,"smac-map-index:%d\n",MAP_INDEX_VERSION);
+  fprintf(f,"form:");
+  for(i=0;i<6;i++) fprintf(f,"%02x",r->formhash[i]);
+  fprintf(f,":%d\n",r->field_count);
+  fprintf(f,"recipe:%s\n",signature);
+  fprintf(f,"watermark:%d:%lld\n",idx->watermark.segment,
+	  idx->watermark.offset);
+  fprintf(f,"records:%lld\n",idx->records);
+  fprintf(f,"markers:%lld\n",idx->markers);
+  fprintf(f,"marker-bytes:%lld\n",idx->marker_bytes);
+  for(i=0;i<r->field_count;i++) {
+    struct map_field_summary *fs=&idx->fields[i];
+    fprintf(f,"field:%d:%lld:%.17g:%.17g:%.17g:%d:",i,fs->count,
+	    fs->minimum,fs->maximum,fs->sum,fs->tally_count);
+    for(j=0;j<fs->tally_count;j++)
+      fprintf(f,"%s%lld",j?",":"",fs->tally[j]);
+    fprintf(f,"\n");
+  }
+  if (fclose(f)) {
+    fprintf(stderr,"Could not write map index '%s'\n",tempname);
+    unlink(tempname);
+    return -1;
+  }
+  if (rename(tempname,filename)) {
+    fprintf(stderr,"Could not replace map index '%s'\n",filename);
+    unlink(tempname);
+    return -1;
+  }
+  return 0;
+}
+
+void map_index_add_value(struct map_index *idx,int fieldnumber,char *value)
+{
+  struct field *field=&idx->recipe->fields[fieldnumber];
+  struct map_field_summary *fs=&idx->fields[fieldnumber];
+  int i;
+
+  if (!value[0]||!strcmp(value,"~")) return;
+  fs->count++;
+
+  switch(field->type) {
+  case FIELDTYPE_INTEGER: case FIELDTYPE_FIXEDPOINT: case FIELDTYPE_FLOAT:
+    {
+      char *end;
+      double v=strtod(value,&end);
+      if (end==value) break;
+      if (fs->count==1||v<fs->minimum) fs->minimum=v;
+      if (fs->count==1||v>fs->maximum) fs->maximum=v;
+      fs->sum+=v;
+      if (fs->tally_count) {
+	double range=(double)field->maximum-field->minimum;
+	int bucket=(v-field->minimum)*fs->tally_count/range;
+	if (bucket<0) bucket=0;
+	if (bucket>=fs->tally_count) bucket=fs->tally_count-1;
+	fs->tally[bucket]++;
+      }
+    }
+    break;
+  case FIELDTYPE_BOOLEAN:
+    fs->tally[recipe_parse_boolean(value)]++;
+    break;
+  case FIELDTYPE_ENUM:
+    for(i=0;i<field->enum_count;i++)
+      if (!strcasecmp(value,field->enum_values[i])) break;
+    fs->tally[i]++;
+    break;
+  case FIELDTYPE_MULTISELECT:
+    {
+      // Selected values are separated by |, as recipe_decode_field()
+      // writes them
+      char *p=value;
+      while(*p) {
+	while(*p=='|') p++;
+	int l=strcspn(p,"|");
+	if (!l) break;
+	for(i=0;i<field->enum_count;i++)
+	  if (!strncasecmp(p,field->enum_values[i],l)
+	      &&!field->enum_values[i][l]) {
+	    fs->tally[i]++; break;
+	  }
+	if (i==field->enum_count) fs->tally[i]++;
+	p+=l;
+      }
+    }
+    break;
+  }
+}
+
+/*
+  Fold one record into the index, and append its marker to the marker file
+  if it has a location.
+*/
+int map_index_add_record(struct map_index *idx,struct stripped *s,FILE *markers)
+{
+  struct recipe *r=idx->recipe;
+  char formDetail[8192];
+  int formDetailLen=0;
+  int haveLocation=0;
+  float lat=0,lon=0;
+  int i,hint=0;
+
+  idx->records++;
+  for(i=0;i<s->value_count;i++) {
+    int j=recipe_field_lookup(r,s->keys[i],strlen(s->keys[i]),hint);
+    if (j>=0) {
+      hint=j+1;
+      if (r->fields[j].type==FIELDTYPE_LATLONG&&!haveLocation)
+	if (sscanf(s->values[i],"%f %f",&lat,&lon)==2) haveLocation=1;
+      map_index_add_value(idx,j,s->values[i]);
+    }
+    if (!formDetailLen) {
+      formDetailLen+=snprintf(formDetail,8192,"<div id=\\\"marker%lld\\\" style=\\\"height:\\\"+String(viewportheight*0.2)+\\\"px;overflow:auto;\\\"><table border=1 padding=2>\\n",idx->markers);
+    }
+    if (formDetailLen<8192)
+      formDetailLen
+	+=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
+		   "<tr><td>%s</td><td>%s</td>\\n",
+		   s->keys[i],sanitise(s->values[i]));
+  }
+  if (formDetailLen<8192) {
+    if (formDetailLen) {
+      formDetailLen
+	+=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
+		   "</table></div>\\n");
+    } else {
+      formDetailLen
+	+=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
+		   "Form empty.\\n");
+    }
+  }
+  if (haveLocation) {
+    idx->markers++;
+    fprintf(markers," L.marker([%f, %f]).addTo(map).bindPopup(\"%s\");\n",
+	    lat,lon,formDetail);
+  }
+  return 0;
+}
+
+// The page loads its markers from the marker file beside it
+int map_write_page(char *filename,char *markersName)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    fprintf(stderr,"Could not write map '%s'\n",filename);
+    return -1;
+  }
+  fprintf(f,"%s </script>\n <script src=\"%s\">\n%s",
+	  htmlTop,markersName,htmlBottom);
+  fclose(f);
+  return 0;
+}
+
+int map_write_summary(struct map_index *idx,char *filename)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    fprintf(stderr,"Could not write summary '%s'\n",filename);
+    return -1;
+  }
+
+  struct recipe *r=idx->recipe;
+  int i,j;
+  fprintf(f,"<!DOCTYPE HTML>\n<html>\n<head>\n<title>%s summary</title>\n"
+	  "<meta charset=\"utf-8\" />\n</head>\n<body>\n",r->formname);
+  fprintf(f,"<p>%lld records, %lld with a location.</p>\n",
+	  idx->records,idx->markers);
+  fprintf(f,"<table border=1 padding=2>\n"
+	  "<tr><th>Field</th><th>Type</th><th>Present</th>"
+	  "<th>Minimum</th><th>Maximum</th><th>Mean</th>"
+	  "<th>Distribution</th></tr>\n");
+  for(i=0;i<r->field_count;i++) {
+    struct field *field=&r->fields[i];
+    struct map_field_summary *fs=&idx->fields[i];
+    fprintf(f,"<tr><td>%s</td><td>%s</td><td>%lld</td>",
+	    field->name,recipe_field_type_name(field->type),fs->count);
+    switch(field->type) {
+    case FIELDTYPE_INTEGER: case FIELDTYPE_FIXEDPOINT: case FIELDTYPE_FLOAT:
+      if (fs->count) {
+	fprintf(f,"<td>%g</td><td>%g</td><td>%g</td>",
+		fs->minimum,fs->maximum,fs->sum/fs->count);
+	break;
+      }
+      // fall through
+    default:
+      fprintf(f,"<td></td><td></td><td></td>");
+    }
+    fprintf(f,"<td>");
+    for(j=0;j<fs->tally_count;j++) {
+      if (!fs->tally[j]) continue;
+      switch(field->type) {
+      case FIELDTYPE_BOOLEAN:
+	fprintf(f,"%s: %lld<br>",j?"true":"false",fs->tally[j]);
+	break;
+      case FIELDTYPE_ENUM: case FIELDTYPE_MULTISELECT:
+	fprintf(f,"%s: %lld<br>",
+		j<field->enum_count?sanitise(field->enum_values[j]):"(other)",
+		fs->tally[j]);
+	break;
+      default:
+	{
+	  double range=(double)field->maximum-field->minimum;
+	  fprintf(f,"%g &ndash; %g: %lld<br>",
+		  field->minimum+range*j/fs->tally_count,
+		  field->minimum+range*(j+1)/fs->tally_count,fs->tally[j]);
+	}
+      }
+    }
+    fprintf(f,"</td></tr>\n");
+  }
+  fprintf(f,"</table>\n</body>\n</html>\n");
+  fclose(f);
+  return 0;
+}
+
+struct map_update {
+  struct map_index *idx;
+  FILE *markers;
+  int records;
+};
+
+static int map_update_record(void *context,struct store_record *r)
+{
+  struct map_update *u=context;
+  struct stripped *s=parse_stripped(r->stripped,r->stripped_len);
+  if (s) {
+    map_index_add_record(u->idx,s,u->markers);
+    stripped_free(s);
+    u->records++;
+  }
+  // Malformed records are skipped for good rather than retried each run
+  return 0;
+}
+
 int generateMap(char *recipeDir,char *recipe_name, char *outputDir)
 {
   char filename[1024];
+  char indexFilename[1024];
+  char markersName[1024];
+  char markersFilename[1024];
 
   snprintf(filename,1024,"%s/%s.recipe",recipeDir,recipe_name);
   struct recipe *r=recipe_read_from_file(filename);
@@ -222,96 +617,88 @@ int generateMap(char *recipeDir,char *recipe_name, char *outputDir)
   snprintf(filename,1024,"%s/maps/",outputDir);
   mkdir(filename,0777);
 
-  int markerCount=0;
-
-  // Process each form instance
-  snprintf(filename,1024,"%s/%s",outputDir,recipe_name);
-  DIR *d=opendir(filename);
-  if (d) {
-    snprintf(filename,1024,"%s/maps/%s.html",outputDir,recipe_name);
-    FILE *f=fopen(filename,"w");
-
-    fprintf(f,"%s",htmlTop);
-    
-    struct dirent *de;
-    while((de=readdir(d))) {
-      if (strlen(de->d_name)>strlen(".stripped"))
-	if (!strcasecmp(&de->d_name[strlen(de->d_name)-strlen(".stripped")],".stripped"))
-	  {
-	    // It's a stripped file -- read it and add a data point for the first 
-	    // location field present.
-	    char formDetail[8192];
-	    int formDetailLen=0;
-	    int haveLocation=0;
-	    float lat=0,lon=0;
-	    snprintf(filename,1024,"%s/%s/%s",outputDir,recipe_name,de->d_name);
-	    struct stripped *s=parse_stripped(filename);
-	    if (s) {
-	      fprintf(stderr,"  %d fields in '%s'\n",s->value_count,filename);
-	      int i,j;
-	      for(i=0;i<s->value_count;i++) {
-		for(j=0;j<r->field_count;j++)
-		  if (!strcasecmp(s->keys[i],r->fields[j].name)) {
-		    switch (r->fields[j].type) {
-		    case FIELDTYPE_LATLONG:
-		      if (sscanf(s->values[i],"%f %f",&lat,&lon)==2) haveLocation=1;
-		      break;
-		    case FIELDTYPE_INTEGER:
-		      // calculate summary statistics
-		      break;
-		    case FIELDTYPE_BOOLEAN:
-		      // calculate summary statistics
-		      break;
-		    case FIELDTYPE_ENUM:
-		      // calculate summary statistics
-		      break;
-		    }
-		  }
-		if (!formDetailLen) {
-		  formDetailLen+=snprintf(formDetail,8192,"<div id=\\\"marker%d\\\" style=\\\"height:\\\"+String(viewportheight*0.2)+\\\"px;overflow:auto;\\\"><table border=1 padding=2>\\n",markerCount++);
-		}
-		formDetailLen
-		  +=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
-			     "<tr><td>%s</td><td>%s</td>\\n",
-			     s->keys[i],sanitise(s->values[i]));
-	      }
-	      if (formDetailLen) {
-		formDetailLen
-		  +=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
-			     "</table></div>\\n");
-	      } else {
-		formDetailLen
-		  +=snprintf(&formDetail[formDetailLen],8192-formDetailLen,
-			     "Form empty.\\n");
-	      }
-	      if (haveLocation) {
-		formDetail[formDetailLen]=0;
-		fprintf(f," L.marker([%f, %f]).addTo(map).bindPopup(\"%s\");\n",
-			lat,lon,formDetail);
-	      }
-	      stripped_free(s);
-	    }
-	  }
-    }
-    closedir(d);
-    
-    fprintf(f,"%s",htmlBottom);
-    
-    fclose(f);
+  snprintf(indexFilename,1024,"%s/maps/%s.index",outputDir,recipe_name);
+  snprintf(markersName,1024,"%.900s.markers.js",recipe_name);
+  snprintf(markersFilename,1024,"%s/maps/%s.markers.js",outputDir,recipe_name);
+
+  // Resume from the saved index, cutting off any markers written after it
+  // was saved, or start again with no markers
+  struct map_index *idx=map_index_read(r,indexFilename);
+  struct stat st;
+  if (idx&&(stat(markersFilename,&st)||st.st_size<idx->marker_bytes
+	    ||truncate(markersFilename,idx->marker_bytes))) {
+    fprintf(stderr,"Marker file '%s' does not match its index -- rebuilding\n",
+	    markersFilename);
+    map_index_free(idx);
+    idx=NULL;
+  }
+  FILE *markers;
+  if (idx) markers=fopen(markersFilename,"a");
+  else {
+    idx=map_index_new(r);
+    markers=fopen(markersFilename,"w");
+  }
+  if (!markers) {
+    fprintf(stderr,"Could not open marker file '%s'\n",markersFilename);
+    map_index_free(idx); recipe_free(r);
+    return -1;
+  }
+
+  // Process each stored form instance not yet in the index
+  struct map_update update;
+  update.idx=idx;
+  update.markers=markers;
+  update.records=0;
+  snprintf(filename,1024,"%s/store/%s",outputDir,recipe_name);
+  if (!stat(filename,&st)) {
+    snprintf(filename,1024,"%s/store",outputDir);
+    struct record_store *store=store_open_readonly(filename,recipe_name);
+    if (!store||store_iterate_from(store,&idx->watermark,
+				   map_update_record,&update)<0)
+      fprintf(stderr,"Could not read records of '%s': %s",recipe_name,recipe_error);
+    store_close(store);
   } else {
     fprintf(stderr,"There do not appear to be any form instances for '%s'\n",
 	    recipe_name);
     fprintf(stderr,"  ('%s' is non-existent)\n",filename);
   }
-  return 0;
+  int newRecords=update.records;
+  fprintf(stderr,"  %d new records for '%s' (%lld in total)\n",
+	  newRecords,recipe_name,idx->records);
+
+  // The markers must be on disk before the index that counts them
+  int retVal=0;
+  if (fflush(markers)||fsync(fileno(markers))||fstat(fileno(markers),&st)) {
+    fprintf(stderr,"Could not write marker file '%s'\n",markersFilename);
+    retVal=-1;
+  } else {
+    idx->marker_bytes=st.st_size;
+    if (map_index_write(idx,indexFilename)) retVal=-1;
+  }
+  fclose(markers);
+
+  snprintf(filename,1024,"%s/maps/%s.html",outputDir,recipe_name);
+  if (map_write_page(filename,markersName)) retVal=-1;
+  snprintf(filename,1024,"%s/maps/%s-summary.html",outputDir,recipe_name);
+  if (map_write_summary(idx,filename)) retVal=-1;
+
+  map_index_free(idx);
+  recipe_free(r);
+  return retVal;
 }
 
 
 int generateMaps(char *recipeDir, char *outputDir)
 {
   DIR *d=opendir(recipeDir);
+  if (!d) {
+    fprintf(stderr,"Could not open recipe directory '%s'\n",recipeDir);
+    return -1;
+  }
 
   char filename[1024];
+  snprintf(filename,1024,"%s/maps/",outputDir);
+  mkdir(filename,0777);
   snprintf(filename,1024,"%s/maps/index.html",outputDir);
   fprintf(stderr,"Trying to create %s\n",filename);
   FILE *idx=fopen(filename,"w");
@@ -332,13 +719,14 @@ int generateMaps(char *recipeDir, char *outputDir)
 	fprintf(stderr,"Recipe '%s'\n",recipe_name);
 
 	if (idx) fprintf(idx,"<a href=\"%s.html\">%s</a> ",recipe_name,recipe_name);
+	if (idx) fprintf(idx,"<a href=\"%s-summary.html\">Summary</a> ",recipe_name);
 	if (idx) fprintf(idx,"<a href=\"../csv/%s.csv\">CSV</a><br>\n",recipe_name);
 
 	generateMap(recipeDir,recipe_name,outputDir);
       }      
   }
   
-  fclose(idx);
+  if (idx) fclose(idx);
   closedir(d);
   return 0;
 }
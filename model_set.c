@@ -0,0 +1,190 @@
+/*
+  Statistics models that can be replaced while in use.  See model_set.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "model_set.h"
+
+int model_set_init(struct model_set *s)
+{
+  bzero(s,sizeof(struct model_set));
+  pthread_mutex_init(&s->lock,NULL);
+  return 0;
+}
+
+static void model_free(struct stats_model *m)
+{
+  int i;
+  // Clones share the model's tree and file, so must go first
+  for(i=0;i<m->spare_count;i++) stats_handle_free(m->spares[i]);
+  stats_handle_free(m->h);
+  free(m);
+}
+
+// Called with the lock held
+static struct stats_model *model_set_find(struct model_set *s,
+					  unsigned char *fingerprint)
+{
+  struct stats_model *m;
+  if (!fingerprint) return s->current;
+  for(m=s->models;m;m=m->next)
+    if (!memcmp(m->h->fingerprint,fingerprint,STATS_FINGERPRINT_BYTES))
+      return m;
+  return NULL;
+}
+
+/*
+  Add a loaded statistics handle to the set, which then owns it, and make it
+  the model that new messages are compressed with.  If a file with the same
+  fingerprint is already loaded, that becomes the current model instead, and
+  h is freed.
+*/
+struct stats_model *model_set_add(struct model_set *s,stats_handle *h,
+				  char *filename)
+{
+  // Models are told apart by their fingerprints, which are worked out here,
+  // once, rather than whenever a statistics file is opened
+  if (stats_fingerprint(h)) {
+    snprintf(recipe_error,1024,"Could not fingerprint model '%.900s'\n",filename);
+    stats_handle_free(h);
+    return NULL;
+  }
+  struct stats_model *m=calloc(1,sizeof(struct stats_model));
+  if (!m) {
+    snprintf(recipe_error,1024,"Out of memory loading model\n");
+    stats_handle_free(h);
+    return NULL;
+  }
+  m->h=h;
+  snprintf(m->filename,1024,"%s",filename);
+  m->references=1;
+
+  pthread_mutex_lock(&s->lock);
+  struct stats_model *loaded=model_set_find(s,h->fingerprint);
+  if (loaded) {
+    s->current=loaded;
+    pthread_mutex_unlock(&s->lock);
+    model_free(m);
+    return loaded;
+  }
+  m->next=s->models;
+  s->models=m;
+  s->current=m;
+  pthread_mutex_unlock(&s->lock);
+  return m;
+}
+
+struct stats_model *model_set_load(struct model_set *s,char *filename)
+{
+  // Loading takes a while, so is done before the set is locked
+  stats_handle *h=stats_new_handle(filename);
+  if (!h) {
+    snprintf(recipe_error,1024,"Could not read stats file '%s'\n",filename);
+    return NULL;
+  }
+  stats_load_tree(h);
+  return model_set_add(s,h,filename);
+}
+
+/*
+  Remove a model from the set, so that it can no longer be borrowed.  It is
+  freed once every handle on it has been returned.  The current model cannot
+  be unloaded.
+*/
+int model_set_unload(struct model_set *s,unsigned char *fingerprint)
+{
+  struct stats_model **p,*m=NULL;
+  pthread_mutex_lock(&s->lock);
+  for(p=&s->models;*p;p=&(*p)->next)
+    if (!memcmp((*p)->h->fingerprint,fingerprint,STATS_FINGERPRINT_BYTES)) {
+      m=*p;
+      break;
+    }
+  if (!m||m==s->current) {
+    pthread_mutex_unlock(&s->lock);
+    snprintf(recipe_error,1024,m?"The current model cannot be unloaded\n"
+	     :"No such model is loaded\n");
+    return -1;
+  }
+  *p=m->next;
+  m->next=NULL;
+  int unused=!--m->references;
+  pthread_mutex_unlock(&s->lock);
+  if (unused) model_free(m);
+  return 0;
+}
+
+/*
+  Borrow a handle on the model with the given fingerprint, or on the current
+  model if fingerprint is NULL, to be given back with model_set_return().
+  Returns NULL if there is no such model.
+*/
+stats_handle *model_set_borrow(struct model_set *s,unsigned char *fingerprint,
+			       struct stats_model **model)
+{
+  stats_handle *h=NULL;
+  pthread_mutex_lock(&s->lock);
+  struct stats_model *m=model_set_find(s,fingerprint);
+  if (!m) {
+    pthread_mutex_unlock(&s->lock);
+    if (fingerprint) {
+      char hex[STATS_FINGERPRINT_BYTES*2+1];
+      stats_fingerprint_hex(fingerprint,hex);
+      snprintf(recipe_error,1024,"No model with fingerprint %s is loaded\n",hex);
+    } else snprintf(recipe_error,1024,"No model is loaded\n");
+    return NULL;
+  }
+  m->references++;
+  if (m->spare_count) h=m->spares[--m->spare_count];
+  pthread_mutex_unlock(&s->lock);
+
+  if (!h) h=stats_handle_clone(m->h);
+  if (!h) {
+    model_set_return(s,m,NULL);
+    snprintf(recipe_error,1024,"Out of memory borrowing model\n");
+    return NULL;
+  }
+  *model=m;
+  return h;
+}
+
+void model_set_return(struct model_set *s,struct stats_model *m,stats_handle *h)
+{
+  pthread_mutex_lock(&s->lock);
+  if (h&&m->spare_count<MODEL_SET_SPARE_HANDLES) {
+    m->spares[m->spare_count++]=h;
+    h=NULL;
+  }
+  int unused=!--m->references;
+  pthread_mutex_unlock(&s->lock);
+  if (h) stats_handle_free(h);
+  if (unused) model_free(m);
+}
+
+// Describe the loaded models, one per line, as <fingerprint> <file>
+int model_set_list(struct model_set *s,char *out,int out_size)
+{
+  struct stats_model *m;
+  int n=0;
+  pthread_mutex_lock(&s->lock);
+  for(m=s->models;m&&n<out_size;m=m->next) {
+    char hex[STATS_FINGERPRINT_BYTES*2+1];
+    stats_fingerprint_hex(m->h->fingerprint,hex);
+    n+=snprintf(&out[n],out_size-n,"%s %s%s\n",hex,m->filename,
+		m==s->current?" current":"");
+  }
+  pthread_mutex_unlock(&s->lock);
+  return n<out_size?n:out_size-1;
+}
@@ -0,0 +1,45 @@
+/*
+  A set of loaded statistics models, for long-running processes.
+
+  A new stats.dat can be loaded alongside those already loaded, and becomes
+  the current model, which new messages are compressed with.  Messages are
+  decompressed with whichever model has the fingerprint they were sent
+  with, so that messages compressed before the switch still decode.
+
+  Users borrow a handle on a model for the length of one operation.
+  Switching models only replaces the current model pointer: operations
+  already under way keep the model they borrowed, and an unloaded model is
+  freed once the last handle on it is returned.
+
+  Needs packed_stats.h.
+*/
+
+// Handles kept for reuse by each model, so that each borrower need not
+// clone the model's handle afresh
+#define MODEL_SET_SPARE_HANDLES 64
+
+struct stats_model {
+  stats_handle *h;
+  char filename[1024];
+  int references;          // borrowed handles, plus one while in the set
+  stats_handle *spares[MODEL_SET_SPARE_HANDLES];
+  int spare_count;
+  struct stats_model *next;
+};
+
+struct model_set {
+  pthread_mutex_t lock;
+  struct stats_model *current;
+  struct stats_model *models;  // newest first
+};
+
+int model_set_init(struct model_set *s);
+struct stats_model *model_set_add(struct model_set *s,stats_handle *h,
+				  char *filename);
+struct stats_model *model_set_load(struct model_set *s,char *filename);
+int model_set_unload(struct model_set *s,unsigned char *fingerprint);
+stats_handle *model_set_borrow(struct model_set *s,unsigned char *fingerprint,
+			       struct stats_model **model);
+void model_set_return(struct model_set *s,struct stats_model *model,
+		      stats_handle *h);
+int model_set_list(struct model_set *s,char *out,int out_size);
@@ -3,6 +3,8 @@
 
 #define crypto_onetimeauth_poly1305_ref_BYTES 16
 #define crypto_onetimeauth_poly1305_ref_KEYBYTES 32
+#define crypto_onetimeauth_poly1305_donna_BYTES 16
+#define crypto_onetimeauth_poly1305_donna_KEYBYTES 32
 #ifdef __cplusplus
 #include <string>
 extern std::string crypto_onetimeauth_poly1305_ref(const std::string &,const std::string &);
@@ -11,10 +13,23 @@ extern "C" {
 #endif
 extern int crypto_onetimeauth_poly1305_ref(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_onetimeauth_poly1305_ref_verify(const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_onetimeauth_poly1305_donna(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_onetimeauth_poly1305_donna_verify(const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(NACL_FAST) && defined(__SIZEOF_INT128__)
+#define crypto_onetimeauth_poly1305 crypto_onetimeauth_poly1305_donna
+/* POTATO crypto_onetimeauth_poly1305_donna crypto_onetimeauth_poly1305_donna crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_verify crypto_onetimeauth_poly1305_donna_verify
+/* POTATO crypto_onetimeauth_poly1305_donna_verify crypto_onetimeauth_poly1305_donna crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_BYTES crypto_onetimeauth_poly1305_donna_BYTES
+/* POTATO crypto_onetimeauth_poly1305_donna_BYTES crypto_onetimeauth_poly1305_donna crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_KEYBYTES crypto_onetimeauth_poly1305_donna_KEYBYTES
+/* POTATO crypto_onetimeauth_poly1305_donna_KEYBYTES crypto_onetimeauth_poly1305_donna crypto_onetimeauth_poly1305 */
+#define crypto_onetimeauth_poly1305_IMPLEMENTATION "crypto_onetimeauth/poly1305/donna"
+#else
 #define crypto_onetimeauth_poly1305 crypto_onetimeauth_poly1305_ref
 /* POTATO crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305 */
 #define crypto_onetimeauth_poly1305_verify crypto_onetimeauth_poly1305_ref_verify
@@ -24,9 +39,17 @@ extern int crypto_onetimeauth_poly1305_ref_verify(const unsigned char *,const un
 #define crypto_onetimeauth_poly1305_KEYBYTES crypto_onetimeauth_poly1305_ref_KEYBYTES
 /* POTATO crypto_onetimeauth_poly1305_ref_KEYBYTES crypto_onetimeauth_poly1305_ref crypto_onetimeauth_poly1305 */
 #define crypto_onetimeauth_poly1305_IMPLEMENTATION "crypto_onetimeauth/poly1305/ref"
+#endif
 #ifndef crypto_onetimeauth_poly1305_ref_VERSION
 #define crypto_onetimeauth_poly1305_ref_VERSION "-"
 #endif
+#ifndef crypto_onetimeauth_poly1305_donna_VERSION
+#define crypto_onetimeauth_poly1305_donna_VERSION "-"
+#endif
+#if defined(NACL_FAST) && defined(__SIZEOF_INT128__)
+#define crypto_onetimeauth_poly1305_VERSION crypto_onetimeauth_poly1305_donna_VERSION
+#else
 #define crypto_onetimeauth_poly1305_VERSION crypto_onetimeauth_poly1305_ref_VERSION
+#endif
 
 #endif
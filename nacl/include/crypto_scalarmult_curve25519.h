@@ -3,6 +3,8 @@
 
 #define crypto_scalarmult_curve25519_ref_BYTES 32
 #define crypto_scalarmult_curve25519_ref_SCALARBYTES 32
+#define crypto_scalarmult_curve25519_donna_c64_BYTES 32
+#define crypto_scalarmult_curve25519_donna_c64_SCALARBYTES 32
 #ifdef __cplusplus
 #include <string>
 extern std::string crypto_scalarmult_curve25519_ref(const std::string &,const std::string &);
@@ -11,10 +13,23 @@ extern "C" {
 #endif
 extern int crypto_scalarmult_curve25519_ref(unsigned char *,const unsigned char *,const unsigned char *);
 extern int crypto_scalarmult_curve25519_ref_base(unsigned char *,const unsigned char *);
+extern int crypto_scalarmult_curve25519_donna_c64(unsigned char *,const unsigned char *,const unsigned char *);
+extern int crypto_scalarmult_curve25519_donna_c64_base(unsigned char *,const unsigned char *);
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(NACL_FAST) && defined(__SIZEOF_INT128__)
+#define crypto_scalarmult_curve25519 crypto_scalarmult_curve25519_donna_c64
+/* POTATO crypto_scalarmult_curve25519_donna_c64 crypto_scalarmult_curve25519_donna_c64 crypto_scalarmult_curve25519 */
+#define crypto_scalarmult_curve25519_base crypto_scalarmult_curve25519_donna_c64_base
+/* POTATO crypto_scalarmult_curve25519_donna_c64_base crypto_scalarmult_curve25519_donna_c64 crypto_scalarmult_curve25519 */
+#define crypto_scalarmult_curve25519_BYTES crypto_scalarmult_curve25519_donna_c64_BYTES
+/* POTATO crypto_scalarmult_curve25519_donna_c64_BYTES crypto_scalarmult_curve25519_donna_c64 crypto_scalarmult_curve25519 */
+#define crypto_scalarmult_curve25519_SCALARBYTES crypto_scalarmult_curve25519_donna_c64_SCALARBYTES
+/* POTATO crypto_scalarmult_curve25519_donna_c64_SCALARBYTES crypto_scalarmult_curve25519_donna_c64 crypto_scalarmult_curve25519 */
+#define crypto_scalarmult_curve25519_IMPLEMENTATION "crypto_scalarmult/curve25519/donna_c64"
+#else
 #define crypto_scalarmult_curve25519 crypto_scalarmult_curve25519_ref
 /* POTATO crypto_scalarmult_curve25519_ref crypto_scalarmult_curve25519_ref crypto_scalarmult_curve25519 */
 #define crypto_scalarmult_curve25519_base crypto_scalarmult_curve25519_ref_base
@@ -24,9 +39,17 @@ extern int crypto_scalarmult_curve25519_ref_base(unsigned char *,const unsigned
 #define crypto_scalarmult_curve25519_SCALARBYTES crypto_scalarmult_curve25519_ref_SCALARBYTES
 /* POTATO crypto_scalarmult_curve25519_ref_SCALARBYTES crypto_scalarmult_curve25519_ref crypto_scalarmult_curve25519 */
 #define crypto_scalarmult_curve25519_IMPLEMENTATION "crypto_scalarmult/curve25519/ref"
+#endif
 #ifndef crypto_scalarmult_curve25519_ref_VERSION
 #define crypto_scalarmult_curve25519_ref_VERSION "-"
 #endif
+#ifndef crypto_scalarmult_curve25519_donna_c64_VERSION
+#define crypto_scalarmult_curve25519_donna_c64_VERSION "-"
+#endif
+#if defined(NACL_FAST) && defined(__SIZEOF_INT128__)
+#define crypto_scalarmult_curve25519_VERSION crypto_scalarmult_curve25519_donna_c64_VERSION
+#else
 #define crypto_scalarmult_curve25519_VERSION crypto_scalarmult_curve25519_ref_VERSION
+#endif
 
 #endif
@@ -0,0 +1,157 @@
+/*
+Poly1305 with 64-bit limbs.
+The accumulator and key are held in radix 2^44 (44, 44 and 42 bits), so that
+each 16-byte block costs nine 64x64->128 bit products rather than the
+reference implementation's byte-at-a-time schoolbook multiply.  Derived from
+the public domain poly1305-donna by Andrew Moon.
+Public domain.
+
+Needs a compiler with unsigned __int128 (gcc or clang on a 64-bit target);
+elsewhere this file is empty and the reference implementation is used.
+*/
+
+#include "crypto_onetimeauth.h"
+
+#ifdef __SIZEOF_INT128__
+
+typedef unsigned long long u64;
+typedef unsigned __int128 uint128_t;
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+static inline u64 load64_le(const unsigned char *p)
+{
+  return
+    ((u64)p[0]) |
+    (((u64)p[1]) << 8) |
+    (((u64)p[2]) << 16) |
+    (((u64)p[3]) << 24) |
+    (((u64)p[4]) << 32) |
+    (((u64)p[5]) << 40) |
+    (((u64)p[6]) << 48) |
+    (((u64)p[7]) << 56);
+}
+
+static inline void store64_le(unsigned char *p,u64 v)
+{
+  p[0] = v; v >>= 8;
+  p[1] = v; v >>= 8;
+  p[2] = v; v >>= 8;
+  p[3] = v; v >>= 8;
+  p[4] = v; v >>= 8;
+  p[5] = v; v >>= 8;
+  p[6] = v; v >>= 8;
+  p[7] = v;
+}
+
+/* h = (h + m) * r for each 16-byte block of m; hibit is 2^128 in limb 2 for
+   full blocks, or 0 for the padded final block */
+static void poly1305_blocks(u64 h[3],const u64 r[3],
+			    const unsigned char *m,unsigned long long bytes,
+			    u64 hibit)
+{
+  u64 r0,r1,r2,s1,s2,h0,h1,h2,c;
+  uint128_t d0,d1,d2,d;
+
+  r0 = r[0]; r1 = r[1]; r2 = r[2];
+  h0 = h[0]; h1 = h[1]; h2 = h[2];
+
+  s1 = r1 * (5 << 2);
+  s2 = r2 * (5 << 2);
+
+  while (bytes >= 16) {
+    u64 t0 = load64_le(m);
+    u64 t1 = load64_le(m + 8);
+
+    h0 += t0 & MASK44;
+    h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+    h2 += ((t1 >> 24) & MASK42) | hibit;
+
+    d0 = (uint128_t)h0 * r0;
+    d = (uint128_t)h1 * s2; d0 += d;
+    d = (uint128_t)h2 * s1; d0 += d;
+    d1 = (uint128_t)h0 * r1;
+    d = (uint128_t)h1 * r0; d1 += d;
+    d = (uint128_t)h2 * s2; d1 += d;
+    d2 = (uint128_t)h0 * r2;
+    d = (uint128_t)h1 * r1; d2 += d;
+    d = (uint128_t)h2 * r0; d2 += d;
+
+    c = (u64)(d0 >> 44); h0 = (u64)d0 & MASK44;
+    d1 += c; c = (u64)(d1 >> 44); h1 = (u64)d1 & MASK44;
+    d2 += c; c = (u64)(d2 >> 42); h2 = (u64)d2 & MASK42;
+    h0 += c * 5; c = h0 >> 44; h0 = h0 & MASK44;
+    h1 += c;
+
+    m += 16;
+    bytes -= 16;
+  }
+
+  h[0] = h0; h[1] = h1; h[2] = h2;
+}
+
+int crypto_onetimeauth(unsigned char *out,const unsigned char *in,unsigned long long inlen,const unsigned char *k)
+{
+  u64 r[3],h[3];
+  u64 h0,h1,h2,g0,g1,g2,c,t0,t1;
+  unsigned char block[16];
+  unsigned long long i;
+
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  t0 = load64_le(k);
+  t1 = load64_le(k + 8);
+  r[0] = t0 & 0xffc0fffffffULL;
+  r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+  r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+  h[0] = h[1] = h[2] = 0;
+
+  poly1305_blocks(h,r,in,inlen & ~15ULL,((u64)1) << 40);
+
+  if (inlen & 15) {
+    in += inlen & ~15ULL;
+    inlen &= 15;
+    for (i = 0;i < inlen;++i) block[i] = in[i];
+    block[i++] = 1;
+    for (;i < 16;++i) block[i] = 0;
+    poly1305_blocks(h,r,block,16,0);
+  }
+
+  /* fully carry h */
+  h0 = h[0]; h1 = h[1]; h2 = h[2];
+  c = h1 >> 44; h1 &= MASK44;
+  h2 += c; c = h2 >> 42; h2 &= MASK42;
+  h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+  h1 += c; c = h1 >> 44; h1 &= MASK44;
+  h2 += c; c = h2 >> 42; h2 &= MASK42;
+  h0 += c * 5; c = h0 >> 44; h0 &= MASK44;
+  h1 += c;
+
+  /* compute h + -p */
+  g0 = h0 + 5; c = g0 >> 44; g0 &= MASK44;
+  g1 = h1 + c; c = g1 >> 44; g1 &= MASK44;
+  g2 = h2 + c - (((u64)1) << 42);
+
+  /* select h if h < p, or h + -p if h >= p */
+  c = (g2 >> 63) - 1;
+  g0 &= c;
+  g1 &= c;
+  g2 &= c;
+  c = ~c;
+  h0 = (h0 & c) | g0;
+  h1 = (h1 & c) | g1;
+  h2 = (h2 & c) | g2;
+
+  /* h = h + s, mod 2^128 */
+  t0 = load64_le(k + 16);
+  t1 = load64_le(k + 24);
+  h0 += t0 & MASK44; c = h0 >> 44; h0 &= MASK44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c; c = h1 >> 44; h1 &= MASK44;
+  h2 += ((t1 >> 24) & MASK42) + c; h2 &= MASK42;
+
+  store64_le(out,h0 | (h1 << 44));
+  store64_le(out + 8,(h1 >> 20) | (h2 << 24));
+  return 0;
+}
+
+#endif
@@ -3,13 +3,13 @@
 
 #include "crypto_scalarmult_curve25519.h"
 
-#define crypto_scalarmult crypto_scalarmult_curve25519
+#define crypto_scalarmult crypto_scalarmult_curve25519_ref
 /* CHEESEBURGER crypto_scalarmult_curve25519 */
-#define crypto_scalarmult_base crypto_scalarmult_curve25519_base
+#define crypto_scalarmult_base crypto_scalarmult_curve25519_ref_base
 /* CHEESEBURGER crypto_scalarmult_curve25519_base */
-#define crypto_scalarmult_BYTES crypto_scalarmult_curve25519_BYTES
+#define crypto_scalarmult_BYTES crypto_scalarmult_curve25519_ref_BYTES
 /* CHEESEBURGER crypto_scalarmult_curve25519_BYTES */
-#define crypto_scalarmult_SCALARBYTES crypto_scalarmult_curve25519_SCALARBYTES
+#define crypto_scalarmult_SCALARBYTES crypto_scalarmult_curve25519_ref_SCALARBYTES
 /* CHEESEBURGER crypto_scalarmult_curve25519_SCALARBYTES */
 #define crypto_scalarmult_PRIMITIVE "curve25519"
 #define crypto_scalarmult_IMPLEMENTATION crypto_scalarmult_curve25519_IMPLEMENTATION
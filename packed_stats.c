@@ -18,15 +18,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stdio.h>
 #include <strings.h>
+#include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "arithmetic.h"
 #include "charset.h"
 #include "packed_stats.h"
 #include "unicode.h"
+#include "md5.h"
 
 void node_free_recursive(struct node *n)
 {
@@ -48,14 +51,25 @@ void node_free(struct node *n)
   return;
 }
 
+/* Serialises reads of the statistics file by a handle and its clones */
+static pthread_mutex_t stats_file_lock=PTHREAD_MUTEX_INITIALIZER;
+
 void stats_handle_free(stats_handle *h)
 {
+  int i;
+  if (h->parent) {
+    for(i=0;i<512;i++) if (h->unicode_pages[i]) free(h->unicode_pages[i]);
+    if (h->unicode_page_addresses) free(h->unicode_page_addresses);
+    free(h);
+    return;
+  }
+
   if (h->mmap) munmap(h->mmap,h->fileLength);
+  if (h->file) fclose(h->file);
   if (h->buffer) free(h->buffer);
   if (h->bufferBitmap) free(h->bufferBitmap);
   if (h->tree) node_free_recursive(h->tree);
 
-  int i;
   for(i=0;i<512;i++) if (h->unicode_pages[i]) free(h->unicode_pages[i]);
   if (h->unicode_page_addresses) free(h->unicode_page_addresses);
 
@@ -71,6 +85,62 @@ unsigned int read24bits(FILE *f)
   return v;
 }
 
+/*
+  Work out the fingerprint of the statistics file, if that has not been done
+  already.  Only handles that need to be told apart, such as the models that
+  smacd and libsmac load, are fingerprinted, since it means hashing the whole
+  file.
+*/
+int stats_fingerprint(stats_handle *h)
+{
+  unsigned char hash[16];
+  char hex[STATS_FINGERPRINT_BYTES*2+1];
+  MD5_CTX md5;
+
+  if (h->fingerprinted) return 0;
+  MD5_Init(&md5);
+  if (h->mmap) MD5_Update(&md5,h->mmap,h->fileLength);
+  else {
+    unsigned char buffer[65536];
+    int r;
+    pthread_mutex_lock(&stats_file_lock);
+    fseek(h->file,0,SEEK_SET);
+    while((r=fread(buffer,1,sizeof(buffer),h->file))>0) MD5_Update(&md5,buffer,r);
+    r=ferror(h->file);
+    pthread_mutex_unlock(&stats_file_lock);
+    if (r) {
+      fprintf(stderr,"Could not read statistics file to fingerprint it\n");
+      return -1;
+    }
+  }
+  MD5_Final(hash,&md5);
+  bcopy(hash,h->fingerprint,STATS_FINGERPRINT_BYTES);
+  h->fingerprinted=1;
+  stats_fingerprint_hex(h->fingerprint,hex);
+  fprintf(stderr,"Statistics file fingerprint is %s\n",hex);
+  return 0;
+}
+
+int stats_fingerprint_hex(unsigned char *fingerprint,char *hex)
+{
+  int i;
+  for(i=0;i<STATS_FINGERPRINT_BYTES;i++) sprintf(&hex[i*2],"%02x",fingerprint[i]);
+  return 0;
+}
+
+int stats_fingerprint_parse(char *hex,unsigned char *fingerprint)
+{
+  int i;
+  if (strlen(hex)!=STATS_FINGERPRINT_BYTES*2) return -1;
+  for(i=0;i<STATS_FINGERPRINT_BYTES;i++) {
+    unsigned int v;
+    if (!isxdigit(hex[i*2])||!isxdigit(hex[i*2+1])
+	||sscanf(&hex[i*2],"%2x",&v)!=1) return -1;
+    fingerprint[i]=v;
+  }
+  return 0;
+}
+
 stats_handle *stats_new_handle(char *file)
 {
   int i,j;
@@ -151,6 +221,22 @@ stats_handle *stats_new_handle(char *file)
   return h;
 }
 
+/*
+  A handle for use by another thread.  It shares the file and the statistics
+  tree of h, which must outlive it, but has its own vector for
+  extractVector() to return and loads its own unicode statistics.
+*/
+stats_handle *stats_handle_clone(stats_handle *h)
+{
+  stats_handle *clone=malloc(sizeof(stats_handle));
+  if (!clone) return NULL;
+  bcopy(h,clone,sizeof(stats_handle));
+  clone->parent=h;
+  bzero(clone->unicode_pages,sizeof(clone->unicode_pages));
+  clone->unicode_page_addresses=NULL;
+  return clone;
+}
+
 int stats_load_tree(stats_handle *h)
 {  
   extractNodeAt(NULL,0,h->rootNodeAddress,h->totalCount,h,
@@ -174,13 +260,16 @@ unsigned char *getCompressedBytes(stats_handle *h,int start,int count)
   
   /* not memory mapped, so pull in the appropriate part of the file as required */
   int i;
+  pthread_mutex_lock(&stats_file_lock);
   for(i=((start)>>10);i<=((start+count)>>10);i++)
     {
       if (!h->bufferBitmap[i]) {
+	fseek(h->file,i<<10,SEEK_SET);
 	fread(&h->buffer[i<<10],1024,1,h->file);
 	h->bufferBitmap[i]=1;
       }
     }
+  pthread_mutex_unlock(&stats_file_lock);
   return &h->buffer[start];
 }
 
@@ -505,6 +594,7 @@ int *getUnicodeStatistics(stats_handle *h,int codePage)
     fprintf(stderr,"Illegal code page: 0x%x\n",codePage);
     return NULL;
   }
+  pthread_mutex_lock(&stats_file_lock);
   if (!h->unicode_page_addresses) {
     // Load list of addresses to unicode page statistics
     h->unicode_page_addresses=calloc(sizeof(int),512);
@@ -555,6 +645,7 @@ int *getUnicodeStatistics(stats_handle *h,int codePage)
     for(i=0;i<128+512+1;i++)
       h->unicode_pages[codePage]->counts[i]*=rescaleFactor;
   }
+  pthread_mutex_unlock(&stats_file_lock);
   return h->unicode_pages[codePage]->counts;
 }
 
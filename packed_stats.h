@@ -41,8 +41,17 @@ struct unicode_page_statistics {
   int counts[128+512+1];
 };
 
+/*
+  Identifies the statistics file a message was compressed with: the first
+  bytes of the MD5 hash of the file.  Compressed data does not carry it, so
+  it travels alongside, as it does in smacd's responses.
+*/
+#define STATS_FINGERPRINT_BYTES 4
+
 typedef struct compressed_stats_handle {
   FILE *file;
+  unsigned char fingerprint[STATS_FINGERPRINT_BYTES]; // see stats_fingerprint()
+  int fingerprinted;
   unsigned char *mmap;
   int fileLength;
   int dummyOffset;
@@ -74,6 +83,9 @@ typedef struct compressed_stats_handle {
 
   /* Used when not caching vectors for returning vector values */
   struct probability_vector vector;
+
+  /* Handle whose tree and file this one shares, if it is a clone */
+  struct compressed_stats_handle *parent;
 } stats_handle;
 
 void node_free(struct node *n);
@@ -90,6 +102,10 @@ int dumpNode(struct node *n);
 
 void stats_handle_free(stats_handle *h);
 stats_handle *stats_new_handle(char *file);
+stats_handle *stats_handle_clone(stats_handle *h);
+int stats_fingerprint(stats_handle *h);
+int stats_fingerprint_hex(unsigned char *fingerprint,char *hex);
+int stats_fingerprint_parse(char *hex,unsigned char *fingerprint);
 int stats_load_tree(stats_handle *h);
 unsigned char *getCompressedBytes(stats_handle *h,int start,int count);
 int *getUnicodeStatistics(stats_handle *h,int codePage);
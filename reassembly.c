@@ -0,0 +1,428 @@
+/*
+  Reassembly of the fragments of encrypted succinct data messages.
+
+  A fragment is two characters giving its number and the number of the last
+  data fragment of its message, then eight characters of encoded nonce (the
+  prefix) naming the message, then the data.  Fragments numbered beyond the
+  last data fragment are parity fragments.  Fragment files are named by
+  these first ten characters.
+
+  The journal is a text file of lines:
+
+  F <time> <fragment>     a fragment was accepted
+  D <prefix> <time>       the message was complete, and has been delivered
+  E <prefix>              the set expired
+
+  It is rewritten with only the lines that still matter once most of it no
+  longer does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+
+#include "reassembly.h"
+
+int char_to_num(int c);
+
+// Rewrite the journal once it is this big, and mostly dead
+#define REASSEMBLY_COMPACT_SIZE (1024*1024)
+// Look for expired sets this often
+#define REASSEMBLY_EXPIRY_INTERVAL (60*60)
+
+static unsigned int reassembly_hash(const char *prefix)
+{
+  unsigned int h=2166136261U;
+  for(;*prefix;prefix++) h=(h^(unsigned char)*prefix)*16777619U;
+  return h;
+}
+
+// Parse the ten character header of a fragment or fragment file name
+static int reassembly_header(const char *s,int *frag_num,int *frag_count,
+			     char *prefix)
+{
+  int i;
+  for(i=0;i<10;i++) if (!s[i]||char_to_num(s[i])<0) return -1;
+  *frag_num=char_to_num(s[0]);
+  *frag_count=char_to_num(s[1]);
+  bcopy(&s[2],prefix,8);
+  prefix[8]=0;
+  return 0;
+}
+
+static struct fragment_set *reassembly_find(struct reassembly *r,
+					    const char *prefix)
+{
+  struct fragment_set *f=r->buckets[reassembly_hash(prefix)%r->bucket_count];
+  for(;f;f=f->next)
+    if (!strcmp(f->prefix,prefix)) return f;
+  return NULL;
+}
+
+static int reassembly_grow(struct reassembly *r)
+{
+  int count=r->bucket_count*2;
+  struct fragment_set **buckets=calloc(count,sizeof(*buckets));
+  if (!buckets) return -1;
+  int i;
+  for(i=0;i<r->bucket_count;i++) {
+    struct fragment_set *f=r->buckets[i];
+    while(f) {
+      struct fragment_set *next=f->next;
+      unsigned int b=reassembly_hash(f->prefix)%count;
+      f->next=buckets[b];
+      buckets[b]=f;
+      f=next;
+    }
+  }
+  free(r->buckets);
+  r->buckets=buckets;
+  r->bucket_count=count;
+  return 0;
+}
+
+static int reassembly_evict_oldest(struct reassembly *r);
+
+static struct fragment_set *reassembly_new_set(struct reassembly *r,
+					       const char *prefix,int frag_count)
+{
+  if (r->set_count>=REASSEMBLY_MAX_SETS&&reassembly_evict_oldest(r)) return NULL;
+  if (r->set_count>=r->bucket_count*2&&reassembly_grow(r)) return NULL;
+  struct fragment_set *f=calloc(1,sizeof(struct fragment_set));
+  if (!f) return NULL;
+  f->slots=frag_count+1;
+  f->pieces=calloc(f->slots,sizeof(char *));
+  if (!f->pieces) { free(f); return NULL; }
+  strcpy(f->prefix,prefix);
+  f->frag_count=frag_count;
+  unsigned int b=reassembly_hash(prefix)%r->bucket_count;
+  f->next=r->buckets[b];
+  r->buckets[b]=f;
+  r->set_count++;
+  r->pending_count++;
+  return f;
+}
+
+static void reassembly_free_pieces(struct fragment_set *f)
+{
+  int i;
+  if (!f->pieces) return;
+  for(i=0;i<f->slots;i++) if (f->pieces[i]) free(f->pieces[i]);
+  free(f->pieces);
+  f->pieces=NULL;
+}
+
+static void reassembly_remove(struct reassembly *r,struct fragment_set *f)
+{
+  struct fragment_set **p=&r->buckets[reassembly_hash(f->prefix)%r->bucket_count];
+  while(*p!=f) p=&(*p)->next;
+  *p=f->next;
+  if (!f->complete) r->pending_count--;
+  r->set_count--;
+  r->journal_live-=f->journal_bytes;
+  reassembly_free_pieces(f);
+  free(f);
+}
+
+static int reassembly_log(struct reassembly *r,struct fragment_set *f,
+			  const char *format,...)
+  __attribute__((format(printf,3,4)));
+
+static int reassembly_log(struct reassembly *r,struct fragment_set *f,
+			  const char *format,...)
+{
+  if (!r->journal) return 0;
+  va_list ap;
+  va_start(ap,format);
+  int n=vfprintf(r->journal,format,ap);
+  va_end(ap);
+  if (n<0||fflush(r->journal)) {
+    fprintf(stderr,"Could not write reassembly journal '%s'\n",r->journal_file);
+    return -1;
+  }
+  r->journal_size+=n;
+  if (f) {
+    f->journal_bytes+=n;
+    r->journal_live+=n;
+  }
+  return 0;
+}
+
+/*
+  Make room for a new set by giving up on the one that has gone longest
+  without a fragment, as if it had expired.
+*/
+static int reassembly_evict_oldest(struct reassembly *r)
+{
+  struct fragment_set *oldest=NULL,*f;
+  int i;
+  for(i=0;i<r->bucket_count;i++)
+    for(f=r->buckets[i];f;f=f->next)
+      if (!oldest||f->last_seen<oldest->last_seen) oldest=f;
+  if (!oldest) return -1;
+  fprintf(stderr,"Holding %d messages: giving up on message %s to make room\n",
+	  r->set_count,oldest->prefix);
+  reassembly_log(r,NULL,"E %s\n",oldest->prefix);
+  reassembly_remove(r,oldest);
+  return 0;
+}
+
+// Whether there are enough pieces, data or parity, to rebuild the message
+static int reassembly_full(struct fragment_set *f)
+{
+  return __builtin_popcountll(f->received)>f->frag_count;
+}
+
+static int reassembly_store(struct reassembly *r,const char *fragment,
+			    time_t now,struct fragment_set **set)
+{
+  int frag_num,frag_count;
+  char prefix[16];
+  if (reassembly_header(fragment,&frag_num,&frag_count,prefix)) return -1;
+
+  struct fragment_set *f=reassembly_find(r,prefix);
+  if (f&&f->complete) return 0; // late duplicate of a delivered message
+  if (!f) f=reassembly_new_set(r,prefix,frag_count);
+  if (!f) return -1;
+  if (f->frag_count!=frag_count) return -1;
+  if (frag_num>=f->slots) {
+    // The first parity fragment of the set
+    char **pieces=realloc(f->pieces,MAX_FRAGMENTS*sizeof(char *));
+    if (!pieces) return -1;
+    bzero(&pieces[f->slots],(MAX_FRAGMENTS-f->slots)*sizeof(char *));
+    f->pieces=pieces;
+    f->slots=MAX_FRAGMENTS;
+  }
+  if (!(f->received&(1ULL<<frag_num))) {
+    f->pieces[frag_num]=strdup(fragment);
+    if (!f->pieces[frag_num]) return -1;
+    f->received|=1ULL<<frag_num;
+    if (now>f->last_seen) f->last_seen=now;
+    reassembly_log(r,f,"F %lld %s\n",(long long)now,fragment);
+  }
+  // A set that was complete but not delivered before a restart is offered
+  // again when any of its fragments turns up
+  if (!reassembly_full(f)) return 0;
+  // and must not expire while the caller is dealing with it
+  if (now>f->last_seen) f->last_seen=now;
+  *set=f;
+  return 1;
+}
+
+static int reassembly_compact(struct reassembly *r)
+{
+  char temp[sizeof(r->journal_file)+5];
+  snprintf(temp,sizeof(temp),"%s.tmp",r->journal_file);
+  FILE *j=fopen(temp,"w");
+  if (!j) {
+    fprintf(stderr,"Could not rewrite reassembly journal '%s'\n",temp);
+    return -1;
+  }
+  long long size=0;
+  int i,p;
+  for(i=0;i<r->bucket_count;i++) {
+    struct fragment_set *f;
+    for(f=r->buckets[i];f;f=f->next) {
+      f->journal_bytes=0;
+      if (f->complete)
+	f->journal_bytes+=fprintf(j,"D %s %lld\n",f->prefix,(long long)f->last_seen);
+      else
+	for(p=0;p<f->slots;p++)
+	  if (f->pieces[p])
+	    f->journal_bytes+=fprintf(j,"F %lld %s\n",(long long)f->last_seen,
+				      f->pieces[p]);
+      size+=f->journal_bytes;
+    }
+  }
+  if (fclose(j)||rename(temp,r->journal_file)) {
+    fprintf(stderr,"Could not replace reassembly journal '%s'\n",r->journal_file);
+    unlink(temp);
+    return -1;
+  }
+  fclose(r->journal);
+  r->journal=fopen(r->journal_file,"a");
+  r->journal_size=size;
+  r->journal_live=size;
+  return r->journal?0:-1;
+}
+
+static void reassembly_maybe_compact(struct reassembly *r)
+{
+  if (r->journal&&r->journal_size>REASSEMBLY_COMPACT_SIZE
+      &&r->journal_size>2*r->journal_live)
+    reassembly_compact(r);
+}
+
+// Rebuild the sets described by a journal, and truncate any torn last line
+static int reassembly_replay(struct reassembly *r,char *journal_file)
+{
+  FILE *j=fopen(journal_file,"r");
+  if (!j) return 0;
+  char line[32768];
+  long long good=0;
+  int lines=0;
+  while(fgets(line,sizeof(line),j)) {
+    int len=strlen(line);
+    if (!len||line[len-1]!='\n') break;
+    line[--len]=0;
+    long long t;
+    char prefix[1024];
+    int n=0;
+    struct fragment_set *f=NULL;
+    if (sscanf(line,"F %lld %n",&t,&n)==1&&n) {
+      int frag_num,frag_count;
+      if (reassembly_store(r,&line[n],t,&f)<0
+	  ||reassembly_header(&line[n],&frag_num,&frag_count,prefix))
+	fprintf(stderr,"Ignoring bad fragment in reassembly journal: '%s'\n",line);
+      else if ((f=reassembly_find(r,prefix))&&!f->complete) {
+	f->journal_bytes+=len+1;
+	r->journal_live+=len+1;
+      }
+    } else if (sscanf(line,"D %15s %lld",prefix,&t)==2) {
+      f=reassembly_find(r,prefix);
+      if (!f) f=reassembly_new_set(r,prefix,0);
+      if (f) {
+	if (!f->complete) r->pending_count--;
+	reassembly_free_pieces(f);
+	f->complete=1;
+	f->last_seen=t;
+	r->journal_live-=f->journal_bytes;
+	f->journal_bytes=len+1;
+	r->journal_live+=len+1;
+      }
+    } else if (sscanf(line,"E %15s",prefix)==1) {
+      f=reassembly_find(r,prefix);
+      if (f) reassembly_remove(r,f);
+    } else
+      fprintf(stderr,"Ignoring unrecognised line in reassembly journal: '%s'\n",line);
+    good=ftell(j);
+    lines++;
+  }
+  fclose(j);
+  r->journal_size=good;
+  if (truncate(journal_file,good))
+    fprintf(stderr,"Could not truncate reassembly journal '%s'\n",journal_file);
+  fprintf(stderr,"Replayed %d journal lines: %d messages awaiting fragments\n",
+	  lines,r->pending_count);
+  return 0;
+}
+
+/*
+  Create a reassembly engine.  If journal_file is not NULL, sets recorded in
+  it are restored, and changes are appended to it.  Sets are given up on
+  expiry seconds after their last fragment arrived.
+*/
+struct reassembly *reassembly_open(char *journal_file,int expiry)
+{
+  struct reassembly *r=calloc(1,sizeof(struct reassembly));
+  if (!r) return NULL;
+  r->bucket_count=1024;
+  r->buckets=calloc(r->bucket_count,sizeof(*r->buckets));
+  if (!r->buckets) { free(r); return NULL; }
+  r->expiry=expiry>0?expiry:REASSEMBLY_DEFAULT_EXPIRY;
+
+  if (journal_file) {
+    snprintf(r->journal_file,1024,"%s",journal_file);
+    reassembly_replay(r,journal_file);
+    r->journal=fopen(journal_file,"a");
+    if (!r->journal) {
+      fprintf(stderr,"Could not open reassembly journal '%s'\n",journal_file);
+      reassembly_close(r);
+      return NULL;
+    }
+    reassembly_expire(r,time(0));
+  }
+  return r;
+}
+
+void reassembly_close(struct reassembly *r)
+{
+  int i;
+  for(i=0;i<r->bucket_count;i++)
+    while(r->buckets[i]) reassembly_remove(r,r->buckets[i]);
+  free(r->buckets);
+  if (r->journal) fclose(r->journal);
+  free(r);
+}
+
+/*
+  Whether the fragment that a file of this name holds has already been
+  accepted (1), or belongs to a message that has been delivered (2), so that
+  the file need not be read.
+*/
+int reassembly_known(struct reassembly *r,const char *name)
+{
+  int frag_num,frag_count;
+  char prefix[16];
+  if (reassembly_header(name,&frag_num,&frag_count,prefix)) return 0;
+  struct fragment_set *f=reassembly_find(r,prefix);
+  if (!f) return 0;
+  if (f->complete) return 2;
+  // Files of complete but undelivered sets must be read again to deliver them
+  return f->frag_count==frag_count&&(f->received&(1ULL<<frag_num))
+    &&!reassembly_full(f);
+}
+
+/*
+  Add a received fragment.  Returns 1, with *set pointing at the complete set,
+  if the fragment completes its message, 0 if more fragments are needed (or
+  the fragment was a duplicate), or -1 if the fragment is malformed or cannot
+  be stored.  The caller must pass a complete set to reassembly_complete()
+  once it has dealt with it.
+*/
+int reassembly_add(struct reassembly *r,const char *fragment,time_t now,
+		   struct fragment_set **set)
+{
+  if (now-r->last_expiry>=REASSEMBLY_EXPIRY_INTERVAL)
+    reassembly_expire(r,now);
+  return reassembly_store(r,fragment,now,set);
+}
+
+// Forget the fragments of a delivered message, but not that it was delivered
+int reassembly_complete(struct reassembly *r,struct fragment_set *f,time_t now)
+{
+  reassembly_free_pieces(f);
+  f->complete=1;
+  f->last_seen=now;
+  r->pending_count--;
+  r->journal_live-=f->journal_bytes;
+  f->journal_bytes=0;
+  int result=reassembly_log(r,f,"D %s %lld\n",f->prefix,(long long)now);
+  reassembly_maybe_compact(r);
+  return result;
+}
+
+// Evict sets that have not been added to for the expiry period
+int reassembly_expire(struct reassembly *r,time_t now)
+{
+  int i,count=0;
+  r->last_expiry=now;
+  for(i=0;i<r->bucket_count;i++) {
+    struct fragment_set *f=r->buckets[i];
+    while(f) {
+      struct fragment_set *next=f->next;
+      if (f->last_seen+r->expiry<now) {
+	if (!f->complete)
+	  fprintf(stderr,"Giving up on message %s: %d of %d fragments after %d seconds\n",
+		  f->prefix,__builtin_popcountll(f->received),f->frag_count+1,
+		  r->expiry);
+	reassembly_log(r,NULL,"E %s\n",f->prefix);
+	reassembly_remove(r,f);
+	count++;
+      }
+      f=next;
+    }
+  }
+  if (count) reassembly_maybe_compact(r);
+  return count;
+}
+
+// Number of messages of which some but not all fragments have been received
+int reassembly_pending(struct reassembly *r)
+{
+  return r->pending_count;
+}
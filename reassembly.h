@@ -0,0 +1,57 @@
+/*
+  Reassembly of the fragments of encrypted succinct data messages.
+
+  Fragments are collected into sets by the encoded nonce (the prefix) that
+  names their message, in a hash table, with a bitmap of the pieces received
+  so far.  A message may also have been sent with parity fragments (see
+  fec.h), numbered after its data fragments, in which case it can be rebuilt
+  as soon as as many pieces as it has data fragments have arrived.
+
+  If a journal file is given, every fragment accepted, and every message
+  completed or given up on, is appended to it, so that partial sets survive
+  a restart, and fragments already used need not be read again.
+  Sets that have not grown for the expiry period are dropped.
+*/
+
+#define MAX_FRAGMENTS 64
+
+// Sets not added to for this long are evicted
+#define REASSEMBLY_DEFAULT_EXPIRY (7*24*60*60)
+// Most sets held at once; the longest idle is given up on to make room
+#define REASSEMBLY_MAX_SETS (1<<20)
+
+struct fragment_set {
+  char prefix[16];
+  int frag_count;              // number of the last data fragment
+  unsigned long long received; // bitmap of the pieces held
+  char **pieces;               // indexed by fragment number, or NULL once complete
+  int slots;                   // entries in pieces
+  int complete;                // delivered; kept to recognise late duplicates
+  time_t last_seen;
+  int journal_bytes;           // length of the journal lines describing it
+  struct fragment_set *next;   // in hash bucket
+};
+
+struct reassembly {
+  struct fragment_set **buckets;
+  int bucket_count;
+  int set_count;
+  int pending_count;           // sets that are not complete
+
+  int expiry;
+  time_t last_expiry;
+
+  FILE *journal;
+  char journal_file[1024];
+  long long journal_live;      // bytes of journal still describing held state
+  long long journal_size;
+};
+
+struct reassembly *reassembly_open(char *journal_file,int expiry);
+void reassembly_close(struct reassembly *r);
+int reassembly_known(struct reassembly *r,const char *name);
+int reassembly_add(struct reassembly *r,const char *fragment,time_t now,
+		   struct fragment_set **set);
+int reassembly_complete(struct reassembly *r,struct fragment_set *f,time_t now);
+int reassembly_expire(struct reassembly *r,time_t now);
+int reassembly_pending(struct reassembly *r);
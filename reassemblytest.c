@@ -0,0 +1,143 @@
+/*
+  Journal checks for fragment reassembly.
+
+  Fragments are fed to a reassembly engine with a journal, and the engine
+  reopened from it at each step, to check that partial sets survive a
+  restart, that delivered and expired sets are remembered as such, and that
+  compaction of a journal of mostly delivered messages keeps what is still
+  needed.
+
+  Usage: reassemblytest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "reassembly.h"
+
+#define EXPIRY 100
+// Enough two fragment messages of this size to pass the compaction threshold
+#define CHURN_MESSAGES 1200
+#define CHURN_BYTES 1000
+
+int failures=0;
+
+void check(int ok,const char *what)
+{
+  if (!ok) {
+    fprintf(stderr,"FAIL: %s\n",what);
+    failures++;
+  }
+}
+
+// Fragment frag_num of a two fragment message, whose prefix is eight digits
+void fragment(char *out,int out_size,int message,int frag_num,int data_bytes)
+{
+  int len=snprintf(out,out_size,"%d1%08d",frag_num,message);
+  for(;len<10+data_bytes&&len<out_size-1;len++) out[len]='a'+(message+len)%26;
+  out[len]=0;
+}
+
+int add(struct reassembly *r,int message,int frag_num,time_t now,
+	struct fragment_set **f)
+{
+  char text[CHURN_BYTES+16];
+  fragment(text,sizeof(text),message,frag_num,32);
+  return reassembly_add(r,text,now,f);
+}
+
+long long file_size(char *filename)
+{
+  struct stat st;
+  if (stat(filename,&st)) return -1;
+  return st.st_size;
+}
+
+int main(int argc,char **argv)
+{
+  char journal[]="/tmp/reassemblytest.XXXXXX";
+  int fd=mkstemp(journal);
+  if (fd<0) { perror("mkstemp"); return 1; }
+  close(fd);
+  time_t now=time(0);
+  struct fragment_set *f=NULL;
+  char text[CHURN_BYTES+16];
+  int i;
+
+  // Three messages with one of their two fragments each
+  struct reassembly *r=reassembly_open(journal,EXPIRY);
+  if (!r) return 1;
+  for(i=1;i<=3;i++) check(add(r,i,0,now,&f)==0,"first fragment is held");
+  check(add(r,1,0,now,&f)==0,"duplicate fragment is ignored");
+  reassembly_close(r);
+
+  r=reassembly_open(journal,EXPIRY);
+  if (!r) return 1;
+  check(reassembly_pending(r)==3,"partial sets survive a restart");
+  check(reassembly_known(r,"0100000001")==1,"held fragment is known");
+  f=NULL;
+  check(add(r,1,1,now+50,&f)==1&&f,"second fragment completes the message");
+  if (f) {
+    fragment(text,sizeof(text),1,0,32);
+    check(f->pieces&&f->pieces[0]&&!strcmp(f->pieces[0],text),
+	  "fragment from before the restart is intact");
+    reassembly_complete(r,f,now+50);
+  }
+  check(add(r,1,0,now+60,&f)==0,"late duplicate of a delivered message is ignored");
+  check(add(r,3,1,now+60,&f)==1,"other message completes");
+  // Message 2 has not grown since now, and message 3 is complete but
+  // undelivered, so only message 2 is given up on
+  check(reassembly_expire(r,now+EXPIRY+10)==1,"stale set expires");
+  check(reassembly_pending(r)==1,"only the undelivered set is pending");
+  reassembly_close(r);
+
+  r=reassembly_open(journal,EXPIRY);
+  if (!r) return 1;
+  check(reassembly_known(r,"0100000001")==2,"delivery survives a restart");
+  check(reassembly_known(r,"0100000002")==0,"expiry survives a restart");
+  f=NULL;
+  check(add(r,3,0,now+60,&f)==1&&f,"complete undelivered set is offered again");
+  if (f) reassembly_complete(r,f,now+60);
+  check(reassembly_pending(r)==0,"nothing is pending");
+
+  // Leave one message partial, then deliver enough others that the journal
+  // is mostly dead and is compacted
+  check(add(r,4,0,now+60,&f)==0,"first fragment is held");
+  for(i=0;i<CHURN_MESSAGES;i++) {
+    f=NULL;
+    fragment(text,sizeof(text),1000+i,0,CHURN_BYTES);
+    reassembly_add(r,text,now+60,&f);
+    fragment(text,sizeof(text),1000+i,1,CHURN_BYTES);
+    if (reassembly_add(r,text,now+60,&f)==1&&f) reassembly_complete(r,f,now+60);
+  }
+  reassembly_close(r);
+  check(file_size(journal)<CHURN_MESSAGES*CHURN_BYTES,"journal is compacted");
+
+  r=reassembly_open(journal,EXPIRY);
+  if (!r) return 1;
+  check(reassembly_pending(r)==1,"partial set survives compaction");
+  check(reassembly_known(r,"0100001000")==2,"delivery survives compaction");
+  f=NULL;
+  check(add(r,4,1,now+70,&f)==1&&f,"partial set completes after compaction");
+  if (f) {
+    fragment(text,sizeof(text),4,0,32);
+    check(f->pieces&&f->pieces[0]&&!strcmp(f->pieces[0],text),
+	  "fragment from before compaction is intact");
+    reassembly_complete(r,f,now+70);
+  }
+  reassembly_close(r);
+
+  unlink(journal);
+
+  if (failures) {
+    fprintf(stderr,"%d reassembly checks failed\n",failures);
+    return 1;
+  }
+  printf("Reassembly journal checks passed.\n");
+  return 0;
+}
@@ -15,9 +15,11 @@
 #include <fcntl.h>
 #include <math.h>
 #include <time.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 #ifdef ANDROID
 #include <jni.h>
 #include <android/log.h>
@@ -36,9 +38,21 @@
 #include "smac.h"
 #include "recipe.h"
 #include "md5.h"
-
-int encryptAndFragment(char *filename,int mtu,char *outputdir,char *publickeyhex);
+#include "datetime.h"
+#include "latlong.h"
+#include "store.h"
+
+int encryptAndFragment(char *filename,int mtu,char *outputdir,char *publickeyhex,
+		       int parity,int encoding,int debug);
+int encryptAndFragmentFiles(char **filenames,int count,int mtu,char *outputdir,
+			    char *publickeyhex,int parity,int encoding,int debug);
+int fragment_encoding_by_name(char *name);
+int fragment_payload_bytes(int mtu,int fragment_count,int parity,int encoding);
 int defragmentAndDecrypt(char *inputdir,char *outputdir,char *passphrase);
+int ingest_run(stats_handle *h,char *recipe_dir,char *inbox,char *output_dir,
+	       char *passphrase);
+int recipe_compress_batch(stats_handle *h,char *recipe_dir,char *input_file,
+			  char *output_file,int threads,int out_size);
 int recipe_create(char *input);
 int xhtml_recipe_create(char *input);
 
@@ -85,6 +99,8 @@ int recipe_parse_fieldtype(char *name)
   if (!strcasecmp(name,"magpiuuid")) return FIELDTYPE_MAGPIUUID;
   if (!strcasecmp(name,"enum")) return FIELDTYPE_ENUM;
   if (!strcasecmp(name,"multi")) return FIELDTYPE_MULTISELECT;
+  if (!strcasecmp(name,"subform")) return FIELDTYPE_SUBFORM;
+  if (!strcasecmp(name,"repeat")) return FIELDTYPE_SUBFORM;
   
   return -1;
 }
@@ -104,15 +120,20 @@ char *recipe_field_type_name(int f)
   case FIELDTYPE_TEXT: return    "text";
   case FIELDTYPE_UUID: return    "uuid";
   case FIELDTYPE_MAGPIUUID: return    "magpiuuid";
+  case FIELDTYPE_SUBFORM: return    "subform";
   default: return "unknown";
   }
 }
 
-char recipe_error[1024]="No error.\n";
+// Each thread has its own, so that records can be compressed in parallel
+__thread char recipe_error[1024]="No error.\n";
 
 void recipe_free(struct recipe *recipe)
 {
   int i;
+  recipe_model_free(recipe);
+  if (recipe->template) template_free(recipe->template);
+  recipe->template=NULL;
   for(i=0;i<recipe->field_count;i++) {
     if (recipe->fields[i].name) free(recipe->fields[i].name);
     recipe->fields[i].name=NULL;
@@ -184,6 +205,9 @@ struct recipe *recipe_read(char *formname,char *buffer,int buffer_size)
   char name[16384],type[16384];
   int min,max,precision;
   char enumvalues[16384];
+  char delta_name[16384]="";
+
+  recipe->delta_field=-1;
 
   for(i=0;i<=buffer_size;i++) {
     if (l>16380) { 
@@ -196,13 +220,25 @@ struct recipe *recipe_read(char *formname,char *buffer,int buffer_size)
       }
       // Process recipe line
       line[l]=0; 
-      if ((l>0)&&(line[0]!='#')) {
+      if ((l>0)&&(line[0]=='@')) {
+	// Recipe header: options that apply to the whole recipe
+	if (!strcasecmp(line,"@presence:flat"))
+	  recipe->presence_coding=PRESENCE_CODING_FLAT;
+	else if (!strcasecmp(line,"@presence:context"))
+	  recipe->presence_coding=PRESENCE_CODING_CONTEXT;
+	else if (!strncasecmp(line,"@delta:",strlen("@delta:"))&&line[7])
+	  snprintf(delta_name,sizeof(delta_name),"%s",&line[7]);
+	else {
+	  snprintf(recipe_error,1024,"line:%d:Unknown recipe header '%.900s'.\n",line_number,line);
+	  recipe_free(recipe); return NULL;
+	}
+      } else if ((l>0)&&(line[0]!='#')) {
 	enumvalues[0]=0;
 	if (sscanf(line,"%[^:]:%[^:]:%d:%d:%d:%[^\n]",
 		   name,type,&min,&max,&precision,enumvalues)>=5) {
 	  int fieldtype=recipe_parse_fieldtype(type);
 	  if (fieldtype==-1) {
-	    snprintf(recipe_error,1024,"line:%d:Unknown or misspelled field type '%s'.\n",line_number,type);
+	    snprintf(recipe_error,1024,"line:%d:Unknown or misspelled field type '%.900s'.\n",line_number,type);
 	    recipe_free(recipe); return NULL;
 	  } else {
 	    // Store parsed field
@@ -211,8 +247,32 @@ struct recipe *recipe_read(char *formname,char *buffer,int buffer_size)
 	    recipe->fields[recipe->field_count].minimum=min;
 	    recipe->fields[recipe->field_count].maximum=max;
 	    recipe->fields[recipe->field_count].precision=precision;
+	    recipe->fields[recipe->field_count].whole=fieldtype==FIELDTYPE_TEXT
+	      &&(precision<0||!strcasecmp(name,"formid"));
+	    recipe->fields[recipe->field_count].group=-1;
+	    recipe->fields[recipe->field_count].latlong_reference=-1;
+
+	    if (fieldtype==FIELDTYPE_LATLONG&&enumvalues[0]) {
+	      char reference[1024];
+	      if (latlong_parse_options(&recipe->fields[recipe->field_count],
+					enumvalues,reference,sizeof(reference))) {
+		recipe->field_count++;
+		recipe_free(recipe); return NULL;
+	      }
+	      if (reference[0]) {
+		int r=recipe_field_lookup(recipe,reference,strlen(reference),0);
+		if (r<0||recipe->fields[r].type!=FIELDTYPE_LATLONG) {
+		  snprintf(recipe_error,1024,"line:%d:'%.900s' is not an earlier location field.\n",
+			   line_number,reference);
+		  recipe->field_count++;
+		  recipe_free(recipe); return NULL;
+		}
+		recipe->fields[recipe->field_count].latlong_reference=r;
+	      }
+	    }
 
-	    if (fieldtype==FIELDTYPE_ENUM||fieldtype==FIELDTYPE_MULTISELECT) {
+	    if (fieldtype==FIELDTYPE_ENUM||fieldtype==FIELDTYPE_MULTISELECT
+		||(fieldtype==FIELDTYPE_SUBFORM&&enumvalues[0])) {
 	      char enum_value[1024];
 	      int e=0;
 	      int en=0;
@@ -254,6 +314,60 @@ struct recipe *recipe_read(char *formname,char *buffer,int buffer_size)
       line[l++]=buffer[i];
     }
   }
+
+  // Mark the fields that belong to each repeat group
+  int f,m;
+  for(f=0;f<recipe->field_count;f++) {
+    struct field *group=&recipe->fields[f];
+    if (group->type!=FIELDTYPE_SUBFORM) continue;
+    if (group->maximum<=0) group->maximum=REPEAT_DEFAULT_MAXIMUM;
+    if (group->maximum>MAX_REPEAT_INSTANCES) group->maximum=MAX_REPEAT_INSTANCES;
+    for(m=0;m<group->enum_count;m++) {
+      int member=recipe_field_lookup(recipe,group->enum_values[m],
+				     strlen(group->enum_values[m]),f+1);
+      if (member<0||member==f||recipe->fields[member].group!=-1) {
+	snprintf(recipe_error,1024,"Repeat group '%s' lists unknown or already grouped field '%s'.\n",
+		 group->name,group->enum_values[m]);
+	recipe_free(recipe); return NULL;
+      }
+      recipe->fields[member].group=f;
+    }
+  }
+  // A group must not contain itself, even indirectly
+  for(f=0;f<recipe->field_count;f++) {
+    int depth=0;
+    for(m=recipe->fields[f].group;m>=0&&depth<=recipe->field_count;
+	m=recipe->fields[m].group) depth++;
+    if (m>=0) {
+      snprintf(recipe_error,1024,"Repeat group containing '%s' contains itself.\n",
+	       recipe->fields[f].name);
+      recipe_free(recipe); return NULL;
+    }
+  }
+
+  // Locations are coded relative to a field decoded earlier in the same
+  // instance
+  for(f=0;f<recipe->field_count;f++) {
+    m=recipe->fields[f].latlong_reference;
+    if (m>=0&&recipe->fields[m].group!=recipe->fields[f].group) {
+      snprintf(recipe_error,1024,"Location '%s' is not in the same repeat group as '%s'.\n",
+	       recipe->fields[f].name,recipe->fields[m].name);
+      recipe_free(recipe); return NULL;
+    }
+  }
+
+  // Records may be coded against the previous record from the same device,
+  // as identified by the named field.
+  if (delta_name[0]) {
+    recipe->delta_field=recipe_field_lookup(recipe,delta_name,
+					    strlen(delta_name),0);
+    if (recipe->delta_field<0||recipe->fields[recipe->delta_field].group!=-1
+	||recipe->fields[recipe->delta_field].type==FIELDTYPE_SUBFORM) {
+      snprintf(recipe_error,1024,"@delta names '%s', which is not a top-level question.\n",
+	       delta_name);
+      recipe_free(recipe); return NULL;
+    }
+  }
   return recipe;
 }
 
@@ -293,6 +407,123 @@ int recipe_load_file(char *filename,char *out,int out_size)
   return stat.st_size;
 }
 
+/*
+  Converting a form specification to a recipe means running the whole
+  specification through expat, yet the same few forms are submitted again and
+  again.  So keep the generated recipe and template text of recently seen
+  specifications, keyed by the MD5 hash of the specification text.
+*/
+#define MAX_CACHED_SPECIFICATIONS 16
+struct cached_specification {
+  unsigned char hash[16];
+  char formname[1024];
+  char formversion[1024];
+  char *recipetext;
+  int recipeLen;
+  char *templatetext;
+  int templateLen;
+  int r;
+};
+struct cached_specification specification_cache[MAX_CACHED_SPECIFICATIONS];
+int specification_cache_count=0;
+int specification_cache_next=0;
+pthread_mutex_t specification_cache_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static int specification_cache_copy(struct cached_specification *c,
+				    char *formname,char *formversion,
+				    char *recipetext,int *recipeLen,
+				    char *templatetext,int *templateLen)
+{
+  if (c->recipeLen>=*recipeLen||c->templateLen>=*templateLen) return -1;
+  snprintf(formname,1024,"%s",c->formname);
+  snprintf(formversion,1024,"%s",c->formversion);
+  bcopy(c->recipetext,recipetext,c->recipeLen+1);
+  *recipeLen=c->recipeLen;
+  bcopy(c->templatetext,templatetext,c->templateLen+1);
+  *templateLen=c->templateLen;
+  return c->r;
+}
+
+/*
+  Convert an ODK XML or Magpi XHTML form specification to recipe and template
+  text, as xmlToRecipe() or xhtmlToRecipe() would, but reusing the result of
+  an earlier conversion of an identical specification if there is one.
+*/
+int recipe_specification_to_recipe(char *xmlform_c,int size,
+				   char *formname,char *formversion,
+				   char *recipetext,int *recipeLen,
+				   char *templatetext,int *templateLen)
+{
+  unsigned char hash[16];
+  MD5_CTX md5;
+  int i,r;
+
+  MD5_Init(&md5);
+  MD5_Update(&md5,xmlform_c,size);
+  MD5_Final(hash,&md5);
+
+  pthread_mutex_lock(&specification_cache_lock);
+  for(i=0;i<specification_cache_count;i++)
+    if (!memcmp(hash,specification_cache[i].hash,16)) {
+      r=specification_cache_copy(&specification_cache[i],formname,formversion,
+				 recipetext,recipeLen,templatetext,templateLen);
+      pthread_mutex_unlock(&specification_cache_lock);
+      return r;
+    }
+  pthread_mutex_unlock(&specification_cache_lock);
+
+  // Not cached, so convert it.  The conversion is reentrant, so the lock is not
+  // held while parsing.
+  int recipeMaxLen=*recipeLen;
+  int templateMaxLen=*templateLen;
+  if (!strncasecmp("<html",xmlform_c,5))
+    r=xhtmlToRecipe(xmlform_c,size,formname,formversion,
+		    recipetext,recipeLen,templatetext,templateLen);
+  else
+    r=xmlToRecipe(xmlform_c,size,formname,formversion,
+		  recipetext,recipeLen,templatetext,templateLen);
+  // Only successful conversions are remembered
+  if (r||*recipeLen>=recipeMaxLen||*templateLen>=templateMaxLen) return r;
+
+  struct cached_specification c;
+  bcopy(hash,c.hash,16);
+  snprintf(c.formname,1024,"%s",formname);
+  snprintf(c.formversion,1024,"%s",formversion);
+  c.recipeLen=*recipeLen;
+  c.templateLen=*templateLen;
+  c.r=r;
+  c.recipetext=malloc(c.recipeLen+1);
+  c.templatetext=malloc(c.templateLen+1);
+  if (!c.recipetext||!c.templatetext) {
+    if (c.recipetext) free(c.recipetext);
+    if (c.templatetext) free(c.templatetext);
+    return r;
+  }
+  bcopy(recipetext,c.recipetext,c.recipeLen); c.recipetext[c.recipeLen]=0;
+  bcopy(templatetext,c.templatetext,c.templateLen); c.templatetext[c.templateLen]=0;
+
+  pthread_mutex_lock(&specification_cache_lock);
+  for(i=0;i<specification_cache_count;i++)
+    if (!memcmp(hash,specification_cache[i].hash,16)) break;
+  if (i<specification_cache_count) {
+    // Another thread got there first
+    free(c.recipetext); free(c.templatetext);
+  } else {
+    // Replace entries round-robin once the cache is full
+    if (specification_cache_count<MAX_CACHED_SPECIFICATIONS)
+      i=specification_cache_count++;
+    else {
+      i=specification_cache_next;
+      specification_cache_next=(i+1)%MAX_CACHED_SPECIFICATIONS;
+      free(specification_cache[i].recipetext);
+      free(specification_cache[i].templatetext);
+    }
+    specification_cache[i]=c;
+  }
+  pthread_mutex_unlock(&specification_cache_lock);
+  return r;
+}
+
 struct recipe *recipe_read_from_specification(char *xmlform_c)
 {
   int magpi_mode =0;
@@ -313,16 +544,10 @@ struct recipe *recipe_read_from_specification(char *xmlform_c)
 
   printf("magpi_mode=%d\n",magpi_mode);
   
-  if (magpi_mode)
-    r=xhtmlToRecipe(xmlform_c,strlen(xmlform_c),
-		    form_name,form_version,
-		    recipetext,&recipetextLen,
-		    templatetext,&templatetextLen);
-  else
-    r=xmlToRecipe(xmlform_c,strlen(xmlform_c),
-		  form_name,form_version,
-		  recipetext,&recipetextLen,
-		  templatetext,&templatetextLen);
+  r=recipe_specification_to_recipe(xmlform_c,strlen(xmlform_c),
+				   form_name,form_version,
+				   recipetext,&recipetextLen,
+				   templatetext,&templatetextLen);
 
   if (r<0) return NULL;
 
@@ -365,6 +590,14 @@ struct recipe *recipe_read_from_file(char *filename)
     return NULL;
   }
 
+  // Use trained field model if one has been provided beside the recipe
+  char model_file[1024];
+  if (recipe&&!recipe_model_path(filename,model_file,1024))
+    if (recipe_model_load(recipe,model_file)) {
+      recipe_free(recipe);
+      return NULL;
+    }
+
   return recipe;
 }
 
@@ -385,17 +618,15 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
   int normalised_value;
   int minimum;
   int maximum;
-  int precision;
 
   int r;
-  
-  precision=recipe->fields[fieldnumber].precision;
 
   switch (recipe->fields[fieldnumber].type) {
   case FIELDTYPE_INTEGER:
     minimum=recipe->fields[fieldnumber].minimum;
     maximum=recipe->fields[fieldnumber].maximum;
-    normalised_value=range_decode_equiprobable(c,maximum-minimum+2);
+    normalised_value=recipe_decode_value(c,&recipe->fields[fieldnumber],
+					 maximum-minimum+2);
     if (normalised_value==(maximum-minimum+1)) {
       // out of range value, so decode it as a string.
       fprintf(stderr,"FIELDTYPE_INTEGER: Illegal value - decoding string representation.\n");
@@ -424,7 +655,7 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
       return 0;
     }
   case FIELDTYPE_BOOLEAN:
-    normalised_value=range_decode_equiprobable(c,2);
+    normalised_value=recipe_decode_value(c,&recipe->fields[fieldnumber],2);
     sprintf(value,"%d",normalised_value);
     return 0;
     break;
@@ -448,8 +679,8 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
       break;
     }
   case FIELDTYPE_ENUM:
-    normalised_value=range_decode_equiprobable(c,recipe->fields[fieldnumber]
-					       .enum_count);
+    normalised_value=recipe_decode_value(c,&recipe->fields[fieldnumber],
+					 recipe->fields[fieldnumber].enum_count);
     if (normalised_value<0||normalised_value>=recipe->fields[fieldnumber].enum_count)      {
       printf("enum: range_decode_equiprobable returned illegal value %d for range %d..%d\n",
 	     normalised_value,0,recipe->fields[fieldnumber].enum_count-1);
@@ -463,60 +694,11 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
   case FIELDTYPE_TEXT:
     r=stats3_decompress_bits(c,(unsigned char *)value,&value_size,stats,NULL);
     return 0;
+  case FIELDTYPE_TIMEOFDAY:
   case FIELDTYPE_TIMEDATE:
-    // time is 32-bit seconds since 1970.
-    // Format as yyyy-mm-ddThh:mm:ss+hh:mm
-    {
-      // SMAC has a bug with encoding large ranges, so break into smaller pieces
-      time_t t = 0;
-      t=range_decode_equiprobable(c,0x8000)<<16;
-      t|=range_decode_equiprobable(c,0x10000);
-      printf("TIMEDATE: decoding t=%d\n",(int)t);
-      struct tm tm;
-      // gmtime_r(&t,&tm);
-      localtime_r(&t,&tm);
-      sprintf(value,"%04d-%02d-%02dT%02d:%02d:%02d+00:00",
-	      tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,
-	      tm.tm_hour,tm.tm_min,tm.tm_sec);
-      return 0;
-    }
   case FIELDTYPE_MAGPITIMEDATE:
-    // time encodes each field precisely, allowing years 0 - 9999
-    // Format as yyyy-mm-dd hh:mm:ss
-    {
-      struct tm tm;
-      bzero(&tm,sizeof(tm));
-
-      tm.tm_year=range_decode_equiprobable(c,10000);
-      tm.tm_mon=range_decode_equiprobable(c,12);
-      tm.tm_mday=range_decode_equiprobable(c,31);
-      tm.tm_hour=range_decode_equiprobable(c,25);
-      tm.tm_min=range_decode_equiprobable(c,60);
-      tm.tm_sec=range_decode_equiprobable(c,62);
-      
-      sprintf(value,"%04d-%02d-%02d %02d:%02d:%02d",
-	      tm.tm_year,tm.tm_mon+1,tm.tm_mday,
-	      tm.tm_hour,tm.tm_min,tm.tm_sec);
-      return 0;
-    }
   case FIELDTYPE_DATE:
-    // Date encoded using:
-    // normalised_value=y*372+(m-1)*31+(d-1);
-    // So year = value / 372 ...
-    {
-      if (precision==0) precision=22;
-      int minimum=0;
-      int maximum=10000*372;
-      maximum=maximum>> (22-precision);
-      int normalised_value = range_decode_equiprobable(c,maximum-minimum+1);
-      int year = normalised_value / 372;
-      int day_of_year = normalised_value - (year*372);
-      int month = day_of_year/31+1;
-      int day_of_month = day_of_year%31+1;
-      // American date format for Magpi
-      sprintf(value,"%02d-%02d-%04d",month,day_of_month,year);
-      return 0;
-    }
+    return datetime_decode_field(c,&recipe->fields[fieldnumber],value,value_size);
   case FIELDTYPE_UUID:
     {
       int i,j=5;      
@@ -559,27 +741,8 @@ int recipe_decode_field(struct recipe *recipe,stats_handle *stats, range_coder *
       return 0;
     }
   case FIELDTYPE_LATLONG:
-    {
-      int ilat,ilon;
-      double lat,lon;
-      switch(recipe->fields[fieldnumber].precision) {
-      case 0: case 34:
-	ilat=range_decode_equiprobable(c,182*112000); ilat-=90*112000;
-	ilon=range_decode_equiprobable(c,361*112000); ilon-=180*112000;
-	lat=ilat/112000.0; lon=ilon/112000.0;
-	break;
-      case 16:
-	ilat=range_decode_equiprobable(c,182); ilat-=90;
-	ilon=range_decode_equiprobable(c,361); ilon-=180;
-	lat=ilat; lon=ilon;
-	break;
-      default:
-	sprintf(recipe_error,"Illegal LATLONG precision of %d bits.  Should be 16 or 34.\n",recipe->fields[fieldnumber].precision);
-	return -1;
-      }
-      sprintf(value,"%.5f %.5f",lat,lon);
-      return 0;
-    }
+    // Coded without its reference location, if it has one
+    return latlong_decode_field(c,&recipe->fields[fieldnumber],NULL,value,value_size);
   default:
     snprintf(recipe_error,1024,"Attempting decompression of unsupported field type of '%s'.\n",recipe_field_type_name(recipe->fields[fieldnumber].type));
     return -1;
@@ -601,18 +764,31 @@ int parseHexByte(char *hex)
   return (parseHexDigit(hex[0])<<4)|parseHexDigit(hex[1]);
 }
 
+/*
+  Number of characters of a TEXT value to encode.  Values are cut at the
+  field's maximum length, and if cap is not negative, at cap characters, but
+  never below the field's precision, nor at all if it is kept whole.  UTF-8
+  sequences are not split.
+*/
+int recipe_text_length(struct field *field,const char *value,int cap)
+{
+  int len=strlen(value);
+  if (field->maximum>0&&len>field->maximum) len=field->maximum;
+  if (cap>=0&&len>cap&&!field->whole) {
+    int l=cap;
+    if (l<field->precision) l=field->precision;
+    if (l<len) len=l;
+  }
+  while(len>0&&value[len]&&(value[len]&0xc0)==0x80) len--;
+  return len;
+}
+
 int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *c,
 			int fieldnumber,char *value)
 {
   int normalised_value;
   int minimum;
   int maximum;
-  int precision;
-  int h,m,s,d,y;
-  float lat,lon;
-  int ilat,ilon;
-
-  precision=recipe->fields[fieldnumber].precision;
 
   switch (recipe->fields[fieldnumber].type) {
   case FIELDTYPE_INTEGER:
@@ -629,12 +805,14 @@ int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *
                      minimum,maximum,atoi(value));
       LOGI("Illegal value: min=%d, max=%d, value=%d\n",
                      minimum,maximum,atoi(value));
-      range_encode_equiprobable(c,maximum-minimum+2,maximum-minimum+1);
+      recipe_encode_value(c,&recipe->fields[fieldnumber],
+			  maximum-minimum+2,maximum-minimum+1);
       int r=stats3_compress_append(c,(unsigned char *)value,strlen(value),stats,
 				   NULL);
       return r;
     }
-    return range_encode_equiprobable(c,maximum-minimum+2,normalised_value);
+    return recipe_encode_value(c,&recipe->fields[fieldnumber],
+			       maximum-minimum+2,normalised_value);
   case FIELDTYPE_FLOAT:
     {
       float f = atof(value);
@@ -662,132 +840,15 @@ int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *
     normalised_value=recipe_parse_boolean(value);
     minimum=0;
     maximum=1;
-    return range_encode_equiprobable(c,maximum-minimum+1,normalised_value);
+    return recipe_encode_value(c,&recipe->fields[fieldnumber],
+			       maximum-minimum+1,normalised_value);
   case FIELDTYPE_TIMEOFDAY:
-    if (sscanf(value,"%d:%d.%d",&h,&m,&s)<2) return -1;
-    // XXX - We don't support leap seconds
-    if (h<0||h>23||m<0||m>59||s<0||s>59) return -1;
-    normalised_value=h*3600+m*60+s;
-    minimum=0;
-    maximum=24*60*60;
-    if (precision==0) precision=17; // 2^16 < 24*60*60 < 2^17
-    if (precision<17) {
-      normalised_value=normalised_value >> (17 - precision);
-      minimum=minimum >> (17 - precision);
-      maximum=maximum >> (17 - precision);
-      maximum+=1; // make sure that normalised_value cannot = maximum
-    }
-    return range_encode_equiprobable(c,maximum-minimum+1,normalised_value);
   case FIELDTYPE_TIMEDATE:
-    {
-      struct tm tm;
-      int tzh=0,tzm=0;
-      int r;
-      bzero(&tm,sizeof(tm));
-      if ((r=sscanf(value,"%d-%d-%dT%d:%d:%d.%*d+%d:%d",
-		 &tm.tm_year,&tm.tm_mon,&tm.tm_mday,
-		 &tm.tm_hour,&tm.tm_min,&tm.tm_sec,
-		    &tzh,&tzm))<6) {
-	printf("r=%d\n",r);
-	return -1;
-      }
-#if defined(__sgi) || defined(__sun)
-#else
-      tm.tm_gmtoff=tzm*60+tzh*3600;
-#endif
-      tm.tm_year-=1900;
-      tm.tm_mon-=1;
-      time_t t = mktime(&tm);
-      minimum=1;
-      maximum=0x7fffffff;
-      normalised_value=t;
-
-      int b;
-      b=range_encode_equiprobable(c,0x8000,t>>16);
-      b=range_encode_equiprobable(c,0x10000,t&0xffff);
-      printf("TIMEDATE: encoding t=%d\n",(int)t);
-      return b;
-    }
   case FIELDTYPE_MAGPITIMEDATE:
-    {
-      struct tm tm;
-      // int tzh=0,tzm=0;
-      int r;
-      bzero(&tm,sizeof(tm));
-      if ((r=sscanf(value,"%d-%d-%d %d:%d:%d",
-		 &tm.tm_year,&tm.tm_mon,&tm.tm_mday,
-		 &tm.tm_hour,&tm.tm_min,&tm.tm_sec))<6) {
-	printf("r=%d\n",r);
-	return -1;
-      }
-
-      // Validate fields
-      if (tm.tm_year<0||tm.tm_year>9999) return -1;
-      if (tm.tm_mon<1||tm.tm_mon>12) return -1;
-      if (tm.tm_mday<1||tm.tm_mday>31) return -1;
-      if (tm.tm_hour<0||tm.tm_hour>24) return -1;
-      if (tm.tm_min<0||tm.tm_min>59) return -1;
-      if (tm.tm_sec<0||tm.tm_sec>61) return -1;
-
-      // Encode each field: requires about 40 bits, but safely encodes all values
-      // without risk of timezone munging on Android
-      range_encode_equiprobable(c,10000,tm.tm_year);
-      range_encode_equiprobable(c,12,tm.tm_mon-1);
-      range_encode_equiprobable(c,31,tm.tm_mday-1);
-      range_encode_equiprobable(c,25,tm.tm_hour);
-      range_encode_equiprobable(c,60,tm.tm_min);
-      return range_encode_equiprobable(c,62,tm.tm_sec);
-    }
   case FIELDTYPE_DATE:
-    // ODK does YYYY/MM/DD
-    // Magpi does DD-MM-YYYY
-    // The different delimiter allows us to discern between the two
-    fprintf(stderr,"Parsing FIELDTYPE_DATE value '%s'\n",value);
-    if (sscanf(value,"%d/%d/%d",&y,&m,&d)==3) { }
-    else if (sscanf(value,"%d-%d-%d",&d,&m,&y)==3) { }
-    else return -1;
-
-    // XXX Not as efficient as it could be (assumes all months have 31 days)
-    if (y<1||y>9999||m<1||m>12||d<1||d>31) {
-      fprintf(stderr,"Invalid field value\n");
-      return -1;
-    }
-    normalised_value=y*372+(m-1)*31+(d-1);
-    minimum=0;
-    maximum=10000*372;
-    if (precision==0) precision=22; // 2^21 < maximum < 2^22
-    if (precision<22) {
-      normalised_value=normalised_value >> (22 - precision);
-      minimum=minimum >> (22 - precision);
-      maximum=maximum >> (22 - precision);
-      maximum+=1; // make sure that normalised_value cannot = maximum
-    }
-    return range_encode_equiprobable(c,maximum-minimum+1,normalised_value);
+    return datetime_encode_field(c,&recipe->fields[fieldnumber],value);
   case FIELDTYPE_LATLONG:
-    // Allow space or comma between LAT and LONG
-    if ((sscanf(value,"%f %f",&lat,&lon)!=2)
-	&&(sscanf(value,"%f,%f",&lat,&lon)!=2))
-      return -1;
-    if (lat<-90||lat>90||lon<-180||lon>180) return -1;
-    ilat=lroundf(lat);
-    ilon=lroundf(lon);
-    ilat+=90; // range now 0..181 (for -90 to +90, inclusive)
-    ilon+=180; // range now 0..360 (for -180 to +180, inclusive)
-    if (precision==16) {
-      // gradicule resolution
-      range_encode_equiprobable(c,182,ilat);
-      return range_encode_equiprobable(c,361,ilon);
-    } else if (precision==0||precision==34) {
-      // ~1m resolution
-    ilat=lroundf(lat*112000);
-    ilon=lroundf(lon*112000);
-    ilat+=90*112000; // range now 0..181 (for -90 to +90, inclusive)
-    ilon+=180*112000; // range now 0..359 (for -179 to +180, inclusive)
-    // encode latitude
-    range_encode_equiprobable(c,182*112000,ilat);
-    return range_encode_equiprobable(c,361*112000,ilon);
-    } else
-      return -1;
+    return latlong_encode_field(c,&recipe->fields[fieldnumber],value,NULL,NULL,0);
   case FIELDTYPE_MULTISELECT:
     {
       // Multiselect has labels for each item selected, with a pipe
@@ -837,18 +898,15 @@ int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *
       }
       maximum=recipe->fields[fieldnumber].enum_count;
       printf("enum: encoding %s as %d of %d\n",value,normalised_value,maximum);
-      return range_encode_equiprobable(c,maximum,normalised_value);
+      return recipe_encode_value(c,&recipe->fields[fieldnumber],
+				 maximum,normalised_value);
     }
   case FIELDTYPE_TEXT:
     {
       int before=c->bits_used;
-      // Trim to precision specified length if non-zero
-      if (recipe->fields[fieldnumber].precision>0) {
-	if (strlen(value)>recipe->fields[fieldnumber].precision)
-	  value[recipe->fields[fieldnumber].precision]=0;
-      }
-      int r=stats3_compress_append(c,(unsigned char *)value,strlen(value),stats,
-				   NULL);
+      int r=stats3_compress_append(c,(unsigned char *)value,
+				   recipe_text_length(&recipe->fields[fieldnumber],
+						      value,-1),stats,NULL);
       printf("'%s' encoded in %d bits\n",value,c->bits_used-before);
       if (r) return -1;
       return 0;
@@ -904,8 +962,87 @@ int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *
   return -1;
 }
 
-struct recipe *recipe_find_recipe(char *recipe_dir,unsigned char *formhash)
+/*
+  Recipes found by recipe_find_recipe() are cached, so that decompressing a
+  directory of messages reads each recipe (and compiles each template) only
+  once.  A recipe is read again if its file changes, and the least recently
+  used is dropped when the cache is full.  Each recipe found must be given
+  back with recipe_release(), and is freed once it has been dropped and is
+  no longer in use.
+*/
+#define MAX_CACHED_RECIPES 256
+struct cached_recipe {
+  char *path;
+  time_t mtime;
+  off_t size;
+  unsigned long long last_used;
+  struct recipe *recipe;
+};
+static struct cached_recipe recipe_cache[MAX_CACHED_RECIPES];
+static int recipe_cache_count=0;
+static unsigned long long recipe_cache_clock=0;
+// Held while the cache or the users of a recipe change, for smacd's workers
+static pthread_mutex_t recipe_cache_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Drop cache entry i.  Called with the lock held.
+static void recipe_cache_drop(int i)
+{
+  struct recipe *r=recipe_cache[i].recipe;
+  r->cached=0;
+  if (!r->users) recipe_free(r);
+  free(recipe_cache[i].path);
+  recipe_cache[i]=recipe_cache[--recipe_cache_count];
+}
+
+// Whether the file of cache entry i is as it was when read
+static int recipe_cache_current(int i)
+{
+  struct stat st;
+  return !stat(recipe_cache[i].path,&st)
+    &&st.st_mtime==recipe_cache[i].mtime&&st.st_size==recipe_cache[i].size;
+}
+
+// Add a recipe read from path, making room if need be.  Called with the lock held.
+static int recipe_cache_add(char *path,struct stat *st,struct recipe *r)
 {
+  int i;
+  if (recipe_cache_count>=MAX_CACHED_RECIPES) {
+    int oldest=0;
+    for(i=1;i<recipe_cache_count;i++)
+      if (recipe_cache[i].last_used<recipe_cache[oldest].last_used) oldest=i;
+    recipe_cache_drop(oldest);
+  }
+  struct cached_recipe *c=&recipe_cache[recipe_cache_count];
+  c->path=strdup(path);
+  if (!c->path) return -1;
+  c->mtime=st->st_mtime;
+  c->size=st->st_size;
+  c->last_used=++recipe_cache_clock;
+  c->recipe=r;
+  r->cached=1;
+  recipe_cache_count++;
+  return 0;
+}
+
+static struct recipe *recipe_find_recipe_locked(char *recipe_dir,
+						unsigned char *formhash)
+{
+  char recipe_path[1024];
+  int i;
+  int dir_len=strlen(recipe_dir);
+
+  for(i=0;i<recipe_cache_count;i++)
+    if (!strncmp(recipe_cache[i].path,recipe_dir,dir_len)
+	&&recipe_cache[i].path[dir_len]=='/'
+	&&!memcmp(formhash,recipe_cache[i].recipe->formhash,6)) {
+      if (!recipe_cache_current(i)) {
+	recipe_cache_drop(i);
+	break;
+      }
+      recipe_cache[i].last_used=++recipe_cache_clock;
+      return recipe_cache[i].recipe;
+    }
+
   DIR *dir=opendir(recipe_dir);
   struct dirent *de;
   if (!dir) return NULL;
@@ -915,8 +1052,17 @@ struct recipe *recipe_find_recipe(char *recipe_dir,unsigned char *formhash)
 	if (!strcasecmp(&de->d_name[strlen(de->d_name)-strlen(".recipe")],
 			".recipe"))
 	  {
-	    char recipe_path[1024];
 	    snprintf(recipe_path,1024,"%s/%s",recipe_dir,de->d_name);
+	    // Already cached recipes do not match, so need not be re-read,
+	    // unless they have changed
+	    for(i=0;i<recipe_cache_count;i++)
+	      if (!strcmp(recipe_cache[i].path,recipe_path)) break;
+	    if (i<recipe_cache_count) {
+	      if (recipe_cache_current(i)) continue;
+	      recipe_cache_drop(i);
+	    }
+	    struct stat st;
+	    if (stat(recipe_path,&st)) continue;
 	    struct recipe *r=recipe_read_from_file(recipe_path);
 	    if (0) fprintf(stderr,"Is %s a recipe?\n",recipe_path);
 	    if (r) {
@@ -925,107 +1071,1164 @@ struct recipe *recipe_find_recipe(char *recipe_dir,unsigned char *formhash)
 			r->formhash[0],r->formhash[1],r->formhash[2],
 			r->formhash[3],r->formhash[4],r->formhash[5]);
 	      }
+	      if (recipe_cache_add(recipe_path,&st,r)) {
+		recipe_free(r);
+		continue;
+	      }
 	      if (!memcmp(formhash,r->formhash,6)) {
+		closedir(dir);
 		return r;
 	      }
-	      recipe_free(r);
 	    }
 	  }
       }
     }
+  closedir(dir);
   return NULL;
 }
 
-int recipe_decompress(stats_handle *h, char *recipe_dir,
-		      unsigned char *in,int in_len, char *out, int out_size,
-		      char *recipe_name)
+struct recipe *recipe_find_recipe(char *recipe_dir,unsigned char *formhash)
 {
-  if (!recipe_dir) {
-    snprintf(recipe_error,1024,"No recipe directory provided.\n");
-    LOGI("%s",recipe_error);
+  pthread_mutex_lock(&recipe_cache_lock);
+  struct recipe *recipe=recipe_find_recipe_locked(recipe_dir,formhash);
+  if (recipe) recipe->users++;
+  pthread_mutex_unlock(&recipe_cache_lock);
+  return recipe;
+}
+
+// Give back a recipe from recipe_find_recipe()
+void recipe_release(struct recipe *recipe)
+{
+  if (!recipe) return;
+  pthread_mutex_lock(&recipe_cache_lock);
+  if (!--recipe->users&&!recipe->cached) recipe_free(recipe);
+  pthread_mutex_unlock(&recipe_cache_lock);
+}
+
+/*
+  Within the second and later instances of a repeat group, each field is coded
+  in the context of the same field in the instance before, since the rows of a
+  roster mostly follow the same skip pattern, and often repeat values.
+*/
+unsigned int repeat_presence_frequencies[2]={0xe00000,0x200000};
+unsigned int repeat_same_value_frequency=0xc00000;
+
+/*
+  Top-level fields of a record coded against a reference record are coded the
+  same way, but resubmissions from a device mostly repeat their values, so a
+  repeated value is expected.
+*/
+unsigned int reference_same_value_frequency=0x400000;
+
+static int recipe_decode_output(char *out,int out_size,int *written,
+				const char *format,const char *name,
+				const char *value)
+{
+  int r=snprintf(&out[*written],out_size-*written,format,name,value);
+  if (r<0||(*written)+r>=out_size) {
+    snprintf(recipe_error,1024,"Decompressed record too big for output buffer.\n");
     return -1;
   }
+  (*written)+=r;
+  return 0;
+}
+
+/*
+  Find the top-level values of a stripped record: offsets[] is set to the
+  offset in text of each field's value, or -1 if it is absent or ~.
+*/
+static void recipe_stripped_offsets(struct recipe *recipe,const char *text,
+				    int len,int *offsets)
+{
+  int i,f;
+  int line_start=0;
+  int depth=0;
+  int hint=0;
+
+  for(f=0;f<recipe->field_count;f++) offsets[f]=-1;
+  for(i=0;i<=len;i++) {
+    if (i<len&&text[i]!='\n'&&text[i]!='\r') continue;
+    const char *line=&text[line_start];
+    int l=i-line_start;
+    line_start=i+1;
+    if (l<1||line[0]=='#') continue;
+    if (line[0]=='{') { depth++; continue; }
+    if (line[0]=='}') { if (depth) depth--; continue; }
+    if (depth) continue;
+    int eq;
+    for(eq=0;eq<l&&line[eq]!='=';eq++) continue;
+    if (eq==0||eq>=l-1) continue;
+    if (l-eq-1==1&&line[eq+1]=='~') continue;
+    f=recipe_field_lookup(recipe,line,eq,hint);
+    if (f<0||offsets[f]>=0) continue;
+    offsets[f]=(line-text)+eq+1;
+    hint=f+1;
+  }
+}
 
-  if (!in) {
-    snprintf(recipe_error,1024,"No input provided.\n");
-    LOGI("%s",recipe_error);
+// Length of the value at the start of text, which ends with the line.
+static int recipe_value_length(const char *text)
+{
+  int len;
+  for(len=0;text[len]&&text[len]!='\n'&&text[len]!='\r';len++) continue;
+  return len;
+}
+
+static void recipe_reference_name(unsigned char *id,char *name)
+{
+  int i;
+  for(i=0;i<RECIPE_REFERENCE_ID_BYTES;i++) sprintf(&name[i*2],"%02x",id[i]);
+}
+
+static void recipe_reference_id(unsigned char *succinct,int succinct_len,
+				unsigned char *id)
+{
+  MD5_CTX md5;
+  unsigned char hash[16];
+  MD5_Init(&md5);
+  MD5_Update(&md5,succinct,succinct_len);
+  MD5_Final(hash,&md5);
+  bcopy(hash,id,RECIPE_REFERENCE_ID_BYTES);
+}
+
+// References are known in their store by their id, padded to a full key
+static void recipe_reference_key(unsigned char *id,unsigned char *key)
+{
+  bzero(key,16);
+  bcopy(id,key,RECIPE_REFERENCE_ID_BYTES);
+}
+
+/*
+  The record and reference stores of each form are opened on first use, and
+  kept open for later messages.  Each may be open only once, so they are kept
+  here rather than with a recipe, of which there may briefly be an old and a
+  new copy.  They are shared between threads, and only used with the lock held.
+*/
+#define MAX_OPEN_STORES 64
+static struct record_store *recipe_stores[MAX_OPEN_STORES];
+static unsigned long long recipe_store_used[MAX_OPEN_STORES];
+static int recipe_store_count=0;
+static unsigned long long recipe_store_clock=0;
+static pthread_mutex_t recipe_store_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Called with the lock held
+static struct record_store *recipe_store_get(char *root,char *form)
+{
+  int i;
+  for(i=0;i<recipe_store_count;i++)
+    if (!strcmp(recipe_stores[i]->root,root)&&!strcmp(recipe_stores[i]->form,form)) {
+      recipe_store_used[i]=++recipe_store_clock;
+      return recipe_stores[i];
+    }
+  if (recipe_store_count>=MAX_OPEN_STORES) {
+    int oldest=0;
+    for(i=1;i<recipe_store_count;i++)
+      if (recipe_store_used[i]<recipe_store_used[oldest]) oldest=i;
+    store_close(recipe_stores[oldest]);
+    recipe_store_count--;
+    recipe_stores[oldest]=recipe_stores[recipe_store_count];
+    recipe_store_used[oldest]=recipe_store_used[recipe_store_count];
+  }
+  struct record_store *s=store_open(root,form);
+  if (!s) return NULL;
+  recipe_stores[recipe_store_count]=s;
+  recipe_store_used[recipe_store_count++]=++recipe_store_clock;
+  return s;
+}
+
+/*
+  Each device's references are listed, newest last, in a file beside the
+  reference store, named by the hash of the device's @delta field value.
+  Called with the lock held.
+*/
+static void recipe_device_file(struct record_store *s,const char *device,
+			       int device_len,char *filename)
+{
+  MD5_CTX md5;
+  unsigned char hash[16];
+  char name[21];
+  MD5_Init(&md5);
+  MD5_Update(&md5,device,device_len);
+  MD5_Final(hash,&md5);
+  store_record_name(hash,name);
+  snprintf(filename,STORE_PATH_BYTES+STORE_NAME_BYTES,"%s/device-%s",
+	   s->directory,name);
+}
+
+// Read the ids of a device's references.  Returns how many there are.
+static int recipe_device_references(char *filename,
+				    unsigned char ids[][RECIPE_REFERENCE_ID_BYTES])
+{
+  char line[1024];
+  int count=0,i;
+  FILE *f=fopen(filename,"r");
+  if (!f) return 0;
+  while(count<RECIPE_DEVICE_REFERENCES&&fgets(line,sizeof(line),f)) {
+    if (strlen(line)<RECIPE_REFERENCE_ID_BYTES*2) continue;
+    for(i=0;i<RECIPE_REFERENCE_ID_BYTES;i++)
+      ids[count][i]=parseHexByte(&line[i*2]);
+    count++;
+  }
+  fclose(f);
+  return count;
+}
+
+// Make id the newest of a device's references, forgetting the oldest
+static int recipe_device_add(struct record_store *s,const char *device,
+			     int device_len,unsigned char *id)
+{
+  char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+  char temp[STORE_PATH_BYTES+STORE_NAME_BYTES+4];
+  unsigned char ids[RECIPE_DEVICE_REFERENCES][RECIPE_REFERENCE_ID_BYTES];
+  char name[RECIPE_REFERENCE_ID_BYTES*2+1];
+  recipe_device_file(s,device,device_len,filename);
+  snprintf(temp,sizeof(temp),"%s.tmp",filename);
+  int count=recipe_device_references(filename,ids);
+  int kept=0,i;
+  for(i=0;i<count;i++)
+    if (memcmp(ids[i],id,RECIPE_REFERENCE_ID_BYTES))
+      bcopy(ids[i],ids[kept++],RECIPE_REFERENCE_ID_BYTES);
+  FILE *f=fopen(temp,"w");
+  if (!f) {
+    snprintf(recipe_error,1024,"Could not write '%.900s'.\n",temp);
     return -1;
   }
-  if (!out) {
-    snprintf(recipe_error,1024,"No output buffer provided.\n");
-    LOGI("%s",recipe_error);
+  for(i=kept>=RECIPE_DEVICE_REFERENCES?kept+1-RECIPE_DEVICE_REFERENCES:0;
+      i<kept;i++) {
+    recipe_reference_name(ids[i],name);
+    fprintf(f,"%s\n",name);
+  }
+  recipe_reference_name(id,name);
+  fprintf(f,"%s\n",name);
+  if (fclose(f)||rename(temp,filename)) {
+    snprintf(recipe_error,1024,"Could not write '%.900s'.\n",filename);
     return -1;
   }
-  if (in_len>=1024) {
-    snprintf(recipe_error,1024,"Input must be <1KB.\n");
-    LOGI("%s",recipe_error);
+  return 0;
+}
+/*
+  Load the reference record with the given id from the store kept by
+  recipe_reference_store(), as text ending in a nul, and find its values.
+  Returns its length, or -1 if it is not there, or is no longer kept for the
+  device that sent it.
+*/
+static int recipe_reference_load(char *reference_dir,struct recipe *recipe,
+				 unsigned char *id,char *out,int out_size,
+				 int *offsets)
+{
+  char name[RECIPE_REFERENCE_ID_BYTES*2+1];
+  unsigned char key[16];
+  recipe_reference_name(id,name);
+  recipe_reference_key(id,key);
+  if (!reference_dir) {
+    snprintf(recipe_error,1024,"Record is coded against reference record %s, but there is no reference store.\n",name);
     return -1;
   }
+  pthread_mutex_lock(&recipe_store_lock);
+  struct record_store *s=recipe_store_get(reference_dir,recipe->formname);
+  int len=s?store_read_stripped(s,key,out,out_size-1):-1;
+  int kept=0;
+  if (len>=0) {
+    out[len]=0;
+    recipe_stripped_offsets(recipe,out,len,offsets);
+    int device=offsets[recipe->delta_field];
+    if (device>=0) {
+      char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+      unsigned char ids[RECIPE_DEVICE_REFERENCES][RECIPE_REFERENCE_ID_BYTES];
+      recipe_device_file(s,&out[device],recipe_value_length(&out[device]),
+			 filename);
+      int count=recipe_device_references(filename,ids),i;
+      for(i=0;i<count;i++)
+	if (!memcmp(ids[i],id,RECIPE_REFERENCE_ID_BYTES)) kept=1;
+    }
+  }
+  pthread_mutex_unlock(&recipe_store_lock);
+  if (len<0) {
+    snprintf(recipe_error,1024,"Record is coded against reference record %s, which is not in '%.900s'.\n",
+	     name,reference_dir);
+    return -1;
+  }
+  if (!kept) {
+    snprintf(recipe_error,1024,"Record is coded against reference record %s, which is no longer kept for its device.\n",
+	     name);
+    return -1;
+  }
+  printf("Decoding against reference record %s\n",name);
+  return len;
+}
 
-  // Make new range coder with 1KB of space
-  range_coder *c=range_new_coder(1024);
-
-  // Point range coder bit stream to input buffer
-  bcopy(in,c->bit_stream,in_len);
-  c->bit_stream_length=in_len*8;
-  range_decode_prefetch(c);
-  
-  // Read form id hash from the succinct data stream.
-  unsigned char formhash[6];
-  int i;
-  for(i=0;i<6;i++) formhash[i]=range_decode_equiprobable(c,256);
-  printf("formhash from succinct data message = %02x%02x%02x%02x%02x%02x\n",
-	 formhash[0],formhash[1],formhash[2],
-	 formhash[3],formhash[4],formhash[5]);
-
-  struct recipe *recipe=recipe_find_recipe(recipe_dir,formhash);
+/*
+  Keep a decoded record so that later records from the same device can be
+  coded against it.  References are appended to a record store of their own
+  under reference_dir, in which they are known by their id, and the last
+  RECIPE_DEVICE_REFERENCES of each device are listed beside it.  A record
+  whose id is already taken by a different one is not kept, since the device
+  could not name it.
+*/
+static int recipe_reference_store(char *reference_dir,struct recipe *recipe,
+				  unsigned char *succinct,int succinct_len,
+				  char *stripped,int stripped_len)
+{
+  unsigned char id[RECIPE_REFERENCE_ID_BYTES];
+  unsigned char key[16];
+  char name[RECIPE_REFERENCE_ID_BYTES*2+1];
+  recipe_reference_id(succinct,succinct_len,id);
+  recipe_reference_name(id,name);
+  recipe_reference_key(id,key);
+
+  int offsets[recipe->field_count];
+  recipe_stripped_offsets(recipe,stripped,stripped_len,offsets);
+  int device=offsets[recipe->delta_field];
+  if (device<0) {
+    printf("Not keeping reference record %s, which does not name its device\n",
+	   name);
+    return 0;
+  }
 
-  if (!recipe) {
-    snprintf(recipe_error,1024,"No recipe provided.\n");
-    LOGI("%s:%d: %s",__FILE__,__LINE__,recipe_error);
-    range_coder_free(c);
-    return -1;
+  char existing[65536];
+  pthread_mutex_lock(&recipe_store_lock);
+  struct record_store *s=recipe_store_get(reference_dir,recipe->formname);
+  int added=s?store_append_keyed(s,key,time(0),succinct,succinct_len,
+				 stripped,stripped_len,NULL,0):-1;
+  if (!added) {
+    int len=store_read_stripped(s,key,existing,sizeof(existing));
+    if (len!=stripped_len||memcmp(existing,stripped,len)) {
+      snprintf(recipe_error,1024,"Reference id %s is already taken by another record, so this one is not kept.\n",
+	       name);
+      added=-1;
+    }
   }
-  snprintf(recipe_name,1024,"%s",recipe->formname);
+  if (added>=0
+      &&recipe_device_add(s,&stripped[device],
+			  recipe_value_length(&stripped[device]),id))
+    added=-1;
+  pthread_mutex_unlock(&recipe_store_lock);
+  if (added<0) return -1;
+  if (added) printf("Stored reference record %s\n",name);
+  return 0;
+}
 
-  int written=0;
+static int recipe_decode_repeats(struct recipe *recipe,stats_handle *h,
+				 range_coder *c,struct presence_state *presence,
+				 int group,char *out,int out_size,int *written);
+
+/*
+  Decode the fields of one repeat group instance (or of the top level if group
+  is -1).  previous[] holds the offset in previous_text of each field's value
+  in the instance before, or -1 if it was absent, and values[] is filled in
+  with offsets in out for this instance.  At the top level, previous[] instead
+  refers to the reference record, if the record was coded against one.
+  presence is NULL unless the recipe uses context coding of field presence.
+*/
+static int recipe_decode_fields(struct recipe *recipe,stats_handle *h,
+				range_coder *c,struct presence_state *presence,
+				int group,const char *previous_text,int *previous,
+				int *values,char *out,int out_size,int *written)
+{
+  unsigned int *same_frequency=group<0?&reference_same_value_frequency
+    :&repeat_same_value_frequency;
   int field;
   for(field=0;field<recipe->field_count;field++)
     {
-      int field_present=range_decode_equiprobable(c,2);
+      if (recipe->fields[field].group!=group) continue;
+      values[field]=-1;
+      if (recipe->fields[field].type==FIELDTYPE_SUBFORM) {
+	if (recipe_decode_repeats(recipe,h,c,presence,field,out,out_size,written))
+	  return -1;
+	continue;
+      }
+      int field_present;
+      if (previous)
+	field_present=range_decode_symbol(c,&repeat_presence_frequencies[previous[field]>=0?1:0],2);
+      else
+	field_present=recipe_decode_presence(c,&recipe->fields[field],presence);
       printf("%sdecompressing value for '%s'\n",
 	     field_present?"":"not ",
 	     recipe->fields[field].name);
       if (field_present) {
 	char value[1024];
-	int r=recipe_decode_field(recipe,h,c,field,value,1024);
-	if (r) {
-	  range_coder_free(c);
-	  return -1;
+	if (previous&&previous[field]>=0
+	    &&range_decode_symbol(c,same_frequency,2)) {
+	  // Same value as in the instance before
+	  const char *same=&previous_text[previous[field]];
+	  snprintf(value,1024,"%.*s",recipe_value_length(same),same);
+	} else if (recipe->fields[field].type==FIELDTYPE_LATLONG) {
+	  // Locations may be coded relative to one decoded before
+	  int ref=recipe->fields[field].latlong_reference;
+	  char reference[1024];
+	  if (ref>=0&&values[ref]>=0)
+	    snprintf(reference,1024,"%.*s",recipe_value_length(&out[values[ref]]),
+		     &out[values[ref]]);
+	  if (latlong_decode_field(c,&recipe->fields[field],
+				   ref>=0&&values[ref]>=0?reference:NULL,value,1024))
+	    return -1;
+	} else {
+	  int r=recipe_decode_field(recipe,h,c,field,value,1024);
+	  if (r) return -1;
 	}
 	printf("  the value is '%s'\n",value);
 	
-	int r2=snprintf(&out[written],out_size-written,"%s=%s\n",
-			recipe->fields[field].name,value);
-	if (r2>0) written+=r2;
+	values[field]=(*written)+strlen(recipe->fields[field].name)+1;
+	if (recipe_decode_output(out,out_size,written,"%s=%s\n",
+				 recipe->fields[field].name,value))
+	  return -1;
       } else {
 	// Field not present.
 	// Magpi uses ~ to indicate an empty field, so insert.
 	// ODK Collect shouldn't care about the presence of the ~'s, so we
 	// will always insert them.
-	int r2=snprintf(&out[written],out_size-written,"%s=~\n",
-			recipe->fields[field].name);
-	if (r2>0) written+=r2;	
+	if (recipe_decode_output(out,out_size,written,"%s=%s\n",
+				 recipe->fields[field].name,"~"))
+	  return -1;
       }
     }
+  return 0;
+}
+
+/*
+  Rebuild the instances of a repeat group as nested sub-forms, each named by a
+  question field, as in the stripped form of a Magpi record.
+*/
+static int recipe_decode_repeats(struct recipe *recipe,stats_handle *h,
+				 range_coder *c,struct presence_state *presence,
+				 int group,char *out,int out_size,int *written)
+{
+  struct field *field=&recipe->fields[group];
+  if (!recipe_decode_presence(c,field,presence)) {
+    printf("not decompressing repeat group '%s'\n",field->name);
+    return 0;
+  }
+  int count=recipe_decode_value(c,field,field->maximum)+1;
+  printf("decompressing %d instances of repeat group '%s'\n",count,field->name);
+
+  int offsets[2][recipe->field_count];
+  int i;
+  for(i=0;i<count;i++) {
+    if (recipe_decode_output(out,out_size,written,"%s%s","{\nquestion=",
+			     field->name)) return -1;
+    if (recipe_decode_output(out,out_size,written,"%s%s","\n","")) return -1;
+    if (recipe_decode_fields(recipe,h,c,presence,group,
+			     out,i?offsets[(i-1)&1]:NULL,
+			     offsets[i&1],out,out_size,written)) return -1;
+    if (recipe_decode_output(out,out_size,written,"%s%s","}\n","")) return -1;
+  }
+  return 0;
+}
+
+/*
+  Decompress a succinct data message.  Records coded against an earlier record
+  are decoded using the copy of it in reference_dir, which may be NULL if
+  there is no reference store.
+*/
+int recipe_decompress(stats_handle *h, char *recipe_dir,char *reference_dir,
+		      unsigned char *in,int in_len, char *out, int out_size,
+		      char *recipe_name,struct recipe **recipe_out)
+{
+  if (!recipe_dir) {
+    snprintf(recipe_error,1024,"No recipe directory provided.\n");
+    LOGI("%s",recipe_error);
+    return -1;
+  }
+
+  if (!in) {
+    snprintf(recipe_error,1024,"No input provided.\n");
+    LOGI("%s",recipe_error);
+    return -1;
+  }
+  if (!out) {
+    snprintf(recipe_error,1024,"No output buffer provided.\n");
+    LOGI("%s",recipe_error);
+    return -1;
+  }
+  if (in_len>=1024) {
+    snprintf(recipe_error,1024,"Input must be <1KB.\n");
+    LOGI("%s",recipe_error);
+    return -1;
+  }
+
+  // Make new range coder with 1KB of space
+  range_coder *c=range_new_coder(1024);
+
+  // Point range coder bit stream to input buffer
+  bcopy(in,c->bit_stream,in_len);
+  c->bit_stream_length=in_len*8;
+  range_decode_prefetch(c);
+  
+  // Read form id hash from the succinct data stream.
+  unsigned char formhash[6];
+  int i;
+  for(i=0;i<6;i++) formhash[i]=range_decode_equiprobable(c,256);
+  printf("formhash from succinct data message = %02x%02x%02x%02x%02x%02x\n",
+	 formhash[0],formhash[1],formhash[2],
+	 formhash[3],formhash[4],formhash[5]);
+
+  struct recipe *recipe=recipe_find_recipe(recipe_dir,formhash);
+
+  if (!recipe) {
+    // The model is part of the form hash, so this is also what happens if
+    // the record was coded with a different field model
+    snprintf(recipe_error,1024,"No recipe or field model matches form hash %02x%02x%02x%02x%02x%02x.\n",
+	     formhash[0],formhash[1],formhash[2],
+	     formhash[3],formhash[4],formhash[5]);
+    LOGI("%s:%d: %s",__FILE__,__LINE__,recipe_error);
+    range_coder_free(c);
+    return -1;
+  }
+  snprintf(recipe_name,1024,"%s",recipe->formname);
+
+  // The record may be coded as changes to an earlier one from the device
+  char reference[65536];
+  int reference_offsets[recipe->field_count];
+  int *previous=NULL;
+  if (recipe->delta_field>=0&&range_decode_equiprobable(c,2)) {
+    unsigned char id[RECIPE_REFERENCE_ID_BYTES];
+    for(i=0;i<RECIPE_REFERENCE_ID_BYTES;i++) id[i]=range_decode_equiprobable(c,256);
+    if (recipe_reference_load(reference_dir,recipe,id,reference,
+			      sizeof(reference),reference_offsets)<0) {
+      LOGI("%s",recipe_error);
+      range_coder_free(c);
+      recipe_release(recipe);
+      return -1;
+    }
+    previous=reference_offsets;
+  }
+
+  struct presence_state presence;
+  recipe_presence_init(&presence);
+
+  int written=0;
+  int values[recipe->field_count];
+  if (recipe_decode_fields(recipe,h,c,
+			   recipe->presence_coding==PRESENCE_CODING_CONTEXT
+			   ?&presence:NULL,
+			   -1,reference,previous,values,out,out_size,&written)) {
+    range_coder_free(c);
+    recipe_release(recipe);
+    return -1;
+  }
   
   range_coder_free(c);
 
+  // Another device's record only has the same id by chance
+  if (previous) {
+    int d=recipe->delta_field;
+    const char *sent=values[d]>=0?&out[values[d]]:"";
+    const char *kept=previous[d]>=0?&reference[previous[d]]:"";
+    int len=recipe_value_length(sent);
+    if (len!=recipe_value_length(kept)||strncmp(sent,kept,len)) {
+      snprintf(recipe_error,1024,"Record is from another device than the reference record it is coded against.\n");
+      LOGI("%s",recipe_error);
+      recipe_release(recipe);
+      return -1;
+    }
+  }
+
+  // The caller may keep the recipe, and then gives it back instead
+  if (recipe_out) *recipe_out=recipe;
+  else recipe_release(recipe);
   return written;
 }
 
+/*
+  Find the recipe field called name, trying the field at hint first, since
+  records usually list their fields in recipe order.  Returns -1 if there is
+  no such field.
+*/
+int recipe_field_lookup(struct recipe *recipe,const char *name,int name_len,
+			int hint)
+{
+  int f;
+  if (hint<0||hint>recipe->field_count) hint=0;
+  for(f=hint;f<recipe->field_count;f++)
+    if (!strncasecmp(recipe->fields[f].name,name,name_len)
+	&&!recipe->fields[f].name[name_len])
+      return f;
+  for(f=0;f<hint;f++)
+    if (!strncasecmp(recipe->fields[f].name,name,name_len)
+	&&!recipe->fields[f].name[name_len])
+      return f;
+  return -1;
+}
+
+void recipe_encoder_init(struct recipe_encoder *e,struct recipe *recipe)
+{
+  int i;
+  e->recipe=recipe;
+  for(i=0;i<recipe->field_count;i++) e->values[i]=NULL;
+  e->value_count=0;
+  e->next_field=0;
+  e->instance_count=0;
+  e->current_instance=-1;
+  e->pair_count=0;
+  e->text_cap=-1;
+  for(i=0;i<recipe->field_count;i++) e->reference[i]=NULL;
+  e->reference_set=0;
+  e->arena_len=0;
+}
+
+static char *recipe_encoder_store(struct recipe_encoder *e,
+				  const char *value,int value_len)
+{
+  if (e->arena_len+value_len+1>sizeof(e->arena)) {
+    snprintf(recipe_error,1024,"Too much data in record.\n");
+    return NULL;
+  }
+  char *v=&e->arena[e->arena_len];
+  bcopy(value,v,value_len);
+  v[value_len]=0;
+  e->arena_len+=value_len+1;
+  return v;
+}
+
+/*
+  Value of field in the given repeat group instance, or at the top level if
+  instance is -1.  NULL if the field is absent.
+*/
+static char *recipe_encoder_value(struct recipe_encoder *e,int instance,int field)
+{
+  int i;
+  if (instance<0) return e->values[field];
+  for(i=0;i<e->pair_count;i++)
+    if (e->pair_instance[i]==instance&&e->pair_field[i]==field)
+      return e->pair_value[i];
+  return NULL;
+}
+
+/*
+  Accept one key=value pair of a record.  Keys that are not in the recipe are
+  ignored, and if a key appears more than once its first value is used.
+  Within a repeat group instance, the first "question" value names the group,
+  as it does in Magpi sub-forms.
+*/
+int recipe_encoder_add(struct recipe_encoder *e,const char *key,int key_len,
+		       const char *value,int value_len)
+{
+  if (e->value_count>=1000) {
+    snprintf(recipe_error,1024,"Too many data values (must be <=1000).\n");
+    return -1;
+  }
+  e->value_count++;
+
+  int instance=e->current_instance;
+  if (instance>=0&&e->instance_group[instance]<0
+      &&key_len==strlen("question")&&!strncasecmp(key,"question",key_len)) {
+    int group=recipe_field_lookup(e->recipe,value,value_len,0);
+    if (group>=0&&e->recipe->fields[group].type==FIELDTYPE_SUBFORM)
+      e->instance_group[instance]=group;
+    else
+      printf("Ignoring sub-form '%.*s', which is not in the recipe\n",
+	     value_len,value);
+    return 0;
+  }
+
+  int field=recipe_field_lookup(e->recipe,key,key_len,e->next_field);
+  if (field<0||recipe_encoder_value(e,instance,field)) return 0;
+  char *v=recipe_encoder_store(e,value,value_len);
+  if (!v) return -1;
+  if (instance<0) e->values[field]=v;
+  else {
+    e->pair_instance[e->pair_count]=instance;
+    e->pair_field[e->pair_count]=field;
+    e->pair_value[e->pair_count]=v;
+    e->pair_count++;
+  }
+  e->next_field=field+1;
+  return 0;
+}
+
+// Start a new instance of a repeat group, nested in the current one if any.
+int recipe_encoder_open_instance(struct recipe_encoder *e)
+{
+  if (e->instance_count>=MAX_REPEAT_INSTANCES) {
+    snprintf(recipe_error,1024,"Too many sub-form instances (must be <=%d).\n",
+	     MAX_REPEAT_INSTANCES);
+    return -1;
+  }
+  e->instance_group[e->instance_count]=-1;
+  e->instance_parent[e->instance_count]=e->current_instance;
+  e->current_instance=e->instance_count++;
+  return 0;
+}
+
+int recipe_encoder_close_instance(struct recipe_encoder *e)
+{
+  if (e->current_instance<0) {
+    snprintf(recipe_error,1024,"} without matching {.\n");
+    return -1;
+  }
+  e->current_instance=e->instance_parent[e->current_instance];
+  return 0;
+}
+
+/*
+  Find the text the decoder will produce for a value, which is coded in a
+  canonical form, and so may not be the text it was given.  location is the
+  decoded value of a LATLONG field's reference location, or NULL.  Values are
+  coded to find out, so this must not be used while training a field model.
+*/
+static int recipe_quantize_value(struct recipe *recipe,stats_handle *h,
+				 int field,const char *value,
+				 const char *location,char *out,int out_size)
+{
+  if (recipe->fields[field].type==FIELDTYPE_TEXT) {
+    snprintf(out,out_size,"%s",value);
+    return 0;
+  }
+  range_coder *c=range_new_coder(1024);
+  if (!c) return -1;
+  int r;
+  if (recipe->fields[field].type==FIELDTYPE_LATLONG)
+    r=latlong_encode_field(c,&recipe->fields[field],value,location,
+			   out,out_size);
+  else {
+    r=recipe_encode_field(recipe,h,c,field,(char *)value);
+    range_conclude(c);
+    range_coder *d=r||c->errors?NULL:range_new_coder(1024);
+    r=-1;
+    if (d) {
+      int bytes=(c->bits_used+7)/8;
+      bcopy(c->bit_stream,d->bit_stream,bytes);
+      d->bit_stream_length=bytes*8;
+      range_decode_prefetch(d);
+      r=recipe_decode_field(recipe,h,d,field,out,out_size);
+      range_coder_free(d);
+    }
+  }
+  range_coder_free(c);
+  return r;
+}
+
+/*
+  Code the record as changes to an earlier one from the same device, which the
+  server has kept.  stripped is the earlier record, and succinct its
+  compressed form as sent, by which the server knows it.  The earlier values
+  are kept as the server decoded them, since that is what it will repeat.
+*/
+int recipe_encoder_set_reference(struct recipe_encoder *e,stats_handle *h,
+				 char *stripped,int stripped_len,
+				 unsigned char *succinct,int succinct_len)
+{
+  struct recipe *recipe=e->recipe;
+  if (recipe->delta_field<0) {
+    snprintf(recipe_error,1024,"Recipe for '%.900s' has no @delta header, so records cannot be coded against earlier ones.\n",
+	     recipe->formname);
+    return -1;
+  }
+
+  int offsets[recipe->field_count];
+  int field;
+  recipe_stripped_offsets(recipe,stripped,stripped_len,offsets);
+  for(field=0;field<recipe->field_count;field++) {
+    e->reference[field]=NULL;
+    if (offsets[field]<0) continue;
+    int len;
+    for(len=0;offsets[field]+len<stripped_len;len++)
+      if (stripped[offsets[field]+len]=='\n'||stripped[offsets[field]+len]=='\r')
+	break;
+    char value[1024],decoded[1024];
+    int ref=recipe->fields[field].latlong_reference;
+    snprintf(value,sizeof(value),"%.*s",len,&stripped[offsets[field]]);
+    if (recipe_quantize_value(recipe,h,field,value,
+			      ref>=0?e->reference[ref]:NULL,
+			      decoded,sizeof(decoded))) {
+      snprintf(recipe_error,1024,"Reference record has value '%.500s' for field '%.400s', which cannot be coded.\n",
+	       value,recipe->fields[field].name);
+      return -1;
+    }
+    e->reference[field]=recipe_encoder_store(e,decoded,strlen(decoded));
+    if (!e->reference[field]) return -1;
+  }
+  recipe_reference_id(succinct,succinct_len,e->reference_id);
+  e->reference_set=1;
+  return 0;
+}
+
+// Presence coding state to use, or NULL for flat presence coding.
+static struct presence_state *recipe_encoder_presence(struct recipe_encoder *e)
+{
+  if (e->recipe->presence_coding==PRESENCE_CODING_CONTEXT) return &e->presence;
+  return NULL;
+}
+
+static int recipe_encode_repeats(struct recipe_encoder *e,stats_handle *h,
+				 range_coder *c,int group,int parent);
+
+static int recipe_encode_fields(struct recipe_encoder *e,stats_handle *h,
+				range_coder *c,int group,
+				int instance,int previous)
+{
+  struct recipe *recipe=e->recipe;
+  int field;
+  // The text the decoder will have for each location field of this
+  // instance, for coding later locations relative to them
+  char locations[1024][64];
+
+  for(field=0;field<recipe->field_count;field++) {
+    if (recipe->fields[field].group!=group) continue;
+    if (recipe->fields[field].type==FIELDTYPE_SUBFORM) {
+      if (recipe_encode_repeats(e,h,c,field,instance)) return -1;
+      continue;
+    }
+    char *value=recipe_encoder_value(e,instance,field);
+    locations[field][0]=0;
+    char *previous_value=NULL;
+    unsigned int *same_frequency=&repeat_same_value_frequency;
+    if (previous>=0||(instance<0&&e->reference_set)) {
+      if (previous>=0)
+	previous_value=recipe_encoder_value(e,previous,field);
+      else {
+	// Top level of a record coded against a reference record
+	previous_value=e->reference[field];
+	same_frequency=&reference_same_value_frequency;
+      }
+      range_encode_symbol(c,&repeat_presence_frequencies[previous_value?1:0],2,
+			  value?1:0);
+    } else
+      // Record whether the field is present.
+      recipe_encode_presence(c,&recipe->fields[field],value?1:0,
+			     recipe_encoder_presence(e));
+    if (value) {
+      // Field present
+      printf("Found field #%d ('%s')\n",field,recipe->fields[field].name);
+      LOGI("Found field #%d ('%s', value '%s')\n",
+	   field,recipe->fields[field].name,value);
+      if (previous_value) {
+	// Reference values are as decoded, so compare this one as it would be
+	char decoded[1024];
+	const char *coded=value;
+	int ref=recipe->fields[field].latlong_reference;
+	if (instance<0
+	    &&!recipe_quantize_value(recipe,h,field,value,
+				     ref>=0&&locations[ref][0]?locations[ref]:NULL,
+				     decoded,sizeof(decoded)))
+	  coded=decoded;
+	int same=!strcmp(coded,previous_value);
+	range_encode_symbol(c,same_frequency,2,same);
+	if (same) {
+	  snprintf(locations[field],64,"%s",previous_value);
+	  continue;
+	}
+      }
+      char shortened[1024];
+      if (e->text_cap>=0&&recipe->fields[field].type==FIELDTYPE_TEXT) {
+	int l=recipe_text_length(&recipe->fields[field],value,e->text_cap);
+	if (l<strlen(value)) {
+	  if (l>1000) l=1000;
+	  printf("Shortening '%s' to %d characters to fit\n",
+		 recipe->fields[field].name,l);
+	  memcpy(shortened,value,l); shortened[l]=0;
+	  value=shortened;
+	}
+      }
+      // Now, based on type of field, encode it.
+      int r;
+      if (recipe->fields[field].type==FIELDTYPE_LATLONG) {
+	int ref=recipe->fields[field].latlong_reference;
+	r=latlong_encode_field(c,&recipe->fields[field],value,
+			       ref>=0&&locations[ref][0]?locations[ref]:NULL,
+			       locations[field],64);
+      } else
+	r=recipe_encode_field(recipe,h,c,field,value);
+      if (r)
+	{
+	  snprintf(recipe_error,1024,"Could not record value '%.500s' for field '%.400s' (type %d)\n",
+		   value,recipe->fields[field].name,
+		   recipe->fields[field].type);
+	  return -1;
+	}
+      LOGI(" ... encoded value '%s'",value);
+    } else {
+      // Field missing: record this fact and nothing else.
+      printf("No field #%d ('%s')\n",field,recipe->fields[field].name);
+      LOGI("No field #%d ('%s')\n",field,recipe->fields[field].name);
+    }
+  }
+  return 0;
+}
+
+/*
+  A repeat group is coded as a presence bit, then the number of instances, then
+  the fields of each instance in turn.
+*/
+static int recipe_encode_repeats(struct recipe_encoder *e,stats_handle *h,
+				 range_coder *c,int group,int parent)
+{
+  struct field *field=&e->recipe->fields[group];
+  int instances[MAX_REPEAT_INSTANCES];
+  int count=0;
+  int i;
+
+  for(i=0;i<e->instance_count;i++)
+    if (e->instance_group[i]==group&&e->instance_parent[i]==parent)
+      instances[count++]=i;
+  printf("Found %d instances of repeat group #%d ('%s')\n",
+	 count,group,field->name);
+  recipe_encode_presence(c,field,count?1:0,recipe_encoder_presence(e));
+  if (!count) return 0;
+  if (count<field->minimum||count>field->maximum) {
+    snprintf(recipe_error,1024,"Repeat group '%s' has %d instances, but must have %d to %d.\n",
+	     field->name,count,field->minimum,field->maximum);
+    return -1;
+  }
+  recipe_encode_value(c,field,field->maximum,count-1);
+  for(i=0;i<count;i++)
+    if (recipe_encode_fields(e,h,c,group,instances[i],i?instances[i-1]:-1))
+      return -1;
+  return 0;
+}
+
+static range_coder *recipe_encode_record(struct recipe_encoder *e,
+					  stats_handle *h)
+{
+  struct recipe *recipe=e->recipe;
+
+  // Make new range coder with room for records well beyond any output buffer,
+  // so that we can find out how much too big they are.
+  range_coder *c=range_new_coder(65536);
+  if (!c) {
+    snprintf(recipe_error,1024,"Could not instantiate range coder.\n");
+    return NULL;
+  }
+
+  // Write form hash first
+  int i;
+  printf("form hash = %02x%02x%02x%02x%02x%02x\n",
+	 recipe->formhash[0],
+	 recipe->formhash[1],
+	 recipe->formhash[2],
+	 recipe->formhash[3],
+	 recipe->formhash[4],
+	 recipe->formhash[5]);
+  for(i=0;i<sizeof(recipe->formhash);i++)
+    range_encode_equiprobable(c,256,recipe->formhash[i]);
+
+  // Then the reference record, if the recipe allows one
+  if (recipe->delta_field>=0) {
+    range_encode_equiprobable(c,2,e->reference_set);
+    if (e->reference_set)
+      for(i=0;i<RECIPE_REFERENCE_ID_BYTES;i++)
+	range_encode_equiprobable(c,256,e->reference_id[i]);
+  }
+
+  // Then the fields that are not within repeat groups, in recipe order
+  recipe_presence_init(&e->presence);
+  if (recipe_encode_fields(e,h,c,-1,-1,-1)) {
+    range_coder_free(c);
+    return NULL;
+  }
+
+  if (c->errors) {
+    range_coder_free(c);
+    snprintf(recipe_error,1024,"Record contains values that the model cannot code.\n");
+    return NULL;
+  }
+  range_conclude(c);
+  return c;
+}
+
+static double recipe_text_cost(stats_handle *h,const char *value,int len)
+{
+  // Sized for the value as stats3_compress_append() sizes its trial coders
+  range_coder *c=range_new_coder(len*4+1024);
+  if (!c) return 0;
+  stats3_compress_append(c,(unsigned char *)value,len,h,NULL);
+  double bits=c->entropy;
+  range_coder_free(c);
+  return bits;
+}
+
+// TEXT values that may be shortened, and what each costs per character
+struct recipe_text_costs {
+  int count;
+  int longest;
+  struct field *fields[2048];
+  char *values[2048];
+  int lengths[2048];
+  double bits_per_character[2048];
+};
+
+/*
+  Text values are coded independently of the rest of the record, so the
+  effect of shortening one can be estimated from the cost of coding it whole.
+  Each value is coded once, here.
+*/
+static void recipe_text_costs(struct recipe_encoder *e,stats_handle *h,
+			      struct recipe_text_costs *t)
+{
+  struct recipe *recipe=e->recipe;
+  int i;
+
+  t->count=0;
+  t->longest=0;
+  for(i=0;i<recipe->field_count+e->pair_count;i++) {
+    int field=i<recipe->field_count?i:e->pair_field[i-recipe->field_count];
+    char *value=i<recipe->field_count?e->values[i]:e->pair_value[i-recipe->field_count];
+    if (!value||recipe->fields[field].type!=FIELDTYPE_TEXT) continue;
+    if (recipe->fields[field].whole) continue;
+    int len=recipe_text_length(&recipe->fields[field],value,-1);
+    if (len<=recipe->fields[field].precision) continue;
+    t->fields[t->count]=&recipe->fields[field];
+    t->values[t->count]=value;
+    t->lengths[t->count]=len;
+    t->bits_per_character[t->count]=recipe_text_cost(h,value,len)/len;
+    if (len>t->longest) t->longest=len;
+    t->count++;
+  }
+}
+
+/*
+  Find the largest cap on TEXT value lengths that should let the record fit in
+  target_bits, given that it took bits_used bits without a cap.  Returns 0 if
+  even the shortest permitted values are not expected to fit, so that the
+  caller can find out for sure, or -1 if there is nothing to shorten.
+*/
+static int recipe_text_fit(struct recipe_text_costs *t,int bits_used,
+			   int target_bits)
+{
+  int i;
+  if (!t->count) return -1;
+
+  // Binary search for the longest cap whose estimated size fits
+  int low=-1,high=t->longest-1;
+  while(low<high) {
+    int cap=(low+high+1)/2;
+    double bits=bits_used;
+    for(i=0;i<t->count;i++) {
+      int len=recipe_text_length(t->fields[i],t->values[i],cap);
+      bits-=(t->lengths[i]-len)*t->bits_per_character[i];
+    }
+    if (bits<=target_bits) low=cap; else high=cap-1;
+  }
+  return low<0?0:low;
+}
+
+// Re-encode with a lower estimate this many times at most before giving up
+#define RECIPE_FIT_ATTEMPTS 4
+
+int recipe_encoder_finish(struct recipe_encoder *e,stats_handle *h,
+			  unsigned char *out,int out_size)
+{
+  if (e->current_instance>=0) {
+    snprintf(recipe_error,1024,"End of record, but } expected.\n");
+    return -1;
+  }
+
+  e->text_cap=-1;
+  range_coder *c=recipe_encode_record(e,h);
+  if (!c) return -1;
+
+  // Get result and store it, unless it is too big for the output buffer.
+  // In that case, shorten text values to make it fit, if they allow it.
+  int bytes=(c->bits_used/8)+((c->bits_used&7)?1:0);
+  if (bytes>out_size) {
+    struct recipe_text_costs t;
+    int bits_used=c->bits_used;
+    int target=out_size*8;
+    int attempt,cap=-1;
+    recipe_text_costs(e,h,&t);
+    for(attempt=0;bytes>out_size&&attempt<RECIPE_FIT_ATTEMPTS;attempt++) {
+      int next=recipe_text_fit(&t,bits_used,target);
+      // Each attempt must cut deeper than the one before
+      if (cap>=0&&next>=cap) next=cap-1;
+      if (next<0) break;
+      cap=next;
+      printf("Used %d bytes, but only %d allowed: capping text at %d characters\n",
+	     bytes,out_size,cap);
+      range_coder_free(c);
+      e->text_cap=cap;
+      c=recipe_encode_record(e,h);
+      if (!c) return -1;
+      bytes=(c->bits_used/8)+((c->bits_used&7)?1:0);
+      // Estimates ignore interactions at value boundaries, so aim lower by
+      // as much as this attempt missed by
+      target-=c->bits_used-out_size*8;
+    }
+  }
+  if (bytes>out_size) {
+    range_coder_free(c);
+    snprintf(recipe_error,1024,"Compressed data too big for output buffer\n");
+    return -1;
+  }
+  
+  bcopy(c->bit_stream,out,bytes);
+  printf("Used %d bits (%d bytes).\n",c->bits_used,bytes);
+  range_coder_free(c);
+
+  return bytes;
+}
+
+/*
+  Run a record through the encoder and throw the output away, so that field
+  models in training count the presence bits and values in exactly the order
+  and context that the encoder codes them in.
+*/
+int recipe_encoder_train(struct recipe_encoder *e,stats_handle *h)
+{
+  if (e->current_instance>=0) {
+    snprintf(recipe_error,1024,"End of record, but } expected.\n");
+    return -1;
+  }
+
+  e->text_cap=-1;
+  range_coder *c=recipe_encode_record(e,h);
+  if (!c) return -1;
+  range_coder_free(c);
+  return 0;
+}
+
+// Accept the key=value lines of a stripped record.
+int recipe_encoder_add_stripped(struct recipe_encoder *e,char *in,int in_len)
+{
+  int i;
+  int line_start=0;
+  int line_number=1;
+
+  for(i=0;i<=in_len;i++) {
+    if ((i==in_len)||(in[i]=='\n')||(in[i]=='\r')) {
+      // Process key=value line, ignoring long lines
+      char *line=&in[line_start];
+      int l=i-line_start;
+      if ((l>0)&&(line[0]=='{'||line[0]=='}')) {
+	// Start or end of a sub-form
+	if (line[0]=='{'?recipe_encoder_open_instance(e)
+	    :recipe_encoder_close_instance(e)) return -1;
+      } else if ((l>0)&&(l<1000)&&(line[0]!='#')) {
+	int eq;
+	for(eq=0;eq<l&&line[eq]!='=';eq++) continue;
+	if (eq==0||eq>=l-1) {
+	  snprintf(recipe_error,1024,"line:%d:Malformed data line (%s:%d): '%.*s'\n",
+		   line_number,__FILE__,__LINE__,l,line);	  
+	  return -1;
+	}
+	if (recipe_encoder_add(e,line,eq,&line[eq+1],l-eq-1)) return -1;
+      } else if (l>=1000) {
+	fprintf(stderr,"line:%d:Line too long -- ignoring (must be < 1000 characters).\n",line_number);	  
+	LOGI("line:%d:Line too long -- ignoring (must be < 1000 characters).\n",line_number);
+      }
+      line_number++; 
+      line_start=i+1;
+    }
+  }
+  printf("Read %d data lines, %d values.\n",line_number,e->value_count);
+  LOGI("Read %d data lines, %d values.\n",line_number,e->value_count);
+  return 0;
+}
+
 int recipe_compress(stats_handle *h,struct recipe *recipe,
 		    char *in,int in_len, unsigned char *out, int out_size)
+{
+  return recipe_compress_delta(h,recipe,NULL,0,NULL,0,in,in_len,out,out_size);
+}
+
+/*
+  Compress a stripped record, coding it as changes to an earlier record from
+  the same device if reference is not NULL.  reference_succinct is the
+  earlier record as it was sent, by which the server knows it.
+*/
+int recipe_compress_delta(stats_handle *h,struct recipe *recipe,
+			  char *reference,int reference_len,
+			  unsigned char *reference_succinct,int succinct_len,
+			  char *in,int in_len,unsigned char *out,int out_size)
 {
   /*
     Eventually we want to support full skip logic, repeatable sections and so on.
@@ -1051,120 +2254,105 @@ int recipe_compress(stats_handle *h,struct recipe *recipe,
     return -1;
   }
 
-  // Make new range coder with 1KB of space
-  range_coder *c=range_new_coder(1024);
-  if (!c) {
-    snprintf(recipe_error,1024,"Could not instantiate range coder.\n");
+  struct recipe_encoder e;
+  recipe_encoder_init(&e,recipe);
+  if (reference&&recipe_encoder_set_reference(&e,h,reference,reference_len,
+					      reference_succinct,succinct_len))
     return -1;
-  }
-
-  // Write form hash first
-  int i;
-  printf("form hash = %02x%02x%02x%02x%02x%02x\n",
-	 recipe->formhash[0],
-	 recipe->formhash[1],
-	 recipe->formhash[2],
-	 recipe->formhash[3],
-	 recipe->formhash[4],
-	 recipe->formhash[5]);
-  for(i=0;i<sizeof(recipe->formhash);i++)
-    range_encode_equiprobable(c,256,recipe->formhash[i]);
+  if (recipe_encoder_add_stripped(&e,in,in_len)) return -1;
 
-  char *keys[1024];
-  char *values[1024];
-  int value_count=0;
+  return recipe_encoder_finish(&e,h,out,out_size);
+}
 
-  int l=0;
-  int line_number=1;
-  char line[1024];
-  char key[1024],value[1024];
+static int recipe_encoder_add_pair(void *context,const char *key,const char *value)
+{
+  struct recipe_encoder *e=context;
+  if (!value)
+    return key[0]=='{'?recipe_encoder_open_instance(e)
+      :recipe_encoder_close_instance(e);
+  return recipe_encoder_add(e,key,strlen(key),value,strlen(value));
+}
 
-  for(i=0;i<=in_len;i++) {
-    if ((i==in_len)||(in[i]=='\n')||(in[i]=='\r')) {
-      if (value_count>1000) {
-	snprintf(recipe_error,1024,"line:%d:Too many data lines (must be <=1000).\n",line_number);
-	return -1;
-      }
-      // Process key=value line
-      if (l>=1000) l=0; // ignore long lines
-      line[l]=0; 
-      if ((l>0)&&(line[0]!='#')) {
-	if (sscanf(line,"%[^=]=%[^\n]",key,value)==2) {
-	  keys[value_count]=strdup(key);
-	  values[value_count]=strdup(value);
-	  value_count++;
-	} else {
-	  snprintf(recipe_error,1024,"line:%d:Malformed data line (%s:%d): '%s'\n",
-		   line_number,__FILE__,__LINE__,line);	  
-	  return -1;
-	}
-      }
-      line_number++; 
-      l=0;
-    } else {
-      if (l<1000) { line[l++]=in[i]; }
-      else {
-	if (l==1000) {
-	  fprintf(stderr,"line:%d:Line too long -- ignoring (must be < 1000 characters).\n",line_number);	  
-	  LOGI("line:%d:Line too long -- ignoring (must be < 1000 characters).\n",line_number);
-	}
-	l++;
-      }
-    } 
+/*
+  Compress a form instance directly from its XML.  Values are handed from the
+  XML scanner straight to the recipe field slots, so no stripped text record
+  is built.  This must produce the same output as xml2stripped() followed by
+  recipe_compress().
+*/
+int recipe_compress_xml(stats_handle *h,struct recipe *recipe,
+			const char *form_name,const char *xml,int xml_len,
+			unsigned char *out,int out_size)
+{
+  if (!recipe) {
+    snprintf(recipe_error,1024,"No recipe provided.\n");
+    return -1;
   }
-  printf("Read %d data lines, %d values.\n",line_number,value_count);
-  LOGI("Read %d data lines, %d values.\n",line_number,value_count);
-  
-  int field;
-
-  for(field=0;field<recipe->field_count;field++) {
-    // look for this field in keys[] 
-    for (i=0;i<value_count;i++) {
-      if (!strcasecmp(keys[i],recipe->fields[field].name)) break;
-    }
-    if (i<value_count) {
-      // Field present
-      printf("Found field #%d ('%s')\n",field,recipe->fields[field].name);
-      LOGI("Found field #%d ('%s', value '%s')\n",
-	   field,recipe->fields[field].name,values[i]);
-      // Record that the field is present.
-      range_encode_equiprobable(c,2,1);
-      // Now, based on type of field, encode it.
-      if (recipe_encode_field(recipe,h,c,field,values[i]))
-	{
-	  range_coder_free(c);
-	  snprintf(recipe_error,1024,"Could not record value '%s' for field '%s' (type %d)\n",
-		   values[i],recipe->fields[field].name,
-		   recipe->fields[field].type);
-	  return -1;
-	}
-      LOGI(" ... encoded value '%s'",values[i]);
-    } else {
-      // Field missing: record this fact and nothing else.
-      printf("No field #%d ('%s')\n",field,recipe->fields[field].name);
-      LOGI("No field #%d ('%s')\n",field,recipe->fields[field].name);
-      range_encode_equiprobable(c,2,0);
-    }
+  if (!xml) {
+    snprintf(recipe_error,1024,"No input provided.\n");
+    return -1;
+  }
+  if (!out) {
+    snprintf(recipe_error,1024,"No output buffer provided.\n");
+    return -1;
   }
 
-  // Get result and store it, unless it is too big for the output buffer
-  range_conclude(c);
-  int bytes=(c->bits_used/8)+((c->bits_used&7)?1:0);
-  if (bytes>out_size) {
-    range_coder_free(c);
-    snprintf(recipe_error,1024,"Compressed data too big for output buffer\n");
+  struct recipe_encoder e;
+  recipe_encoder_init(&e,recipe);
+  if (xml_scan_instance(form_name,xml,xml_len,recipe_encoder_add_pair,&e))
+    return -1;
+  if (!e.value_count) {
+    snprintf(recipe_error,1024,"No form instance data found in XML.\n");
     return -1;
   }
-  
-  bcopy(c->bit_stream,out,bytes);
-  range_coder_free(c);
+  printf("Read %d values.\n",e.value_count);
+  LOGI("Read %d values.\n",e.value_count);
 
-  printf("Used %d bits (%d bytes).\n",c->bits_used,bytes);
+  return recipe_encoder_finish(&e,h,out,out_size);
+}
 
-  return bytes;
+static int xml_find_formid(void *context,const char *key,const char *value)
+{
+  if (value&&!strcmp(key,"formid")) {
+    snprintf((char *)context,1024,"%s",value);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Find the formid field of a stripped or XML record, which names the recipe
+  it is compressed with.  formid must hold 1024 bytes.  Returns 1 if the
+  record is XML, 0 if it is stripped, or -1 if it has no formid.
+*/
+int recipe_record_formid(const char *record,int record_len,char *formid)
+{
+  int i;
+  formid[0]=0;
+  // formid= at the start of a line identifies the recipe of a stripped record
+  for(i=0;i<record_len;i++)
+    if ((i==0||record[i-1]=='\n')&&!strncmp(&record[i],"formid=",7)) {
+      int e;
+      for(e=i+7;e<record_len&&record[e]!='\n'&&record[e]!='\r';e++) continue;
+      snprintf(formid,1024,"%.*s",e-i-7,&record[i+7]);
+      if (formid[0]) return 0;
+      break;
+    }
+  xml_scan_instance(NULL,record,record_len,xml_find_formid,formid);
+  if (formid[0]) return 1;
+  snprintf(recipe_error,1024,"Record has no formid field.\n");
+  return -1;
 }
 
-int recipe_compress_file(stats_handle *h,char *recipe_dir,char *input_file,char *output_file)
+/*
+  Compress a stripped or XML record file.  If out_size is positive, the
+  compressed record must fit in that many bytes, and text values are shortened
+  if necessary to achieve that.  If reference_file is not NULL, the record is
+  coded as changes to the stripped record in it, which was sent compressed as
+  reference_succinct_file.
+*/
+int recipe_compress_file(stats_handle *h,char *recipe_dir,char *input_file,
+			 char *output_file,int out_size,
+			 char *reference_file,char *reference_succinct_file)
 {
   unsigned char *buffer;
 
@@ -1192,21 +2380,16 @@ int recipe_compress_file(stats_handle *h,char *recipe_dir,char *input_file,char
     if (sscanf((const char *)&buffer[i],"formid=%[^\n]",formid)==1) break;
   }
 
-  unsigned char *stripped=buffer;
-  int stripped_len = stat.st_size;
-  
+  int is_xml=0;
   if (!formid[0]) {
     // Input file is not a stripped file. Perhaps it is a record to be compressed?
-    stripped=calloc(65536,1);
-    stripped_len=xml2stripped(NULL,(const char *)buffer,stat.st_size,(char *)stripped,65536);
-
-    for(int i=0;i<stripped_len;i++) {
-      if (sscanf((const char *)&stripped[i],"formid=%[^\n]",formid)==1) break;
-    }
+    is_xml=1;
+    xml_scan_instance(NULL,(const char *)buffer,stat.st_size,xml_find_formid,formid);
   } 
   
   if (!formid[0]) {
     fprintf(stderr,"stripped file contains no formid field to identify matching recipe\n");
+    munmap(buffer,stat.st_size); close(fd);
     return -1;
   }
   
@@ -1225,10 +2408,38 @@ int recipe_compress_file(stats_handle *h,char *recipe_dir,char *input_file,char
     if (form_spec_len<1) printf("read %d bytes (error = %s)\n",form_spec_len,recipe_error);
     recipe=recipe_read_from_specification(form_spec_text);
   }
-  if (!recipe) return -1;
+  if (!recipe) { munmap(buffer,stat.st_size); close(fd); return -1; }
   
   unsigned char out_buffer[1024];
-  int r=recipe_compress(h,recipe,(char *)stripped,stripped_len,out_buffer,1024);
+  int r;
+  if (out_size<=0||out_size>sizeof(out_buffer)) out_size=sizeof(out_buffer);
+  if (reference_file) {
+    char reference[65536];
+    unsigned char reference_succinct[1024];
+    int reference_len=recipe_load_file(reference_file,reference,sizeof(reference));
+    int succinct_len=recipe_load_file(reference_succinct_file,
+				      (char *)reference_succinct,
+				      sizeof(reference_succinct));
+    if (reference_len<0||succinct_len<0) {
+      munmap(buffer,stat.st_size); close(fd); return -1;
+    }
+    char stripped[65536];
+    char *in=(char *)buffer;
+    int in_len=stat.st_size;
+    if (is_xml) {
+      in_len=xml2stripped(NULL,(const char *)buffer,stat.st_size,
+			  stripped,sizeof(stripped));
+      in=stripped;
+    }
+    if (in_len<0) r=-1;
+    else r=recipe_compress_delta(h,recipe,reference,reference_len,
+				 reference_succinct,succinct_len,
+				 in,in_len,out_buffer,out_size);
+  } else if (is_xml)
+    r=recipe_compress_xml(h,recipe,NULL,(const char *)buffer,stat.st_size,
+			  out_buffer,out_size);
+  else
+    r=recipe_compress(h,recipe,(char *)buffer,stat.st_size,out_buffer,out_size);
 
   munmap(buffer,stat.st_size); close(fd);
 
@@ -1249,17 +2460,12 @@ int recipe_compress_file(stats_handle *h,char *recipe_dir,char *input_file,char
   return r;
 }
 
-int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
-				char *output_dir,
+// r is the recipe the record was decoded with, so it is not read again
+int recipe_stripped_to_csv_line(struct recipe *r,
 				char *stripped,int stripped_data_len,
 				char *csv_out,int csv_out_size)
 {
-  // Read recipe, CSV encode each field if present, append fields to line,
-  // return.
-  char recipe_file[1024];
-  snprintf(recipe_file,1024,"%s/%s.recipe",recipe_dir,recipe_name);
-  fprintf(stderr,"Reading recipe from '%s' for CSV generation.\n",recipe_file);
-
+  // CSV encode each field if present, append fields to line, return.
   if (csv_out_size<8192) {
     fprintf(stderr,"Not enough space to extract CSV line.\n");
     return -1;
@@ -1277,9 +2483,10 @@ int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
 
   char value[1024];
   int value_len=0;
+  int too_long=0;
   
   // Read fields from stripped.
-  for(i=0;i<stripped_data_len;i++) {
+  for(i=0;i<stripped_data_len&&!too_long;i++) {
     if (stripped[i]=='='&&(state==0)) {
       state=1;
     } else if (stripped[i]<' ') {
@@ -1287,6 +2494,7 @@ int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
 	// record field=value pair
 	field[field_len]=0;
 	value[value_len]=0;
+	if (field_count>=1024) { too_long=1; break; }
 	fieldnames[field_count]=strdup(field);
 	values[field_count]=strdup(value);
 	field_count++;
@@ -1295,24 +2503,15 @@ int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
       field_len=0;
       value_len=0;
     } else {
-      if (field_len>1000||value_len>1000) return -1;
+      if (field_len>1000||value_len>1000) { too_long=1; break; }
       if (state==0) field[field_len++]=stripped[i];
       else value[value_len++]=stripped[i];
     }
   }
-
-
-  struct recipe *r = recipe_read_from_file(recipe_file);
-  if (!r) {
-    fprintf(stderr,"Failed to read recipe file '%s' during CSV extraction.\n",
-	    recipe_file);
-    return -1;
-  }
-
   int n=0;
   int f;
   
-  for(f=0;f<r->field_count;f++) {
+  for(f=0;f<r->field_count&&!too_long;f++) {
     char *v="";
     for(i=0;i<field_count;i++) {
       if (!strcasecmp(fieldnames[i],r->fields[f].name)) {
@@ -1321,7 +2520,11 @@ int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
     }
     n+=snprintf(&csv_out[n],8192-n,"%s%s",f?",":"",v);
   }
-  recipe_free(r);
+  for(i=0;i<field_count;i++) {
+    free(fieldnames[i]);
+    free(values[i]);
+  }
+  if (too_long) return -1;
 
   csv_out[n++]='\n';
   csv_out[n]=0;
@@ -1329,162 +2532,248 @@ int recipe_stripped_to_csv_line(char *recipe_dir, char *recipe_name,
   return 0;
 }
 
-int recipe_decompress_file(stats_handle *h,char *recipe_dir,char *input_file,char *output_directory)
+/*
+  Add a decompressed record to the form's record store and CSV file, unless
+  it is already there.  Returns r, the length of the record, or -1 on error.
+*/
+static int recipe_store_message(struct recipe *recipe,char *recipe_dir,
+				unsigned char *succinct,int succinct_len,
+				char *out_buffer,int r,
+				char *output_directory,char *name)
 {
-  // struct recipe *recipe=recipe_read_from_file(recipe_file);
-  // if (!recipe) return -1;
+  char recipe_name[1024];
+  snprintf(recipe_name,1024,"%s",recipe->formname);
 
-  unsigned char *buffer;
+  // Records are kept in the form's record store in <output>/store
+  char store_root[STORE_PATH_BYTES];
+  if (snprintf(store_root,sizeof(store_root),"%s/store",output_directory)
+      >=sizeof(store_root)) {
+    snprintf(recipe_error,1024,"Output directory '%.900s' is too long.\n",
+	     output_directory);
+    return -1;
+  }
+  mkdir(output_directory,0777);
 
-  int fd=open(input_file,O_RDONLY);
-  if (fd==-1) {
-    snprintf(recipe_error,1024,"Could not open succinct data file '%s'\n",input_file);
+  unsigned char hash[16];
+  store_hash(out_buffer,r,hash);
+  pthread_mutex_lock(&recipe_store_lock);
+  struct record_store *store=recipe_store_get(store_root,recipe_name);
+  int seen=store?store_find(store,hash)>=0:-1;
+
+  // now produce the XML.
+  // We need to give it the template file.  Fortunately, we know the recipe name, 
+  // so we can build the template path from that.  The recipe is cached, so the
+  // template need only be read and compiled the first time we see this form.
+  // If that fails, the record is still stored without its XML.
+  int xml_failed=0;
+  if (!seen&&!recipe->template) {
+    struct stat st;
+    char template_file[1024];
+    snprintf(template_file,1024,"%s/%.900s.template",recipe_dir,recipe_name);
+    char *template=NULL;
+    int template_len=-1;
+    if (!stat(template_file,&st)&&st.st_size>0) {
+      template=malloc(st.st_size);
+      if (template)
+	template_len=recipe_load_file(template_file,template,st.st_size);
+    }
+    if (template_len>0)
+      recipe->template=template_compile(recipe,template,template_len);
+    if (template) free(template);
+    if (template_len<1) {
+      snprintf(recipe_error,1024,"Could not read template file '%.900s'\n",template_file);
+      xml_failed=1;
+    } else if (!recipe->template) {
+      snprintf(recipe_error,1024,"Could not compile template file '%.900s'\n",template_file);
+      xml_failed=1;
+    }
+  }
+  pthread_mutex_unlock(&recipe_store_lock);
+  if (seen<0) {
     LOGI("%s",recipe_error);
     return -1;
   }
+  if (seen) {
+    fprintf(stderr,"Not storing record, as we have already seen it.\n");
+    LOGI("Not storing record, as we have already seen it.\n");
+    return r;
+  }
 
-  struct stat st;
-  if (fstat(fd, &st) == -1) {
-    snprintf(recipe_error,1024,"Could not stat succinct data file '%s'\n",input_file);
+  // The compiled template is not changed by rendering, so is rendered
+  // without the lock
+  char *xml=NULL;
+  int xml_size=0;
+  int x=0;
+  if (!xml_failed) {
+    x=template_render(recipe->template,recipe,out_buffer,r,&xml,&xml_size);
+    if (x<0) {
+      snprintf(recipe_error,1024,"Could not render XML for '%s'\n",name);
+      xml_failed=1;
+    }
+  }
+  char error[1024];
+  if (xml_failed) {
     LOGI("%s",recipe_error);
-    close(fd); return -1;
+    snprintf(error,1024,"%s",recipe_error);
   }
 
-  buffer=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (buffer==MAP_FAILED) {
-    snprintf(recipe_error,1024,"Could not memory map succinct data file '%s'\n",input_file);
+  fprintf(stderr,"Storing record\n");
+  LOGI("Storing record\n");
+  pthread_mutex_lock(&recipe_store_lock);
+  store=recipe_store_get(store_root,recipe_name);
+  int added=store?store_append(store,time(0),succinct,succinct_len,
+			       out_buffer,r,xml_failed?NULL:xml,x):-1;
+  pthread_mutex_unlock(&recipe_store_lock);
+  if (xml) free(xml);
+  if (added<0) {
     LOGI("%s",recipe_error);
-    close(fd); return -1; 
+    return -1;
+  }
+  // Another thread stored the same record first
+  if (!added) return r;
+
+  // The record is new, so append a line to the CSV file.
+  char line[8192];
+  if (!recipe_stripped_to_csv_line(recipe,out_buffer,r,line,8192))
+    {
+      char csv_file[1024];
+      snprintf(csv_file,1024,"%s/csv",output_directory);
+      mkdir(csv_file,0777);
+      snprintf(csv_file,1024,"%s/csv/%.900s.csv",output_directory,
+	       recipe_name);
+      FILE *f=fopen(csv_file,"a");
+      fprintf(stderr,"Appending CSV line: %s\n",line);
+      LOGI("Appending CSV line: %s\n",line);
+      if (f) {
+	int wrote=fwrite(line,strlen(line),1,f);
+	if (wrote<strlen(line)) {
+	  fprintf(stderr,"Failed to produce CSV line (short write)\n");
+	}
+	fclose(f);
+      }
+    } else {
+    fprintf(stderr,"Failed to produce CSV line.\n");
   }
 
+  if (xml_failed) {
+    snprintf(recipe_error,1024,"%s",error);
+    return -1;
+  }
+  return r;
+}
+
+/*
+  Decompress a succinct data message, and add the record to the form's record
+  store and CSV file.  name identifies the message in error messages.
+*/
+int recipe_decompress_message(stats_handle *h,char *recipe_dir,
+			      unsigned char *succinct,int succinct_len,
+			      char *output_directory,char *name)
+{
   LOGI("About to call recipe_decompress");
   char recipe_name[1024]="";
   char out_buffer[1048576];
-  int r=recipe_decompress(h,recipe_dir,buffer,st.st_size,out_buffer,1048576,
-			  recipe_name);
-  LOGI("Got back from recipe_decompress: r=%d, fd=%d, st.st_size=%d, buffer=%p",
-       r,fd,(int)st.st_size,buffer);
-
-  LOGI("%s:%d\n",__FILE__,__LINE__);
-  munmap(buffer,st.st_size); 
-  LOGI("%s:%d\n",__FILE__,__LINE__);
-  close(fd);
-  LOGI("%s:%d\n",__FILE__,__LINE__);
+  struct recipe *recipe=NULL;
+  char reference_dir[STORE_PATH_BYTES];
+  if (snprintf(reference_dir,sizeof(reference_dir),"%s/references",
+	       output_directory)>=sizeof(reference_dir)) {
+    snprintf(recipe_error,1024,"Output directory '%.900s' is too long.\n",
+	     output_directory);
+    return -1;
+  }
+  int r=recipe_decompress(h,recipe_dir,reference_dir,
+			  succinct,succinct_len,out_buffer,1048576,
+			  recipe_name,&recipe);
+  // Keep the record for the device to code its next submission against
+  if (r>=0&&recipe->delta_field>=0) {
+    mkdir(output_directory,0777);
+    if (recipe_reference_store(reference_dir,recipe,succinct,succinct_len,
+			       out_buffer,r))
+      fprintf(stderr,"%s",recipe_error);
+  }
+  LOGI("Got back from recipe_decompress: r=%d, succinct_len=%d",
+       r,succinct_len);
 
   if (r<0) {
     LOGI("%s:%d\n",__FILE__,__LINE__);
     // fprintf(stderr,"Could not find matching recipe file for %s.\n",input_file);
-    LOGI("Could not find matching recipe file for %s.\n",input_file);
+    LOGI("Could not find matching recipe file for %s.\n",name);
     return -1;
   }
   LOGI("%s:%d\n",__FILE__,__LINE__);
-  
-  char stripped_name[80];
-  MD5_CTX md5;
-  unsigned char hash[16];
-  char output_file[1024];
 
-  MD5_Init(&md5);
-  MD5_Update(&md5,out_buffer,r);
-  MD5_Final(hash,&md5);
-  snprintf(stripped_name,80,"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-	   hash[0],hash[1],hash[2],hash[3],hash[4],
-	   hash[5],hash[6],hash[7],hash[8],hash[9]);
-
-  // make directories if required
-  snprintf(output_file,1024,"%s/%s",output_directory,recipe_name);
-  mkdir(output_file,0777);
-
-  // now write stripped file out
-  fprintf(stderr,"Writing stripped data to %s\n",stripped_name);
-  LOGI("Writing stripped data to %s\n",stripped_name);
-  snprintf(output_file,1024,"%s/%s/%s.stripped",
-	   output_directory,recipe_name,stripped_name);
-
-  if (stat(output_file,&st)) {
-    // Stripped file does not yet exist, so append line to CSV file.
-    char line[8192];
-    if (!recipe_stripped_to_csv_line(recipe_dir,recipe_name,output_directory,
-				     out_buffer,r,line,8192))
-      {
-	char csv_file[1024];
-	snprintf(csv_file,1024,"%s",output_directory);
-	mkdir(csv_file,0777);
-	snprintf(csv_file,1024,"%s/csv",output_directory);
-	mkdir(csv_file,0777);
-	snprintf(csv_file,1024,"%s/csv/%s.csv",output_directory,
-		 recipe_name);
-	FILE *f=fopen(csv_file,"a");
-	fprintf(stderr,"Appending CSV line: %s\n",line);
-	LOGI("Appending CSV line: %s\n",line);
-	if (f) {
-	  int wrote=fwrite(line,strlen(line),1,f);
-	  if (wrote<strlen(line)) {
-	    fprintf(stderr,"Failed to produce CSV line (short write)\n");
-	  }
-				  
-	}
-	fclose(f);
-      } else {
-      fprintf(stderr,"Failed to produce CSV line.\n");
-    }
-  } else {
-    fprintf(stderr,"Not writing CSV line for form, as we have already seen it.\n");
-    LOGI("Not writing CSV line for form, as we have already seen it.\n");
-  }
+  r=recipe_store_message(recipe,recipe_dir,succinct,succinct_len,
+			 out_buffer,r,output_directory,name);
+  recipe_release(recipe);
+  if (r>=0) LOGI("Finished extracting succinct data file.\n");
+  return r;
+}
 
-  FILE *f=fopen(output_file,"w");
-  if (!f) {
-    snprintf(recipe_error,1024,"Could not write decompressed file '%s'\n",output_file);
+int recipe_decompress_file(stats_handle *h,char *recipe_dir,char *input_file,char *output_directory)
+{
+  unsigned char *buffer;
+
+  int fd=open(input_file,O_RDONLY);
+  if (fd==-1) {
+    snprintf(recipe_error,1024,"Could not open succinct data file '%s'\n",input_file);
     LOGI("%s",recipe_error);
     return -1;
   }
-  int wrote=fwrite(out_buffer,r,1,f);
-  fclose(f);
-  if (wrote!=1) {
-    snprintf(recipe_error,1024,"Could not write %d bytes of decompressed data into '%s'\n",r,output_file);
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    snprintf(recipe_error,1024,"Could not stat succinct data file '%s'\n",input_file);
     LOGI("%s",recipe_error);
-    return -1;
+    close(fd); return -1;
   }
-
-  // now produce the XML.
-  // We need to give it the template file.  Fortunately, we know the recipe name, 
-  // so we can build the template path from that.
-  char template_file[1024];
-  snprintf(template_file,1024,"%s/%s.template",recipe_dir,recipe_name);
-  char template[1048576];
-  int template_len=recipe_load_file(template_file,template,sizeof(template));
-  if (template_len<1) {
-    snprintf(recipe_error,1024,"Could not read template file '%s'\n",template_file);
+  if (st.st_size>=1024) {
+    snprintf(recipe_error,1024,"Succinct data file '%s' is too long (must be <1KB)\n",input_file);
     LOGI("%s",recipe_error);
-    return -1;    
+    close(fd); return -1;
   }
-  char xml[65536];
-  
-  int x=stripped2xml(out_buffer,r,template,template_len,xml,sizeof(xml));
 
-  char xml_file[1024];
-  snprintf(xml_file,1024,"%s/%s/%s.xml",
-	   output_directory,recipe_name,stripped_name);
-  f=fopen(xml_file,"w");
-  if (!f) {
-    snprintf(recipe_error,1024,"Could not write xml file '%s'\n",xml_file);
+  buffer=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buffer==MAP_FAILED) {
+    snprintf(recipe_error,1024,"Could not memory map succinct data file '%s'\n",input_file);
     LOGI("%s",recipe_error);
+    close(fd); return -1; 
+  }
+
+  // Keep the message as received, for the record store
+  unsigned char succinct[1024];
+  int succinct_len=st.st_size;
+  bcopy(buffer,succinct,succinct_len);
+  munmap(buffer,st.st_size); 
+  close(fd);
+
+  return recipe_decompress_message(h,recipe_dir,succinct,succinct_len,
+				   output_directory,input_file);
+}
+
+
+/*
+  Largest record that fits the fragments described by the command line
+  arguments from argv[first]: <MTU> <fragments> [<parity fragments>
+  [base64|gsm7]].  Returns -1 if none fits.
+*/
+static int recipe_fragment_budget(int argc,char *argv[],int first)
+{
+  int parity=argc>first+2?atoi(argv[first+2]):0;
+  int encoding=argc>first+3?fragment_encoding_by_name(argv[first+3]):0;
+  if (encoding<0) {
+    fprintf(stderr,"Unknown fragment encoding '%s'\n",argv[first+3]);
     return -1;
   }
-  wrote=fwrite(xml,x,1,f);
-  fclose(f);
-  if (wrote!=1) {
-    snprintf(recipe_error,1024,"Could not write %d bytes of XML data into '%s'\n",x,xml_file);
-    LOGI("%s",recipe_error);
+  int out_size=fragment_payload_bytes(atoi(argv[first]),atoi(argv[first+1]),
+				      parity,encoding);
+  if (out_size<1) {
+    fprintf(stderr,"%s fragments of %s characters cannot hold a record.\n",
+	    argv[first+1],argv[first]);
     return -1;
   }
-
-  LOGI("Finished extracting succinct data file.\n");
-  return r;
+  return out_size;
 }
 
-
 int recipe_main(int argc,char *argv[], stats_handle *h)
 {
   if (argc<=2) {
@@ -1504,12 +2793,75 @@ int recipe_main(int argc,char *argv[], stats_handle *h)
     } 
     printf("recipe=%p\n",recipe);
     printf("recipe->field_count=%d\n",recipe->field_count);
+  } else if (!strcasecmp(argv[2],"train")) {
+    if (argc<=4) {
+      fprintf(stderr,"usage: smac recipe train <recipe file> <stripped file or directory> [...]\n");
+      return(-1);
+    }
+    char model_file[1024];
+    if (recipe_model_path(argv[3],model_file,1024)) {
+      fprintf(stderr,"Recipe file name '%s' must end in .recipe\n",argv[3]);
+      return(-1);
+    }
+    struct recipe *recipe = recipe_read_from_file(argv[3]);
+    if (!recipe) {
+      fprintf(stderr,"%s",recipe_error);
+      return(-1);
+    }
+    if (recipe_model_train(recipe,h,&argv[4],argc-4)<0
+	||recipe_model_write(recipe,model_file)) {
+      fprintf(stderr,"%s",recipe_error);
+      recipe_free(recipe);
+      return(-1);
+    }
+    fprintf(stderr,"Wrote field model to '%s'\n",model_file);
+    recipe_free(recipe);
+    return 0;
   } else if (!strcasecmp(argv[2],"compress")) {
     if (argc<=5) {
       fprintf(stderr,"'smac recipe compress' requires recipe directory, input and output files.\n");
+      fprintf(stderr,"usage: smac recipe compress <recipe directory> <input> <output> [<MTU> <fragments> [<parity fragments> [base64|gsm7]]]\n");
+      return(-1);
+    }
+    // Optionally make the record fit in a given number of fragments
+    int out_size=0;
+    if (argc>7) {
+      out_size=recipe_fragment_budget(argc,argv,6);
+      if (out_size<1) return(-1);
+      printf("Record must fit in %d bytes.\n",out_size);
+    }
+    if (recipe_compress_file(h,argv[3],argv[4],argv[5],out_size,NULL,NULL)==-1) {
+      fprintf(stderr,"%s",recipe_error);
+      return(-1);
+    }
+    else return 0;
+  } else if (!strcasecmp(argv[2],"compress-batch")) {
+    if (argc<=5) {
+      fprintf(stderr,"usage: smac recipe compress-batch <recipe directory> <input> <output> [<threads> [<MTU> <fragments> [<parity fragments> [base64|gsm7]]]]\n");
+      return(-1);
+    }
+    int threads=argc>6?atoi(argv[6]):0;
+    int out_size=0;
+    if (argc>8) {
+      out_size=recipe_fragment_budget(argc,argv,7);
+      if (out_size<1) return(-1);
+    }
+    int r=recipe_compress_batch(h,argv[3],argv[4],argv[5],threads,out_size);
+    if (r<0) fprintf(stderr,"%s",recipe_error);
+    return r;
+  } else if (!strcasecmp(argv[2],"compress-delta")) {
+    if (argc<=7) {
+      fprintf(stderr,"usage: smac recipe compress-delta <recipe directory> <reference stripped> <reference succinct data> <input> <output> [<MTU> <fragments> [<parity fragments> [base64|gsm7]]]\n");
       return(-1);
     }
-    if (recipe_compress_file(h,argv[3],argv[4],argv[5])==-1) {
+    int out_size=0;
+    if (argc>9) {
+      out_size=recipe_fragment_budget(argc,argv,8);
+      if (out_size<1) return(-1);
+      printf("Record must fit in %d bytes.\n",out_size);
+    }
+    if (recipe_compress_file(h,argv[3],argv[6],argv[7],out_size,
+			     argv[4],argv[5])==-1) {
       fprintf(stderr,"%s",recipe_error);
       return(-1);
     }
@@ -1522,16 +2874,45 @@ int recipe_main(int argc,char *argv[], stats_handle *h)
     return generateMaps(argv[3],argv[4]);
   } else if (!strcasecmp(argv[2],"encrypt")) {
     if (argc<=6) {
-      fprintf(stderr,"usage: smac encrypt <file> <MTU> <output directory> <public key hex>\n");
+      fprintf(stderr,"usage: smac encrypt <file> <MTU> <output directory> <public key hex> [<parity fragments> [base64|gsm7]]\n");
       return(-1);
     }      
-    return encryptAndFragment(argv[3],atoi(argv[4]),argv[5],argv[6]);
+    // Optionally add parity fragments, so that the message survives the
+    // loss of as many of its fragments, and pack the fragments densely for SMS
+    int parity=argc>7?atoi(argv[7]):0;
+    int encoding=argc>8?fragment_encoding_by_name(argv[8]):0;
+    if (encoding<0) {
+      fprintf(stderr,"Unknown fragment encoding '%s'\n",argv[8]);
+      return(-1);
+    }
+    return encryptAndFragment(argv[3],atoi(argv[4]),argv[5],argv[6],parity,
+			      encoding,0);
+  } else if (!strcasecmp(argv[2],"encrypt-records")) {
+    if (argc<=8) {
+      fprintf(stderr,"usage: smac recipe encrypt-records <MTU> <parity fragments> <base64|gsm7> <output directory> <public key hex> <file> [...]\n");
+      return(-1);
+    }
+    int encoding=fragment_encoding_by_name(argv[5]);
+    if (encoding<0) {
+      fprintf(stderr,"Unknown fragment encoding '%s'\n",argv[5]);
+      return(-1);
+    }
+    // Send the records as one message, so that the per-message overhead is
+    // paid only once
+    return encryptAndFragmentFiles(&argv[8],argc-8,atoi(argv[3]),argv[6],
+				   argv[7],atoi(argv[4]),encoding,0);
   } else if (!strcasecmp(argv[2],"decrypt")) {
     if (argc<=5) {
       fprintf(stderr,"usage: smac decrypt <input directory> <output directory> <pass phrase>\n");
       return(-1);
     }      
     return defragmentAndDecrypt(argv[3],argv[4],argv[5]);
+  } else if (!strcasecmp(argv[2],"ingest")) {
+    if (argc<=6) {
+      fprintf(stderr,"usage: smac recipe ingest <recipe directory> <inbox directory> <output directory> <pass phrase>\n");
+      return(-1);
+    }
+    return ingest_run(h,argv[3],argv[4],argv[5],argv[6]);
   } else if (!strcasecmp(argv[2],"create")) {
     if (argc<=3) {
       fprintf(stderr,"usage: smac recipe create <XML form> \n");
@@ -1584,6 +2965,39 @@ int recipe_main(int argc,char *argv[], stats_handle *h)
       }    
       else return 0;
     }
+  } else if (!strcasecmp(argv[2],"export")) {
+    if (argc<=4) {
+      fprintf(stderr,"usage: smac recipe export <decompression output directory> <export directory> [<form>]\n");
+      return(-1);
+    }
+    // Write stored records out as individual .stripped and .xml files
+    char store_root[STORE_PATH_BYTES];
+    if (snprintf(store_root,sizeof(store_root),"%s/store",argv[3])
+	>=sizeof(store_root)) {
+      fprintf(stderr,"Output directory '%s' is too long\n",argv[3]);
+      return(-1);
+    }
+    DIR *dir=opendir(store_root);
+    if (!dir) {
+      fprintf(stderr,"Could not open record store '%s'\n",store_root);
+      return(-1);
+    }
+    struct dirent *de;
+    int e=0;
+    while((de=readdir(dir))!=NULL) {
+      if (de->d_name[0]=='.') continue;
+      if (argc>5&&strcmp(argv[5],de->d_name)) continue;
+      struct record_store *store=store_open_readonly(store_root,de->d_name);
+      int n=store?store_export(store,argv[4]):-1;
+      if (n<0) {
+	fprintf(stderr,"%s",recipe_error);
+	e++;
+      } else
+	fprintf(stderr,"Exported %d records of form '%s'\n",n,de->d_name);
+      store_close(store);
+    }
+    closedir(dir);
+    if (e) return 1; else return 0;
   } else if (!strcasecmp(argv[2],"strip")) {
     char stripped[65536];
     char xml_data[1048576];
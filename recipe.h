@@ -12,10 +12,21 @@
 // 16 gets resolution of ~ 1 day.
 // with min set appropriately, 25 gets 1 second granularity within a year.
 #define FIELDTYPE_DATE 5
-// precision is bits of precision in coordinates
+// precision is bits of precision in coordinates: 16 or 34 over the whole
+// globe, or 1 to 30 per coordinate within a bounding box or a window around
+// another location field, given where an enum would list its values (see
+// latlong.c).
 #define FIELDTYPE_LATLONG 6
-// min,max refer to size limits of text field.
-// precision refers to minimum number of characters to encode if we run short of space.
+// min,max refer to size limits of text field (max<=0 means no limit).
+// precision refers to minimum number of characters to encode if we run short of space:
+// when a record does not fit its byte budget, the longest text values are
+// shortened first, but never below precision characters.
+// Recipes written before this cut every value at precision characters
+// instead.  To keep that behaviour, set max to precision, as in
+// name:text:0:20:20.  Only the encoder is affected: text is self-delimiting
+// in the compressed stream, so records compressed either way still decode.
+// A negative precision keeps the whole value, as is always done for formid,
+// which names the recipe of a record.
 #define FIELDTYPE_TEXT 7
 // precision is the number of bits of the UUID
 // we just pull bits from the left of the UUID
@@ -30,8 +41,66 @@
 #define FIELDTYPE_MAGPITIMEDATE 12
 // Like _ENUM, but allows multiple choices to be selected
 #define FIELDTYPE_MULTISELECT 13
+// A repeat group (Magpi sub-form).  min,max bound the number of instances
+// (max<=0 means up to REPEAT_DEFAULT_MAXIMUM).  The names of the fields making
+// up one instance follow, comma separated, where an enum would list its values.
+#define FIELDTYPE_SUBFORM 14
+
+#define REPEAT_DEFAULT_MAXIMUM 255
+#define MAX_REPEAT_INSTANCES 256
 
 #define MAX_ENUM_VALUES 1024
+
+// How field presence is coded, as set by a recipe's "@presence:" header line.
+// flat: one bit per field (or the trained per-field probability, if any).
+// context: conditioned on whether the previously coded field was present,
+// using trained per-field probabilities where the model has them, and
+// otherwise probabilities adapted over the course of the record.
+#define PRESENCE_CODING_FLAT 0
+#define PRESENCE_CODING_CONTEXT 1
+
+// A record coded against an earlier one names it by the first bytes of the
+// MD5 hash of the earlier record's succinct data.  The server keeps the
+// records of forms with a @delta header in a record store (see store.h),
+// keyed by that id, to decode against, but only the last few from each
+// device, as named by the @delta field.
+#define RECIPE_REFERENCE_ID_BYTES 8
+#define RECIPE_DEVICE_REFERENCES 4
+
+// Largest number of distinct symbols a trained field model will hold.
+// Fields with larger alphabets are modelled in buckets of adjacent values,
+// with the position within the bucket encoded equiprobably.
+#define MAX_MODEL_SYMBOLS 1024
+
+/* Trained value frequencies for a single recipe field.
+   These are read from the optional <form>.model file that sits beside the
+   <form>.recipe file, and is produced by "smac recipe train".  Encoder and
+   decoder must have the same model file, just as they must have the same
+   recipe, and the model is part of the form hash so that they do. */
+struct field_model {
+  int training;
+
+  int alphabet; // number of values the field can take
+  int bucket;   // number of adjacent values per modelled symbol
+  int symbols;  // number of modelled symbols
+  unsigned int *counts;
+  unsigned int *frequencies;
+
+  unsigned int presence_counts[2];
+  unsigned int presence_frequency;
+
+  // Presence after an absent [0] or present [1] field, for context coding
+  unsigned int presence_context_counts[2][2];
+  unsigned int presence_context_frequency[2];
+};
+
+/* Presence coding state for one record when the recipe uses
+   PRESENCE_CODING_CONTEXT.  Encoder and decoder update it identically. */
+struct presence_state {
+  int previous; // whether the previously coded field was present
+  unsigned int counts[2][2]; // [previous][present], adapted within the record
+};
+
 struct field {
   char *name;
 
@@ -39,8 +108,32 @@ struct field {
   int minimum;
   int maximum;
   int precision; // meaning differs based on field type
+  int whole;     // TEXT value that is never shortened to fit
   char *enum_values[MAX_ENUM_VALUES];
   int enum_count;
+
+  int group; // repeat group field this field belongs to, or -1 if none
+
+  // LATLONG fields coded within a box and/or near another location field
+  int latlong_box;           // non-zero if latlong_bounds is set
+  double latlong_bounds[4];  // south, west, north, east
+  int latlong_reference;     // earlier LATLONG field in the same group, or -1
+  double latlong_window;     // degrees either side of the reference
+
+  struct field_model *model;
+};
+
+struct template_segment {
+  int offset; // literal text to copy
+  int length;
+  int field;  // recipe field whose value follows the text, or -1 for none
+};
+
+struct compiled_template {
+  char *text;
+  int text_len;
+  struct template_segment *segments;
+  int segment_count;
 };
 
 struct recipe {
@@ -49,12 +142,133 @@ struct recipe {
 
   struct field fields[1024];
   int field_count;
+
+  int presence_coding; // PRESENCE_CODING_*
+
+  // Field naming the submitting device, if records may be coded as changes
+  // to a reference record (see recipe_encoder_set_reference()), or -1.
+  int delta_field;
+
+  // Compiled on first use by recipe_decompress_message()
+  struct compiled_template *template;
+
+  // Holders of the recipe from recipe_find_recipe(), and whether it is still
+  // cached.  It is freed when it is neither.
+  int users;
+  int cached;
 };
 
+/*
+  Gathers the values of one record into recipe field slots, so that they can be
+  encoded in recipe order without first building a stripped text record.
+*/
+struct recipe_encoder {
+  struct recipe *recipe;
+  char *values[1024]; // value for each recipe field, or NULL if absent
+  int value_count;
+  int next_field;
+
+  // Instances of repeat groups, in the order they were opened
+  int instance_group[MAX_REPEAT_INSTANCES];  // subform field, or -1 if unknown
+  int instance_parent[MAX_REPEAT_INSTANCES]; // enclosing instance, or -1
+  int instance_count;
+  int current_instance; // instance receiving values, or -1 for top level
+
+  // Values given within repeat group instances
+  int pair_instance[1000];
+  int pair_field[1000];
+  char *pair_value[1000];
+  int pair_count;
+
+  // Longest TEXT value to encode, or -1 for no limit.  Set when the record
+  // has to be shortened to fit the output buffer.
+  int text_cap;
+
+  struct presence_state presence;
+
+  // Top-level values of the record this one is coded against, if any, as
+  // the server decoded them
+  char *reference[1024];
+  unsigned char reference_id[RECIPE_REFERENCE_ID_BYTES];
+  int reference_set;
+
+  char arena[65536];
+  int arena_len;
+};
+
+typedef int (*xml_pair_callback)(void *context,const char *key,const char *value);
+
+extern __thread char recipe_error[1024];
+
 int recipe_main(int argc,char *argv[],stats_handle *h);
 struct recipe *recipe_read_from_file(char *filename);
 struct recipe *recipe_read(char *formname,char *buffer,int buffer_size);
+void recipe_free(struct recipe *recipe);
+char *recipe_field_type_name(int f);
+int recipe_parse_boolean(char *b);
+int recipe_load_file(char *filename,char *out,int out_size);
+int recipe_text_length(struct field *field,const char *value,int cap);
+int recipe_encode_field(struct recipe *recipe,stats_handle *stats, range_coder *c,
+			int fieldnumber,char *value);
+int recipe_field_lookup(struct recipe *recipe,const char *name,int name_len,
+			int hint);
+void recipe_encoder_init(struct recipe_encoder *e,struct recipe *recipe);
+int recipe_encoder_add(struct recipe_encoder *e,const char *key,int key_len,
+		       const char *value,int value_len);
+int recipe_encoder_open_instance(struct recipe_encoder *e);
+int recipe_encoder_close_instance(struct recipe_encoder *e);
+int recipe_encoder_finish(struct recipe_encoder *e,stats_handle *h,
+			  unsigned char *out,int out_size);
+int recipe_encoder_add_stripped(struct recipe_encoder *e,char *in,int in_len);
+int recipe_encoder_train(struct recipe_encoder *e,stats_handle *h);
+int recipe_encoder_set_reference(struct recipe_encoder *e,stats_handle *h,
+				 char *stripped,int stripped_len,
+				 unsigned char *succinct,int succinct_len);
+int recipe_compress(stats_handle *h,struct recipe *recipe,
+		    char *in,int in_len, unsigned char *out, int out_size);
+int recipe_compress_delta(stats_handle *h,struct recipe *recipe,
+			  char *reference,int reference_len,
+			  unsigned char *reference_succinct,int succinct_len,
+			  char *in,int in_len,unsigned char *out,int out_size);
+int recipe_compress_xml(stats_handle *h,struct recipe *recipe,
+			const char *form_name,const char *xml,int xml_len,
+			unsigned char *out,int out_size);
+int recipe_record_formid(const char *record,int record_len,char *formid);
+
+struct recipe *recipe_find_recipe(char *recipe_dir,unsigned char *formhash);
+void recipe_release(struct recipe *recipe);
+int recipe_decompress(stats_handle *h,char *recipe_dir,char *reference_dir,
+		      unsigned char *in,int in_len,char *out,int out_size,
+		      char *recipe_name,struct recipe **recipe_out);
+int recipe_decompress_message(stats_handle *h,char *recipe_dir,
+			      unsigned char *succinct,int succinct_len,
+			      char *output_directory,char *name);
+
+int recipe_form_hash(char *recipe_file,unsigned char *formhash,
+		     char *formname);
+int recipe_model_path(char *recipe_file,char *model_file,int model_file_size);
+int recipe_model_load(struct recipe *recipe,char *filename);
+int recipe_model_free(struct recipe *recipe);
+int recipe_model_train(struct recipe *recipe,stats_handle *h,
+		       char **inputs,int input_count);
+int recipe_model_write(struct recipe *recipe,char *filename);
+void recipe_presence_init(struct presence_state *s);
+int recipe_encode_presence(range_coder *c,struct field *field,int present,
+			   struct presence_state *s);
+int recipe_decode_presence(range_coder *c,struct field *field,
+			   struct presence_state *s);
+int recipe_encode_value(range_coder *c,struct field *field,
+			int alphabet_size,int symbol);
+int recipe_decode_value(range_coder *c,struct field *field,int alphabet_size);
 int stripped2xml(char *stripped,int stripped_len,char *template,int template_len,char *xml,int xml_size);
+struct compiled_template *template_compile(struct recipe *recipe,
+					   char *template,int template_len);
+void template_free(struct compiled_template *t);
+int template_render(struct compiled_template *t,struct recipe *recipe,
+		    char *stripped,int stripped_len,
+		    char **out,int *out_size);
+int xml_scan_instance(const char *form_name, const char *xml,int xml_len,
+		      xml_pair_callback pair,void *context);
 int xml2stripped(const char *form_name, const char *xml,int xml_len,char *stripped,int stripped_size);
 
 int generateMaps(char *recipeDir, char *outputDir);
@@ -65,3 +279,7 @@ int xhtmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 int xmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 		char *recipetext,int *recipeLen,
 		char *templatetext,int *templateLen);
+int recipe_specification_to_recipe(char *xmlform_c,int size,
+				   char *formname,char *formversion,
+				   char *recipetext,int *recipeLen,
+				   char *templatetext,int *templateLen);
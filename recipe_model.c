@@ -0,0 +1,454 @@
+/*
+  Trained per-field probability models for succinct data recipes.
+
+  Most recipe fields are encoded as if every value were equally likely, but
+  real submissions are heavily skewed: an enum usually takes one of two or
+  three of its values, integers cluster, and dates fall within a few months.
+  "smac recipe train" reads an archive of stripped records for a form and
+  writes a <form>.model file of value frequencies beside <form>.recipe.  When
+  that file is present, the encoder and decoder use it with
+  range_encode_symbol() instead of range_encode_equiprobable().
+
+  The model file is plain text, one line per field and kind of statistic:
+
+  fieldname:presence:<absent count>:<present count>
+  fieldname:presence-context:<absent>:<present>:<absent>:<present>
+  fieldname:values:<alphabet size>:<symbol>=<count>,<symbol>=<count>,...
+
+  The presence-context counts are split by whether the field before was absent
+  (first pair) or present (second pair).  They are only used, and only
+  written, for recipes with the "@presence:context" header.
+
+  A record coded with a model cannot be decoded without the same model, so
+  the model file is folded into the form hash that heads each record.  A
+  decoder with a different model, or none, then finds no recipe for the
+  record, instead of decoding it wrongly.
+
+  Training runs each record through the encoder itself, so the counts follow
+  the encoder's traversal: top-level fields and the first instance of each
+  repeat group share one presence context, and later instances, whose
+  presence is coded relative to the instance before, are not counted.
+
+  (C) Copyright Paul Gardner-Stephen, 2016.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <strings.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "md5.h"
+
+/* Convert raw counts into the cumulative 24-bit frequency table expected by
+   range_encode_symbol().  Every symbol gets at least one count, so that values
+   not seen during training can still be encoded. */
+static int model_frequencies(unsigned int *counts,int n,unsigned int *frequencies)
+{
+  unsigned long long total=0;
+  unsigned long long cumulative=0;
+  int i;
+
+  for(i=0;i<n;i++) total+=counts[i]+1;
+  for(i=0;i<n-1;i++) {
+    cumulative+=counts[i]+1;
+    unsigned int f=cumulative*0xffffff/total;
+    if (f<1) f=1;
+    if (i&&f<=frequencies[i-1]) f=frequencies[i-1]+1;
+    if (f>0xffffff-(n-2-i)) f=0xffffff-(n-2-i);
+    frequencies[i]=f;
+  }
+  return 0;
+}
+
+/* Presence probabilities for each context.  A context that was never seen
+   in training is left to be adapted within each record instead. */
+static void model_context_frequencies(struct field_model *m)
+{
+  int p;
+  for(p=0;p<2;p++) {
+    m->presence_context_frequency[p]=0;
+    if (m->presence_context_counts[p][0]+m->presence_context_counts[p][1])
+      model_frequencies(m->presence_context_counts[p],2,
+			&m->presence_context_frequency[p]);
+  }
+}
+
+static int model_setup(struct field_model *m,int alphabet_size)
+{
+  m->alphabet=alphabet_size;
+  m->bucket=1;
+  while ((alphabet_size+m->bucket-1)/m->bucket>MAX_MODEL_SYMBOLS) m->bucket<<=1;
+  m->symbols=(alphabet_size+m->bucket-1)/m->bucket;
+  m->counts=calloc(m->symbols,sizeof(unsigned int));
+  m->frequencies=calloc(m->symbols+1,sizeof(unsigned int));
+  if (!m->counts||!m->frequencies) {
+    snprintf(recipe_error,1024,"Could not allocate field model.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Number of values in the bucket for modelled symbol s.
+static int model_bucket_size(struct field_model *m,int s)
+{
+  int size=m->alphabet-s*m->bucket;
+  if (size>m->bucket) size=m->bucket;
+  return size;
+}
+
+void recipe_presence_init(struct presence_state *s)
+{
+  // The start of a record behaves as if it followed a present field
+  s->previous=1;
+  s->counts[0][0]=1; s->counts[0][1]=1;
+  s->counts[1][0]=1; s->counts[1][1]=1;
+}
+
+// Probability that the field is absent, given the field before it.
+static unsigned int presence_context_frequency(struct field *field,
+					       struct presence_state *s)
+{
+  struct field_model *m=field->model;
+  if (m&&m->presence_context_frequency[s->previous])
+    return m->presence_context_frequency[s->previous];
+  unsigned int *counts=s->counts[s->previous];
+  unsigned int f=(unsigned long long)counts[0]*0xffffff/(counts[0]+counts[1]);
+  if (f<1) f=1;
+  if (f>0xfffffe) f=0xfffffe;
+  return f;
+}
+
+static void presence_context_update(struct presence_state *s,int present)
+{
+  s->counts[s->previous][present]++;
+  s->previous=present;
+}
+
+int recipe_encode_presence(range_coder *c,struct field *field,int present,
+			   struct presence_state *s)
+{
+  struct field_model *m=field->model;
+  present=present?1:0;
+  if (m&&m->training) {
+    m->presence_counts[present]++;
+    if (s) {
+      m->presence_context_counts[s->previous][present]++;
+      s->previous=present;
+    }
+  } else if (s) {
+    unsigned int frequency=presence_context_frequency(field,s);
+    presence_context_update(s,present);
+    return range_encode_symbol(c,&frequency,2,present);
+  } else if (m&&m->presence_frequency)
+    return range_encode_symbol(c,&m->presence_frequency,2,present);
+  return range_encode_equiprobable(c,2,present);
+}
+
+int recipe_decode_presence(range_coder *c,struct field *field,
+			   struct presence_state *s)
+{
+  struct field_model *m=field->model;
+  if (s) {
+    unsigned int frequency=presence_context_frequency(field,s);
+    int present=range_decode_symbol(c,&frequency,2);
+    presence_context_update(s,present);
+    return present;
+  }
+  if (m&&m->presence_frequency)
+    return range_decode_symbol(c,&m->presence_frequency,2);
+  return range_decode_equiprobable(c,2);
+}
+
+int recipe_encode_value(range_coder *c,struct field *field,
+			int alphabet_size,int symbol)
+{
+  struct field_model *m=field->model;
+
+  if (m&&m->training&&symbol>=0&&symbol<alphabet_size) {
+    if (!m->alphabet)
+      if (model_setup(m,alphabet_size)) return -1;
+    if (m->alphabet==alphabet_size) m->counts[symbol/m->bucket]++;
+  } else if (m&&m->symbols&&m->alphabet==alphabet_size
+	     &&symbol>=0&&symbol<alphabet_size) {
+    int s=symbol/m->bucket;
+    if (range_encode_symbol(c,m->frequencies,m->symbols,s)) return -1;
+    if (m->bucket==1) return 0;
+    return range_encode_equiprobable(c,model_bucket_size(m,s),symbol-s*m->bucket);
+  }
+  return range_encode_equiprobable(c,alphabet_size,symbol);
+}
+
+int recipe_decode_value(range_coder *c,struct field *field,int alphabet_size)
+{
+  struct field_model *m=field->model;
+
+  if (m&&m->symbols&&m->alphabet==alphabet_size) {
+    int s=range_decode_symbol(c,m->frequencies,m->symbols);
+    if (m->bucket==1) return s;
+    return s*m->bucket+range_decode_equiprobable(c,model_bucket_size(m,s));
+  }
+  return range_decode_equiprobable(c,alphabet_size);
+}
+
+int recipe_model_free(struct recipe *recipe)
+{
+  int i;
+  for(i=0;i<recipe->field_count;i++) {
+    struct field_model *m=recipe->fields[i].model;
+    if (!m) continue;
+    if (m->counts) free(m->counts);
+    if (m->frequencies) free(m->frequencies);
+    free(m);
+    recipe->fields[i].model=NULL;
+  }
+  // Without a model, the form is known by its name alone
+  recipe_form_hash(recipe->formname,recipe->formhash,NULL);
+  return 0;
+}
+
+int recipe_model_path(char *recipe_file,char *model_file,int model_file_size)
+{
+  int len=strlen(recipe_file);
+  if (len<=strlen(".recipe")
+      ||strcasecmp(&recipe_file[len-strlen(".recipe")],".recipe")) return -1;
+  snprintf(model_file,model_file_size,"%.*s.model",
+	   (int)(len-strlen(".recipe")),recipe_file);
+  return 0;
+}
+
+static int recipe_find_field(struct recipe *recipe,char *name)
+{
+  int f;
+  for(f=0;f<recipe->field_count;f++)
+    if (!strcasecmp(recipe->fields[f].name,name)) return f;
+  return -1;
+}
+
+static struct field_model *recipe_field_model(struct field *field)
+{
+  if (!field->model) field->model=calloc(sizeof(struct field_model),1);
+  return field->model;
+}
+
+int recipe_model_load(struct recipe *recipe,char *filename)
+{
+  struct stat st;
+  // No model is not an error: fields are then encoded equiprobably.
+  if (stat(filename,&st)) return 0;
+
+  char *buffer=malloc(st.st_size+1);
+  if (!buffer) {
+    snprintf(recipe_error,1024,"Could not allocate buffer for model file '%s'\n",filename);
+    return -1;
+  }
+  int len=recipe_load_file(filename,buffer,st.st_size);
+  if (len<0) { free(buffer); return -1; }
+  buffer[len]=0;
+
+  // The form hash of records coded with this model
+  MD5_CTX md5;
+  unsigned char hash[16];
+  MD5_Init(&md5);
+  MD5_Update(&md5,recipe->formname,strlen(recipe->formname));
+  MD5_Update(&md5,"\n",1);
+  MD5_Update(&md5,buffer,len);
+  MD5_Final(hash,&md5);
+
+  int line_number=1;
+  char *line=buffer;
+  while(line&&*line) {
+    char *next=strchr(line,'\n');
+    if (next) *next++=0;
+
+    char name[1024],kind[1024];
+    int o=0;
+    if (line[0]&&line[0]!='#'
+	&&sscanf(line,"%1023[^:]:%1023[^:]:%n",name,kind,&o)==2&&o) {
+      int f=recipe_find_field(recipe,name);
+      struct field_model *m=(f>=0)?recipe_field_model(&recipe->fields[f]):NULL;
+      if (f<0) {
+	// Field no longer in recipe: ignore, so that old models keep working.
+      } else if (!m) {
+	snprintf(recipe_error,1024,"Could not allocate field model.\n");
+	free(buffer); recipe_model_free(recipe); return -1;
+      } else if (!strcasecmp(kind,"presence")) {
+	if (sscanf(&line[o],"%u:%u",
+		   &m->presence_counts[0],&m->presence_counts[1])!=2) {
+	  snprintf(recipe_error,1024,"%s:%d:Malformed presence model.\n",
+		   filename,line_number);
+	  free(buffer); recipe_model_free(recipe); return -1;
+	}
+	model_frequencies(m->presence_counts,2,&m->presence_frequency);
+      } else if (!strcasecmp(kind,"presence-context")) {
+	unsigned int *counts=&m->presence_context_counts[0][0];
+	if (sscanf(&line[o],"%u:%u:%u:%u",
+		   &counts[0],&counts[1],&counts[2],&counts[3])!=4) {
+	  snprintf(recipe_error,1024,"%s:%d:Malformed presence context model.\n",
+		   filename,line_number);
+	  free(buffer); recipe_model_free(recipe); return -1;
+	}
+	model_context_frequencies(m);
+      } else if (!strcasecmp(kind,"values")) {
+	int alphabet_size=0,n=0;
+	if (sscanf(&line[o],"%d:%n",&alphabet_size,&n)!=1||alphabet_size<1
+	    ||m->alphabet||model_setup(m,alphabet_size)) {
+	  snprintf(recipe_error,1024,"%s:%d:Malformed value model.\n",
+		   filename,line_number);
+	  free(buffer); recipe_model_free(recipe); return -1;
+	}
+	char *p=&line[o+n];
+	int symbol; unsigned int count;
+	while(sscanf(p,"%d=%u%n",&symbol,&count,&n)==2) {
+	  if (symbol>=0&&symbol<m->symbols) m->counts[symbol]=count;
+	  p+=n; if (*p==',') p++;
+	}
+	model_frequencies(m->counts,m->symbols,m->frequencies);
+      }
+    }
+    line=next; line_number++;
+  }
+
+  free(buffer);
+  bcopy(hash,recipe->formhash,6);
+  return 0;
+}
+
+int recipe_model_write(struct recipe *recipe,char *filename)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    snprintf(recipe_error,1024,"Could not write model file '%s'\n",filename);
+    return -1;
+  }
+  fprintf(f,"# Field model for %s\n",recipe->formname);
+  int i,s;
+  for(i=0;i<recipe->field_count;i++) {
+    struct field_model *m=recipe->fields[i].model;
+    if (!m) continue;
+    fprintf(f,"%s:presence:%u:%u\n",recipe->fields[i].name,
+	    m->presence_counts[0],m->presence_counts[1]);
+    unsigned int *context=&m->presence_context_counts[0][0];
+    if (context[0]||context[1]||context[2]||context[3])
+      fprintf(f,"%s:presence-context:%u:%u:%u:%u\n",recipe->fields[i].name,
+	      context[0],context[1],context[2],context[3]);
+    if (!m->alphabet) continue;
+    fprintf(f,"%s:values:%d:",recipe->fields[i].name,m->alphabet);
+    int first=1;
+    for(s=0;s<m->symbols;s++)
+      if (m->counts[s]) {
+	fprintf(f,"%s%d=%u",first?"":",",s,m->counts[s]);
+	first=0;
+      }
+    fprintf(f,"\n");
+  }
+  fclose(f);
+  return 0;
+}
+
+static int recipe_model_train_record(struct recipe *recipe,stats_handle *h,
+				     char *in,int in_len)
+{
+  // Decompressed records mark absent fields with ~, which the encoder would
+  // take as a value, so leave those lines out.
+  char *record=malloc(in_len+1);
+  int record_len=0;
+  int i,start=0;
+  if (!record) {
+    snprintf(recipe_error,1024,"Out of memory reading training record.\n");
+    return -1;
+  }
+  for(i=0;i<=in_len;i++) {
+    if ((i==in_len)||(in[i]=='\n')||(in[i]=='\r')) {
+      int l=i-start;
+      if (!(l>=2&&in[i-2]=='='&&in[i-1]=='~')) {
+	bcopy(&in[start],&record[record_len],l);
+	record_len+=l;
+	record[record_len++]='\n';
+      }
+      start=i+1;
+    }
+  }
+
+  // Then encode it as recipe_compress() would, so that presence and values
+  // are counted with the same traversal of fields and repeat groups.
+  struct recipe_encoder *e=malloc(sizeof(struct recipe_encoder));
+  int r=-1;
+  if (!e)
+    snprintf(recipe_error,1024,"Out of memory reading training record.\n");
+  else {
+    recipe_encoder_init(e,recipe);
+    if (!recipe_encoder_add_stripped(e,record,record_len))
+      r=recipe_encoder_train(e,h);
+    free(e);
+  }
+  free(record);
+  return r;
+}
+
+static int recipe_model_train_file(struct recipe *recipe,stats_handle *h,
+				   char *filename)
+{
+  char in[65536];
+  int in_len=recipe_load_file(filename,in,sizeof(in));
+  if (in_len<0) return -1;
+  return recipe_model_train_record(recipe,h,in,in_len);
+}
+
+int recipe_model_train(struct recipe *recipe,stats_handle *h,
+		       char **inputs,int input_count)
+{
+  int i,records=0;
+
+  recipe_model_free(recipe);
+  for(i=0;i<recipe->field_count;i++) {
+    if (!recipe_field_model(&recipe->fields[i])) {
+      snprintf(recipe_error,1024,"Could not allocate field model.\n");
+      return -1;
+    }
+    recipe->fields[i].model->training=1;
+  }
+
+  for(i=0;i<input_count;i++) {
+    struct stat st;
+    if (stat(inputs[i],&st)) {
+      snprintf(recipe_error,1024,"Could not stat '%s'\n",inputs[i]);
+      return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      // Directory of decompressed records, as written by "smac recipe decompress"
+      DIR *dir=opendir(inputs[i]);
+      struct dirent *de;
+      if (!dir) continue;
+      while((de=readdir(dir))!=NULL) {
+	int len=strlen(de->d_name);
+	if (len<=strlen(".stripped")
+	    ||strcasecmp(&de->d_name[len-strlen(".stripped")],".stripped"))
+	  continue;
+	char filename[1024];
+	snprintf(filename,1024,"%s/%s",inputs[i],de->d_name);
+	if (!recipe_model_train_file(recipe,h,filename)) records++;
+      }
+      closedir(dir);
+    } else if (!recipe_model_train_file(recipe,h,inputs[i])) records++;
+  }
+
+  for(i=0;i<recipe->field_count;i++) {
+    struct field_model *m=recipe->fields[i].model;
+    m->training=0;
+    model_frequencies(m->presence_counts,2,&m->presence_frequency);
+    model_context_frequencies(m);
+    if (m->symbols) model_frequencies(m->counts,m->symbols,m->frequencies);
+  }
+
+  fprintf(stderr,"Trained field model on %d records.\n",records);
+  return records;
+}
@@ -0,0 +1,292 @@
+/*
+  Persistent compression sessions for devices.  See session.h.
+
+  The JNI bindings used to read and decode the whole of smac.dat, and read
+  or regenerate the recipe, for every form submitted.  A session does that
+  once for the model, and once for each form, which it then keeps along with
+  the public key its records are encrypted to.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#ifdef ANDROID
+#include <android/log.h>
+
+#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "libsmac", __VA_ARGS__))
+#else
+#define LOGI(...)
+#endif
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "md5.h"
+#include "reassembly.h"
+#include "crypto.h"
+#include "session.h"
+
+// Public key of the Serval succinct data server, for forms without their own
+#define SESSION_DEFAULT_PUBLIC_KEY \
+  "74f3a36029b0e60084d42bd9cafa3f2b26fe802b0a6f024ff00451481c9bba4a"
+
+struct smac_session *session_open(char *stats_file)
+{
+  struct smac_session *s=calloc(1,sizeof(struct smac_session));
+  if (!s) {
+    snprintf(recipe_error,1024,"Out of memory opening session\n");
+    return NULL;
+  }
+  s->h=stats_new_handle(stats_file);
+  if (!s->h) {
+    snprintf(recipe_error,1024,"Could not read SMAC stats file %s\n",stats_file);
+    free(s);
+    return NULL;
+  }
+  stats_load_tree(s->h);
+  pthread_mutex_init(&s->lock,NULL);
+  // Have ephemeral keys ready by the time the first record is encrypted
+  crypto_keypair_pool_start();
+  LOGI("Opened session with stats file %s",stats_file);
+  return s;
+}
+
+void session_close(struct smac_session *s)
+{
+  int i;
+  if (!s) return;
+  for(i=0;i<s->recipe_count;i++) recipe_free(s->recipes[i].recipe);
+  stats_handle_free(s->h);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+// Read the public key of a form, if it has a key file
+static int session_read_public_key(const char *path,const char *formname,
+				   const char *formversion,char *publickeyhex)
+{
+  char filename[1024];
+  snprintf(publickeyhex,1024,"%s",SESSION_DEFAULT_PUBLIC_KEY);
+  if (!path||!formname||!formversion) return 0;
+  if (snprintf(filename,1024,"%s/%s.%s.publickey",path,formname,formversion)
+      >=1024) {
+    snprintf(recipe_error,1024,"Public key file name for form '%.900s' is too long\n",
+	     formname);
+    return -1;
+  }
+  FILE *f=fopen(filename,"r");
+  if (!f) return 0;
+  int r=fread(publickeyhex,1,1023,f);
+  fclose(f);
+  if (r<64) {
+    snprintf(recipe_error,1024,"Failed to read from public key file %.980s\n",
+	     filename);
+    return -1;
+  }
+  publickeyhex[r]=0;
+  // Trim CR/LF from end
+  while(r>0&&publickeyhex[r-1]<' ') publickeyhex[--r]=0;
+  return 0;
+}
+
+static struct recipe *session_read_recipe(const char *specification,
+					  const char *filename)
+{
+  if (!specification) {
+    struct recipe *recipe=recipe_read_from_file((char *)filename);
+    if (!recipe)
+      snprintf(recipe_error,1024,"Could not read recipe file %.990s\n",filename);
+    return recipe;
+  }
+
+  // Create recipe from form specification
+  char *recipetext=malloc(65536);
+  char *templatetext=malloc(65536);
+  int recipetextLen=65536;
+  int templatetextLen=65536;
+  char the_form_name[1024];
+  char the_form_version[1024];
+  struct recipe *recipe=NULL;
+
+  if (!recipetext||!templatetext)
+    snprintf(recipe_error,1024,"Out of memory creating recipe\n");
+  else if (recipe_specification_to_recipe((char *)specification,
+					  strlen(specification),
+					  the_form_name,the_form_version,
+					  recipetext,&recipetextLen,
+					  templatetext,&templatetextLen))
+    snprintf(recipe_error,1024,"Could not create recipe from form specification\n");
+  else if (recipetextLen<10)
+    snprintf(recipe_error,1024,"Could not convert form specification to recipe\n");
+  else {
+    // Magpi forms are identified solely by the numeric formid
+    if (!strncasecmp("<html",specification,5))
+      strcpy(the_form_name,the_form_version);
+    recipe=recipe_read(the_form_name,recipetext,recipetextLen);
+    if (!recipe) {
+      LOGI("Recipe is:\n%s",recipetext);
+      snprintf(recipe_error,1024,"Could not set recipe\n");
+    }
+  }
+  free(recipetext);
+  free(templatetext);
+  return recipe;
+}
+
+// Add a string, or NULL, to a hash, so that no two lists of strings collide
+static void session_hash_string(MD5_CTX *md5,const char *s)
+{
+  unsigned char present=s?1:0;
+  MD5_Update(md5,&present,1);
+  if (s) MD5_Update(md5,(unsigned char *)s,strlen(s)+1);
+}
+
+/*
+  Find the recipe for a form, given either its specification or the
+  directory holding <formname>.<formversion>.recipe (or <formname>.recipe if
+  formversion is NULL), reading it and its public key the first time the
+  form is seen.  Called with the lock held.
+*/
+static struct session_recipe *session_find_recipe(struct smac_session *s,
+						  const char *specification,
+						  const char *path,
+						  const char *formname,
+						  const char *formversion)
+{
+  char filename[1024];
+  unsigned char hash[16];
+  MD5_CTX md5;
+  int i;
+
+  if (specification&&!specification[0]) specification=NULL;
+  if (!specification) {
+    int n=formversion?
+      snprintf(filename,1024,"%s/%s.%s.recipe",path,formname,formversion)
+      :snprintf(filename,1024,"%s/%s.recipe",path,formname);
+    if (n>=1024) {
+      snprintf(recipe_error,1024,"Recipe file name for form '%.900s' is too long\n",
+	       formname);
+      return NULL;
+    }
+  }
+  // The form name and version choose the public key, so are part of the key
+  // even when the recipe comes from the specification
+  MD5_Init(&md5);
+  session_hash_string(&md5,specification);
+  session_hash_string(&md5,path);
+  session_hash_string(&md5,formname);
+  session_hash_string(&md5,formversion);
+  MD5_Final(hash,&md5);
+  for(i=0;i<s->recipe_count;i++)
+    if (!memcmp(hash,s->recipes[i].hash,16)) return &s->recipes[i];
+
+  struct session_recipe r;
+  if (session_read_public_key(path,formname,formversion,r.publickeyhex))
+    return NULL;
+  r.recipe=session_read_recipe(specification,filename);
+  if (!r.recipe) return NULL;
+  bcopy(hash,r.hash,16);
+  LOGI("Read recipe for session. Hash = %02x%02x%02x%02x%02x%02x",
+       r.recipe->formhash[0],r.recipe->formhash[1],r.recipe->formhash[2],
+       r.recipe->formhash[3],r.recipe->formhash[4],r.recipe->formhash[5]);
+
+  // Replace entries round-robin once the cache is full
+  if (s->recipe_count<SESSION_MAX_RECIPES) i=s->recipe_count++;
+  else {
+    i=s->recipe_next;
+    s->recipe_next=(i+1)%SESSION_MAX_RECIPES;
+    recipe_free(s->recipes[i].recipe);
+  }
+  s->recipes[i]=r;
+  return &s->recipes[i];
+}
+
+static int session_compress_locked(struct smac_session *s,const char *xml,
+				   const char *specification,const char *path,
+				   const char *formname,const char *formversion,
+				   unsigned char *out,int out_size,
+				   char *publickeyhex)
+{
+  struct session_recipe *r=session_find_recipe(s,specification,path,
+					       formname,formversion);
+  if (!r) return -1;
+  snprintf(publickeyhex,1024,"%s",r->publickeyhex);
+  // Produce succinct data straight from the XML, without stripping it first.
+  // Recipes made from a specification match the instance by any tag.
+  int len=recipe_compress_xml(s->h,r->recipe,
+			      specification&&specification[0]?"":NULL,
+			      xml,strlen(xml),out,out_size);
+  LOGI("Binary succinct data is %d bytes long",len);
+  return len;
+}
+
+/*
+  Compress a form instance, given the form specification, or if that is NULL
+  or empty the directory holding <formname>.<formversion>.recipe.  Returns
+  the length of the succinct data, and the public key to encrypt it to.
+*/
+int session_compress_xml(struct smac_session *s,const char *xml,
+			 const char *specification,const char *path,
+			 const char *formname,const char *formversion,
+			 unsigned char *out,int out_size,char *publickeyhex)
+{
+  pthread_mutex_lock(&s->lock);
+  int len=session_compress_locked(s,xml,specification,path,formname,
+				  formversion,out,out_size,publickeyhex);
+  pthread_mutex_unlock(&s->lock);
+  return len;
+}
+
+/*
+  Compress a stripped or XML record with <recipe_dir>/<formid>.recipe, as
+  named by the record's formid field.
+*/
+int session_compress_record(struct smac_session *s,const char *recipe_dir,
+			    const char *record,int record_len,
+			    unsigned char *out,int out_size)
+{
+  char formid[1024];
+  int is_xml=recipe_record_formid(record,record_len,formid);
+  if (is_xml<0) return -1;
+  pthread_mutex_lock(&s->lock);
+  int len=-1;
+  struct session_recipe *r=session_find_recipe(s,NULL,recipe_dir,formid,NULL);
+  if (r&&is_xml)
+    len=recipe_compress_xml(s->h,r->recipe,NULL,record,record_len,
+			    out,out_size);
+  else if (r)
+    len=recipe_compress(s->h,r->recipe,(char *)record,record_len,
+			out,out_size);
+  pthread_mutex_unlock(&s->lock);
+  return len;
+}
+
+/*
+  Compress a form instance as session_compress_xml() does, then encrypt it
+  and break it into fragments, as encryptAndFragmentBufferFEC() does.
+*/
+int session_xml_to_fragments(struct smac_session *s,const char *xml,
+			     const char *specification,const char *path,
+			     const char *formname,const char *formversion,
+			     int mtu,int parity,int encoding,int debug,
+			     char *fragments[MAX_FRAGMENTS],int *fragment_count)
+{
+  unsigned char succinct[1024];
+  char publickeyhex[1024];
+  int len=session_compress_xml(s,xml,specification,path,formname,formversion,
+			       succinct,sizeof(succinct),publickeyhex);
+  if (len<1) return -1;
+  if (encryptAndFragmentBufferFEC(succinct,len,fragments,fragment_count,mtu,
+				  publickeyhex,parity,encoding,debug)) {
+    snprintf(recipe_error,1024,"Could not fragment %d bytes of succinct data\n",
+	     len);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+/*
+  A compression session holds what every form submission from a device
+  needs: the stats.dat model, loaded once, the recipes of the forms seen so
+  far, and the recipient public key of each.  Each submission then costs
+  only what its record does.  Calls on one session are serialised.
+
+  Needs packed_stats.h, recipe.h and crypto.h.
+*/
+
+#define SESSION_MAX_RECIPES 16
+
+struct session_recipe {
+  unsigned char hash[16];      // of the specification, path, name and version
+  struct recipe *recipe;
+  char publickeyhex[1024];
+};
+
+struct smac_session {
+  pthread_mutex_t lock;
+  stats_handle *h;
+  struct session_recipe recipes[SESSION_MAX_RECIPES];
+  int recipe_count;
+  int recipe_next;             // replaced next once the cache is full
+};
+
+struct smac_session *session_open(char *stats_file);
+void session_close(struct smac_session *s);
+int session_compress_xml(struct smac_session *s,const char *xml,
+			 const char *specification,const char *path,
+			 const char *formname,const char *formversion,
+			 unsigned char *out,int out_size,char *publickeyhex);
+int session_compress_record(struct smac_session *s,const char *recipe_dir,
+			    const char *record,int record_len,
+			    unsigned char *out,int out_size);
+int session_xml_to_fragments(struct smac_session *s,const char *xml,
+			     const char *specification,const char *path,
+			     const char *formname,const char *formversion,
+			     int mtu,int parity,int encoding,int debug,
+			     char *fragments[MAX_FRAGMENTS],int *fragment_count);
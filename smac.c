@@ -42,6 +42,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "smac.h"
 #include "unicode.h"
 
+// Where the bits of compressed messages go, summed over all messages
+long long total_alpha_bits=0;
+long long total_nonalpha_bits=0;
+long long total_case_bits=0;
+long long total_model_bits=0;
+long long total_length_bits=0;
+long long total_finalisation_bits=0;
+
 int encodeLCAlphaSpace(range_coder *c,unsigned short *s,int len,stats_handle *h,
 		       double *entropyLog);
 int encodeNonAlpha(range_coder *c,unsigned short *s,int len);
@@ -264,16 +272,21 @@ int stats3_compress_append(range_coder *c,unsigned char *m_in,int m_in_len,
 {
   int b1,b2,b3;
 
-  /* Try the three sub-models to see which performs best. */
+  /* Try the three sub-models to see which performs best.  The trial coders
+     must hold the worst case of every character being coded at the least
+     likely frequency, which is well under 32 bits. */
+  int trial_bytes=m_in_len*4+1024;
 
   // Variable depth model
-  range_coder *t1=range_new_coder(1024);
+  range_coder *t1=range_new_coder(trial_bytes);
   stats3_compress_model1_append(t1,m_in,m_in_len,h,entropyLog);
-  range_conclude(t1); b1=t1->bits_used; range_coder_free(t1);
+  if (t1->errors) b1=999999;
+  else { range_conclude(t1); b1=t1->bits_used; }
+  range_coder_free(t1);
 
   // Packed ascii (only if there are no non-ascii chars)
-  range_coder *t2=range_new_coder(1024);
-  if (stats3_compress_radix_append(t2,m_in,m_in_len,h,entropyLog)) 
+  range_coder *t2=range_new_coder(trial_bytes);
+  if (stats3_compress_radix_append(t2,m_in,m_in_len,h,entropyLog)||t2->errors)
     b2=999999;
   else { range_conclude(t2); b2=t2->bits_used; }
   range_coder_free(t2);
@@ -282,13 +295,20 @@ int stats3_compress_append(range_coder *c,unsigned char *m_in,int m_in_len,
   b3=(m_in_len+1)*8; // one extra character for null termination
   b3=999999;
 
+  // Neither model can code the message, and the raw form is never used
+  if (b1==999999&&b2==999999) { c->errors++; return -1; }
+
   // Compare the results and encode accordingly
+  int r;
   if (b1<b2&&b1<b3)
-    return stats3_compress_model1_append(c,m_in,m_in_len,h,entropyLog);
+    r=stats3_compress_model1_append(c,m_in,m_in_len,h,entropyLog);
   else if (b2<b3||(m_in[0]&0x80))
-    return stats3_compress_radix_append(c,m_in,m_in_len,h,entropyLog);
+    r=stats3_compress_radix_append(c,m_in,m_in_len,h,entropyLog);
   else
-    return stats3_compress_uncompressed_append(c,m_in,m_in_len,h,entropyLog);
+    r=stats3_compress_uncompressed_append(c,m_in,m_in_len,h,entropyLog);
+  // A symbol that the model cannot code leaves the coder in error
+  if (c->errors) return -1;
+  return r;
 }
 
 
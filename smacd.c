@@ -0,0 +1,759 @@
+/*
+  smacd: local compression daemon.  See smacd.h for the protocol.
+
+  "smac daemon" loads the statistics model once, and keeps every recipe it
+  reads, so that a gateway can have messages and records compressed and
+  decompressed without starting smac, and reloading stats.dat, for each one.
+
+  Each connection has a thread that reads a batch of requests, queues it,
+  and writes back the responses once the workers have handled every request
+  in it.  Workers take requests from the queued batches in turn, each with
+  its own clone of the statistics handle, as recipe_compress_batch() does.
+
+  Counters of requests, errors and latency, which is measured from when a
+  batch has been read to when each of its requests has been handled, are
+  kept for each operation, and returned by SMACD_STATS.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "charset.h"
+#include "visualise.h"
+#include "arithmetic.h"
+#include "packed_stats.h"
+#include "smac.h"
+#include "recipe.h"
+#include "model_set.h"
+#include "smacd.h"
+
+#define SMACD_MAX_FORMS 256
+// Seconds over which the recent request rate is measured
+#define SMACD_RATE_SECONDS 10
+
+static const char *smacd_operation_names[SMACD_OPERATIONS]={
+  NULL,"compress","decompress","recipe-compress","recipe-decompress","stats",
+  "model-load","model-unload","models"
+};
+
+struct smacd_request {
+  unsigned char operation;
+  unsigned char *in;            // NUL terminated
+  int in_len;
+  unsigned char status;
+  unsigned char *out;
+  int out_len;
+};
+
+struct smacd_batch {
+  struct smacd_request *requests;
+  int count;
+  int next;                     // next request for a worker to take
+  int pending;                  // requests not yet handled
+  long long start_us;
+  struct smacd_batch *queue_next;
+};
+
+struct smacd_counter {
+  long long requests;
+  long long errors;
+  long long total_us;
+  long long max_us;
+};
+
+struct smacd_server {
+  // New messages are compressed with the current model
+  struct model_set models;
+  // Directory that SMACD_MODEL_LOAD may load models from, or NULL if none
+  char *model_dir;
+  char *recipe_dir;
+  char reference_dir[1024];
+
+  // Recipes for compression, by formid.  Those for decompression are found
+  // by recipe_find_recipe(), which keeps its own cache.
+  pthread_mutex_t recipe_lock;
+  char *formids[SMACD_MAX_FORMS];
+  struct recipe *recipes[SMACD_MAX_FORMS];
+  int form_count;
+
+  pthread_mutex_t queue_lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct smacd_batch *queue;
+  struct smacd_batch *queue_tail;
+
+  pthread_mutex_t counter_lock;
+  long long start_us;
+  long long batches;
+  struct smacd_counter counters[SMACD_OPERATIONS];
+  time_t rate_second[SMACD_RATE_SECONDS+1];
+  long long rate_requests[SMACD_RATE_SECONDS+1];
+};
+
+struct smacd_worker {
+  struct smacd_server *server;
+  unsigned char *buffer;        // SMACD_MAX_PAYLOAD bytes of output
+  pthread_t thread;
+};
+
+struct smacd_connection {
+  struct smacd_server *server;
+  int fd;
+};
+
+static long long smacd_time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+static int smacd_read(int fd,unsigned char *buffer,int len)
+{
+  int offset=0;
+  while(offset<len) {
+    int r=read(fd,&buffer[offset],len-offset);
+    if (r<0&&errno==EINTR) continue;
+    if (r<1) return -1;
+    offset+=r;
+  }
+  return 0;
+}
+
+static int smacd_write(int fd,unsigned char *buffer,int len)
+{
+  int offset=0;
+  while(offset<len) {
+    int r=write(fd,&buffer[offset],len-offset);
+    if (r<0&&errno==EINTR) continue;
+    if (r<1) return -1;
+    offset+=r;
+  }
+  return 0;
+}
+
+static void smacd_put_length(unsigned char *out,int len)
+{
+  out[0]=len>>24; out[1]=len>>16; out[2]=len>>8; out[3]=len;
+}
+
+static int smacd_get_length(unsigned char *in)
+{
+  return (in[0]<<24)|(in[1]<<16)|(in[2]<<8)|in[3];
+}
+
+// The recipe for a form, reading it the first time it is needed
+static struct recipe *smacd_recipe(struct smacd_server *s,const char *formid)
+{
+  int i;
+  struct recipe *recipe=NULL;
+  pthread_mutex_lock(&s->recipe_lock);
+  for(i=0;i<s->form_count;i++)
+    if (!strcmp(s->formids[i],formid)) {
+      recipe=s->recipes[i];
+      pthread_mutex_unlock(&s->recipe_lock);
+      if (!recipe) snprintf(recipe_error,1024,"No recipe for form '%.900s'.\n",formid);
+      return recipe;
+    }
+  char recipe_file[1024];
+  if (snprintf(recipe_file,sizeof(recipe_file),"%s/%s.recipe",
+	       s->recipe_dir,formid)>=sizeof(recipe_file))
+    snprintf(recipe_error,1024,"Recipe path for form '%.900s' is too long.\n",
+	     formid);
+  else recipe=recipe_read_from_file(recipe_file);
+  if (!recipe)
+    fprintf(stderr,"Could not read recipe '%s': %s",recipe_file,recipe_error);
+  // Remember failures too, so that each recipe is only tried once
+  if (s->form_count<SMACD_MAX_FORMS) {
+    s->formids[s->form_count]=strdup(formid);
+    s->recipes[s->form_count++]=recipe;
+  } else if (recipe) {
+    snprintf(recipe_error,1024,"Too many forms (max=%d).\n",SMACD_MAX_FORMS);
+    recipe_free(recipe);
+    recipe=NULL;
+  }
+  pthread_mutex_unlock(&s->recipe_lock);
+  return recipe;
+}
+
+static int smacd_recipe_compress(struct smacd_worker *w,stats_handle *h,
+				 unsigned char *record,int record_len,
+				 unsigned char *out)
+{
+  char formid[1024];
+  char *in=(char *)record;
+  int is_xml=recipe_record_formid(in,record_len,formid);
+  if (is_xml<0) return -1;
+  struct recipe *recipe=smacd_recipe(w->server,formid);
+  if (!recipe) return -1;
+  if (is_xml)
+    return recipe_compress_xml(h,recipe,NULL,in,record_len,out,1024);
+  return recipe_compress(h,recipe,in,record_len,out,1024);
+}
+
+static int smacd_stats(struct smacd_server *s,char *out,int out_size)
+{
+  long long now=smacd_time_us();
+  time_t second=time(0);
+  double uptime=(now-s->start_us)/1000000.0;
+  long long requests=0,recent=0;
+  int i,n;
+
+  pthread_mutex_lock(&s->counter_lock);
+  for(i=1;i<SMACD_OPERATIONS;i++) requests+=s->counters[i].requests;
+  // The last complete seconds
+  for(i=0;i<=SMACD_RATE_SECONDS;i++)
+    if (s->rate_second[i]<second&&s->rate_second[i]>=second-SMACD_RATE_SECONDS)
+      recent+=s->rate_requests[i];
+  n=snprintf(out,out_size,
+	     "uptime_s=%.1f\n"
+	     "batches=%lld\n"
+	     "requests=%lld\n"
+	     "requests_per_s=%.1f\n"
+	     "recent_requests_per_s=%.1f\n",
+	     uptime,s->batches,requests,uptime>0?requests/uptime:0,
+	     recent*1.0/SMACD_RATE_SECONDS);
+  for(i=1;i<SMACD_OPERATIONS&&n<out_size;i++) {
+    struct smacd_counter *c=&s->counters[i];
+    n+=snprintf(&out[n],out_size-n,
+		"%s.requests=%lld\n"
+		"%s.errors=%lld\n"
+		"%s.mean_latency_us=%lld\n"
+		"%s.max_latency_us=%lld\n",
+		smacd_operation_names[i],c->requests,
+		smacd_operation_names[i],c->errors,
+		smacd_operation_names[i],c->requests?c->total_us/c->requests:0,
+		smacd_operation_names[i],c->max_us);
+  }
+  pthread_mutex_unlock(&s->counter_lock);
+  return n<out_size?n:out_size-1;
+}
+
+// The payload of these begins with the fingerprint of the model to use
+static int smacd_decodes(int operation)
+{
+  return operation==SMACD_DECOMPRESS||operation==SMACD_RECIPE_DECOMPRESS;
+}
+
+// and the result of these with the fingerprint of the model used
+static int smacd_encodes(int operation)
+{
+  return operation==SMACD_COMPRESS||operation==SMACD_RECIPE_COMPRESS;
+}
+
+static int smacd_run(struct smacd_worker *w,struct smacd_request *r,
+		     stats_handle *h,unsigned char *in,int in_len,
+		     unsigned char *out,int out_size)
+{
+  struct smacd_server *s=w->server;
+  int len=-1;
+
+  switch(r->operation) {
+  case SMACD_COMPRESS:
+    if (in_len>1024) {
+      snprintf(recipe_error,1024,"Messages must be no more than 1024 bytes.\n");
+      break;
+    } else {
+      range_coder *c=range_new_coder(2048);
+      if (!stats3_compress_bits(c,in,in_len,h,NULL)) {
+	len=(c->bits_used+7)>>3;
+	bcopy(c->bit_stream,out,len);
+      } else snprintf(recipe_error,1024,"Could not compress message.\n");
+      range_coder_free(c);
+    }
+    break;
+  case SMACD_DECOMPRESS:
+    if (in_len>1024) {
+      snprintf(recipe_error,1024,"Compressed messages are less than 1KB.\n");
+      break;
+    }
+    if (stats3_decompress(in,in_len,out,&len,h)) {
+      snprintf(recipe_error,1024,"Could not decompress message.\n");
+      len=-1;
+    }
+    break;
+  case SMACD_RECIPE_COMPRESS:
+    len=smacd_recipe_compress(w,h,in,in_len,out);
+    break;
+  case SMACD_RECIPE_DECOMPRESS:
+    {
+      char recipe_name[1024];
+      len=recipe_decompress(h,s->recipe_dir,s->reference_dir,in,in_len,
+			    (char *)out,out_size,recipe_name,NULL);
+    }
+    break;
+  case SMACD_STATS:
+    len=smacd_stats(s,(char *)out,out_size);
+    break;
+  case SMACD_MODEL_LOAD:
+    {
+      // Clients may only name a file in the model directory
+      char filename[1024];
+      if (!s->model_dir)
+	snprintf(recipe_error,1024,"The daemon was not given a model directory.\n");
+      else if (!in_len||strlen((char *)in)!=in_len||in[0]=='.'
+	       ||strchr((char *)in,'/'))
+	snprintf(recipe_error,1024,"Models must be named by a file name in the model directory.\n");
+      else if (snprintf(filename,sizeof(filename),"%s/%s",s->model_dir,
+			(char *)in)>=sizeof(filename))
+	snprintf(recipe_error,1024,"Model name is too long.\n");
+      else {
+	struct stats_model *m=model_set_load(&s->models,filename);
+	if (m) {
+	  bcopy(m->h->fingerprint,out,STATS_FINGERPRINT_BYTES);
+	  len=STATS_FINGERPRINT_BYTES;
+	  fprintf(stderr,"Now compressing with model '%s'\n",filename);
+	}
+      }
+    }
+    break;
+  case SMACD_MODEL_UNLOAD:
+    if (in_len!=STATS_FINGERPRINT_BYTES)
+      snprintf(recipe_error,1024,"Expected a model fingerprint.\n");
+    else if (!model_set_unload(&s->models,in)) len=0;
+    break;
+  case SMACD_MODELS:
+    len=model_set_list(&s->models,(char *)out,out_size);
+    break;
+  default:
+    snprintf(recipe_error,1024,"Unknown operation %d.\n",r->operation);
+    r->status=SMACD_ERROR_UNKNOWN_OPERATION;
+  }
+  return len;
+}
+
+static void smacd_handle(struct smacd_worker *w,struct smacd_request *r)
+{
+  struct smacd_server *s=w->server;
+  struct stats_model *model=NULL;
+  stats_handle *h=NULL;
+  unsigned char *in=r->in;
+  int in_len=r->in_len;
+  int prefix=smacd_encodes(r->operation)?STATS_FINGERPRINT_BYTES:0;
+  int len=-1;
+
+  snprintf(recipe_error,1024,"Request failed.\n");
+  if (smacd_decodes(r->operation)) {
+    if (in_len<STATS_FINGERPRINT_BYTES)
+      snprintf(recipe_error,1024,"Compressed data must begin with the fingerprint of its model.\n");
+    else {
+      h=model_set_borrow(&s->models,in,&model);
+      in+=STATS_FINGERPRINT_BYTES;
+      in_len-=STATS_FINGERPRINT_BYTES;
+    }
+  } else if (prefix) h=model_set_borrow(&s->models,NULL,&model);
+
+  if (h||!(prefix||smacd_decodes(r->operation)))
+    len=smacd_run(w,r,h,in,in_len,&w->buffer[prefix],SMACD_MAX_PAYLOAD-prefix);
+  if (len>=0&&prefix) {
+    bcopy(model->h->fingerprint,w->buffer,STATS_FINGERPRINT_BYTES);
+    len+=prefix;
+  }
+  if (h) model_set_return(&s->models,model,h);
+
+  if (len>=0) {
+    r->out=malloc(len?len:1);
+    if (r->out) {
+      bcopy(w->buffer,r->out,len);
+      r->out_len=len;
+      return;
+    }
+    snprintf(recipe_error,1024,"Could not allocate %d bytes for response.\n",len);
+  }
+  if (r->status==SMACD_OK) r->status=SMACD_ERROR_FAILED;
+  r->out=(unsigned char *)strdup(recipe_error);
+  r->out_len=r->out?strlen(recipe_error):0;
+}
+
+static void smacd_count(struct smacd_server *s,struct smacd_request *r,
+			long long latency_us)
+{
+  time_t second=time(0);
+  int slot=second%(SMACD_RATE_SECONDS+1);
+  int operation=r->operation<SMACD_OPERATIONS?r->operation:0;
+  struct smacd_counter *c=&s->counters[operation];
+
+  pthread_mutex_lock(&s->counter_lock);
+  c->requests++;
+  if (r->status!=SMACD_OK) c->errors++;
+  c->total_us+=latency_us;
+  if (latency_us>c->max_us) c->max_us=latency_us;
+  if (s->rate_second[slot]!=second) {
+    s->rate_second[slot]=second;
+    s->rate_requests[slot]=0;
+  }
+  s->rate_requests[slot]++;
+  pthread_mutex_unlock(&s->counter_lock);
+}
+
+static void *smacd_worker(void *context)
+{
+  struct smacd_worker *w=context;
+  struct smacd_server *s=w->server;
+
+  while(1) {
+    pthread_mutex_lock(&s->queue_lock);
+    while(!s->queue) pthread_cond_wait(&s->work,&s->queue_lock);
+    struct smacd_batch *b=s->queue;
+    int i=b->next++;
+    if (b->next>=b->count) {
+      s->queue=b->queue_next;
+      if (!s->queue) s->queue_tail=NULL;
+    }
+    pthread_mutex_unlock(&s->queue_lock);
+
+    smacd_handle(w,&b->requests[i]);
+    smacd_count(s,&b->requests[i],smacd_time_us()-b->start_us);
+
+    pthread_mutex_lock(&s->queue_lock);
+    if (!--b->pending) pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->queue_lock);
+  }
+  return NULL;
+}
+
+static void smacd_batch_free(struct smacd_batch *b)
+{
+  int i;
+  for(i=0;i<b->count;i++) {
+    free(b->requests[i].in);
+    free(b->requests[i].out);
+  }
+  free(b->requests);
+}
+
+// Read the rest of a batch whose request count has been read
+static int smacd_read_batch(int fd,struct smacd_batch *b)
+{
+  int i;
+  long long total=0;
+  if (b->count>SMACD_MAX_BATCH) {
+    fprintf(stderr,"Batch of %d requests is too big (max=%d)\n",
+	    b->count,SMACD_MAX_BATCH);
+    b->count=0;
+    return -1;
+  }
+  b->requests=calloc(b->count?b->count:1,sizeof(struct smacd_request));
+  if (!b->requests) return -1;
+  for(i=0;i<b->count;i++) {
+    struct smacd_request *r=&b->requests[i];
+    unsigned char header[5];
+    if (smacd_read(fd,header,5)) return -1;
+    r->operation=header[0];
+    r->in_len=smacd_get_length(&header[1]);
+    if (r->in_len<0||r->in_len>SMACD_MAX_PAYLOAD) {
+      fprintf(stderr,"Request of %d bytes is too big (max=%d)\n",
+	      r->in_len,SMACD_MAX_PAYLOAD);
+      return -1;
+    }
+    total+=r->in_len;
+    if (total>SMACD_MAX_BATCH_BYTES) {
+      fprintf(stderr,"Batch of more than %d bytes is too big\n",
+	      SMACD_MAX_BATCH_BYTES);
+      return -1;
+    }
+    r->in=malloc(r->in_len+1);
+    if (!r->in) return -1;
+    if (smacd_read(fd,r->in,r->in_len)) return -1;
+    r->in[r->in_len]=0;
+  }
+  return 0;
+}
+
+static int smacd_write_batch(int fd,struct smacd_batch *b)
+{
+  int i,len=2;
+  for(i=0;i<b->count;i++) len+=5+b->requests[i].out_len;
+  unsigned char *out=malloc(len);
+  if (!out) return -1;
+  out[0]=b->count>>8; out[1]=b->count;
+  int o=2;
+  for(i=0;i<b->count;i++) {
+    struct smacd_request *r=&b->requests[i];
+    out[o]=r->status;
+    smacd_put_length(&out[o+1],r->out_len);
+    bcopy(r->out,&out[o+5],r->out_len);
+    o+=5+r->out_len;
+  }
+  int result=smacd_write(fd,out,len);
+  free(out);
+  return result;
+}
+
+static void *smacd_connection(void *context)
+{
+  struct smacd_connection *c=context;
+  struct smacd_server *s=c->server;
+
+  while(1) {
+    unsigned char header[2];
+    struct smacd_batch b;
+    bzero(&b,sizeof(b));
+    if (smacd_read(c->fd,header,2)) break;
+    b.count=(header[0]<<8)|header[1];
+    if (smacd_read_batch(c->fd,&b)) {
+      smacd_batch_free(&b);
+      break;
+    }
+    b.start_us=smacd_time_us();
+    b.pending=b.count;
+
+    if (b.count) {
+      pthread_mutex_lock(&s->queue_lock);
+      if (s->queue_tail) s->queue_tail->queue_next=&b;
+      else s->queue=&b;
+      s->queue_tail=&b;
+      pthread_cond_broadcast(&s->work);
+      while(b.pending) pthread_cond_wait(&s->done,&s->queue_lock);
+      pthread_mutex_unlock(&s->queue_lock);
+    }
+    pthread_mutex_lock(&s->counter_lock);
+    s->batches++;
+    pthread_mutex_unlock(&s->counter_lock);
+
+    int r=smacd_write_batch(c->fd,&b);
+    smacd_batch_free(&b);
+    if (r) break;
+  }
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+static int smacd_listen(char *socket_path)
+{
+  struct sockaddr_un addr;
+  bzero(&addr,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  if (strlen(socket_path)>=sizeof(addr.sun_path)) {
+    snprintf(recipe_error,1024,"Socket path '%s' is too long\n",socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path,socket_path);
+
+  int fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0) {
+    snprintf(recipe_error,1024,"Could not create socket: %s\n",strerror(errno));
+    return -1;
+  }
+  // Replace the socket of an earlier daemon
+  unlink(socket_path);
+  if (bind(fd,(struct sockaddr *)&addr,sizeof(addr))||listen(fd,64)) {
+    snprintf(recipe_error,1024,"Could not listen on '%s': %s\n",
+	     socket_path,strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int smacd_main(int argc,char *argv[],stats_handle *h)
+{
+  if (argc<=4) {
+    fprintf(stderr,"usage: smac daemon <socket> <recipe directory> <output directory> [<threads> [<model directory>]]\n");
+    return -1;
+  }
+  struct smacd_server *s=calloc(1,sizeof(struct smacd_server));
+  if (!s) {
+    fprintf(stderr,"Could not allocate daemon state\n");
+    return -1;
+  }
+  model_set_init(&s->models);
+  if (!model_set_add(&s->models,h,"stats.dat")) {
+    fprintf(stderr,"%s",recipe_error);
+    return -1;
+  }
+  s->recipe_dir=argv[3];
+  s->model_dir=argc>6?argv[6]:NULL;
+  // Records coded against an earlier record are decoded using the
+  // references kept by "smac recipe decompress" with the same output
+  snprintf(s->reference_dir,1024,"%s/references",argv[4]);
+  s->start_us=smacd_time_us();
+  pthread_mutex_init(&s->recipe_lock,NULL);
+  pthread_mutex_init(&s->queue_lock,NULL);
+  pthread_mutex_init(&s->counter_lock,NULL);
+  pthread_cond_init(&s->work,NULL);
+  pthread_cond_init(&s->done,NULL);
+
+  int threads=argc>5?atoi(argv[5]):0;
+  if (threads<1) threads=sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads<1) threads=1;
+  if (threads>SMACD_MAX_THREADS) threads=SMACD_MAX_THREADS;
+
+  int listen_fd=smacd_listen(argv[2]);
+  if (listen_fd<0) {
+    fprintf(stderr,"%s",recipe_error);
+    return -1;
+  }
+  // A client that goes away must not take the daemon with it
+  signal(SIGPIPE,SIG_IGN);
+
+  struct smacd_worker workers[SMACD_MAX_THREADS];
+  int i,started=0;
+  for(i=0;i<threads;i++) {
+    workers[started].server=s;
+    workers[started].buffer=malloc(SMACD_MAX_PAYLOAD);
+    if (!workers[started].buffer
+	||pthread_create(&workers[started].thread,NULL,smacd_worker,
+			 &workers[started])) {
+      free(workers[started].buffer);
+      break;
+    }
+    started++;
+  }
+  if (!started) {
+    fprintf(stderr,"Could not start any worker threads\n");
+    close(listen_fd);
+    return -1;
+  }
+  fprintf(stderr,"smacd listening on '%s' with %d workers\n",argv[2],started);
+  // The compression code reports its progress on stdout, which would cost
+  // more than the compression at the rates the daemon is meant for
+  if (!freopen("/dev/null","w",stdout))
+    fprintf(stderr,"Could not discard standard output\n");
+
+  while(1) {
+    int fd=accept(listen_fd,NULL,NULL);
+    if (fd<0) {
+      if (errno==EINTR) continue;
+      fprintf(stderr,"accept() failed: %s\n",strerror(errno));
+      break;
+    }
+    struct smacd_connection *c=malloc(sizeof(struct smacd_connection));
+    pthread_t thread;
+    if (c) {
+      c->server=s;
+      c->fd=fd;
+    }
+    if (!c||pthread_create(&thread,NULL,smacd_connection,c)) {
+      fprintf(stderr,"Could not start connection thread\n");
+      close(fd);
+      free(c);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  close(listen_fd);
+  return -1;
+}
+
+// Whether an operation takes no argument, and returns text
+static int smacd_reports(int operation)
+{
+  return operation==SMACD_STATS||operation==SMACD_MODELS;
+}
+
+// Whether the arguments of an operation name files of data
+static int smacd_takes_files(int operation)
+{
+  return operation>=SMACD_COMPRESS&&operation<=SMACD_RECIPE_DECOMPRESS;
+}
+
+/*
+  Send every argument as one batch of requests.  For operations on data, the
+  arguments are files, and the result for each is written to <file>.out.
+  Other results go to standard output.
+*/
+int smacd_client_main(int argc,char *argv[])
+{
+  if (argc<=3) {
+    fprintf(stderr,"usage: smac daemon-client <socket> <compress|decompress|recipe-compress|recipe-decompress> <file> ...\n"
+	    "       smac daemon-client <socket> <stats|models>\n"
+	    "       smac daemon-client <socket> model-load <stats file name>\n"
+	    "       smac daemon-client <socket> model-unload <fingerprint>\n");
+    return -1;
+  }
+  int operation,i;
+  for(operation=1;operation<SMACD_OPERATIONS;operation++)
+    if (!strcasecmp(argv[3],smacd_operation_names[operation])) break;
+  if (operation>=SMACD_OPERATIONS) {
+    fprintf(stderr,"Unknown daemon operation '%s'\n",argv[3]);
+    return -1;
+  }
+  int count=smacd_reports(operation)?1:argc-4;
+  if (count<1||count>SMACD_MAX_BATCH) {
+    fprintf(stderr,"Requests must be for 1 to %d arguments\n",SMACD_MAX_BATCH);
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  bzero(&addr,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",argv[2]);
+  int fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0||connect(fd,(struct sockaddr *)&addr,sizeof(addr))) {
+    fprintf(stderr,"Could not connect to '%s': %s\n",argv[2],strerror(errno));
+    if (fd>=0) close(fd);
+    return -1;
+  }
+
+  unsigned char header[5];
+  header[0]=count>>8; header[1]=count;
+  int failed=smacd_write(fd,header,2);
+  for(i=0;i<count&&!failed;i++) {
+    unsigned char *in=malloc(SMACD_MAX_PAYLOAD);
+    int len=0;
+    if (!in) failed=1;
+    else if (smacd_takes_files(operation)) {
+      len=recipe_load_file(argv[4+i],(char *)in,SMACD_MAX_PAYLOAD);
+      if (len<0) {
+	fprintf(stderr,"%s",recipe_error);
+	failed=1;
+      }
+    } else if (operation==SMACD_MODEL_UNLOAD) {
+      len=STATS_FINGERPRINT_BYTES;
+      if (stats_fingerprint_parse(argv[4+i],in)) {
+	fprintf(stderr,"'%s' is not a model fingerprint\n",argv[4+i]);
+	failed=1;
+      }
+    } else if (!smacd_reports(operation)) {
+      len=snprintf((char *)in,SMACD_MAX_PAYLOAD,"%s",argv[4+i]);
+    }
+    header[0]=operation;
+    smacd_put_length(&header[1],len);
+    if (!failed) failed=smacd_write(fd,header,5)||smacd_write(fd,in,len);
+    free(in);
+  }
+
+  if (!failed) failed=smacd_read(fd,header,2);
+  for(i=0;i<count&&!failed;i++) {
+    if (smacd_read(fd,header,5)) { failed=1; break; }
+    int len=smacd_get_length(&header[1]);
+    unsigned char *out=malloc(len+1);
+    if (!out||smacd_read(fd,out,len)) { free(out); failed=1; break; }
+    out[len]=0;
+    if (header[0]!=SMACD_OK)
+      fprintf(stderr,"%s: %s",smacd_reports(operation)?argv[3]:argv[4+i],out);
+    else if (smacd_reports(operation))
+      fwrite(out,len,1,stdout);
+    else if (operation==SMACD_MODEL_LOAD&&len==STATS_FINGERPRINT_BYTES) {
+      char hex[STATS_FINGERPRINT_BYTES*2+1];
+      stats_fingerprint_hex(out,hex);
+      printf("%s\n",hex);
+    } else if (smacd_takes_files(operation)) {
+      char filename[1024];
+      snprintf(filename,1024,"%s.out",argv[4+i]);
+      FILE *f=fopen(filename,"w");
+      if (!f||(len&&fwrite(out,len,1,f)!=1)) {
+	fprintf(stderr,"Could not write '%s'\n",filename);
+	failed=1;
+      }
+      if (f) fclose(f);
+    }
+    free(out);
+  }
+  close(fd);
+  if (failed) fprintf(stderr,"Request to daemon failed\n");
+  return failed?-1:0;
+}
@@ -0,0 +1,77 @@
+/*
+  smacd: a local compression daemon, which keeps the statistics model and
+  recipes resident, and serves requests over a Unix domain socket.
+
+  Requests travel in batches, so that a client can have many messages
+  handled for each round trip.  All numbers are big-endian.  A batch is
+
+    2 bytes   number of requests
+    then for each request:
+      1 byte    operation (SMACD_*)
+      4 bytes   length of payload
+      payload
+
+  and the reply is a batch of the same number of responses, in the same
+  order:
+
+      1 byte    status (SMACD_OK or SMACD_ERROR_*)
+      4 bytes   length of payload
+      payload   the result, or for an error, its text
+
+  The payload of each operation is
+    SMACD_COMPRESS            text message          -> fingerprint,
+                                                       compressed message
+    SMACD_DECOMPRESS          fingerprint,
+                              compressed message    -> text message
+    SMACD_RECIPE_COMPRESS     stripped or XML record,
+                              with a formid field   -> fingerprint,
+                                                       succinct data
+    SMACD_RECIPE_DECOMPRESS   fingerprint,
+                              succinct data         -> stripped record
+    SMACD_STATS               empty                 -> counters, as
+                                                       name=value lines
+    SMACD_MODEL_LOAD          name of a stats file
+                              in the model
+                              directory             -> fingerprint
+    SMACD_MODEL_UNLOAD        fingerprint           -> empty
+    SMACD_MODELS              empty                 -> loaded models, as
+                                                       in model_set_list()
+
+  The fingerprint is the STATS_FINGERPRINT_BYTES that identify the
+  statistics model (see packed_stats.h).  Messages are compressed with the
+  model most recently loaded, and decompressed with the one they name, so
+  that a retrained model can be rolled out without restarting the daemon,
+  while messages compressed with the old one can still be read until it is
+  unloaded.  Models can only be loaded from the directory named when the
+  daemon was started, and only by a plain file name, so that clients cannot
+  have it open any other file.
+
+  A connection may send any number of batches, one after the other.
+  Requests are compressed and decompressed by a pool of worker threads, so
+  that the requests of one batch, and of different connections, are handled
+  in parallel.
+*/
+
+#define SMACD_COMPRESS 1
+#define SMACD_DECOMPRESS 2
+#define SMACD_RECIPE_COMPRESS 3
+#define SMACD_RECIPE_DECOMPRESS 4
+#define SMACD_STATS 5
+#define SMACD_MODEL_LOAD 6
+#define SMACD_MODEL_UNLOAD 7
+#define SMACD_MODELS 8
+#define SMACD_OPERATIONS 9
+
+#define SMACD_OK 0
+#define SMACD_ERROR_FAILED 1
+#define SMACD_ERROR_UNKNOWN_OPERATION 2
+
+#define SMACD_MAX_PAYLOAD (1024*1024)
+// Batches with more requests, or more request bytes in all, are refused
+// and their connection closed
+#define SMACD_MAX_BATCH 4096
+#define SMACD_MAX_BATCH_BYTES (16*1024*1024)
+#define SMACD_MAX_THREADS 64
+
+int smacd_main(int argc,char *argv[],stats_handle *h);
+int smacd_client_main(int argc,char *argv[]);
@@ -0,0 +1,598 @@
+/*
+  Append-only store of decompressed records.
+
+  Writing a .stripped and an .xml file for every record received leaves
+  millions of tiny files on a busy server.  Instead, each form's records are
+  appended to large segment files, and indexed by content hash so that
+  resubmitted records are recognised.  The old one-file-per-record layout can
+  still be produced with store_export().
+
+  A segment holds a sequence of records, each of which is:
+
+    record <content hash> <time received> <succinct bytes> <stripped bytes> <xml bytes>\n
+    <succinct data><stripped text><xml>\n
+
+  and the index holds a line "<content hash> <segment> <offset>" per record.
+  The index is appended to after the segment, so after a crash the segments
+  are scanned from the last indexed record, and any torn record at the end is
+  cut off.
+
+  Only one writer may have a store open at a time, which it ensures by
+  holding a lock on the file "lock" in the store's directory.  Readers such
+  as the map generator use store_open_readonly(), which neither takes the
+  lock nor recovers anything, and so can run alongside the writer: a record
+  that the writer is part way through appending does not parse, and is
+  simply not seen until next time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "md5.h"
+#include "store.h"
+
+extern __thread char recipe_error[1024];
+
+void store_hash(char *stripped,int stripped_len,unsigned char *hash)
+{
+  MD5_CTX md5;
+  MD5_Init(&md5);
+  MD5_Update(&md5,stripped,stripped_len);
+  MD5_Final(hash,&md5);
+}
+
+// Name of the record in the one-file-per-record layout
+void store_record_name(unsigned char *hash,char *name)
+{
+  int i;
+  for(i=0;i<10;i++) sprintf(&name[i*2],"%02x",hash[i]);
+}
+
+static void store_hex(unsigned char *hash,char *hex)
+{
+  int i;
+  for(i=0;i<16;i++) sprintf(&hex[i*2],"%02x",hash[i]);
+}
+
+static int store_unhex(const char *hex,unsigned char *hash)
+{
+  int i;
+  for(i=0;i<16;i++) {
+    unsigned int b;
+    if (sscanf(&hex[i*2],"%2x",&b)!=1) return -1;
+    hash[i]=b;
+  }
+  return 0;
+}
+
+// name must hold STORE_PATH_BYTES+STORE_NAME_BYTES
+static void store_segment_name(struct record_store *s,int segment,char *name)
+{
+  snprintf(name,STORE_PATH_BYTES+STORE_NAME_BYTES,"%s/segment-%06d.log",
+	   s->directory,segment);
+}
+
+static int store_slot(struct record_store *s,unsigned char *hash)
+{
+  unsigned int h=(hash[0]<<24)|(hash[1]<<16)|(hash[2]<<8)|hash[3];
+  return h&(s->slot_count-1);
+}
+
+int store_find(struct record_store *s,unsigned char *hash)
+{
+  if (!s->slot_count) return -1;
+  int slot=store_slot(s,hash);
+  while(s->slots[slot]) {
+    struct store_entry *e=&s->entries[s->slots[slot]-1];
+    if (!memcmp(e->hash,hash,16)) return s->slots[slot]-1;
+    slot=(slot+1)&(s->slot_count-1);
+  }
+  return -1;
+}
+
+static int store_add_entry(struct record_store *s,unsigned char *hash,
+			   int segment,long long offset)
+{
+  int i;
+  if (s->entry_count>=s->entry_size) {
+    int size=s->entry_size?s->entry_size*2:1024;
+    struct store_entry *entries=realloc(s->entries,size*sizeof(struct store_entry));
+    if (!entries) {
+      snprintf(recipe_error,1024,"Could not grow record store index.\n");
+      return -1;
+    }
+    s->entries=entries;
+    s->entry_size=size;
+  }
+  // Keep the hash table no more than half full
+  if ((s->entry_count+1)*2>s->slot_count) {
+    int slot_count=s->slot_count?s->slot_count*2:2048;
+    int *slots=calloc(slot_count,sizeof(int));
+    if (!slots) {
+      snprintf(recipe_error,1024,"Could not grow record store index.\n");
+      return -1;
+    }
+    free(s->slots);
+    s->slots=slots;
+    s->slot_count=slot_count;
+    for(i=0;i<s->entry_count;i++) {
+      int slot=store_slot(s,s->entries[i].hash);
+      while(s->slots[slot]) slot=(slot+1)&(s->slot_count-1);
+      s->slots[slot]=i+1;
+    }
+  }
+
+  struct store_entry *e=&s->entries[s->entry_count];
+  bcopy(hash,e->hash,16);
+  e->segment=segment;
+  e->offset=offset;
+  int slot=store_slot(s,hash);
+  while(s->slots[slot]) slot=(slot+1)&(s->slot_count-1);
+  s->slots[slot]=++s->entry_count;
+  return 0;
+}
+
+static int store_write_index(struct record_store *s,unsigned char *hash,
+			     int segment,long long offset)
+{
+  char line[128];
+  char hex[33];
+  store_hex(hash,hex);
+  int len=snprintf(line,sizeof(line),"%s %d %lld\n",hex,segment,offset);
+  if (write(s->index_fd,line,len)!=len) {
+    snprintf(recipe_error,1024,"Could not append to index of record store '%.900s'\n",
+	     s->directory);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Parse the record at offset in a segment of segment_len bytes.  Returns the
+  offset of the next record, or -1 if there is no complete record there.
+*/
+static long long store_parse_record(unsigned char *segment,long long segment_len,
+				    long long offset,struct store_record *r)
+{
+  char header[256];
+  int i;
+  for(i=0;i<sizeof(header)-1&&offset+i<segment_len;i++) {
+    header[i]=segment[offset+i];
+    if (header[i]=='\n') break;
+  }
+  if (i==sizeof(header)-1||offset+i>=segment_len) return -1;
+  header[i]=0;
+
+  char hex[33];
+  long long received;
+  if (sscanf(header,"record %32s %lld %d %d %d",hex,&received,
+	     &r->succinct_len,&r->stripped_len,&r->xml_len)!=5) return -1;
+  if (store_unhex(hex,r->hash)) return -1;
+  if (r->succinct_len<0||r->stripped_len<0||r->xml_len<0) return -1;
+  r->received=received;
+
+  long long body=offset+i+1;
+  long long next=body+r->succinct_len+r->stripped_len+r->xml_len+1;
+  if (next>segment_len||segment[next-1]!='\n') return -1;
+  r->succinct=&segment[body];
+  r->stripped=(char *)&segment[body+r->succinct_len];
+  r->xml=r->xml_len?(char *)&segment[body+r->succinct_len+r->stripped_len]:NULL;
+  return next;
+}
+
+/*
+  Index any records in the segment from offset onwards that are not yet in
+  the index, and cut off an incomplete record at the end.  Returns -1 if the
+  segment does not exist.
+*/
+static int store_recover_segment(struct record_store *s,int segment,
+				 long long offset)
+{
+  char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+  store_segment_name(s,segment,filename);
+  int fd=open(filename,O_RDWR);
+  if (fd<0) return -1;
+  struct stat st;
+  if (fstat(fd,&st)) { close(fd); return -1; }
+  if (offset>=st.st_size) { close(fd); return 0; }
+
+  unsigned char *data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (data==MAP_FAILED) { close(fd); return -1; }
+  struct store_record r;
+  long long next;
+  int recovered=0;
+  while(offset<st.st_size
+	&&(next=store_parse_record(data,st.st_size,offset,&r))>=0) {
+    if (store_find(s,r.hash)<0) {
+      if (store_add_entry(s,r.hash,segment,offset)
+	  ||store_write_index(s,r.hash,segment,offset)) break;
+      recovered++;
+    }
+    offset=next;
+  }
+  munmap(data,st.st_size);
+  if (offset<st.st_size) {
+    fprintf(stderr,"Cutting incomplete record from end of '%s'\n",filename);
+    if (ftruncate(fd,offset))
+      fprintf(stderr,"Could not truncate '%s'\n",filename);
+  }
+  close(fd);
+  if (recovered)
+    fprintf(stderr,"Recovered %d unindexed records from '%s'\n",
+	    recovered,filename);
+  return 0;
+}
+
+static struct record_store *store_open_mode(char *root,char *form,int writable)
+{
+  struct record_store *s=calloc(sizeof(struct record_store),1);
+  if (!s) {
+    snprintf(recipe_error,1024,"Could not allocate record store.\n");
+    return NULL;
+  }
+  s->segment_fd=-1;
+  s->index_fd=-1;
+  s->lock_fd=-1;
+  if (snprintf(s->root,STORE_PATH_BYTES,"%s",root)>=STORE_PATH_BYTES
+      ||snprintf(s->form,STORE_PATH_BYTES,"%s",form)>=STORE_PATH_BYTES
+      ||snprintf(s->directory,STORE_PATH_BYTES,"%s/%s",root,form)
+      >=STORE_PATH_BYTES) {
+    snprintf(recipe_error,1024,"Record store path for form '%.900s' is too long.\n",
+	     form);
+    store_close(s); return NULL;
+  }
+  char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+  if (writable) {
+    mkdir(root,0777);
+    mkdir(s->directory,0777);
+    snprintf(filename,sizeof(filename),"%s/lock",s->directory);
+    s->lock_fd=open(filename,O_RDWR|O_CREAT,0666);
+    if (s->lock_fd<0||flock(s->lock_fd,LOCK_EX|LOCK_NB)) {
+      snprintf(recipe_error,1024,"Record store '%.900s' is already open for writing\n",
+	       s->directory);
+      store_close(s); return NULL;
+    }
+  }
+
+  snprintf(filename,sizeof(filename),"%s/index",s->directory);
+  FILE *f=fopen(filename,"r");
+  if (f) {
+    char line[1024];
+    char hex[1024];
+    unsigned char hash[16];
+    int segment;
+    long long offset;
+    while(fgets(line,1024,f)) {
+      // A line still being written, or torn by a crash, is not used
+      if (!strchr(line,'\n')) continue;
+      if (sscanf(line,"%s %d %lld",hex,&segment,&offset)!=3
+	  ||strlen(hex)!=32||store_unhex(hex,hash)) continue;
+      if (store_find(s,hash)>=0) continue;
+      if (store_add_entry(s,hash,segment,offset)) {
+	fclose(f); store_close(s); return NULL;
+      }
+    }
+    fclose(f);
+  }
+
+  // Pick up records appended after the index was last written
+  long long offset=0;
+  int i;
+  for(i=0;i<s->entry_count;i++)
+    if (s->entries[i].segment>s->segment
+	||(s->entries[i].segment==s->segment&&s->entries[i].offset>offset)) {
+      s->segment=s->entries[i].segment;
+      offset=s->entries[i].offset;
+    }
+  if (!writable) {
+    // Leave that to the writer, but find the last segment to read
+    struct stat st;
+    store_segment_name(s,s->segment+1,filename);
+    while(!stat(filename,&st)) store_segment_name(s,++s->segment+1,filename);
+    return s;
+  }
+
+  snprintf(filename,sizeof(filename),"%s/index",s->directory);
+  s->index_fd=open(filename,O_WRONLY|O_CREAT|O_APPEND,0666);
+  if (s->index_fd<0) {
+    snprintf(recipe_error,1024,"Could not open index of record store '%.900s'\n",
+	     s->directory);
+    store_close(s); return NULL;
+  }
+  while(!store_recover_segment(s,s->segment,offset)) {
+    s->segment++;
+    offset=0;
+  }
+  if (s->segment) s->segment--;
+
+  store_segment_name(s,s->segment,filename);
+  s->segment_fd=open(filename,O_WRONLY|O_CREAT|O_APPEND,0666);
+  if (s->segment_fd<0) {
+    snprintf(recipe_error,1024,"Could not open record store segment '%.900s'\n",
+	     filename);
+    store_close(s); return NULL;
+  }
+  s->segment_size=lseek(s->segment_fd,0,SEEK_END);
+  return s;
+}
+
+// Open a form's store for appending, recovering it from any crash
+struct record_store *store_open(char *root,char *form)
+{
+  return store_open_mode(root,form,1);
+}
+
+/*
+  Open a form's store only to read it, while it may be being written to.
+  Records the writer has not yet indexed are still visited by
+  store_iterate(), but cannot be found by key.
+*/
+struct record_store *store_open_readonly(char *root,char *form)
+{
+  return store_open_mode(root,form,0);
+}
+
+void store_close(struct record_store *s)
+{
+  if (!s) return;
+  if (s->segment_fd>=0) close(s->segment_fd);
+  if (s->index_fd>=0) close(s->index_fd);
+  if (s->lock_fd>=0) close(s->lock_fd);
+  free(s->entries);
+  free(s->slots);
+  free(s);
+}
+
+/*
+  Append a record, unless a record with the same stripped text is already in
+  the store.  Returns 1 if the record was added, 0 if it was already there,
+  or -1 on error.  xml may be NULL if the record could not be rendered.
+*/
+int store_append(struct record_store *s,time_t received,
+		 unsigned char *succinct,int succinct_len,
+		 char *stripped,int stripped_len,
+		 char *xml,int xml_len)
+{
+  unsigned char hash[16];
+  store_hash(stripped,stripped_len,hash);
+  return store_append_keyed(s,hash,received,succinct,succinct_len,
+			    stripped,stripped_len,xml,xml_len);
+}
+
+/*
+  As store_append(), but the record is known by the 16 byte key given, in
+  place of the hash of its stripped text.
+*/
+int store_append_keyed(struct record_store *s,unsigned char *hash,
+		       time_t received,
+		       unsigned char *succinct,int succinct_len,
+		       char *stripped,int stripped_len,
+		       char *xml,int xml_len)
+{
+  if (s->segment_fd<0) {
+    snprintf(recipe_error,1024,"Record store '%.900s' is open read-only\n",
+	     s->directory);
+    return -1;
+  }
+  if (store_find(s,hash)>=0) return 0;
+  if (!xml) xml_len=0;
+
+  if (s->segment_size>=STORE_SEGMENT_SIZE) {
+    char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+    store_segment_name(s,s->segment+1,filename);
+    int fd=open(filename,O_WRONLY|O_CREAT|O_APPEND,0666);
+    if (fd<0) {
+      snprintf(recipe_error,1024,"Could not create record store segment '%.900s'\n",
+	       filename);
+      return -1;
+    }
+    close(s->segment_fd);
+    s->segment_fd=fd;
+    s->segment++;
+    s->segment_size=0;
+  }
+
+  // Assemble the record so that it reaches the segment in a single write
+  char header[256];
+  char hex[33];
+  store_hex(hash,hex);
+  int header_len=snprintf(header,sizeof(header),"record %s %lld %d %d %d\n",
+			  hex,(long long)received,
+			  succinct_len,stripped_len,xml_len);
+  int len=header_len+succinct_len+stripped_len+xml_len+1;
+  unsigned char *record=malloc(len);
+  if (!record) {
+    snprintf(recipe_error,1024,"Could not allocate %d bytes for record.\n",len);
+    return -1;
+  }
+  int n=0;
+  bcopy(header,&record[n],header_len); n+=header_len;
+  bcopy(succinct,&record[n],succinct_len); n+=succinct_len;
+  bcopy(stripped,&record[n],stripped_len); n+=stripped_len;
+  if (xml_len) { bcopy(xml,&record[n],xml_len); n+=xml_len; }
+  record[n++]='\n';
+
+  int wrote=write(s->segment_fd,record,len);
+  free(record);
+  if (wrote!=len) {
+    snprintf(recipe_error,1024,"Could not append record to '%.900s'\n",s->directory);
+    if (wrote>0) {
+      // Leave the segment as it was
+      if (ftruncate(s->segment_fd,s->segment_size))
+	fprintf(stderr,"Could not truncate segment of '%s'\n",s->directory);
+    }
+    return -1;
+  }
+
+  long long offset=s->segment_size;
+  s->segment_size+=len;
+  if (store_add_entry(s,hash,s->segment,offset)) return -1;
+  if (store_write_index(s,hash,s->segment,offset)) return -1;
+  return 1;
+}
+
+/*
+  Call callback for every record in the store from position onwards, in the
+  order they were appended, and leave position just past the last record the
+  callback was given.  The store is append-only, so a position saved after
+  one pass can be used to visit only the records added since.  The record is
+  only valid during the call.
+*/
+int store_iterate_from(struct record_store *s,struct store_position *position,
+		       store_record_callback callback,void *context)
+{
+  int segment;
+  for(segment=position->segment;segment<=s->segment;segment++) {
+    char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+    store_segment_name(s,segment,filename);
+    int fd=open(filename,O_RDONLY);
+    if (fd<0) continue;
+    struct stat st;
+    long long offset=segment==position->segment?position->offset:0;
+    if (fstat(fd,&st)||offset>=st.st_size) { close(fd); continue; }
+    unsigned char *data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (data==MAP_FAILED) {
+      snprintf(recipe_error,1024,"Could not memory map record store segment '%.900s'\n",
+	       filename);
+      return -1;
+    }
+
+    struct store_record r;
+    int stop=0;
+    while(!stop&&offset<st.st_size
+	  &&(offset=store_parse_record(data,st.st_size,offset,&r))>=0) {
+      stop=callback(context,&r);
+      position->segment=segment;
+      position->offset=offset;
+    }
+    munmap(data,st.st_size);
+    if (stop) return stop;
+  }
+  return 0;
+}
+
+/*
+  Call callback for every record in the store, in the order they were
+  appended.  The record is only valid during the call.
+*/
+int store_iterate(struct record_store *s,store_record_callback callback,
+		  void *context)
+{
+  struct store_position start={0,0};
+  return store_iterate_from(s,&start,callback,context);
+}
+
+/*
+  Copy the stripped text of the record with the given key into out.  Returns
+  its length, or -1 if there is no such record, or it does not fit.
+*/
+int store_read_stripped(struct record_store *s,unsigned char *hash,
+			char *out,int out_size)
+{
+  int entry=store_find(s,hash);
+  if (entry<0) return -1;
+  struct store_entry *e=&s->entries[entry];
+  char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+  store_segment_name(s,e->segment,filename);
+  int fd=open(filename,O_RDONLY);
+  if (fd<0) {
+    snprintf(recipe_error,1024,"Could not open record store segment '%.900s'\n",
+	     filename);
+    return -1;
+  }
+  struct stat st;
+  unsigned char *data=MAP_FAILED;
+  if (!fstat(fd,&st)&&st.st_size)
+    data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (data==MAP_FAILED) {
+    snprintf(recipe_error,1024,"Could not memory map record store segment '%.900s'\n",
+	     filename);
+    return -1;
+  }
+  struct store_record r;
+  int len=-1;
+  if (store_parse_record(data,st.st_size,e->offset,&r)<0)
+    snprintf(recipe_error,1024,"Record store segment '%.900s' is damaged\n",
+	     filename);
+  else if (r.stripped_len>out_size)
+    snprintf(recipe_error,1024,"Stored record is %d bytes, but only %d fit\n",
+	     r.stripped_len,out_size);
+  else {
+    bcopy(r.stripped,out,r.stripped_len);
+    len=r.stripped_len;
+  }
+  munmap(data,st.st_size);
+  return len;
+}
+
+static int store_write_file(char *filename,void *data,int len)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    snprintf(recipe_error,1024,"Could not write '%.900s'\n",filename);
+    return -1;
+  }
+  int wrote=len?fwrite(data,len,1,f):1;
+  fclose(f);
+  if (wrote!=1) {
+    snprintf(recipe_error,1024,"Could not write %d bytes into '%.900s'\n",len,filename);
+    return -1;
+  }
+  return 0;
+}
+
+struct store_export_state {
+  char *directory;
+  int count;
+};
+
+static int store_export_record(void *context,struct store_record *r)
+{
+  struct store_export_state *x=context;
+  char name[21];
+  char filename[STORE_PATH_BYTES+STORE_NAME_BYTES];
+  store_record_name(r->hash,name);
+
+  snprintf(filename,sizeof(filename),"%s/%s.stripped",x->directory,name);
+  if (store_write_file(filename,r->stripped,r->stripped_len)) return -1;
+  if (r->xml) {
+    snprintf(filename,sizeof(filename),"%s/%s.xml",x->directory,name);
+    if (store_write_file(filename,r->xml,r->xml_len)) return -1;
+  }
+  x->count++;
+  return 0;
+}
+
+/*
+  Write the records of the store as <output_directory>/<form>/<name>.stripped
+  and .xml files, as they used to be written as each record arrived.
+  Returns the number of records written, or -1 on error.
+*/
+int store_export(struct record_store *s,char *output_directory)
+{
+  char directory[STORE_PATH_BYTES];
+  if (snprintf(directory,sizeof(directory),"%s/%s",output_directory,s->form)
+      >=sizeof(directory)) {
+    snprintf(recipe_error,1024,"Export path for form '%.900s' is too long.\n",
+	     s->form);
+    return -1;
+  }
+  mkdir(output_directory,0777);
+  mkdir(directory,0777);
+
+  struct store_export_state x;
+  x.directory=directory;
+  x.count=0;
+  if (store_iterate(s,store_export_record,&x)) return -1;
+  return x.count;
+}
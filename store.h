@@ -0,0 +1,87 @@
+/*
+  Append-only store of decompressed records, one per form.
+
+  Each form has a directory of segment files, to which records are appended
+  as a header line followed by the succinct data as received, the stripped
+  text and the rendered XML.  An index file lists the content hash (the MD5
+  hash of the stripped text) and location of every record, so that duplicates
+  can be recognised without looking in the segments.  Records may instead be
+  known by a key of the caller's choosing (see store_append_keyed()).
+*/
+
+// Start a new segment once the current one reaches this size
+#define STORE_SEGMENT_SIZE (64*1024*1024)
+
+// Longest path of a store directory, and longest name of a file within it,
+// so that the path of every file fits in a buffer of their sum
+#define STORE_PATH_BYTES 4096
+#define STORE_NAME_BYTES 64
+
+struct store_entry {
+  unsigned char hash[16];
+  int segment;
+  long long offset;
+};
+
+struct record_store {
+  char root[STORE_PATH_BYTES];
+  char form[STORE_PATH_BYTES];
+  char directory[STORE_PATH_BYTES];
+
+  int segment;          // segment being appended to
+  long long segment_size;
+  int segment_fd;       // -1 if open read-only
+  int index_fd;
+  int lock_fd;          // held while open for writing
+
+  // Index entries, in the order the records were appended, and an open
+  // addressed hash table of them
+  struct store_entry *entries;
+  int entry_count;
+  int entry_size;
+  int *slots;           // entry number + 1, or 0 if empty
+  int slot_count;
+};
+
+struct store_record {
+  unsigned char hash[16];
+  time_t received;
+  unsigned char *succinct;
+  int succinct_len;
+  char *stripped;
+  int stripped_len;
+  char *xml;            // NULL if no XML could be rendered
+  int xml_len;
+};
+
+// A point in the store, as a segment and an offset within it
+struct store_position {
+  int segment;
+  long long offset;
+};
+
+// Return non-zero to stop iterating
+typedef int (*store_record_callback)(void *context,struct store_record *r);
+
+struct record_store *store_open(char *root,char *form);
+struct record_store *store_open_readonly(char *root,char *form);
+void store_close(struct record_store *s);
+void store_hash(char *stripped,int stripped_len,unsigned char *hash);
+void store_record_name(unsigned char *hash,char *name);
+int store_find(struct record_store *s,unsigned char *hash);
+int store_append(struct record_store *s,time_t received,
+		 unsigned char *succinct,int succinct_len,
+		 char *stripped,int stripped_len,
+		 char *xml,int xml_len);
+int store_append_keyed(struct record_store *s,unsigned char *hash,
+		       time_t received,
+		       unsigned char *succinct,int succinct_len,
+		       char *stripped,int stripped_len,
+		       char *xml,int xml_len);
+int store_read_stripped(struct record_store *s,unsigned char *hash,
+			char *out,int out_size);
+int store_iterate(struct record_store *s,store_record_callback callback,
+		  void *context);
+int store_iterate_from(struct record_store *s,struct store_position *position,
+		       store_record_callback callback,void *context);
+int store_export(struct record_store *s,char *output_directory);
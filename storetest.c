@@ -0,0 +1,186 @@
+/*
+  Crash recovery checks for the record store.
+
+  A store is written, then left as a crash would leave it: the last index
+  line lost after its record reached the segment, and half of a further
+  record appended to the segment.  Reopening must index the record again,
+  cut off the torn one, and keep appending after it.  A reader must see
+  the intact records without changing anything, even while a writer has the
+  store open, and a second writer must be refused.
+
+  Usage: storetest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "store.h"
+
+__thread char recipe_error[1024];
+
+int failures=0;
+
+void check(int ok,const char *what)
+{
+  if (!ok) {
+    fprintf(stderr,"FAIL: %s\n",what);
+    failures++;
+  }
+}
+
+char *records[]={
+  "formid=a\nname=first\n",
+  "formid=a\nname=second\n",
+  "formid=a\nname=third\n",
+  "formid=a\nname=fourth\n",
+  NULL
+};
+
+struct seen {
+  int count;
+  int matched;
+};
+
+int count_record(void *context,struct store_record *r)
+{
+  struct seen *seen=context;
+  if (seen->count<4
+      &&r->stripped_len==strlen(records[seen->count])
+      &&!memcmp(r->stripped,records[seen->count],r->stripped_len))
+    seen->matched++;
+  seen->count++;
+  return 0;
+}
+
+int append(struct record_store *s,int n)
+{
+  unsigned char succinct[4]={n,n,n,n};
+  return store_append(s,time(0),succinct,sizeof(succinct),
+		      records[n],strlen(records[n]),NULL,0);
+}
+
+// Check that the store holds the first n records, and nothing else
+void check_contents(struct record_store *s,int n,const char *when)
+{
+  char what[1024];
+  int i;
+  for(i=0;records[i];i++) {
+    unsigned char hash[16];
+    store_hash(records[i],strlen(records[i]),hash);
+    snprintf(what,sizeof(what),"%s: record %d %s",when,i,
+	     i<n?"found":"not found");
+    check((store_find(s,hash)>=0)==(i<n),what);
+  }
+  struct seen seen={0,0};
+  store_iterate(s,count_record,&seen);
+  snprintf(what,sizeof(what),"%s: iterate visits %d records in order",when,n);
+  check(seen.count==n&&seen.matched==n,what);
+}
+
+// Drop the last line of a file, as if it was never written
+void drop_last_line(char *filename)
+{
+  char buffer[65536];
+  FILE *f=fopen(filename,"r");
+  int len=f?fread(buffer,1,sizeof(buffer),f):0;
+  if (f) fclose(f);
+  if (len<1) { check(0,"index can be read"); return; }
+  len--;
+  while(len>0&&buffer[len-1]!='\n') len--;
+  check(!truncate(filename,len),"index can be truncated");
+}
+
+void append_bytes(char *filename,char *bytes)
+{
+  int fd=open(filename,O_WRONLY|O_APPEND);
+  check(fd>=0&&write(fd,bytes,strlen(bytes))==strlen(bytes),
+	"torn record can be appended");
+  if (fd>=0) close(fd);
+}
+
+long long file_size(char *filename)
+{
+  struct stat st;
+  if (stat(filename,&st)) return -1;
+  return st.st_size;
+}
+
+int main(int argc,char **argv)
+{
+  char root[]="/tmp/storetest.XXXXXX";
+  if (!mkdtemp(root)) { perror("mkdtemp"); return 1; }
+  char index[1024],segment[1024],lock[1024];
+  snprintf(index,sizeof(index),"%s/a/index",root);
+  snprintf(segment,sizeof(segment),"%s/a/segment-000000.log",root);
+  snprintf(lock,sizeof(lock),"%s/a/lock",root);
+
+  struct record_store *s=store_open(root,"a");
+  if (!s) { fprintf(stderr,"%s",recipe_error); return 1; }
+  int i;
+  for(i=0;i<3;i++) check(append(s,i)==1,"record appended");
+  check(append(s,1)==0,"duplicate record is not appended again");
+  check_contents(s,3,"before crash");
+  struct record_store *other=store_open(root,"a");
+  check(!other,"second writer is refused");
+  store_close(other);
+  struct record_store *reader=store_open_readonly(root,"a");
+  check(reader!=NULL,"reader opens alongside the writer");
+  if (reader) check_contents(reader,3,"reader alongside the writer");
+  store_close(reader);
+  store_close(s);
+  long long intact=file_size(segment);
+
+  // Lose the index line of the third record, and tear a fourth
+  drop_last_line(index);
+  append_bytes(segment,"record 00112233445566778899aabbccddeeff 0 4 20 0\nabc");
+  long long torn=file_size(segment),index_size=file_size(index);
+
+  // A reader visits the intact records, but leaves recovery to the writer
+  reader=store_open_readonly(root,"a");
+  if (!reader) { fprintf(stderr,"%s",recipe_error); return 1; }
+  struct seen seen={0,0};
+  store_iterate(reader,count_record,&seen);
+  check(seen.count==3&&seen.matched==3,"reader visits the unindexed record");
+  check(append(reader,3)==-1,"reader cannot append");
+  store_close(reader);
+  check(file_size(segment)==torn&&file_size(index)==index_size,
+	"reader changes nothing");
+
+  s=store_open(root,"a");
+  if (!s) { fprintf(stderr,"%s",recipe_error); return 1; }
+  check_contents(s,3,"after recovery");
+  check(file_size(segment)==intact,"torn record is cut from the segment");
+  check(append(s,3)==1,"record appended after recovery");
+  store_close(s);
+
+  s=store_open(root,"a");
+  if (!s) { fprintf(stderr,"%s",recipe_error); return 1; }
+  check_contents(s,4,"after reopening");
+  char stripped[1024];
+  unsigned char hash[16];
+  store_hash(records[3],strlen(records[3]),hash);
+  int len=store_read_stripped(s,hash,stripped,sizeof(stripped));
+  check(len==strlen(records[3])&&!memcmp(stripped,records[3],len),
+	"record appended after recovery reads back");
+  store_close(s);
+
+  unlink(index);
+  unlink(segment);
+  unlink(lock);
+  snprintf(index,sizeof(index),"%s/a",root);
+  rmdir(index);
+  rmdir(root);
+
+  if (failures) {
+    fprintf(stderr,"%d record store checks failed\n",failures);
+    return 1;
+  }
+  printf("Record store recovery checks passed.\n");
+  return 0;
+}
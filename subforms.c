@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdlib.h>
 #include <unistd.h>
 #include <strings.h>
+#include <string.h>
 #include<sys/types.h>
 #include<sys/time.h>
 
@@ -60,7 +61,8 @@ int record_free(struct record *r)
 
 struct record *parse_stripped_with_subforms(char *in,int in_len)
 {
-  struct record *record=calloc(sizeof(record),1);
+  struct record *record=calloc(sizeof(struct record),1);
+  if (!record) return NULL;
   struct record *current_record=record;
   int i;
   char line[1024];
@@ -84,13 +86,19 @@ struct record *parse_stripped_with_subforms(char *in,int in_len)
 	  return NULL;
 	}
 	
-	current_record->fields[record->field_count].subrecord=calloc(sizeof(struct record),1);
-	current_record->fields[record->field_count].subrecord->parent=current_record;
+	struct record *subrecord=calloc(sizeof(struct record),1);
+	if (!subrecord) {
+	  snprintf(recipe_error,1024,"line:%d:Out of memory.\n",line_number);
+	  record_free(record);
+	  return NULL;
+	}
+	subrecord->parent=current_record;
+	current_record->fields[current_record->field_count].subrecord=subrecord;
 	current_record->field_count++;
-	current_record=current_record->fields[record->field_count-1].subrecord;
+	current_record=subrecord;
       } else if (line[0]=='}') {
 	// End of sub-form
-	if (!current_record->fields[record->field_count].subrecord->parent) {
+	if (!current_record->parent) {
 	    snprintf(recipe_error,1024,"line:%d:} without matching {.\n",
 		     line_number);
 	  record_free(record);
@@ -98,10 +106,12 @@ struct record *parse_stripped_with_subforms(char *in,int in_len)
 	}
 	// Find the question field name, so that we can promote it to our caller
 	char *question=NULL;
-	for(i=0;i<current_record->field_count;i++) {
-	  if (!strcmp("question",current_record->fields[i].key)) {
+	int f;
+	for(f=0;f<current_record->field_count;f++) {
+	  if (current_record->fields[f].key
+	      &&!strcmp("question",current_record->fields[f].key)) {
 	    // Found it
-	    question=current_record->fields[i].value;
+	    question=current_record->fields[f].value;
 	  }
 	}
 	if (!question) {
@@ -112,11 +122,10 @@ struct record *parse_stripped_with_subforms(char *in,int in_len)
 	}
 	
 	// Step back out to parent
-	current_record->fields[record->field_count].subrecord
-	  =current_record->fields[record->field_count].subrecord->parent;
+	current_record=current_record->parent;
 
 	// Update key name for sub-form we have exited to match the question name
-	current_record->fields[record->field_count-1].key=strdup(question);
+	current_record->fields[current_record->field_count-1].key=strdup(question);
 	
       } else if ((l>0)&&(line[0]!='#')) {
 	if (sscanf(line,"%[^=]=%[^\n]",key,value)==2) {
@@ -127,7 +136,7 @@ struct record *parse_stripped_with_subforms(char *in,int in_len)
 	  return NULL;
 	  }	
 	  current_record->fields[current_record->field_count].key=strdup(key);
-	  current_record->fields[current_record->field_count].key=strdup(value);
+	  current_record->fields[current_record->field_count].value=strdup(value);
 	  current_record->field_count++;
 	} else {
 	  snprintf(recipe_error,1024,"line:%d:Malformed data line (%s:%d): '%s'\n",
@@ -150,7 +159,7 @@ struct record *parse_stripped_with_subforms(char *in,int in_len)
     } 
   }
 
-  if (current_record->fields[record->field_count].subrecord->parent) {
+  if (current_record->parent) {
     snprintf(recipe_error,1024,"line:%d:End of input, but } expected.\n",
 	     line_number);
     record_free(record);
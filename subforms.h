@@ -12,7 +12,7 @@ struct record {
   struct record *parent;
 };
 
-extern char recipe_error[1024];
+extern __thread char recipe_error[1024];
 
 int record_free(struct record *r);
 struct record *parse_stripped_with_subforms(char *in,int in_len);
@@ -1,29 +1,17 @@
 #include <time.h>
 
+long long datetime_days_from_civil(int year,int month,int day);
+
+/* Inverse of gmtime(), by pure arithmetic, so that it neither depends on nor
+   disturbs the timezone of the host.  Out of range fields are normalised in
+   the same way as mktime() does. */
 time_t timegm(struct tm *t) 
 { 
-  time_t tl, tb; 
-  struct tm *tg; 
+  int year=t->tm_year+1900;
+  int month=t->tm_mon;
+  year+=month/12; month%=12;
+  if (month<0) { month+=12; year--; }
 
-  tl = mktime (t); 
-  if (tl == -1) 
-    { 
-      t->tm_hour--; 
-      tl = mktime (t); 
-      if (tl == -1) 
-        return -1; /* can't deal with output from strptime */ 
-      tl += 3600; 
-    } 
-  tg = gmtime (&tl); 
-  tg->tm_isdst = 0; 
-  tb = mktime (tg); 
-  if (tb == -1) 
-    { 
-      tg->tm_hour--; 
-      tb = mktime (tg); 
-      if (tb == -1) 
-        return -1; /* can't deal with output from gmtime */ 
-      tb += 3600; 
-    } 
-  return (tl - (tb - tl));
+  long long days=datetime_days_from_civil(year,month+1,1)+t->tm_mday-1;
+  return (time_t)(days*86400LL+t->tm_hour*3600LL+t->tm_min*60LL+t->tm_sec);
 }
@@ -20,6 +20,7 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
@@ -78,32 +79,72 @@ int xhtmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 //Creation specification stripped file from ODK XML
 //FieldName:Type:Minimum:Maximum:Precision,Select1,Select2,...,SelectN
 
-char     *xhtmlFormName = "", *xhtmlFormVersion = "";
-
-char    *xhtml2template[1024];
-int      xhtml2templateLen = 0;
-char    *xhtml2recipe[1024];
-int      xhtml2recipeLen = 0;
-
-int      xhtml_in_instance = 0;
+/*
+  Parser state for one call to xhtmlToRecipe(), handed to the expat callbacks
+  as their user data, so that concurrent conversions do not interfere.
+*/
+struct xhtml2recipe_state {
+  char    *xhtmlFormName, *xhtmlFormVersion;
+
+  char    *xhtml2template[1024];
+  int      xhtml2templateLen;
+  char    *xhtml2recipe[1024];
+  int      xhtml2recipeLen;
+
+  int      xhtml_in_instance;
+
+  char    *xhtmlSelects[1024];
+  int      xhtmlSelectsLen;
+  char    *xhtmlSelectElem;
+  int      xhtmlSelectFirst;
+  int      xhtml_in_value;
+  char     xhtmlValue[1024];
+  int      xhtmlValueLen;
+
+  // Sub-forms (repeat groups) seen so far, so that the fields bound within
+  // them can be listed as their members.
+  char    *xhtmlSubformPaths[1024];
+  int      xhtmlSubformRecipeIndex[1024];
+  int      xhtmlSubformMembers[1024];
+  int      xhtmlSubformsLen;
+};
 
-char    *selects[1024];
-int      xhtmlSelectsLen = 0;
-char    *xhtmlSelectElem = NULL;
-int      xhtmlSelectFirst = 1;
-int      xhtml_in_value = 0;
+/*
+  Add a field to the member list of the innermost sub-form whose nodeset
+  contains it, if any.
+*/
+static void subform_add_member(struct xhtml2recipe_state *s,
+			       const char *nodeset,const char *name)
+{
+  int i,best=-1,best_len=0;
+  if (!nodeset) return;
+  for(i=0;i<s->xhtmlSubformsLen;i++) {
+    int len=strlen(s->xhtmlSubformPaths[i]);
+    if (len>best_len&&!strncmp(nodeset,s->xhtmlSubformPaths[i],len)
+	&&nodeset[len]=='/') {
+      best=i; best_len=len;
+    }
+  }
+  if (best<0) return;
+  int index=s->xhtmlSubformRecipeIndex[best];
+  s->xhtml2recipe[index]=strgrow(s->xhtml2recipe[index],
+				 s->xhtmlSubformMembers[best]?",":":");
+  s->xhtml2recipe[index]=strgrow(s->xhtml2recipe[index],(char *)name);
+  s->xhtmlSubformMembers[best]++;
+}
 
 #define MAXCHARS 1000000
 
-char temp[1024];
-
 void
 start_xhtml(void *data, const char *el, const char **attr) //This function is called  by the XML library each time it sees a new tag 
 {   
+  struct xhtml2recipe_state *s=data;
+  char    temp[1024];
   char    *node_name = "", *node_type = "", *node_constraint = "", *str = "";
+  const char *nodeset = NULL;
   int     i ;
   
-  if (xhtml_in_instance) { // We are between <instance> tags, so we want to get everything to create template file
+  if (s->xhtml_in_instance) { // We are between <instance> tags, so we want to get everything to create template file
     str = calloc (4096, sizeof(char*));
     strcpy (str, "<");
     strcat (str, el);
@@ -116,7 +157,7 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
     }
     strcat (str, ">");
     strcat(str,"$"); strcat(str,el); strcat(str,"$");
-    xhtml2template[xhtml2templateLen++] = str;
+    s->xhtml2template[s->xhtml2templateLen++] = str;
   }
 
   //Looking for bind elements to create the recipe file
@@ -128,6 +169,7 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
 	  if (!strncasecmp("nodeset",attr[i],strlen("nodeset"))) {
 	    char *last_slash = strrchr(attr[i+1], '/');
 	    node_name = strdup(last_slash+1);
+	    nodeset = attr[i+1];
 	  }
 	    
 	  //Looking for attribute type
@@ -159,19 +201,22 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
       //Lets build output
       fprintf(stderr,"Parsing field %s:%s\n", node_name,node_type);  
 
+      // Fields inside a sub-form are listed by the sub-form's recipe line
+      if (strcasecmp(node_type,"binary")) subform_add_member(s,nodeset,node_name);
+
       if ((!strcasecmp(node_type,"select"))
 	  ||(!strcasecmp(node_type,"select1"))
 	  ) // Select, special case we need to wait later to get all informations (ie the range)
 	{
 	  snprintf(temp,1024,"%s:enum:0:0:0:",node_name);	 
-	  selects[xhtmlSelectsLen] = strdup(temp);
-	  xhtmlSelectsLen++;
+	  s->xhtmlSelects[s->xhtmlSelectsLen] = strdup(temp);
+	  s->xhtmlSelectsLen++;
 	}
       else if (!strcasecmp(node_type,"selectn")) // multiple-choice checkbox (allows multiple selections at the same time)
 	{
 	  snprintf(temp,1024,"%s:multi:0:0:0:",node_name);
-	  selects[xhtmlSelectsLen] = strdup(temp);
-	  xhtmlSelectsLen++;	  
+	  s->xhtmlSelects[s->xhtmlSelectsLen] = strdup(temp);
+	  s->xhtmlSelectsLen++;	  
 	}
       else if ((!strcasecmp(node_type,"decimal"))
 	       ||(!strcasecmp(node_type,"integer"))
@@ -179,7 +224,7 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
         {
 	  fprintf(stderr,"Parsing INT field %s:%s\n", node_name,node_type);  
 	  snprintf(temp,1024,"%s:%s",node_name,node_type);
-	  xhtml2recipe[xhtml2recipeLen] = strdup(temp);
+	  s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
             
 	  if (strlen(node_constraint)) {
 	    char *ptr = node_constraint;
@@ -196,37 +241,44 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
 		    node_name,node_type,
 		    MIN(a, b), MAX(a, b));
 	    snprintf(temp,1024,"%s:%s:%d:%d:0",node_name,node_type,MIN(a,b),MAX(a,b));
-	    free(xhtml2recipe[xhtml2recipeLen]);
-	    xhtml2recipe[xhtml2recipeLen] = strdup(temp);
+	    free(s->xhtml2recipe[s->xhtml2recipeLen]);
+	    s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
 
 	  } else {
 	    // Default to integers being in the range 0 to 999.
 	    snprintf(temp,1024,"%s:%s:0:999:0",node_name,node_type);
-	    free(xhtml2recipe[xhtml2recipeLen]);
-	    xhtml2recipe[xhtml2recipeLen] = strdup(temp);
+	    free(s->xhtml2recipe[s->xhtml2recipeLen]);
+	    s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
 	  }
-	  xhtml2recipeLen++;
+	  s->xhtml2recipeLen++;
 		  
 	}
       else if (strcasecmp(node_type,"binary")) // All others type except binary (ignore binary fields in succinct data)
         {
 	  if (!strcasecmp(node_name,"instanceID")) {
 	    snprintf(temp,1024,"%s:uuid",node_name);
-	    xhtml2recipe[xhtml2recipeLen] = strdup(temp);
+	    s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
 	  }else{    
-	    printf("xhtml2recipeLen = %d\n",xhtml2recipeLen);
+	    printf("xhtml2recipeLen = %d\n",s->xhtml2recipeLen);
 	    
 	    snprintf(temp,1024,"%s:%s",node_name,node_type);
-	    xhtml2recipe[xhtml2recipeLen] = strdup(temp);
+	    s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
 	  }
-	  snprintf(temp,1024,"%s:0:0:0",xhtml2recipe[xhtml2recipeLen]);
-	  free(xhtml2recipe[xhtml2recipeLen]);
-	  xhtml2recipe[xhtml2recipeLen] = strdup(temp);
-	  xhtml2recipeLen++;
+	  snprintf(temp,1024,"%s:0:0:0",s->xhtml2recipe[s->xhtml2recipeLen]);
+	  free(s->xhtml2recipe[s->xhtml2recipeLen]);
+	  s->xhtml2recipe[s->xhtml2recipeLen] = strdup(temp);
+	  if (!strcasecmp(node_type,"subform")&&nodeset
+	      &&s->xhtmlSubformsLen<1024) {
+	    s->xhtmlSubformPaths[s->xhtmlSubformsLen]=strdup(nodeset);
+	    s->xhtmlSubformRecipeIndex[s->xhtmlSubformsLen]=s->xhtml2recipeLen;
+	    s->xhtmlSubformMembers[s->xhtmlSubformsLen]=0;
+	    s->xhtmlSubformsLen++;
+	  }
+	  s->xhtml2recipeLen++;
 	}
     }
     
-  //Now look for selects specifications, we wait until to find a select node
+  //Now look for xhtmlSelects specifications, we wait until to find a select node
   else if ((!strcasecmp("xf:select1",el))||(!strcasecmp("xf:select",el))) 
     {
       for (i = 0; attr[i]; i += 2) //Found a select element, look for attributes
@@ -237,32 +289,34 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
 	    if (!last_slash) last_slash=attr[i+1]; else last_slash++;
 	    printf("Found multiple-choice selection definition '%s'\n",last_slash);
 	    node_name  = strdup(last_slash);
-	    xhtmlSelectElem  = node_name;
-	    xhtmlSelectFirst = 1; 
+	    s->xhtmlSelectElem  = node_name;
+	    s->xhtmlSelectFirst = 1; 
 	  }
         }
     }
     
   //We are in a select node and we need to find a value element
-  else if ((xhtmlSelectElem)&&((!strcasecmp("value",el))||(!strcasecmp("xf:value",el)))) 
+  else if ((s->xhtmlSelectElem)&&((!strcasecmp("value",el))||(!strcasecmp("xf:value",el)))) 
     {
-      xhtml_in_value = 1;
+      s->xhtml_in_value = 1;
     }
     
   //We reached the start of the data in the instance, so start collecting fields
   else if (!strcasecmp("data",el)) 
     {
-      xhtml_in_instance = 1;
+      s->xhtml_in_instance = 1;
     }
   else if (!strcasecmp("xf:model",el))
     {
       // Form name is the id attribute of the xf:model tag
       for (i = 0; attr[i]; i += 2) { 
 	if (!strcasecmp("id",attr[i])) {
-	  xhtmlFormName  = strdup(attr[i+1]);
+	  if (s->xhtmlFormName) free(s->xhtmlFormName);
+	  s->xhtmlFormName  = strdup(attr[i+1]);
 	}
 	if (!strcasecmp("dd:formid",attr[i])) {
-	  xhtmlFormVersion = strdup(attr[i+1]);
+	  if (s->xhtmlFormVersion) free(s->xhtmlFormVersion);
+	  s->xhtmlFormVersion = strdup(attr[i+1]);
 	}
       }
     }
@@ -272,59 +326,82 @@ start_xhtml(void *data, const char *el, const char **attr) //This function is ca
 void characterdata_xhtml(void *data, const char *el, int len)
 //This function is called  by the XML library each time we got data in a tag
 {
-  int i;
-   
-    
-  if ( xhtmlSelectElem && xhtml_in_value) 
+  struct xhtml2recipe_state *s=data;
+
+  // Expat may deliver the text of one value in several pieces, for example
+  // either side of a buffer boundary, so gather it up until the value ends.
+  if ( s->xhtmlSelectElem && s->xhtml_in_value) 
     {
-      char x[len+2]; //el is not null terminated, so copy it to x and add \0
-      memcpy(x,el,len);
-      memcpy(x+len,"",1);
-    
-      for (i = 0; i<xhtmlSelectsLen; i++)
-        { 
-	  if (!strncasecmp(xhtmlSelectElem,selects[i],strlen(xhtmlSelectElem))) {
-	    if (xhtmlSelectFirst) {
-	      xhtmlSelectFirst = 0; 
-	    }else{
-	      selects[i] = strgrow (selects[i] ,",");
-	    }
-	    selects[i] = strgrow (selects[i] ,x);
-	  }
-        }
+      if (len>(int)sizeof(s->xhtmlValue)-1-s->xhtmlValueLen)
+	len=sizeof(s->xhtmlValue)-1-s->xhtmlValueLen;
+      memcpy(&s->xhtmlValue[s->xhtmlValueLen],el,len);
+      s->xhtmlValueLen+=len;
+      s->xhtmlValue[s->xhtmlValueLen]=0;
     }
-    
-    		
-	
+}
 
+static void select_value_end_xhtml(struct xhtml2recipe_state *s)
+{
+  int i;
+
+  if (!s->xhtmlValueLen) return;
+  for (i = 0; i<s->xhtmlSelectsLen; i++)
+    { 
+      if (!strncasecmp(s->xhtmlSelectElem,s->xhtmlSelects[i],strlen(s->xhtmlSelectElem))) {
+	if (s->xhtmlSelectFirst) {
+	  s->xhtmlSelectFirst = 0; 
+	}else{
+	  s->xhtmlSelects[i] = strgrow (s->xhtmlSelects[i] ,",");
+	}
+	s->xhtmlSelects[i] = strgrow (s->xhtmlSelects[i] ,s->xhtmlValue);
+      }
+    }
+  s->xhtmlValueLen=0;
 }
 
 void end_xhtml(void *data, const char *el) //This function is called  by the XML library each time it sees an ending of a tag
 {
+  struct xhtml2recipe_state *s=data;
   char *str = "";
 
-  if (xhtmlSelectElem && ((!strcasecmp("xf:select1",el))||(!strcasecmp("xf:select",el))))  {
-    xhtmlSelectElem = NULL;
+  if (s->xhtmlSelectElem && ((!strcasecmp("xf:select1",el))||(!strcasecmp("xf:select",el))))  {
+    free(s->xhtmlSelectElem);
+    s->xhtmlSelectElem = NULL;
   }
     
-  if (xhtml_in_value && ((!strcasecmp("value",el))||(!strcasecmp("xf:value",el))))  {
-    xhtml_in_value = 0;
+  if (s->xhtml_in_value && ((!strcasecmp("value",el))||(!strcasecmp("xf:value",el))))  {
+    if (s->xhtmlSelectElem) select_value_end_xhtml(s);
+    s->xhtml_in_value = 0;
   }
     
-  if (xhtml_in_instance &&(!strcasecmp("data",el))) {
-    xhtml_in_instance = 0;
+  if (s->xhtml_in_instance &&(!strcasecmp("data",el))) {
+    s->xhtml_in_instance = 0;
   }
     
-  if (xhtml_in_instance) { // We are between <instance> tags, we want to get everything
+  if (s->xhtml_in_instance) { // We are between <instance> tags, we want to get everything
     str = calloc (4096, sizeof(char*));
     strcpy (str, "</");
     strcat (str, el);
     strcat (str, ">\n");
-    xhtml2template[xhtml2templateLen++] = str;
+    s->xhtml2template[s->xhtml2templateLen++] = str;
   }
 }  
 
 int appendto(char *out,int *used,int max,char *stuff);
+int xml_parse_streaming(XML_Parser parser,const char *xmltext,int size);
+
+static void xhtml2recipe_state_free(struct xhtml2recipe_state *s)
+{
+  int i;
+  for(i=0;i<s->xhtml2templateLen;i++) free(s->xhtml2template[i]);
+  for(i=0;i<s->xhtml2recipeLen;i++) free(s->xhtml2recipe[i]);
+  for(i=0;i<s->xhtmlSelectsLen;i++) free(s->xhtmlSelects[i]);
+  for(i=0;i<s->xhtmlSubformsLen;i++) free(s->xhtmlSubformPaths[i]);
+  if (s->xhtmlSelectElem) free(s->xhtmlSelectElem);
+  if (s->xhtmlFormName) free(s->xhtmlFormName);
+  if (s->xhtmlFormVersion) free(s->xhtmlFormVersion);
+  free(s);
+}
 
 int xhtml_recipe_create(char *input)
 {
@@ -388,21 +465,18 @@ int xhtmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
   XML_Parser parser;
   int i ;
 
-  // Reset parser state.
-  xhtml2templateLen = 0;
-  xhtml2recipeLen = 0;
-  xhtml_in_instance = 0;
-  xhtmlSelectsLen = 0;
-  xhtmlSelectElem = NULL;
-  xhtmlSelectFirst = 1;
-  xhtml_in_value = 0;
+  struct xhtml2recipe_state *s=calloc(sizeof(struct xhtml2recipe_state),1);
+  if (!s) return (1);
+  s->xhtmlSelectFirst = 1;
   
   //ParserCreation
   parser = XML_ParserCreate(NULL);
   if (parser == NULL) {
     fprintf(stderr, "ERROR: %s: Parser not created\n",__FUNCTION__);
+    xhtml2recipe_state_free(s);
     return (1);
   }
+  XML_SetUserData(parser, s);
     
   // Tell expat to use functions start() and end() each times it encounters the start or end of an element.
   XML_SetElementHandler(parser, start_xhtml, end_xhtml);    
@@ -414,16 +488,18 @@ int xhtmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 #endif
   
   //Parse Xml Text
-  if (XML_Parse(parser, xmltext, strlen(xmltext), XML_TRUE) ==
-      XML_STATUS_ERROR) {
+  if (xml_parse_streaming(parser, xmltext, size)) {
 #ifdef ANDROID
     LOGI("XML_Parse() failed");
 #endif
     fprintf(stderr,
 	    "ERROR: %s: Cannot parse , file may be too large or not well-formed XML\n",
 	    __FUNCTION__);
+    XML_ParserFree(parser);
+    xhtml2recipe_state_free(s);
     return (1);
   }
+  XML_ParserFree(parser);
   
   // Build recipe output
   int recipeMaxLen=*recipeLen;
@@ -434,57 +510,62 @@ int xhtmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
   *recipeLen=strlen(recipetext);
 
   // Now add explicit fields
-  for(i=0;i<xhtml2recipeLen;i++){
-    if (appendto(recipetext,recipeLen,recipeMaxLen,xhtml2recipe[i])) {
+  for(i=0;i<s->xhtml2recipeLen;i++){
+    if (appendto(recipetext,recipeLen,recipeMaxLen,s->xhtml2recipe[i])) {
       fprintf(stderr,"ERROR: %s:%d: %s() recipe text overflow.\n",
 	      __FILE__,__LINE__,__FUNCTION__);      
+      xhtml2recipe_state_free(s);
       return -1;
     }
     if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) {
       fprintf(stderr,"ERROR: %s:%d: %s() recipe text overflow.\n",
 	      __FILE__,__LINE__,__FUNCTION__);      
+      xhtml2recipe_state_free(s);
       return -1;
     }
   }
-  for(i=0;i<xhtmlSelectsLen;i++){
-    if (appendto(recipetext,recipeLen,recipeMaxLen,selects[i])) {
+  for(i=0;i<s->xhtmlSelectsLen;i++){
+    if (appendto(recipetext,recipeLen,recipeMaxLen,s->xhtmlSelects[i])) {
       fprintf(stderr,"ERROR: %s:%d: %s() recipe text overflow.\n",
 	      __FILE__,__LINE__,__FUNCTION__);      
+      xhtml2recipe_state_free(s);
       return -1;
     }
     if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) {
       fprintf(stderr,"ERROR: %s:%d: %s() recipe text overflow.\n",
 	      __FILE__,__LINE__,__FUNCTION__);      
+      xhtml2recipe_state_free(s);
       return -1;
     }
   }
   
   int templateMaxLen=*templateLen;
   *templateLen=0;
-  for(i=0;i<xhtml2templateLen;i++){
-    if (appendto(templatetext,templateLen,templateMaxLen,xhtml2template[i])) {
+  for(i=0;i<s->xhtml2templateLen;i++){
+    if (appendto(templatetext,templateLen,templateMaxLen,s->xhtml2template[i])) {
       fprintf(stderr,"ERROR: %s:%d: %s() template text overflow.\n",
 	      __FILE__,__LINE__,__FUNCTION__);      
+      xhtml2recipe_state_free(s);
       return -1;
     }    
   }
 
-  snprintf(formname,1024,"%s",xhtmlFormName);
-  snprintf(formversion,1024,"%s",xhtmlFormVersion);
+  snprintf(formname,1024,"%s",s->xhtmlFormName?s->xhtmlFormName:"");
+  snprintf(formversion,1024,"%s",s->xhtmlFormVersion?s->xhtmlFormVersion:"");
 #ifdef ANDROID
   LOGI("xhtmlToRecipe(): formname='%s'",formname);
   LOGI("xhtmlToRecipe(): formversion='%s'",formversion);
 #endif
   
-  XML_ParserFree(parser);
   fprintf(stderr, "\n\nSuccessfully parsed %i characters !\n", (int)size);
   fprintf(stderr,"xhtmlFormName=%s, xhtmlFormVersion=%s\n",
-	  xhtmlFormName,xhtmlFormVersion);
+	  formname,formversion);
 
 #ifdef ANDROID
   LOGI("XML_Parse() succeeded, xhtml2recipeLen = %d, recipeLen=%d",
-       xhtml2recipeLen,*recipeLen);
+       s->xhtml2recipeLen,*recipeLen);
 #endif
   
+  xhtml2recipe_state_free(s);
   return (0);
 }
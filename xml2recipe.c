@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 */
 #include <expat.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -39,37 +40,43 @@ int xmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 //Creation specification stripped file from ODK XML
 //FieldName:Type:Minimum:Maximum:Precision,Select1,Select2,...,SelectN
 
-char     *formName = "", *formVersion = "";
-
-char    *xml2template[1024];
-int      xml2templateLen = 0;
-char    *xml2recipe[1024];
-int      xml2recipeLen = 0;
-
-
-int      in_instance = 0;
-int      in_instance_first = 0;
-
-
-char    *selects[1024];
-int      selectsLen = 0;
-char    *selectElem = NULL;
-int      selectFirst = 1;
-int      in_value = 0;
-
-
+/*
+  Parser state for one call to xmlToRecipe(), handed to the expat callbacks as
+  their user data, so that concurrent conversions do not interfere.
+*/
+struct xml2recipe_state {
+  char    *formName, *formVersion;
+
+  char    *xml2template[1024];
+  int      xml2templateLen;
+  char    *xml2recipe[1024];
+  int      xml2recipeLen;
+
+  int      in_instance;
+  int      in_instance_first;
+
+  char    *selects[1024];
+  int      selectsLen;
+  char    *selectElem;
+  int      selectFirst;
+  int      in_value;
+  char     value[1024];
+  int      valueLen;
+};
 
 #define MAXCHARS 1000000
+#define XML_PARSE_CHUNK 4096
 
 
 
 void
 start(void *data, const char *el, const char **attr) //This function is called  by the XML library each time it sees a new tag 
 {   
+    struct xml2recipe_state *s=data;
     char    *node_name = "", *node_type = "", *node_constraint = "", *str = "";
 	int     i ;
     
-    if (in_instance) { // We are between <instance> tags, so we want to get everything to create template file
+    if (s->in_instance) { // We are between <instance> tags, so we want to get everything to create template file
         str = calloc (4096, sizeof(char*));
         strcpy (str, "<");
         strcat (str, el);
@@ -82,16 +89,18 @@ start(void *data, const char *el, const char **attr) //This function is called
         }
         strcat (str, ">");
 	strcat(str,"$"); strcat(str,el); strcat(str,"$");
-        xml2template[xml2templateLen++] = str;
+        s->xml2template[s->xml2templateLen++] = str;
         
-        if (in_instance_first) { // First node since we are in instance, it's the Form Name that we want to get
-            in_instance_first = 0;
+        if (s->in_instance_first) { // First node since we are in instance, it's the Form Name that we want to get
+            s->in_instance_first = 0;
             for (i = 0; attr[i]; i += 2) { 
                 if (!strcasecmp("version",attr[i])) {
-		  formVersion = strdup(attr[i+1]);
+		  if (s->formVersion) free(s->formVersion);
+		  s->formVersion = strdup(attr[i+1]);
                 }
                 if (!strcasecmp("id",attr[i])) {
-		  formName = strdup(attr[i+1]);
+		  if (s->formName) free(s->formName);
+		  s->formName = strdup(attr[i+1]);
                 }
             }
         }
@@ -128,18 +137,18 @@ start(void *data, const char *el, const char **attr) //This function is called
         //Lets build output        
 	if ((!strcasecmp(node_type,"select"))||(!strcasecmp(node_type,"select1"))) // Select, special case we need to wait later to get all informations (ie the range)
 		{
-            selects[selectsLen] = node_name;
-            strcat (selects[selectsLen] ,":");
-            strcat (selects[selectsLen] ,"enum");
-            strcat (selects[selectsLen] ,":0:0:0:");
-            selectsLen++;
+            s->selects[s->selectsLen] = node_name;
+            strcat (s->selects[s->selectsLen] ,":");
+            strcat (s->selects[s->selectsLen] ,"enum");
+            strcat (s->selects[s->selectsLen] ,":0:0:0:");
+            s->selectsLen++;
 		} 
 	else if ((!strcasecmp(node_type,"decimal"))||(!strcasecmp(node_type,"int"))) // Integers and decimal
         {
             //printf("%s:%s", node_name,node_type);  
-            xml2recipe[xml2recipeLen] = node_name;
-            strcat (xml2recipe[xml2recipeLen] ,":");
-            strcat (xml2recipe[xml2recipeLen] ,node_type);
+            s->xml2recipe[s->xml2recipeLen] = node_name;
+            strcat (s->xml2recipe[s->xml2recipeLen] ,":");
+            strcat (s->xml2recipe[s->xml2recipeLen] ,node_type);
             
             if (strlen(node_constraint)) {
                 char *ptr = node_constraint;
@@ -154,33 +163,33 @@ start(void *data, const char *el, const char **attr) //This function is called
                 b = atoi(ptr);
 		if (b<=a) b=a+999;
                 //printf(":%d:%d:0", MIN(a, b), MAX(a, b));
-                strcat (xml2recipe[xml2recipeLen] ,":");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":");
                 sprintf(str, "%d", MIN(a, b));
-                strcat (xml2recipe[xml2recipeLen] ,str);
-                strcat (xml2recipe[xml2recipeLen] ,":");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,str);
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":");
                 sprintf(str, "%d", MAX(a, b));
-                strcat (xml2recipe[xml2recipeLen] ,str);
-                strcat (xml2recipe[xml2recipeLen] ,":0");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,str);
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":0");
             } else {
 	        // Default to integers being in the range 0 to 999.
-                strcat (xml2recipe[xml2recipeLen] ,":0:999:0");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":0:999:0");
             }
-            xml2recipeLen++;
+            s->xml2recipeLen++;
 		  
 		}
 	else if (strcasecmp(node_type,"binary")) // All others type except binary (ignore binary fields in succinct data)
         {
             if (!strcasecmp(node_name,"instanceID")) {
-                xml2recipe[xml2recipeLen] = node_name;
-                strcat (xml2recipe[xml2recipeLen] ,":");
-                strcat (xml2recipe[xml2recipeLen] ,"uuid");
+                s->xml2recipe[s->xml2recipeLen] = node_name;
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,"uuid");
             }else{    
-                xml2recipe[xml2recipeLen] = node_name;
-                strcat (xml2recipe[xml2recipeLen] ,":");
-                strcat (xml2recipe[xml2recipeLen] ,node_type);
+                s->xml2recipe[s->xml2recipeLen] = node_name;
+                strcat (s->xml2recipe[s->xml2recipeLen] ,":");
+                strcat (s->xml2recipe[s->xml2recipeLen] ,node_type);
             }
-            strcat (xml2recipe[xml2recipeLen] ,":0:0:0");
-            xml2recipeLen++;
+            strcat (s->xml2recipe[s->xml2recipeLen] ,":0:0:0");
+            s->xml2recipeLen++;
 	}
     }
     
@@ -195,22 +204,22 @@ start(void *data, const char *el, const char **attr) //This function is called
 					memcpy (node_name, last_slash+1, strlen(last_slash));
 			}
         }
-        selectElem  = calloc (strlen(node_name), sizeof(char*));
-		memcpy (selectElem, node_name, strlen(node_name));
-        selectFirst = 1; 
+        s->selectElem  = calloc (strlen(node_name), sizeof(char*));
+		memcpy (s->selectElem, node_name, strlen(node_name));
+        s->selectFirst = 1; 
     }
     
     //We are in a select node and we need to find a value element
-    else if ((selectElem)&&((!strcasecmp("value",el))||(!strcasecmp("xf:value",el)))) 
+    else if ((s->selectElem)&&((!strcasecmp("value",el))||(!strcasecmp("xf:value",el)))) 
     {
-        in_value = 1;
+        s->in_value = 1;
     }
     
     //We reached an instance element, means we have to take everything in it for the .template
     else if (!strcasecmp("instance",el)) 
     {
-        in_instance = 1;
-        in_instance_first = 1;
+        s->in_instance = 1;
+        s->in_instance_first = 1;
     }
      
     
@@ -218,55 +227,63 @@ start(void *data, const char *el, const char **attr) //This function is called
 
 void characterdata(void *data, const char *el, int len) //This function is called  by the XML library each time we got data in a tag
 {
-	int i;
+    struct xml2recipe_state *s=data;
    
-    
-    if ( selectElem && in_value) 
+    // Expat may deliver the text of one value in several pieces, for example
+    // either side of a buffer boundary, so gather it up until the value ends.
+    if ( s->selectElem && s->in_value) 
     {
-        char x[len+2]; //el is not null terminated, so copy it to x and add \0
-        memcpy(x,el,len);
-        memcpy(x+len,"",1);
-    
-        for (i = 0; i<selectsLen; i++)
-        { 
-			if (!strncasecmp(selectElem,selects[i],strlen(selectElem))) {
-                    if (selectFirst) {
-                        selectFirst = 0; 
-                    }else{
-                        strcat (selects[i] ,",");
-                    }
-                    strcat (selects[i] ,x);
-			}
-        }
+        if (len>(int)sizeof(s->value)-1-s->valueLen) len=sizeof(s->value)-1-s->valueLen;
+        memcpy(&s->value[s->valueLen],el,len);
+        s->valueLen+=len;
+        s->value[s->valueLen]=0;
     }
-    
-    		
-	
+}
 
+static void select_value_end(struct xml2recipe_state *s)
+{
+    int i;
+
+    if (!s->valueLen) return;
+    for (i = 0; i<s->selectsLen; i++)
+    { 
+        if (!strncasecmp(s->selectElem,s->selects[i],strlen(s->selectElem))) {
+            if (s->selectFirst) {
+                s->selectFirst = 0; 
+            }else{
+                strcat (s->selects[i] ,",");
+            }
+            strcat (s->selects[i] ,s->value);
+        }
+    }
+    s->valueLen=0;
 }
 
 void end(void *data, const char *el) //This function is called  by the XML library each time it sees an ending of a tag
 {
+    struct xml2recipe_state *s=data;
     char *str = "";
     
-    if (selectElem && ((!strcasecmp("select1",el))||(!strcasecmp("select",el))))  {
-       selectElem = NULL;
+    if (s->selectElem && ((!strcasecmp("select1",el))||(!strcasecmp("select",el))))  {
+       free(s->selectElem);
+       s->selectElem = NULL;
     }
     
-    if (in_value && ((!strcasecmp("value",el))||(!strcasecmp("xf:value",el))))  {
-       in_value = 0;
+    if (s->in_value && ((!strcasecmp("value",el))||(!strcasecmp("xf:value",el))))  {
+       if (s->selectElem) select_value_end(s);
+       s->in_value = 0;
     }
     
-    if (in_instance &&(!strcasecmp("instance",el))) {
-        in_instance = 0;
+    if (s->in_instance &&(!strcasecmp("instance",el))) {
+        s->in_instance = 0;
     }
     
-     if (in_instance) { // We are between <instance> tags, we want to get everything
+     if (s->in_instance) { // We are between <instance> tags, we want to get everything
         str = calloc (4096, sizeof(char*));
         strcpy (str, "</");
         strcat (str, el);
         strcat (str, ">");
-        xml2template[xml2templateLen++] = str;
+        s->xml2template[s->xml2templateLen++] = str;
     }
 }  
 
@@ -330,19 +347,54 @@ int recipe_create(char *input)
     return 0;
 }
     
+/*
+  Feed a document to expat a piece at a time, rather than as one huge buffer,
+  so that expat's own buffering stays small regardless of the form size.
+*/
+int xml_parse_streaming(XML_Parser parser,const char *xmltext,int size)
+{
+  int offset=0;
+  do {
+    int n=size-offset;
+    if (n>XML_PARSE_CHUNK) n=XML_PARSE_CHUNK;
+    if (XML_Parse(parser,&xmltext[offset],n,(offset+n)>=size)==XML_STATUS_ERROR)
+      return -1;
+    offset+=n;
+  } while(offset<size);
+  return 0;
+}
+
+static void xml2recipe_state_free(struct xml2recipe_state *s)
+{
+  int i;
+  for(i=0;i<s->xml2templateLen;i++) free(s->xml2template[i]);
+  for(i=0;i<s->xml2recipeLen;i++) free(s->xml2recipe[i]);
+  for(i=0;i<s->selectsLen;i++) free(s->selects[i]);
+  if (s->selectElem) free(s->selectElem);
+  if (s->formName) free(s->formName);
+  if (s->formVersion) free(s->formVersion);
+  free(s);
+}
+
 int xmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
 		char *recipetext,int *recipeLen,
 		char *templatetext,int *templateLen)
 {
   XML_Parser parser;
   int i ;
+
+  struct xml2recipe_state *s=calloc(sizeof(struct xml2recipe_state),1);
+  if (!s) return (1);
+  s->selectFirst=1;
   
   //ParserCreation
   parser = XML_ParserCreate(NULL);
   if (parser == NULL) {
     fprintf(stderr, "Parser not created\n");
+    xml2recipe_state_free(s);
     return (1);
   }
+  XML_SetUserData(parser, s);
     
   // Tell expat to use functions start() and end() each times it encounters the start or end of an element.
   XML_SetElementHandler(parser, start, end);    
@@ -350,40 +402,47 @@ int xmlToRecipe(char *xmltext,int size,char *formname,char *formversion,
   XML_SetCharacterDataHandler(parser,characterdata);
   
   //Parse Xml Text
-  if (XML_Parse(parser, xmltext, strlen(xmltext), XML_TRUE) ==
-      XML_STATUS_ERROR) {
+  if (xml_parse_streaming(parser, xmltext, size)) {
     fprintf(stderr,
 	    "Cannot parse , file may be too large or not well-formed XML\n");
+    XML_ParserFree(parser);
+    xml2recipe_state_free(s);
     return (1);
   }
+  XML_ParserFree(parser);
   
   // Build recipe output
   int recipeMaxLen=*recipeLen;
   *recipeLen=0;
+  int templateMaxLen=*templateLen;
+  *templateLen=0;
+  int overflow=0;
   
-  for(i=0;i<xml2recipeLen;i++){
-    if (appendto(recipetext,recipeLen,recipeMaxLen,xml2recipe[i])) return -1;
-    if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) return -1;
+  for(i=0;i<s->xml2recipeLen&&!overflow;i++){
+    if (appendto(recipetext,recipeLen,recipeMaxLen,s->xml2recipe[i])) overflow=1;
+    else if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) overflow=1;
   }
-  for(i=0;i<selectsLen;i++){
-    if (appendto(recipetext,recipeLen,recipeMaxLen,selects[i])) return -1;
-    if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) return -1;
+  for(i=0;i<s->selectsLen&&!overflow;i++){
+    if (appendto(recipetext,recipeLen,recipeMaxLen,s->selects[i])) overflow=1;
+    else if (appendto(recipetext,recipeLen,recipeMaxLen,"\n")) overflow=1;
   }
   
-  int templateMaxLen=*templateLen;
-  *templateLen=0;
-  for(i=0;i<xml2templateLen;i++){
-    if (appendto(templatetext,templateLen,templateMaxLen,xml2template[i]))
-      return -1;
-    if (appendto(templatetext,templateLen,templateMaxLen,"\n")) return -1;
+  for(i=0;i<s->xml2templateLen&&!overflow;i++){
+    if (appendto(templatetext,templateLen,templateMaxLen,s->xml2template[i]))
+      overflow=1;
+    else if (appendto(templatetext,templateLen,templateMaxLen,"\n")) overflow=1;
+  }
+  if (overflow) {
+    xml2recipe_state_free(s);
+    return -1;
   }
 
-  snprintf(formname,1024,"%s",formName);
-  snprintf(formversion,1024,"%s",formVersion);
+  snprintf(formname,1024,"%s",s->formName?s->formName:"");
+  snprintf(formversion,1024,"%s",s->formVersion?s->formVersion:"");
   
-  XML_ParserFree(parser);
   fprintf(stderr, "\n\nSuccessfully parsed %i characters !\n", (int)size);
   fprintf(stderr,"formName=%s, formVersion=%s\n",
-	  formName,formVersion);
+	  formname,formversion);
+  xml2recipe_state_free(s);
   return (0);
 }